@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include "batch.h"
+#include "file.h"
+
+/*
+ Batch assembly (--batch).
+
+ Files are assembled one at a time and in order, but reads are issued up to
+ BATCH_DEPTH files ahead and writes are left in flight, so loading file N+1
+ and writing file N-1 overlap with assembling file N.
+
+ Backends:
+     IO_URING    reads and writes go through an io_uring submission queue
+     IO_THREADS  a small pool of threads does blocking reads and writes
+     IO_SYNC     each file is loaded, assembled and written in turn
+ io_uring is driven with raw syscalls. If the kernel refuses to set up a
+ ring, the thread pool is used instead. If io_uring_enter fails later, the
+ files in the ring fail and the rest are read and written blocking.
+*/
+
+#define BATCH_DEPTH                        8
+#define BATCH_THREADS                      4
+#define URING_ENTRIES                      32
+
+enum FILE_STATE {
+    FILE_IDLE = 0,
+    FILE_READING,
+    FILE_READ,
+    FILE_WRITING,
+    FILE_DONE,
+    FILE_FAILED,
+};
+
+typedef struct {
+    char *path;
+    char output_path[BATCH_PATH_SIZE];
+    char *buf; // input while reading, output while writing
+    size_t size;
+    size_t done; // bytes transferred so far (io_uring)
+    int fd;
+    struct iovec iov;
+    enum FILE_STATE state;
+} Batch_File;
+
+#ifdef __linux__
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned to_submit; // queued but not yet passed to the kernel
+    unsigned inflight; // submitted but not yet completed
+    int broken; // io_uring_enter failed, transfers are blocking
+} Uring;
+#endif
+
+typedef struct {
+    enum BATCH_IO io;
+    Batch_File *files;
+
+    // Thread pool
+    pthread_t threads[BATCH_THREADS];
+    size_t thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    size_t *queue; // file indices, each file is queued at most twice
+    size_t queue_head;
+    size_t queue_tail;
+    int stop;
+
+#ifdef __linux__
+    Uring ring;
+#endif
+} Batch;
+
+static int is_busy(Batch_File *f)
+{
+    return f->state == FILE_READING || f->state == FILE_WRITING;
+}
+
+// Blocking read or write of 'f' for the sync and thread backends
+// Returns the new state of 'f'
+static enum FILE_STATE transfer_blocking(Batch_File *f, enum FILE_STATE op)
+{
+    if (op == FILE_READING) {
+        f->buf = load_file(f->path, &f->size);
+        return f->buf ? FILE_READ : FILE_FAILED;
+    }
+
+    int err = write_file(f->buf, f->output_path, f->size);
+    free(f->buf);
+    f->buf = NULL;
+    return err ? FILE_FAILED : FILE_DONE;
+}
+
+static void *worker(void *arg)
+{
+    Batch *b = arg;
+
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        while (b->queue_head == b->queue_tail && !b->stop)
+            pthread_cond_wait(&b->work, &b->lock);
+        if (b->queue_head == b->queue_tail)
+            break;
+
+        Batch_File *f = b->files + b->queue[b->queue_head++];
+        enum FILE_STATE op = f->state;
+        pthread_mutex_unlock(&b->lock);
+
+        enum FILE_STATE state = transfer_blocking(f, op);
+
+        pthread_mutex_lock(&b->lock);
+        f->state = state;
+        pthread_cond_broadcast(&b->done);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+// Returns 0 on success, 1 if no thread could be started
+static int threads_init(Batch *b, size_t file_count)
+{
+    b->queue = malloc((2 * file_count + 1) * sizeof(size_t));
+    b->queue_head = 0;
+    b->queue_tail = 0;
+    b->stop = 0;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->work, NULL);
+    pthread_cond_init(&b->done, NULL);
+
+    for (b->thread_count = 0; b->thread_count < BATCH_THREADS;
+        b->thread_count++) {
+        if (pthread_create(b->threads + b->thread_count, NULL, worker, b))
+            break;
+    }
+    if (b->thread_count > 0)
+        return 0;
+
+    free(b->queue);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->work);
+    pthread_cond_destroy(&b->done);
+    return 1;
+}
+
+static void threads_free(Batch *b)
+{
+    pthread_mutex_lock(&b->lock);
+    b->stop = 1;
+    pthread_cond_broadcast(&b->work);
+    pthread_mutex_unlock(&b->lock);
+
+    for (size_t i = 0; i < b->thread_count; i++)
+        pthread_join(b->threads[i], NULL);
+
+    free(b->queue);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->work);
+    pthread_cond_destroy(&b->done);
+}
+
+#ifdef __linux__
+// Returns 0 on success, 1 if io_uring is unavailable
+static int uring_init(Uring *r)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd < 0)
+        return 1;
+
+    r->entries = p.sq_entries;
+    r->to_submit = 0;
+    r->inflight = 0;
+    r->broken = 0;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Both rings can share one mapping on newer kernels
+    int single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = single_mmap ? r->sq_ring : mmap(NULL, r->cq_ring_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, r->fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED ||
+        r->sqes == MAP_FAILED) {
+        if (r->sq_ring != MAP_FAILED)
+            munmap(r->sq_ring, r->sq_ring_size);
+        if (!single_mmap && r->cq_ring != MAP_FAILED)
+            munmap(r->cq_ring, r->cq_ring_size);
+        if (r->sqes != MAP_FAILED)
+            munmap(r->sqes, r->sqes_size);
+        close(r->fd);
+        return 1;
+    }
+
+    char *sq = r->sq_ring;
+    char *cq = r->cq_ring;
+    r->sq_head = (unsigned*) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*) (sq + p.sq_off.array);
+    r->cq_head = (unsigned*) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_free(Uring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+static void uring_fail(Batch_File *f)
+{
+    if (f->fd != -1)
+        close(f->fd);
+    f->fd = -1;
+    free(f->buf);
+    f->buf = NULL;
+    f->state = FILE_FAILED;
+}
+
+// Gives up on the ring. Fails every file being transferred through it
+static void uring_break(Batch *b)
+{
+    Uring *r = &b->ring;
+    r->broken = 1;
+    r->to_submit = 0;
+    r->inflight = 0;
+    for (Batch_File *f = b->files; f->path; f++) {
+        if (is_busy(f))
+            uring_fail(f);
+    }
+}
+
+static void uring_reap(Batch *b, int wait);
+
+// Queues the rest of the transfer of 'f'
+static void uring_queue(Batch *b, Batch_File *f)
+{
+    Uring *r = &b->ring;
+    while (r->inflight >= r->entries && !r->broken)
+        uring_reap(b, 1);
+    if (r->broken) // 'f' failed with the rest
+        return;
+
+    unsigned tail = *r->sq_tail;
+    unsigned i = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = r->sqes + i;
+    memset(sqe, 0, sizeof(*sqe));
+
+    f->iov.iov_base = f->buf + f->done;
+    f->iov.iov_len = f->size - f->done;
+    sqe->opcode = f->state == FILE_READING ? IORING_OP_READV :
+        IORING_OP_WRITEV;
+    sqe->fd = f->fd;
+    sqe->addr = (uintptr_t) &f->iov;
+    sqe->len = 1;
+    sqe->off = f->done;
+    sqe->user_data = f - b->files;
+
+    r->sq_array[i] = i;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    r->inflight++;
+}
+
+// Handles a completed read or write of 'res' bytes (or -errno)
+static void uring_complete(Batch *b, Batch_File *f, int res)
+{
+    int writing = f->state == FILE_WRITING;
+    if (res < 0 || (res == 0 && writing)) {
+        printf("Couldn't %s %s: %s\n", writing ? "write" : "read",
+            writing ? f->output_path : f->path, strerror(res ? -res : EIO));
+        uring_fail(f);
+        return;
+    }
+
+    // File got shorter since fstat
+    if (res == 0)
+        f->size = f->done;
+
+    f->done += res;
+    if (f->done < f->size) {
+        uring_queue(b, f);
+        return;
+    }
+
+    close(f->fd);
+    f->fd = -1;
+    if (writing) {
+        free(f->buf);
+        f->buf = NULL;
+        f->state = FILE_DONE;
+    } else {
+        f->buf[f->size] = '\0';
+        f->state = FILE_READ;
+    }
+}
+
+// Passes queued entries to the kernel and handles completions
+// Waits for at least one completion if 'wait' is set
+static void uring_reap(Batch *b, int wait)
+{
+    Uring *r = &b->ring;
+    if (r->broken)
+        return;
+    int enter_err = 0;
+    if (r->to_submit || wait) {
+        int ret;
+        do {
+            ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit,
+                wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret > 0)
+            r->to_submit -= ret;
+        if (ret < 0)
+            enter_err = errno;
+    }
+
+    // Completions can queue more entries, so reread the head every time
+    for (;;) {
+        unsigned head = *r->cq_head;
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+            break;
+        struct io_uring_cqe *cqe = r->cqes + (head & *r->cq_mask);
+        Batch_File *f = b->files + cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+        r->inflight--;
+        uring_complete(b, f, res);
+    }
+
+    // The kernel is out of room until completions are reaped, which was
+    // just done, so the caller's next reap retries. Other errors stay
+    if (enter_err && enter_err != EAGAIN && enter_err != EBUSY &&
+        !r->broken) {
+        printf("io_uring_enter failed: %s\n", strerror(enter_err));
+        uring_break(b);
+    }
+}
+
+static void uring_submit(Batch *b, Batch_File *f, enum FILE_STATE op)
+{
+    if (b->ring.broken) {
+        f->state = transfer_blocking(f, op);
+        return;
+    }
+    f->done = 0;
+    f->state = op;
+    if (op == FILE_READING) {
+        struct stat st;
+        f->fd = open(f->path, O_RDONLY);
+        if (f->fd == -1 || fstat(f->fd, &st) == -1) {
+            printf("Couldn't open %s\n", f->path);
+            uring_fail(f);
+            return;
+        }
+        f->size = (size_t) st.st_size;
+        if (f->size == 0) {
+            printf("File %s empty\n", f->path);
+            uring_fail(f);
+            return;
+        }
+        f->buf = malloc(f->size + 1);
+    } else {
+        f->fd = open(f->output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (f->fd == -1) {
+            printf("Couldn't open file '%s' for writing\n", f->output_path);
+            uring_fail(f);
+            return;
+        }
+        if (f->size == 0) {
+            uring_complete(b, f, 0);
+            return;
+        }
+    }
+    uring_queue(b, f);
+}
+#endif
+
+// Starts reading (FILE_READING) or writing (FILE_WRITING) 'f'
+static void submit(Batch *b, Batch_File *f, enum FILE_STATE op)
+{
+    switch (b->io) {
+    case IO_URING:
+#ifdef __linux__
+        uring_submit(b, f, op);
+#endif
+        break;
+    case IO_THREADS:
+        pthread_mutex_lock(&b->lock);
+        f->state = op;
+        b->queue[b->queue_tail++] = f - b->files;
+        pthread_cond_signal(&b->work);
+        pthread_mutex_unlock(&b->lock);
+        break;
+    case IO_SYNC:
+        f->state = transfer_blocking(f, op);
+        break;
+    }
+}
+
+// Blocks until 'f' is no longer being read or written
+static void wait_file(Batch *b, Batch_File *f)
+{
+    switch (b->io) {
+    case IO_URING:
+#ifdef __linux__
+        while (is_busy(f))
+            uring_reap(b, 1);
+#endif
+        break;
+    case IO_THREADS:
+        pthread_mutex_lock(&b->lock);
+        while (is_busy(f))
+            pthread_cond_wait(&b->done, &b->lock);
+        pthread_mutex_unlock(&b->lock);
+        break;
+    case IO_SYNC:
+        break;
+    }
+}
+
+// Converts every file in 'paths' with 'fn' and writes the results
+// Returns 0 on success, 1 if any file failed
+int run_batch(char **paths, size_t count, enum BATCH_IO io, Batch_Fn fn,
+    void *ctx, Batch_Stats *stats)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Batch b = { .io = io };
+    b.files = calloc(count + 1, sizeof(Batch_File));
+    for (size_t i = 0; i < count; i++) {
+        b.files[i].path = paths[i];
+        b.files[i].fd = -1;
+    }
+
+#ifdef __linux__
+    if (b.io == IO_URING && uring_init(&b.ring))
+        b.io = IO_THREADS;
+#else
+    if (b.io == IO_URING)
+        b.io = IO_THREADS;
+#endif
+    if (b.io == IO_THREADS && threads_init(&b, count))
+        b.io = IO_SYNC;
+
+    // The sequential path only ever holds one file
+    size_t depth = b.io == IO_SYNC ? 1 : BATCH_DEPTH;
+    size_t ahead = 0;
+    for (size_t i = 0; i < count; i++) {
+        for (; ahead < count && ahead < i + depth; ahead++)
+            submit(&b, b.files + ahead, FILE_READING);
+#ifdef __linux__
+        if (b.io == IO_URING)
+            uring_reap(&b, 0);
+#endif
+
+        Batch_File *f = b.files + i;
+        wait_file(&b, f);
+        if (f->state != FILE_READ)
+            continue;
+
+        char *input = f->buf;
+        f->buf = fn(input, f->path, f->output_path, &f->size, ctx);
+        free(input);
+        if (f->buf == NULL) {
+            f->state = FILE_FAILED;
+            continue;
+        }
+        submit(&b, f, FILE_WRITING);
+    }
+
+    size_t failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        wait_file(&b, b.files + i);
+        if (b.files[i].state != FILE_DONE)
+            failed++;
+    }
+
+    if (b.io == IO_THREADS)
+        threads_free(&b);
+#ifdef __linux__
+    if (b.io == IO_URING)
+        uring_free(&b.ring);
+#endif
+    free(b.files);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->io = b.io;
+    stats->files = count;
+    stats->failed = failed;
+    stats->seconds = (end.tv_sec - start.tv_sec) +
+        (end.tv_nsec - start.tv_nsec) / 1e9;
+    return failed ? 1 : 0;
+}
+
+char *batch_io_name(enum BATCH_IO io)
+{
+    switch (io) {
+    case IO_URING:   return "io_uring";
+    case IO_THREADS: return "threads";
+    case IO_SYNC:    return "sync";
+    }
+    return "?";
+}
@@ -0,0 +1,30 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+
+#define BATCH_PATH_SIZE                    256
+
+enum BATCH_IO {
+    IO_URING = 0,
+    IO_THREADS,
+    IO_SYNC,
+};
+
+// Turns the contents of 'path' into output text
+// Returns the text and sets 'output_path' and 'size'. Returns NULL on error
+typedef char *(*Batch_Fn)(char *input, char *path, char *output_path,
+    size_t *size, void *ctx);
+
+typedef struct {
+    enum BATCH_IO io; // backend actually used
+    size_t files;
+    size_t failed;
+    double seconds;
+} Batch_Stats;
+
+int run_batch(char **paths, size_t count, enum BATCH_IO io, Batch_Fn fn,
+    void *ctx, Batch_Stats *stats);
+char *batch_io_name(enum BATCH_IO io);
+
+#endif // BATCH_H
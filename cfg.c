@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include "cfg.h"
+#include "opt.h"
+
+// Returns 1 if the label address loaded by the A-instruction at 'i' is read
+// as a value (Ex: '@RET', 'D=A') before A is overwritten
+static int label_escapes(Instruction *inst, size_t count, size_t i)
+{
+    for (size_t j = i + 1; j < count; j++) {
+        if (inst[j].type == A_INST)
+            return 0;
+        C_Instruction *c = inst[j].inst;
+        if (comp_reads(c->comp, 'A'))
+            return 1;
+        if (c->dest & DEST_A || c->jump == JMP)
+            return 0;
+    }
+    return 0;
+}
+
+// Splits 'inst' into basic blocks and links them by fall-through and direct
+// jump edges. Blocks start at labels, numeric jump targets and after jumps
+// Returns 0 on success
+// Returns 1 if code addresses can't be told apart from constants
+int build_cfg(CFG *cfg, Instruction *inst, size_t count,
+    Str_Int_Pair *labels, size_t label_count)
+{
+    cfg->is_target = calloc(count + 1, sizeof(char));
+    cfg->is_code_ref = calloc(count + 1, sizeof(char));
+    cfg->escapes = calloc(count + 1, sizeof(char));
+    cfg->block_of = malloc((count + 1) * sizeof(size_t));
+    cfg->blocks = NULL;
+    cfg->block_count = 0;
+
+    if (!can_renumber(inst, count, labels, label_count, cfg->is_target,
+        cfg->is_code_ref)) {
+        return 1;
+    }
+
+    // Find leaders and count blocks
+    size_t block_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        int leader = i == 0 || cfg->is_target[i];
+        if (i > 0 && inst[i - 1].type == C_INST) {
+            C_Instruction *prev = inst[i - 1].inst;
+            leader |= prev->jump != JUMP_NULL;
+        }
+        if (leader)
+            block_count++;
+        cfg->block_of[i] = block_count - 1;
+
+        if (inst[i].type == A_INST) {
+            A_Instruction *a = inst[i].inst;
+            cfg->escapes[i] = a->symbol &&
+                find_label_index(labels, label_count, a->symbol) != -1 &&
+                label_escapes(inst, count, i);
+        }
+    }
+    cfg->block_of[count] = NO_BLOCK;
+
+    cfg->blocks = malloc((block_count + 1) * sizeof(Basic_Block));
+    cfg->block_count = block_count;
+    for (size_t i = 0; i < count; i++) {
+        Basic_Block *b = cfg->blocks + cfg->block_of[i];
+        if (i == 0 || cfg->block_of[i] != cfg->block_of[i - 1])
+            b->start = i;
+        b->end = i + 1;
+    }
+
+    // Link blocks
+    for (size_t b = 0; b < block_count; b++) {
+        Basic_Block *block = cfg->blocks + b;
+        block->fall = (b + 1 < block_count) ? b + 1 : NO_BLOCK;
+        block->jump = NO_BLOCK;
+        block->computed = 0;
+
+        size_t last = block->end - 1;
+        if (inst[last].type != C_INST)
+            continue;
+        C_Instruction *c = inst[last].inst;
+        if (c->jump == JUMP_NULL)
+            continue;
+        if (c->jump == JMP)
+            block->fall = NO_BLOCK;
+
+        long s = find_jump_source(inst, count, cfg->is_target, last);
+        long t = -1;
+        if (s != -1) {
+            A_Instruction *a = inst[s].inst;
+            t = (a->symbol == NULL) ? (long) a->value :
+                find_label_index(labels, label_count, a->symbol);
+        }
+
+        if (t == -1)
+            block->computed = 1;
+        else if ((size_t) t < count)
+            block->jump = cfg->block_of[t];
+    }
+
+    return 0;
+}
+
+void free_cfg(CFG *cfg)
+{
+    free(cfg->blocks);
+    free(cfg->block_of);
+    free(cfg->is_target);
+    free(cfg->is_code_ref);
+    free(cfg->escapes);
+}
@@ -0,0 +1,29 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "inst.h"
+
+#define NO_BLOCK ((size_t) -1)
+
+typedef struct {
+    size_t start; // first instruction
+    size_t end; // one past last instruction
+    size_t fall; // block reached by falling through, NO_BLOCK if none
+    size_t jump; // block reached by a direct jump, NO_BLOCK if none
+    int computed; // ends in a jump to an address loaded from memory
+} Basic_Block;
+
+typedef struct {
+    Basic_Block *blocks;
+    size_t block_count;
+    size_t *block_of; // instruction index -> block index
+    char *is_target; // instruction is a label or a numeric jump target
+    char *is_code_ref; // numeric A-instruction used as a jump target
+    char *escapes; // A-instruction loads a label address as data
+} CFG;
+
+int build_cfg(CFG *cfg, Instruction *inst, size_t count,
+    Str_Int_Pair *labels, size_t label_count);
+void free_cfg(CFG *cfg);
+
+#endif // CFG_H
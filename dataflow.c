@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cfg.h"
+#include "dataflow.h"
+#include "opt.h"
+
+/*
+ Constant propagation over A and D (--dataflow).
+
+ A forward dataflow analysis finds what A and D hold when each basic block
+ is entered: a number, the operand of an A-instruction ('@SP', '@LOOP') or
+ unknown. States meet at labels, where a register stays known only if all
+ paths into the label agree on it. The first block and blocks entered by
+ computed jumps (returns) start with both registers unknown. M isn't
+ tracked, and neither are numeric jump targets, since their values change
+ when code moves.
+
+ With these states the pass
+     - removes A-instructions loading what A already holds
+     - removes C-instructions writing what A and D already hold
+     - replaces computations of known values with '0', '1', '-1' or a copy
+       that reads fewer registers (Ex: '@1', 'D=A' becomes '@1', 'D=1')
+     - makes conditional jumps on known values unconditional, or removes
+       them
+ and then removes A-instructions that were read only by what it folded.
+
+ Cycles saved are estimated by assuming every loop, found by a backward
+ jump with no return in between, runs LOOP_WEIGHT times.
+*/
+
+#define LOOP_WEIGHT                        10
+#define MAX_LOOP_DEPTH                     6
+
+enum VALUE_KIND { UNKNOWN, NUMBER, OPERAND };
+
+// Contents of A or D
+typedef struct {
+    enum VALUE_KIND kind;
+    uint16_t number; // for NUMBER
+    A_Instruction *operand; // for OPERAND, an A-instruction with a symbol
+} Value;
+
+typedef struct {
+    Value a;
+    Value d;
+} Registers;
+
+static const Value unknown = { UNKNOWN, 0, NULL };
+
+static Value number(uint16_t n)
+{
+    Value v = { NUMBER, n, NULL };
+    return v;
+}
+
+static int is_number(Value v, uint16_t n)
+{
+    return v.kind == NUMBER && v.number == n;
+}
+
+// Returns 1 if 'x' and 'y' are known to hold the same value
+static int same_value(Value x, Value y)
+{
+    if (x.kind != y.kind)
+        return 0;
+    if (x.kind == NUMBER)
+        return x.number == y.number;
+    if (x.kind == OPERAND)
+        return same_operand(x.operand, y.operand);
+    return 0;
+}
+
+// Returns the value the A-instruction at 'i' loads
+static Value load_value(Instruction *inst, char *is_code_ref, size_t i)
+{
+    A_Instruction *a = inst[i].inst;
+    if (is_code_ref[i])
+        return unknown;
+    if (a->symbol == NULL)
+        return number(a->value);
+    Value v = { OPERAND, 0, a };
+    return v;
+}
+
+// Returns the value 'comp' computes from 'r'. Computations reading M are
+// unknown
+static Value eval_comp(enum COMP comp, Registers *r)
+{
+    Value a = r->a;
+    Value d = r->d;
+    int numbers = a.kind == NUMBER && d.kind == NUMBER;
+    uint16_t x = d.number;
+    uint16_t y = a.number;
+
+    switch (comp) {
+    case COMP_0:         return number(0);
+    case COMP_1:         return number(1);
+    case COMP_MINUS_1:   return number(0xFFFF);
+    case COMP_D:         return d;
+    case COMP_A:         return a;
+    case COMP_NOT_D:     return d.kind == NUMBER ? number(~x) : unknown;
+    case COMP_NOT_A:     return a.kind == NUMBER ? number(~y) : unknown;
+    case COMP_MINUS_D:   return d.kind == NUMBER ? number(-x) : unknown;
+    case COMP_MINUS_A:   return a.kind == NUMBER ? number(-y) : unknown;
+    case COMP_D_PLUS_1:  return d.kind == NUMBER ? number(x + 1) : unknown;
+    case COMP_A_PLUS_1:  return a.kind == NUMBER ? number(y + 1) : unknown;
+    case COMP_D_MINUS_1: return d.kind == NUMBER ? number(x - 1) : unknown;
+    case COMP_A_MINUS_1: return a.kind == NUMBER ? number(y - 1) : unknown;
+    case COMP_D_PLUS_A:
+    case COMP_A_PLUS_D:
+        if (is_number(d, 0))
+            return a;
+        if (is_number(a, 0))
+            return d;
+        return numbers ? number(x + y) : unknown;
+    case COMP_D_MINUS_A:
+        if (is_number(a, 0))
+            return d;
+        if (same_value(a, d))
+            return number(0);
+        return numbers ? number(x - y) : unknown;
+    case COMP_A_MINUS_D:
+        if (is_number(d, 0))
+            return a;
+        if (same_value(a, d))
+            return number(0);
+        return numbers ? number(y - x) : unknown;
+    case COMP_D_AND_A:
+    case COMP_A_AND_D:
+        if (is_number(d, 0) || is_number(a, 0))
+            return number(0);
+        if (is_number(d, 0xFFFF) || same_value(a, d))
+            return a;
+        if (is_number(a, 0xFFFF))
+            return d;
+        return numbers ? number(x & y) : unknown;
+    case COMP_D_OR_A:
+    case COMP_A_OR_D:
+        if (is_number(d, 0xFFFF) || is_number(a, 0xFFFF))
+            return number(0xFFFF);
+        if (is_number(d, 0) || same_value(a, d))
+            return a;
+        if (is_number(a, 0))
+            return d;
+        return numbers ? number(x | y) : unknown;
+    default:
+        return unknown;
+    }
+}
+
+// Returns 1 if 'jump' is taken when the computation gives 'value'
+static int jump_taken(enum JUMP jump, uint16_t value)
+{
+    int16_t v = (int16_t) value;
+    switch (jump) {
+    case JGT: return v > 0;
+    case JEQ: return v == 0;
+    case JGE: return v >= 0;
+    case JLT: return v < 0;
+    case JNE: return v != 0;
+    case JLE: return v <= 0;
+    case JMP: return 1;
+    default:  return 0;
+    }
+}
+
+// Updates 'r' to the state after the instruction at 'i'
+static void step(Instruction *inst, char *is_code_ref, size_t i,
+    Registers *r)
+{
+    if (inst[i].type == A_INST) {
+        r->a = load_value(inst, is_code_ref, i);
+        return;
+    }
+    C_Instruction *c = inst[i].inst;
+    Value v = eval_comp(c->comp, r);
+    if (c->dest & DEST_A)
+        r->a = v;
+    if (c->dest & DEST_D)
+        r->d = v;
+}
+
+// Merges 'r' into the entry state of a block
+// Returns 1 if the entry state changed
+static int meet(Registers *entry, char *reached, Registers *r)
+{
+    if (!*reached) {
+        *entry = *r;
+        *reached = 1;
+        return 1;
+    }
+    int changed = 0;
+    if (entry->a.kind != UNKNOWN && !same_value(entry->a, r->a)) {
+        entry->a = unknown;
+        changed = 1;
+    }
+    if (entry->d.kind != UNKNOWN && !same_value(entry->d, r->d)) {
+        entry->d = unknown;
+        changed = 1;
+    }
+    return changed;
+}
+
+// Replaces the computation of 'c', known to give 'v', with a constant or a
+// copy of a register that reads fewer registers
+// Returns 1 if it was replaced
+static int fold_comp(C_Instruction *c, Value v, Registers *r)
+{
+    enum COMP comp = COMP_NULL;
+    // The value of an unconditional jump without destination isn't used
+    if (c->jump == JMP && c->dest == DEST_NULL)
+        comp = COMP_0;
+    else if (is_number(v, 0))
+        comp = COMP_0;
+    else if (is_number(v, 1))
+        comp = COMP_1;
+    else if (is_number(v, 0xFFFF))
+        comp = COMP_MINUS_1;
+    else if (v.kind != UNKNOWN && same_value(v, r->a) &&
+        comp_reads(c->comp, 'D'))
+        comp = COMP_A;
+    else if (v.kind != UNKNOWN && same_value(v, r->d) &&
+        comp_reads(c->comp, 'A'))
+        comp = COMP_D;
+
+    if (comp == COMP_NULL || comp == c->comp)
+        return 0;
+    c->comp = comp;
+    return 1;
+}
+
+// Returns 1 if the value in A is overwritten before being read on the
+// fall-through path starting at 'i'
+static int a_dead_from(Instruction *inst, size_t count, char *dead, size_t i)
+{
+    for (; i < count; i++) {
+        if (dead[i])
+            continue;
+        if (inst[i].type == A_INST)
+            return 1;
+        C_Instruction *c = inst[i].inst;
+        // Jumps go to A and stores go to M, which is addressed by A
+        if (comp_reads(c->comp, 'A') || comp_reads(c->comp, 'M') ||
+            c->jump != JUMP_NULL || c->dest & DEST_M)
+            return 0;
+        if (c->dest & DEST_A)
+            return 1;
+    }
+    return 1;
+}
+
+// Finds the entry state of every block reachable from the first one
+// Returns array of 'reached' flags, set for blocks the states are valid for
+static char *solve(CFG *cfg, Instruction *inst, size_t count,
+    Str_Int_Pair *labels, size_t label_count, Registers *entry)
+{
+    size_t n = cfg->block_count;
+    char *reached = calloc(n + 1, sizeof(char));
+    char *queued = calloc(n + 1, sizeof(char));
+    size_t *stack = malloc((n + 1) * sizeof(size_t));
+    size_t top = 0;
+
+    // Nothing is known where execution starts or where computed jumps land
+    Registers none = { unknown, unknown };
+    for (size_t i = 0; i < count; i++) {
+        size_t b = NO_BLOCK;
+        if (i == 0) {
+            b = 0;
+        } else if (cfg->escapes[i]) {
+            A_Instruction *a = inst[i].inst;
+            size_t t = find_label_index(labels, label_count, a->symbol);
+            if (t < count)
+                b = cfg->block_of[t];
+        }
+        if (b == NO_BLOCK || queued[b])
+            continue;
+        entry[b] = none;
+        reached[b] = 1;
+        queued[b] = 1;
+        stack[top++] = b;
+    }
+
+    while (top > 0) {
+        size_t b = stack[--top];
+        queued[b] = 0;
+        Basic_Block *block = cfg->blocks + b;
+        Registers r = entry[b];
+        for (size_t i = block->start; i < block->end; i++)
+            step(inst, cfg->is_code_ref, i, &r);
+
+        size_t next[2] = { block->fall, block->jump };
+        for (int k = 0; k < 2; k++) {
+            if (next[k] == NO_BLOCK ||
+                !meet(entry + next[k], reached + next[k], &r) ||
+                queued[next[k]])
+                continue;
+            queued[next[k]] = 1;
+            stack[top++] = next[k];
+        }
+    }
+
+    free(stack);
+    free(queued);
+    return reached;
+}
+
+// Returns estimated executions of each instruction per run, from the
+// number of loops around it
+static uint64_t *estimate_counts(CFG *cfg, size_t count)
+{
+    // computed[b] is the number of computed jumps in blocks before 'b'
+    size_t *computed = malloc((cfg->block_count + 1) * sizeof(size_t));
+    computed[0] = 0;
+    for (size_t b = 0; b < cfg->block_count; b++)
+        computed[b + 1] = computed[b] + cfg->blocks[b].computed;
+
+    // A backward jump is a loop unless a return lies between it and its
+    // target, which makes it a call to a function placed before the caller
+    long *depth = calloc(count + 1, sizeof(long));
+    for (size_t b = 0; b < cfg->block_count; b++) {
+        Basic_Block *block = cfg->blocks + b;
+        size_t t = block->jump;
+        if (t == NO_BLOCK || t > b || computed[b + 1] != computed[t])
+            continue;
+        depth[cfg->blocks[t].start]++;
+        depth[block->end]--;
+    }
+    free(computed);
+
+    uint64_t *counts = malloc((count + 1) * sizeof(uint64_t));
+    long d = 0;
+    for (size_t i = 0; i < count; i++) {
+        d += depth[i];
+        counts[i] = 1;
+        for (long k = 0; k < d && k < MAX_LOOP_DEPTH; k++)
+            counts[i] *= LOOP_WEIGHT;
+    }
+    free(depth);
+    return counts;
+}
+
+// Removes loads of values A and D already hold and folds computations and
+// jumps on known values, then re-resolves label addresses. Fills 'stats'
+// Returns number of instructions removed
+size_t propagate_constants(Instruction *inst, size_t *count,
+    Str_Int_Pair *labels, size_t label_count, Dataflow_Stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    CFG cfg;
+    if (build_cfg(&cfg, inst, *count, labels, label_count)) {
+        printf("warning: --dataflow skipped, computed jumps to numeric "
+            "addresses or label offsets\n");
+        free_cfg(&cfg);
+        return 0;
+    }
+
+    Registers *entry = malloc((cfg.block_count + 1) * sizeof(Registers));
+    char *reached = solve(&cfg, inst, *count, labels, label_count, entry);
+    char *dead = calloc(*count + 1, sizeof(char));
+
+    // A-instructions read before folding, to find the ones it leaves unread
+    char *was_read = calloc(*count + 1, sizeof(char));
+    for (size_t i = 0; i < *count; i++) {
+        was_read[i] = inst[i].type == A_INST &&
+            !a_dead_from(inst, *count, dead, i + 1);
+    }
+
+    // Jumps keep their A-instructions even when A already holds the
+    // target, so that they stay direct jumps (Ex: '(END)', '@END', '0;JMP')
+    char *is_jump_source = calloc(*count + 1, sizeof(char));
+    for (size_t j = 0; j < *count; j++) {
+        if (inst[j].type != C_INST)
+            continue;
+        C_Instruction *c = inst[j].inst;
+        if (c->jump == JUMP_NULL)
+            continue;
+        long s = find_jump_source(inst, *count, cfg.is_target, j);
+        if (s != -1)
+            is_jump_source[s] = 1;
+    }
+
+    for (size_t b = 0; b < cfg.block_count; b++) {
+        if (!reached[b])
+            continue;
+        Basic_Block *block = cfg.blocks + b;
+        Registers r = entry[b];
+        for (size_t i = block->start; i < block->end; i++) {
+            if (inst[i].type == A_INST) {
+                if (!is_jump_source[i] &&
+                    same_value(r.a, load_value(inst, cfg.is_code_ref, i))) {
+                    dead[i] = 1;
+                    stats->loads++;
+                }
+                step(inst, cfg.is_code_ref, i, &r);
+                continue;
+            }
+
+            C_Instruction *c = inst[i].inst;
+            Value v = eval_comp(c->comp, &r);
+            if (v.kind == NUMBER && c->jump != JUMP_NULL && c->jump != JMP) {
+                c->jump = jump_taken(c->jump, v.number) ? JMP : JUMP_NULL;
+                stats->jumps++;
+            }
+
+            if (c->jump == JUMP_NULL && !(c->dest & DEST_M) &&
+                (!(c->dest & DEST_A) || same_value(r.a, v)) &&
+                (!(c->dest & DEST_D) || same_value(r.d, v))) {
+                dead[i] = 1;
+                if (c->dest != DEST_NULL)
+                    stats->stores++;
+            } else if (fold_comp(c, v, &r)) {
+                stats->folded++;
+            }
+            step(inst, cfg.is_code_ref, i, &r);
+        }
+    }
+
+    for (size_t i = 0; i < *count; i++) {
+        if (was_read[i] && !dead[i] &&
+            a_dead_from(inst, *count, dead, i + 1))
+            dead[i] = 1;
+    }
+
+    uint64_t *counts = estimate_counts(&cfg, *count);
+    for (size_t i = 0; i < *count; i++) {
+        if (dead[i]) {
+            stats->removed++;
+            stats->cycles += counts[i];
+        }
+    }
+
+    size_t old_count = *count;
+    *count = remove_instructions(inst, *count, dead, cfg.is_code_ref, labels,
+        label_count);
+
+    free(counts);
+    free(is_jump_source);
+    free(was_read);
+    free(dead);
+    free(reached);
+    free(entry);
+    free_cfg(&cfg);
+    return old_count - *count;
+}
@@ -0,0 +1,19 @@
+#ifndef DATAFLOW_H
+#define DATAFLOW_H
+
+#include <stdint.h>
+#include "inst.h"
+
+typedef struct {
+    size_t loads; // A-instructions removed
+    size_t stores; // C-instructions removed, registers already held values
+    size_t folded; // computations replaced by constants or register copies
+    size_t jumps; // conditional jumps made unconditional or removed
+    size_t removed; // instructions removed, counting A-loads left unread
+    uint64_t cycles; // estimated cycles saved per run
+} Dataflow_Stats;
+
+size_t propagate_constants(Instruction *inst, size_t *count,
+    Str_Int_Pair *labels, size_t label_count, Dataflow_Stats *stats);
+
+#endif // DATAFLOW_H
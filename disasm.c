@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "disasm.h"
+
+/*
+ Disassembler (-d).
+
+ A .hack file is read as ASCII, 16 '0' and '1' chars per line, if its first
+ line is one, and as binary words, most significant byte first, otherwise.
+ Each ASCII line is checked and turned into a word 16 chars at a time with
+ GCC vector types: the chars that are '1' are masked to their bit weights
+ and each half of the line is added up into a byte by one multiply.
+
+ C-instructions are written from a table of the text of all 8192
+ comp/dest/jump combinations, built once from comp_codes, dest_codes and
+ jump_codes. Comps without a mnemonic are written as '?XX', their 7 bits
+ in hex, which doesn't assemble.
+
+ With a symbol map (--map, 'LABEL address' lines written when assembling),
+ labels are put back before their instructions and '@address' becomes
+ '@LABEL' when the next instruction jumps. Otherwise addresses stay
+ numbers. Either way, assembling the output gives back the same words.
+*/
+
+#define C_TEXT_SIZE                        16
+// Longest instruction line, '    AMD=?7F;JMP\n', with room to spare
+#define MAX_LINE_TEXT                      24
+#define OUT_INITIAL_CAPACITY               4096
+#define MAP_LINE_SIZE                      512
+
+typedef uint8_t Chars __attribute__((vector_size(16)));
+typedef uint64_t Halves __attribute__((vector_size(16)));
+
+// Text of each C-instruction by its low 13 bits
+static char c_text[0x2000][C_TEXT_SIZE];
+static uint8_t c_text_len[0x2000];
+static int c_text_ready = 0;
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t capacity;
+} Out;
+
+static void build_c_text(void)
+{
+    char comp_text[128][4];
+    for (size_t bits = 0; bits < 128; bits++)
+        sprintf(comp_text[bits], "?%02X", (unsigned int) bits);
+    // Backwards, so the first mnemonic of each code ('D+A', not 'A+D') wins
+    for (size_t i = comp_code_count; i-- > 1;) {
+        unsigned int bits = 0;
+        for (char *c = comp_codes[i].bin; *c; c++)
+            bits = bits << 1 | (*c - '0');
+        snprintf(comp_text[bits], 4, "%s", comp_codes[i].str);
+    }
+
+    for (size_t w = 0; w < 0x2000; w++) {
+        char *dest = dest_codes[(w >> 3) & 7].str;
+        char *jump = jump_codes[w & 7].str;
+        c_text_len[w] = snprintf(c_text[w], C_TEXT_SIZE, "%s%s%s%s%s",
+            dest, *dest ? "=" : "", comp_text[w >> 6], *jump ? ";" : "", jump);
+    }
+    c_text_ready = 1;
+}
+
+// Reads the 16 '0' and '1' chars at 'p' into 'word', most significant bit
+// first
+// Returns 0 on success, 1 if there's any other char
+static int decode_bits(char *p, uint16_t *word)
+{
+    const Chars zero = { 0 };
+    const Chars weights = {
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+    };
+    Chars c;
+    memcpy(&c, p, sizeof(c));
+    Halves valid = (Halves) ((c | 1) == zero + (uint8_t) '1');
+    Halves bits = (Halves) ((Chars) (c == zero + (uint8_t) '1') & weights);
+    if (~(valid[0] & valid[1]))
+        return 1;
+
+    // Bits of each half are in separate bytes, so adding them up is an OR
+    uint64_t hi = (bits[0] * 0x0101010101010101ULL) >> 56;
+    uint64_t lo = (bits[1] * 0x0101010101010101ULL) >> 56;
+    *word = hi << 8 | lo;
+    return 0;
+}
+
+static int is_ascii_hack(char *buf, size_t size)
+{
+    if (size < 16)
+        return 0;
+    for (size_t i = 0; i < 16; i++) {
+        if (buf[i] != '0' && buf[i] != '1')
+            return 0;
+    }
+    return size == 16 || buf[16] == '\n' || buf[16] == '\r';
+}
+
+// Decodes the .hack in 'buf', read from 'path', into words
+// Returns the words and sets 'count'. Returns NULL on error
+uint16_t *read_hack(char *buf, size_t size, char *path, size_t *count)
+{
+    if (!is_ascii_hack(buf, size)) {
+        if (size % 2 != 0) {
+            printf("'%s' is neither an ASCII nor a binary .hack\n", path);
+            return NULL;
+        }
+        uint16_t *words = malloc((size / 2 + 1) * sizeof(uint16_t));
+        for (size_t i = 0; i < size / 2; i++)
+            words[i] = (uint8_t) buf[2 * i] << 8 | (uint8_t) buf[2 * i + 1];
+        *count = size / 2;
+        return words;
+    }
+
+    uint16_t *words = malloc((size / 17 + 1) * sizeof(uint16_t));
+    char *p = buf;
+    char *end = buf + size;
+    size_t n = 0;
+    while (p < end) {
+        int bad = end - p < 16 || decode_bits(p, words + n);
+        p += 16;
+        if (!bad && p < end && *p == '\r')
+            p++;
+        if (!bad && p < end && *p++ != '\n')
+            bad = 1;
+        if (bad) {
+            printf("Error at line %zu of '%s': expected 16 '0' or '1' chars\n",
+                n + 1, path);
+            free(words);
+            return NULL;
+        }
+        n++;
+    }
+    *count = n;
+    return words;
+}
+
+static void reserve(Out *out, size_t n)
+{
+    if (out->len + n <= out->capacity)
+        return;
+    while (out->len + n > out->capacity)
+        out->capacity *= 2;
+    out->buf = realloc(out->buf, out->capacity);
+}
+
+static void put_str(Out *out, char *s, size_t len)
+{
+    reserve(out, len);
+    memcpy(out->buf + out->len, s, len);
+    out->len += len;
+}
+
+// Writes 'words' as .asm to 'f', with 'labels' at their addresses
+// Returns 0 on success, 1 on error
+int write_disassembly(FILE *f, uint16_t *words, size_t count,
+    Str_Int_Pair *labels, size_t label_count)
+{
+    if (!c_text_ready)
+        build_c_text();
+
+    // Order labels by address with a counting sort. The first label at an
+    // address names it
+    size_t *first = calloc(count + 2, sizeof(size_t));
+    size_t *order = malloc((label_count + 1) * sizeof(size_t));
+    size_t kept = 0;
+    for (size_t i = 0; i < label_count; i++) {
+        if (labels[i].p1 >= 0 && (size_t) labels[i].p1 <= count) {
+            first[labels[i].p1 + 1]++;
+            kept++;
+        }
+    }
+    for (size_t i = 1; i <= count + 1; i++)
+        first[i] += first[i - 1];
+    char **name_at = calloc(count + 1, sizeof(char*));
+    for (size_t i = 0; i < label_count; i++) {
+        if (labels[i].p1 < 0 || (size_t) labels[i].p1 > count)
+            continue;
+        if (name_at[labels[i].p1] == NULL)
+            name_at[labels[i].p1] = labels[i].p0;
+        order[first[labels[i].p1]++] = i;
+    }
+
+    Out out = { .capacity = OUT_INITIAL_CAPACITY };
+    while (out.capacity < count * MAX_LINE_TEXT / 2)
+        out.capacity *= 2;
+    out.buf = malloc(out.capacity);
+
+    size_t l = 0;
+    for (size_t i = 0; i <= count; i++) {
+        while (l < kept && (size_t) labels[order[l]].p1 == i) {
+            char *name = labels[order[l++]].p0;
+            reserve(&out, strlen(name) + 3);
+            out.buf[out.len++] = '(';
+            put_str(&out, name, strlen(name));
+            out.buf[out.len++] = ')';
+            out.buf[out.len++] = '\n';
+        }
+        if (i == count)
+            break;
+
+        uint16_t w = words[i];
+        reserve(&out, MAX_LINE_TEXT);
+        memcpy(out.buf + out.len, "    ", 4);
+        out.len += 4;
+        if (w & 0x8000) {
+            memcpy(out.buf + out.len, c_text[w & 0x1FFF], C_TEXT_SIZE);
+            out.len += c_text_len[w & 0x1FFF];
+            out.buf[out.len++] = '\n';
+            continue;
+        }
+
+        out.buf[out.len++] = '@';
+        int jumps = i + 1 < count && (words[i + 1] & 0x8000) &&
+            (words[i + 1] & 7);
+        if (jumps && w <= count && name_at[w] != NULL) {
+            put_str(&out, name_at[w], strlen(name_at[w]));
+        } else {
+            char digits[8];
+            int n = 0;
+            do {
+                digits[n++] = '0' + w % 10;
+                w /= 10;
+            } while (w);
+            while (n > 0)
+                out.buf[out.len++] = digits[--n];
+        }
+        reserve(&out, 1);
+        out.buf[out.len++] = '\n';
+    }
+
+    int err = fwrite(out.buf, 1, out.len, f) != out.len;
+    free(out.buf);
+    free(name_at);
+    free(first);
+    free(order);
+    return err || ferror(f);
+}
+
+// Writes 'labels' as 'LABEL address' lines
+// Returns 0 on success, 1 on error
+int write_symbol_map(FILE *f, Str_Int_Pair *labels, size_t label_count)
+{
+    for (size_t i = 0; i < label_count; i++)
+        fprintf(f, "%s %i\n", labels[i].p0, labels[i].p1);
+    return ferror(f) != 0;
+}
+
+// Reads the 'LABEL address' lines of the symbol map at 'path'. It may be
+// empty, for a program without labels
+// Returns the labels and sets 'label_count'. Returns NULL on error
+Str_Int_Pair *read_symbol_map(char *path, size_t *label_count)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        printf("Couldn't open %s\n", path);
+        return NULL;
+    }
+
+    size_t capacity = 64;
+    size_t count = 0;
+    Str_Int_Pair *labels = malloc(capacity * sizeof(Str_Int_Pair));
+    char line[MAP_LINE_SIZE];
+    for (size_t n = 1; fgets(line, MAP_LINE_SIZE, f) != NULL; n++) {
+        size_t len = strcspn(line, "\r\n");
+        int whole = line[len] != '\0' || feof(f);
+        line[len] = '\0';
+        if (len == 0 && whole)
+            continue;
+
+        char *space = strrchr(line, ' ');
+        char *end = NULL;
+        long addr = space ? strtol(space + 1, &end, 10) : -1;
+        if (!whole || space == NULL || space == line || end == space + 1 ||
+            *end != '\0' || addr < 0 || addr > 0x7FFF) {
+            printf("Error at line %zu of '%s': expected 'LABEL address'\n",
+                n, path);
+            free_symbol_map(labels, count);
+            fclose(f);
+            return NULL;
+        }
+
+        if (count == capacity) {
+            capacity *= 2;
+            labels = realloc(labels, capacity * sizeof(Str_Int_Pair));
+        }
+        size_t name_len = space - line;
+        char *name = malloc(name_len + 1);
+        memcpy(name, line, name_len);
+        name[name_len] = '\0';
+        labels[count++] = (Str_Int_Pair) { .p0 = name, .p1 = addr };
+    }
+    fclose(f);
+    *label_count = count;
+    return labels;
+}
+
+void free_symbol_map(Str_Int_Pair *labels, size_t label_count)
+{
+    if (labels == NULL)
+        return;
+    for (size_t i = 0; i < label_count; i++)
+        free(labels[i].p0);
+    free(labels);
+}
@@ -0,0 +1,16 @@
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "inst.h"
+
+uint16_t *read_hack(char *buf, size_t size, char *path, size_t *count);
+int write_disassembly(FILE *f, uint16_t *words, size_t count,
+    Str_Int_Pair *labels, size_t label_count);
+int write_symbol_map(FILE *f, Str_Int_Pair *labels, size_t label_count);
+Str_Int_Pair *read_symbol_map(char *path, size_t *label_count);
+void free_symbol_map(Str_Int_Pair *labels, size_t label_count);
+
+#endif // DISASM_H
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emitc.h"
+#include "inst.h"
+
+/*
+ C backend (--emit=c).
+
+ Translates encoded words into a C program that runs like 'hasm --run'
+ and takes the same --max-cycles, --set and --dump options.
+
+ Basic blocks become cases of one switch in run(), so computed jumps
+ ('pc = a; continue') go through a dense jump table, and jumps after an
+ '@X' in the same block become 'goto L<X>'. Blocks start at 0, after
+ jumps and at every address an A-instruction loads. A block adds its
+ cycles on entry. When fewer cycles than that are left, or a computed
+ jump lands inside a block, interpret() steps through rom[] instead.
+*/
+
+// C expression for each comp code, NULL for codes without a mnemonic
+static const char *comp_exprs[128] = {
+    [0x2A] = "0",
+    [0x3F] = "1",
+    [0x3A] = "0xFFFF",
+    [0x0C] = "d",
+    [0x30] = "a",
+    [0x70] = "M",
+    [0x0D] = "~d",
+    [0x31] = "~a",
+    [0x71] = "~M",
+    [0x0F] = "-d",
+    [0x33] = "-a",
+    [0x73] = "-M",
+    [0x1F] = "d + 1",
+    [0x37] = "a + 1",
+    [0x77] = "M + 1",
+    [0x0E] = "d - 1",
+    [0x32] = "a - 1",
+    [0x72] = "M - 1",
+    [0x02] = "d + a",
+    [0x42] = "d + M",
+    [0x13] = "d - a",
+    [0x53] = "d - M",
+    [0x07] = "a - d",
+    [0x47] = "M - d",
+    [0x00] = "d & a",
+    [0x40] = "d & M",
+    [0x15] = "d | a",
+    [0x55] = "d | M",
+};
+
+// Condition on 'out' for each jump code
+static const char *jump_conds[8] = {
+    NULL, "(int16_t) out > 0", "out == 0", "(int16_t) out >= 0",
+    "(int16_t) out < 0", "out != 0", "(int16_t) out <= 0", NULL,
+};
+
+static const char *prelude =
+    "#include <stdint.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "#define RAM_SIZE 32768\n"
+    "#define MAX_DUMPS 16\n"
+    "#define M ram[a & 0x7FFF]\n"
+    "#define BLOCK(k, n) \\\n"
+    "    if (end - cycles < n) { pc = k; goto tail; } \\\n"
+    "    cycles += n\n"
+    "\n"
+    "enum { HALTED, CYCLE_LIMIT, OUT_OF_ROM, BLOCK_START };\n"
+    "\n"
+    "static uint16_t ram[RAM_SIZE];\n"
+    "static uint64_t cycles;\n"
+    "\n";
+
+static const char *runtime =
+    "static uint16_t alu(uint8_t op, uint16_t x, uint16_t y)\n"
+    "{\n"
+    "    if (op & 0x20) x = 0;\n"
+    "    if (op & 0x10) x = ~x;\n"
+    "    if (op & 0x08) y = 0;\n"
+    "    if (op & 0x04) y = ~y;\n"
+    "    uint16_t out = (op & 0x02) ? x + y : x & y;\n"
+    "    if (op & 0x01) out = ~out;\n"
+    "    return out;\n"
+    "}\n"
+    "\n"
+    "// Runs single instructions until the cycle limit, or until a block\n"
+    "// starts if 'to_block' is set\n"
+    "static int interpret(uint16_t *a, uint16_t *d, uint16_t *pc,\n"
+    "    uint64_t end, int to_block)\n"
+    "{\n"
+    "    for (;;) {\n"
+    "        if (cycles >= end) return CYCLE_LIMIT;\n"
+    "        if (*pc >= ROM_SIZE) return OUT_OF_ROM;\n"
+    "        if (to_block && is_block[*pc]) return BLOCK_START;\n"
+    "\n"
+    "        uint16_t w = rom[*pc];\n"
+    "        if (!(w & 0x8000)) {\n"
+    "            *a = w;\n"
+    "            (*pc)++;\n"
+    "            cycles++;\n"
+    "            continue;\n"
+    "        }\n"
+    "\n"
+    "        uint8_t op = (w >> 6) & 0x7F;\n"
+    "        uint8_t dest = (w >> 3) & 7;\n"
+    "        uint8_t jump = w & 7;\n"
+    "        if (jump == 7 && dest == 0 && *pc > 0 && rom[*pc - 1] == *pc - 1)\n"
+    "            return HALTED;\n"
+    "        cycles++;\n"
+    "\n"
+    "        uint16_t out = alu(op, *d, (op & 0x40) ? ram[*a & 0x7FFF] : *a);\n"
+    "        uint16_t addr = *a;\n"
+    "        int16_t v = out;\n"
+    "        if (dest & 1) ram[addr & 0x7FFF] = out;\n"
+    "        if (dest & 4) *a = out;\n"
+    "        if (dest & 2) *d = out;\n"
+    "        if ((jump & 4 && v < 0) || (jump & 2 && v == 0) ||\n"
+    "            (jump & 1 && v > 0))\n"
+    "            *pc = addr & 0x7FFF;\n"
+    "        else\n"
+    "            (*pc)++;\n"
+    "    }\n"
+    "}\n"
+    "\n";
+
+static const char *main_function =
+    "int main(int argc, char *argv[])\n"
+    "{\n"
+    "    uint64_t max_cycles = 0;\n"
+    "    long dumps[MAX_DUMPS][2];\n"
+    "    int dump_count = 0;\n"
+    "    for (int i = 1; i < argc; i += 2) {\n"
+    "        char *value = i + 1 < argc ? argv[i + 1] : NULL;\n"
+    "        char *end;\n"
+    "        if (value && strcmp(argv[i], \"--max-cycles\") == 0) {\n"
+    "            max_cycles = strtoull(value, NULL, 0);\n"
+    "        } else if (value && strcmp(argv[i], \"--set\") == 0) {\n"
+    "            long addr = strtol(value, &end, 0);\n"
+    "            ram[addr & 0x7FFF] = strtol(end + 1, NULL, 0);\n"
+    "        } else if (value && strcmp(argv[i], \"--dump\") == 0 &&\n"
+    "            dump_count < MAX_DUMPS) {\n"
+    "            dumps[dump_count][0] = strtol(value, &end, 0);\n"
+    "            dumps[dump_count++][1] = *end ? strtol(end + 1, NULL, 0) : 1;\n"
+    "        } else {\n"
+    "            printf(\"usage: %s [--max-cycles n] [--set addr=val] \"\n"
+    "                \"[--dump addr[:n]]\\n\", argv[0]);\n"
+    "            return 1;\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    const char *status_str[] = {\n"
+    "        \"halted\", \"cycle limit reached\", \"ran past end of ROM\",\n"
+    "    };\n"
+    "    int status = run(max_cycles ? max_cycles : UINT64_MAX);\n"
+    "    printf(\"%s after %llu cycles\\n\", status_str[status],\n"
+    "        (unsigned long long) cycles);\n"
+    "    for (int i = 0; i < dump_count; i++) {\n"
+    "        for (long a = dumps[i][0];\n"
+    "            a < dumps[i][0] + dumps[i][1] && a < RAM_SIZE; a++)\n"
+    "            printf(\"RAM[%li] = %i\\n\", a, (int16_t) ram[a]);\n"
+    "    }\n"
+    "    return 0;\n"
+    "}\n";
+
+// Same test as the emulator's decode()
+static int is_halt(uint16_t *words, size_t i)
+{
+    uint16_t w = words[i];
+    return (w & 0x8000) && (w & 7) == 7 && ((w >> 3) & 7) == 0 && i > 0 &&
+        words[i - 1] == i - 1;
+}
+
+// Returns 1 if the value loaded by the A-instruction at 'i' may be a code
+// address: it is jumped to or read as a value rather than only used as 'M'
+static int loads_code_address(uint16_t *words, size_t count, size_t i)
+{
+    if (i + 1 >= count || !(words[i + 1] & 0x8000) || words[i] >= count)
+        return 0;
+    uint8_t op = (words[i + 1] >> 6) & 0x7F;
+    int reads_a = !(op & 0x40) &&
+        (comp_exprs[op] == NULL || strchr(comp_exprs[op], 'a'));
+    return reads_a || (words[i + 1] & 7);
+}
+
+// Emits C-instruction 'w'. 'known_a' is the value of A if it is known at
+// compile time, -1 otherwise
+static void emit_c_inst(FILE *f, uint16_t w, long known_a, size_t count)
+{
+    uint8_t op = (w >> 6) & 0x7F;
+    uint8_t dest = (w >> 3) & 7;
+    uint8_t jump = w & 7;
+
+    if (comp_exprs[op])
+        fprintf(f, " out = %s;", comp_exprs[op]);
+    else
+        fprintf(f, " out = alu(0x%02X, d, %s);", op,
+            (op & 0x40) ? "M" : "a");
+    if (jump && known_a == -1 && dest & 4)
+        fprintf(f, " addr = a;");
+    if (dest & 1) fprintf(f, " M = out;");
+    if (dest & 4) fprintf(f, " a = out;");
+    if (dest & 2) fprintf(f, " d = out;");
+    if (jump == 0)
+        return;
+
+    if (jump_conds[jump])
+        fprintf(f, " if (%s)", jump_conds[jump]);
+    if (known_a == -1)
+        fprintf(f, " { pc = %s & 0x7FFF; continue; }",
+            (dest & 4) ? "addr" : "a");
+    else if ((size_t) known_a < count)
+        fprintf(f, " goto L%li;", known_a);
+    else
+        fprintf(f, " { pc = %li; continue; }", known_a);
+}
+
+// Prints 'n' values from 'a' as the body of a C array initializer
+static void emit_array(FILE *f, uint16_t *a, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        fprintf(f, "%s%u,", (i % 16 == 0) ? "\n    " : " ", a[i]);
+    fprintf(f, "\n");
+}
+
+// Writes a C program that runs the 'count' encoded 'words'
+// Returns 0 on success, 1 on error
+int emit_c(FILE *f, uint16_t *words, size_t count, char *source_name)
+{
+    // Find block starts and 'goto' targets
+    uint16_t *is_block = calloc(count + 1, sizeof(uint16_t));
+    char *is_label = calloc(count + 1, sizeof(char));
+    if (count > 0)
+        is_block[0] = 1;
+    for (size_t i = 0; i < count; i++) {
+        if (!(words[i] & 0x8000)) {
+            if (loads_code_address(words, count, i))
+                is_block[words[i]] = 1;
+        } else if (words[i] & 7) {
+            is_block[i + 1] = 1;
+        }
+    }
+    for (size_t i = 1; i < count; i++) {
+        if ((words[i] & 0x8000) && (words[i] & 7) && !is_block[i] &&
+            !(words[i - 1] & 0x8000) && words[i - 1] < count &&
+            !is_halt(words, i))
+            is_label[words[i - 1]] = 1;
+    }
+
+    fprintf(f, "// Generated by hasm --emit=c from %s\n\n", source_name);
+    fputs(prelude, f);
+    fprintf(f, "#define ROM_SIZE %li\n\n", count);
+    fprintf(f, "static const uint16_t rom[ROM_SIZE + 1] = {");
+    emit_array(f, words, count);
+    fprintf(f, "};\n\n");
+    fprintf(f, "static const uint16_t is_block[ROM_SIZE + 1] = {");
+    emit_array(f, is_block, count);
+    fprintf(f, "};\n\n");
+    fputs(runtime, f);
+
+    fprintf(f, "static int run(uint64_t end)\n{\n");
+    fprintf(f, "    uint16_t a = 0, d = 0, out, addr, pc = 0;\n");
+    fprintf(f, "    int status;\n");
+    fprintf(f, "    (void) out;\n    (void) addr;\n\n");
+    fprintf(f, "    for (;;) switch (pc) {\n");
+
+    char mnemonic[32];
+    long known_a = -1;
+    for (size_t i = 0; i < count; i++) {
+        uint16_t w = words[i];
+        if (is_block[i]) {
+            // Cycles up to the next block, halts don't take one
+            size_t n = 0;
+            for (size_t j = i; j < count && (j == i || !is_block[j]); j++)
+                n += !is_halt(words, j);
+            fprintf(f, "    case %li:", i);
+            fprintf(f, is_label[i] ? " L%li:\n" : "\n", i);
+            if (n > 0)
+                fprintf(f, "        BLOCK(%li, %li);\n", i, n);
+            known_a = -1;
+        }
+
+        format_word(w, mnemonic);
+        fprintf(f, "        // %s\n       ", mnemonic);
+        if (is_halt(words, i)) {
+            fprintf(f, " return cycles >= end ? CYCLE_LIMIT : HALTED;\n");
+        } else if (!(w & 0x8000)) {
+            fprintf(f, " a = %u;\n", w);
+            known_a = w;
+            continue;
+        } else {
+            emit_c_inst(f, w, known_a, count);
+            fprintf(f, "\n");
+        }
+        known_a = -1;
+    }
+
+    fprintf(f, "        pc = ROM_SIZE;\n");
+    fprintf(f, "    default:\n");
+    fprintf(f, "        status = interpret(&a, &d, &pc, end, 1);\n");
+    fprintf(f, "        if (status != BLOCK_START)\n");
+    fprintf(f, "            return status;\n");
+    fprintf(f, "    }\n\n");
+    fprintf(f, "tail:\n    return interpret(&a, &d, &pc, end, 0);\n}\n\n");
+    fputs(main_function, f);
+
+    free(is_block);
+    free(is_label);
+    return ferror(f) ? 1 : 0;
+}
@@ -0,0 +1,9 @@
+#ifndef EMITC_H
+#define EMITC_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+int emit_c(FILE *f, uint16_t *words, size_t count, char *source_name);
+
+#endif // EMITC_H
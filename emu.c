@@ -0,0 +1,683 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "emu.h"
+#include "idiom.h"
+#include "inst.h"
+#include "jit.h"
+#include "prof.h"
+
+/*
+ Hack CPU emulator.
+
+ ROM words are decoded once into Decoded structs. The nand2tetris idiom
+ for ending a program, '(END)', '@END', '0;JMP', is decoded as OP_HALT
+ and stops the run.
+
+ There are three engines, which must give identical results:
+     naive      decodes instruction bits every cycle
+     switch     switches over the pre-decoded comp code every cycle
+     threaded   runs a stream of handler indexes built from the decoded
+                ROM, with superinstructions for common '@X' pairs and
+                fill and copy loops run in bulk (see idiom.c)
+     jit        compiles the ROM to x86-64 a block at a time (see jit.c)
+*/
+
+#define HISTOGRAM_SIZE                     0x10000
+
+// Computes comp code 'op' the way the hack ALU does, for codes that have
+// no mnemonic. 'y' is A or M, depending on the a-bit
+static uint16_t alu(uint8_t op, uint16_t x, uint16_t y)
+{
+    if (op & 0x20) x = 0;      // zx
+    if (op & 0x10) x = ~x;     // nx
+    if (op & 0x08) y = 0;      // zy
+    if (op & 0x04) y = ~y;     // ny
+    uint16_t out = (op & 0x02) ? x + y : x & y; // f
+    if (op & 0x01) out = ~out; // no
+    return out;
+}
+
+static void decode(Hack_CPU *cpu)
+{
+    for (size_t pc = 0; pc < cpu->rom_size; pc++) {
+        uint16_t w = cpu->rom[pc];
+        Decoded *in = cpu->code + pc;
+        if (!(w & 0x8000)) {
+            *in = (Decoded) { .op = OP_A, .value = w };
+            continue;
+        }
+
+        *in = (Decoded) {
+            .op = (w >> 6) & 0x7F,
+            .dest = (w >> 3) & 7,
+            .jump = w & 7,
+        };
+
+        // '@X', '0;JMP' at X
+        if (in->jump == 7 && in->dest == 0 && pc > 0 &&
+            cpu->rom[pc - 1] == pc - 1)
+            in->op = OP_HALT;
+    }
+}
+
+// Creates CPU with 'rom' loaded and RAM cleared
+// Counts executions of each ROM address if 'count_instructions' is set
+// The CPU is mapped rather than allocated so RAM starts on a page, where
+// --screen can map SCREEN and KBD to shared memory (see screen.c)
+Hack_CPU *emu_new(uint16_t *rom, size_t rom_size, int count_instructions)
+{
+    Hack_CPU *cpu = mmap(NULL, sizeof(Hack_CPU), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (cpu == MAP_FAILED)
+        return NULL;
+    cpu->rom = rom;
+    cpu->rom_size = rom_size;
+    cpu->code = malloc((rom_size + 1) * sizeof(Decoded));
+    if (count_instructions) {
+        cpu->counts = calloc(rom_size + 1, sizeof(uint64_t));
+        cpu->taken = calloc(rom_size + 1, sizeof(uint64_t));
+    }
+    decode(cpu);
+    return cpu;
+}
+
+void emu_free(Hack_CPU *cpu)
+{
+    free(cpu->code);
+    free(cpu->ops);
+    free(cpu->targets);
+    idiom_free_loops(cpu->loops, cpu->rom_size);
+    jit_free(cpu->jit);
+    free(cpu->counts);
+    free(cpu->taken);
+    munmap(cpu, sizeof(Hack_CPU));
+}
+
+// Computes comp code 'op'
+static inline uint16_t compute(uint8_t op, uint16_t a, uint16_t d,
+    uint16_t *ram)
+{
+    switch (op) {
+    case 0x2A: return 0;                          // 0
+    case 0x3F: return 1;                          // 1
+    case 0x3A: return 0xFFFF;                     // -1
+    case 0x0C: return d;                          // D
+    case 0x30: return a;                          // A
+    case 0x70: return ram[a & 0x7FFF];            // M
+    case 0x0D: return ~d;                         // !D
+    case 0x31: return ~a;                         // !A
+    case 0x71: return ~ram[a & 0x7FFF];           // !M
+    case 0x0F: return -d;                         // -D
+    case 0x33: return -a;                         // -A
+    case 0x73: return -ram[a & 0x7FFF];           // -M
+    case 0x1F: return d + 1;                      // D+1
+    case 0x37: return a + 1;                      // A+1
+    case 0x77: return ram[a & 0x7FFF] + 1;        // M+1
+    case 0x0E: return d - 1;                      // D-1
+    case 0x32: return a - 1;                      // A-1
+    case 0x72: return ram[a & 0x7FFF] - 1;        // M-1
+    case 0x02: return d + a;                      // D+A
+    case 0x42: return d + ram[a & 0x7FFF];        // D+M
+    case 0x13: return d - a;                      // D-A
+    case 0x53: return d - ram[a & 0x7FFF];        // D-M
+    case 0x07: return a - d;                      // A-D
+    case 0x47: return ram[a & 0x7FFF] - d;        // M-D
+    case 0x00: return d & a;                      // D&A
+    case 0x40: return d & ram[a & 0x7FFF];        // D&M
+    case 0x15: return d | a;                      // D|A
+    case 0x55: return d | ram[a & 0x7FFF];        // D|M
+    default:
+        return alu(op, d, (op & 0x40) ? ram[a & 0x7FFF] : a);
+    }
+}
+
+// Returns 1 if jump condition 'jump' holds for ALU output 'out'
+static inline int jump_taken(uint8_t jump, uint16_t out)
+{
+    int16_t v = (int16_t) out;
+    return (jump & 4 && v < 0) || (jump & 2 && v == 0) || (jump & 1 && v > 0);
+}
+
+// Decodes every instruction from its bits each cycle
+// Used as the baseline when benchmarking the other engines
+static enum EMU_STATUS run_naive(Hack_CPU *cpu, uint64_t end)
+{
+    uint16_t *ram = cpu->ram;
+    uint16_t *rom = cpu->rom;
+    uint16_t a = cpu->a;
+    uint16_t d = cpu->d;
+    uint16_t pc = cpu->pc;
+    uint64_t cycles = cpu->cycles;
+    enum EMU_STATUS status = EMU_CYCLE_LIMIT;
+
+    while (cycles < end) {
+        if (pc >= cpu->rom_size) {
+            status = EMU_OUT_OF_ROM;
+            break;
+        }
+
+        uint16_t w = rom[pc];
+        if (!(w & 0x8000)) {
+            a = w;
+            pc++;
+            cycles++;
+            continue;
+        }
+
+        uint8_t op = (w >> 6) & 0x7F;
+        uint8_t dest = (w >> 3) & 7;
+        uint8_t jump = w & 7;
+        if (jump == 7 && dest == 0 && pc > 0 && rom[pc - 1] == pc - 1) {
+            status = EMU_HALTED;
+            break;
+        }
+        cycles++;
+
+        uint16_t out = alu(op, d, (op & 0x40) ? ram[a & 0x7FFF] : a);
+        uint16_t addr = a;
+        if (dest & 1) ram[addr & 0x7FFF] = out;
+        if (dest & 4) a = out;
+        if (dest & 2) d = out;
+        pc = jump_taken(jump, out) ? addr & 0x7FFF : pc + 1;
+    }
+
+    cpu->a = a;
+    cpu->d = d;
+    cpu->pc = pc;
+    cpu->cycles = cycles;
+    return status;
+}
+
+// Switches over the pre-decoded comp code each cycle
+static enum EMU_STATUS run_switch(Hack_CPU *cpu, uint64_t end)
+{
+    uint16_t *ram = cpu->ram;
+    Decoded *code = cpu->code;
+    uint64_t *counts = cpu->counts;
+    uint32_t *dirty = cpu->dirty_rows;
+    uint16_t a = cpu->a;
+    uint16_t d = cpu->d;
+    uint16_t pc = cpu->pc;
+    uint64_t cycles = cpu->cycles;
+    enum EMU_STATUS status = EMU_CYCLE_LIMIT;
+
+    while (cycles < end) {
+        if (pc >= cpu->rom_size) {
+            status = EMU_OUT_OF_ROM;
+            break;
+        }
+
+        Decoded *in = code + pc;
+        if (in->op == OP_HALT) {
+            status = EMU_HALTED;
+            break;
+        }
+        if (counts)
+            counts[pc]++;
+        cycles++;
+
+        if (in->op == OP_A) {
+            a = in->value;
+            pc++;
+            continue;
+        }
+
+        uint16_t out = compute(in->op, a, d, ram);
+
+        // M is addressed by A before this instruction writes it
+        uint16_t addr = a;
+        if (in->dest & 1) {
+            ram[addr & 0x7FFF] = out;
+            uint16_t word = (addr & 0x7FFF) - SCREEN_ADDR;
+            if (dirty && word < KBD_ADDR - SCREEN_ADDR)
+                dirty[word / ROW_WORDS / 32] |= 1u << (word / ROW_WORDS % 32);
+        }
+        if (in->dest & 4) a = out;
+        if (in->dest & 2) d = out;
+        if (jump_taken(in->jump, out)) {
+            if (counts) {
+                cpu->taken[pc]++;
+                if (cpu->profiler)
+                    prof_jump(cpu->profiler, pc, addr & 0x7FFF, cycles);
+            }
+            pc = addr & 0x7FFF;
+        } else {
+            pc++;
+        }
+    }
+
+    cpu->a = a;
+    cpu->d = d;
+    cpu->pc = pc;
+    cpu->cycles = cycles;
+    return status;
+}
+
+// Handlers for threaded code. TH_C runs any C-instruction from its Decoded
+// form. The others are specialized for the instructions and '@X' pairs
+// (superinstructions) Pong.asm spends most of its cycles on
+enum TH {
+    TH_END, TH_HALT, TH_A, TH_C, TH_LOOP,
+    TH_A_M_MINUS_1, TH_M_NOT_M, TH_D_M, TH_AM_M_MINUS_1, TH_JMP, TH_M_0,
+    TH_M_M_PLUS_1, TH_D_JNE, TH_M_D, TH_A_A_MINUS_1, TH_AM_M_PLUS_1, TH_A_M,
+    TH_D_A, TH_M_D_PLUS_M,
+    TH_AT_A_M_MINUS_1, TH_AT_AM_M_MINUS_1, TH_AT_JMP, TH_AT_M_M_PLUS_1,
+    TH_AT_D_JNE, TH_AT_AM_M_PLUS_1, TH_AT_A_M, TH_AT_M_D, TH_AT_D_M,
+    TH_AT_D_A,
+    TH_COUNT,
+};
+
+typedef struct {
+    uint16_t word;
+    uint8_t single; // handler for the instruction alone
+    uint8_t pair; // handler for '@X' followed by the instruction, or TH_C
+} Specialization;
+
+static const Specialization specializations[] = {
+    { 0xFCA0, TH_A_M_MINUS_1,  TH_AT_A_M_MINUS_1 },  // A=M-1
+    { 0xFC48, TH_M_NOT_M,      TH_C },               // M=!M
+    { 0xFC10, TH_D_M,          TH_AT_D_M },          // D=M
+    { 0xFCA8, TH_AM_M_MINUS_1, TH_AT_AM_M_MINUS_1 }, // AM=M-1
+    { 0xEA87, TH_JMP,          TH_AT_JMP },          // 0;JMP
+    { 0xEA88, TH_M_0,          TH_C },               // M=0
+    { 0xFDC8, TH_M_M_PLUS_1,   TH_AT_M_M_PLUS_1 },   // M=M+1
+    { 0xE305, TH_D_JNE,        TH_AT_D_JNE },        // D;JNE
+    { 0xE308, TH_M_D,          TH_AT_M_D },          // M=D
+    { 0xECA0, TH_A_A_MINUS_1,  TH_C },               // A=A-1
+    { 0xFDE8, TH_AM_M_PLUS_1,  TH_AT_AM_M_PLUS_1 },  // AM=M+1
+    { 0xFC20, TH_A_M,          TH_AT_A_M },          // A=M
+    { 0xEC10, TH_D_A,          TH_AT_D_A },          // D=A
+    { 0xF088, TH_M_D_PLUS_M,   TH_C },               // M=D+M
+};
+static const size_t specialization_count =
+    sizeof(specializations) / sizeof(Specialization);
+
+static const char *th_names[TH_COUNT] = {
+    "END", "HALT", "@", "C", "LOOP",
+    "A=M-1", "M=!M", "D=M", "AM=M-1", "0;JMP", "M=0",
+    "M=M+1", "D;JNE", "M=D", "A=A-1", "AM=M+1", "A=M",
+    "D=A", "M=D+M",
+    "@ A=M-1", "@ AM=M-1", "@ 0;JMP", "@ M=M+1",
+    "@ D;JNE", "@ AM=M+1", "@ A=M", "@ M=D", "@ D=M",
+    "@ D=A",
+};
+
+static const Specialization *find_specialization(uint16_t word)
+{
+    for (size_t i = 0; i < specialization_count; i++) {
+        if (specializations[i].word == word)
+            return specializations + i;
+    }
+    return NULL;
+}
+
+// Builds the threaded instruction stream from the decoded ROM
+// An '@X' is fused with the next instruction when a pair handler exists.
+// The next instruction keeps its own handler for jumps that land on it
+static void build_ops(Hack_CPU *cpu)
+{
+    cpu->ops = malloc((cpu->rom_size + 1) * sizeof(Threaded_Op));
+    for (size_t pc = 0; pc < cpu->rom_size; pc++) {
+        Decoded *in = cpu->code + pc;
+        Threaded_Op *op = cpu->ops + pc;
+        op->operand = in->value;
+
+        if (in->op == OP_HALT) {
+            op->handler = TH_HALT;
+        } else if (in->op == OP_A) {
+            op->handler = TH_A;
+            if (pc + 1 < cpu->rom_size && cpu->code[pc + 1].op != OP_HALT) {
+                const Specialization *s =
+                    find_specialization(cpu->rom[pc + 1]);
+                if (s && s->pair != TH_C)
+                    op->handler = s->pair;
+            }
+        } else {
+            const Specialization *s = find_specialization(cpu->rom[pc]);
+            op->handler = s ? s->single : TH_C;
+        }
+    }
+    cpu->ops[cpu->rom_size] = (Threaded_Op) { .handler = TH_END };
+
+    // Loop heads run the loop in bulk before their own handler
+    cpu->loops = idiom_find_loops(cpu->code, cpu->rom_size);
+    for (size_t pc = 0; pc < cpu->rom_size; pc++) {
+        if (cpu->loops[pc] != NULL) {
+            cpu->ops[pc].inner = cpu->ops[pc].handler;
+            cpu->ops[pc].handler = TH_LOOP;
+        }
+    }
+}
+
+#if defined(__GNUC__)
+#define HANDLER(h) case h: L_##h
+#define NEXT() do { \
+        if (cycles >= end) goto stop; \
+        goto *targets[pc]; \
+    } while (0)
+#else
+#define HANDLER(h) case h
+#define NEXT() goto dispatch
+#endif
+
+// Jumps past the end of ROM land on the TH_END sentinel
+#define JUMP(addr) do { \
+        pc = (addr) & 0x7FFF; \
+        if (pc > rom_size) pc = rom_size; \
+    } while (0)
+
+#define M ram[a & 0x7FFF]
+
+// Runs the threaded instruction stream. With GCC each handler jumps
+// straight to the next one through 'targets' (direct threading), other
+// compilers dispatch on the handler index with a switch
+// Returns at loop heads with 'at_loop' set, for the caller to run the loop
+// in bulk. Called again with it set, it starts with the head's own handler
+static enum EMU_STATUS run_threaded(Hack_CPU *cpu, uint64_t end,
+    int *at_loop)
+{
+    if (cpu->ops == NULL)
+        build_ops(cpu);
+
+    uint16_t *ram = cpu->ram;
+    Decoded *code = cpu->code;
+    Threaded_Op *ops = cpu->ops;
+    uint16_t rom_size = cpu->rom_size;
+    uint16_t a = cpu->a;
+    uint16_t d = cpu->d;
+    uint16_t pc = cpu->pc;
+    uint64_t cycles = cpu->cycles;
+    enum EMU_STATUS status = EMU_CYCLE_LIMIT;
+    uint16_t out, addr;
+    uint8_t handler;
+
+    if (pc > rom_size)
+        pc = rom_size;
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    static void *handlers[TH_COUNT] = {
+        &&L_TH_END, &&L_TH_HALT, &&L_TH_A, &&L_TH_C, &&L_TH_LOOP,
+        &&L_TH_A_M_MINUS_1, &&L_TH_M_NOT_M, &&L_TH_D_M, &&L_TH_AM_M_MINUS_1,
+        &&L_TH_JMP, &&L_TH_M_0, &&L_TH_M_M_PLUS_1, &&L_TH_D_JNE, &&L_TH_M_D,
+        &&L_TH_A_A_MINUS_1, &&L_TH_AM_M_PLUS_1, &&L_TH_A_M, &&L_TH_D_A,
+        &&L_TH_M_D_PLUS_M,
+        &&L_TH_AT_A_M_MINUS_1, &&L_TH_AT_AM_M_MINUS_1, &&L_TH_AT_JMP,
+        &&L_TH_AT_M_M_PLUS_1, &&L_TH_AT_D_JNE, &&L_TH_AT_AM_M_PLUS_1,
+        &&L_TH_AT_A_M, &&L_TH_AT_M_D, &&L_TH_AT_D_M, &&L_TH_AT_D_A,
+    };
+    if (cpu->targets == NULL) {
+        cpu->targets = malloc((rom_size + 1) * sizeof(void*));
+        for (size_t i = 0; i <= rom_size; i++)
+            cpu->targets[i] = handlers[ops[i].handler];
+    }
+    void **targets = cpu->targets;
+#endif
+
+    handler = ops[pc].handler;
+    if (*at_loop && handler == TH_LOOP)
+        handler = ops[pc].inner;
+    *at_loop = 0;
+#if !defined(__GNUC__)
+    goto run_handler;
+dispatch:
+    handler = ops[pc].handler;
+run_handler:
+#endif
+    if (cycles >= end)
+        goto stop;
+    switch (handler) {
+    HANDLER(TH_END):
+        status = EMU_OUT_OF_ROM;
+        goto stop;
+    HANDLER(TH_HALT):
+        status = EMU_HALTED;
+        goto stop;
+    HANDLER(TH_A):
+    single_a:
+        a = ops[pc].operand; pc++; cycles++;
+        NEXT();
+    HANDLER(TH_C): {
+        Decoded *in = code + pc;
+        out = compute(in->op, a, d, ram);
+        addr = a;
+        if (in->dest & 1) ram[addr & 0x7FFF] = out;
+        if (in->dest & 4) a = out;
+        if (in->dest & 2) d = out;
+        cycles++;
+        if (jump_taken(in->jump, out))
+            JUMP(addr);
+        else
+            pc++;
+        NEXT();
+    }
+    HANDLER(TH_LOOP):
+        // Calls made here would cost every handler registers, so the loop
+        // runs from run_threaded_loops instead
+        *at_loop = 1;
+        goto stop;
+
+    // Single instructions
+    HANDLER(TH_A_M_MINUS_1):   a = M - 1; pc++; cycles++; NEXT();
+    HANDLER(TH_M_NOT_M):       M = ~M; pc++; cycles++; NEXT();
+    HANDLER(TH_D_M):           d = M; pc++; cycles++; NEXT();
+    HANDLER(TH_AM_M_MINUS_1):  a = --M; pc++; cycles++; NEXT();
+    HANDLER(TH_JMP):           cycles++; JUMP(a); NEXT();
+    HANDLER(TH_M_0):           M = 0; pc++; cycles++; NEXT();
+    HANDLER(TH_M_M_PLUS_1):    M++; pc++; cycles++; NEXT();
+    HANDLER(TH_D_JNE):
+        cycles++;
+        if (d != 0)
+            JUMP(a);
+        else
+            pc++;
+        NEXT();
+    HANDLER(TH_M_D):           M = d; pc++; cycles++; NEXT();
+    HANDLER(TH_A_A_MINUS_1):   a--; pc++; cycles++; NEXT();
+    HANDLER(TH_AM_M_PLUS_1):   a = ++M; pc++; cycles++; NEXT();
+    HANDLER(TH_A_M):           a = M; pc++; cycles++; NEXT();
+    HANDLER(TH_D_A):           d = a; pc++; cycles++; NEXT();
+    HANDLER(TH_M_D_PLUS_M):    M = d + M; pc++; cycles++; NEXT();
+
+    // '@X' pairs, which fall back to a single '@X' at the cycle limit
+#define PAIR_PROLOGUE() \
+        if (end - cycles < 2) goto single_a; \
+        a = ops[pc].operand; cycles += 2
+    HANDLER(TH_AT_A_M_MINUS_1):
+        PAIR_PROLOGUE(); a = M - 1; pc += 2; NEXT();
+    HANDLER(TH_AT_AM_M_MINUS_1):
+        PAIR_PROLOGUE(); a = --M; pc += 2; NEXT();
+    HANDLER(TH_AT_JMP):
+        PAIR_PROLOGUE(); JUMP(a); NEXT();
+    HANDLER(TH_AT_M_M_PLUS_1):
+        PAIR_PROLOGUE(); M++; pc += 2; NEXT();
+    HANDLER(TH_AT_D_JNE):
+        PAIR_PROLOGUE();
+        if (d != 0)
+            JUMP(a);
+        else
+            pc += 2;
+        NEXT();
+    HANDLER(TH_AT_AM_M_PLUS_1):
+        PAIR_PROLOGUE(); a = ++M; pc += 2; NEXT();
+    HANDLER(TH_AT_A_M):
+        PAIR_PROLOGUE(); a = M; pc += 2; NEXT();
+    HANDLER(TH_AT_M_D):
+        PAIR_PROLOGUE(); M = d; pc += 2; NEXT();
+    HANDLER(TH_AT_D_M):
+        PAIR_PROLOGUE(); d = M; pc += 2; NEXT();
+    HANDLER(TH_AT_D_A):
+        PAIR_PROLOGUE(); d = a; pc += 2; NEXT();
+#undef PAIR_PROLOGUE
+    }
+
+stop:
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+    cpu->a = a;
+    cpu->d = d;
+    cpu->pc = pc;
+    cpu->cycles = cycles;
+    return status;
+}
+
+#undef M
+#undef JUMP
+#undef NEXT
+#undef HANDLER
+
+// Runs the threaded engine, running each loop it reaches in bulk
+static enum EMU_STATUS run_threaded_loops(Hack_CPU *cpu, uint64_t end)
+{
+    int at_loop = 0;
+    for (;;) {
+        enum EMU_STATUS status = run_threaded(cpu, end, &at_loop);
+        if (!at_loop)
+            return status;
+        idiom_run(cpu->loops[cpu->pc], cpu, end);
+    }
+}
+
+// Runs until the program halts, leaves ROM or 'max_cycles' cycles have run
+// Pass 0 as 'max_cycles' to run without limit
+// Counting executions (see emu_new) and tracking dirty screen rows always
+// use the switch engine
+enum EMU_STATUS emu_run(Hack_CPU *cpu, uint64_t max_cycles)
+{
+    uint64_t end = max_cycles ? cpu->cycles + max_cycles : UINT64_MAX;
+    if (cpu->counts || cpu->dirty_rows)
+        return run_switch(cpu, end);
+
+    switch (cpu->engine) {
+    case ENGINE_NAIVE:
+        return run_naive(cpu, end);
+    case ENGINE_SWITCH:
+        return run_switch(cpu, end);
+    case ENGINE_JIT:
+        if (cpu->jit == NULL)
+            cpu->jit = jit_new(cpu);
+        if (cpu->jit != NULL) {
+            // The JIT stops before a block that would pass 'end'
+            enum EMU_STATUS status = jit_run(cpu->jit, cpu, end);
+            if (status == EMU_CYCLE_LIMIT && cpu->cycles < end)
+                status = run_switch(cpu, end);
+            return status;
+        }
+        return run_threaded_loops(cpu, end);
+    default:
+        return run_threaded_loops(cpu, end);
+    }
+}
+
+// Runs until pc is 'stop', for at most 'max_cycles' cycles (no limit if 0).
+// Steps the switch engine a cycle at a time, as the others don't stop at
+// an address
+// Returns EMU_STOPPED once pc is 'stop', or why it stopped before
+enum EMU_STATUS emu_run_until(Hack_CPU *cpu, uint16_t stop,
+    uint64_t max_cycles)
+{
+    uint64_t end = max_cycles ? cpu->cycles + max_cycles : UINT64_MAX;
+    while (cpu->pc != stop) {
+        if (cpu->cycles >= end)
+            return EMU_CYCLE_LIMIT;
+        enum EMU_STATUS status = run_switch(cpu, cpu->cycles + 1);
+        if (status != EMU_CYCLE_LIMIT)
+            return status;
+    }
+    return EMU_STOPPED;
+}
+
+// Prints the threaded instruction stream, one ROM address per line
+void emu_print_ops(Hack_CPU *cpu)
+{
+    if (cpu->ops == NULL)
+        build_ops(cpu);
+
+    for (size_t pc = 0; pc <= cpu->rom_size; pc++) {
+        Threaded_Op *op = cpu->ops + pc;
+        uint8_t handler = op->handler == TH_LOOP ? op->inner : op->handler;
+        printf("%5li: %-10s", pc, th_names[handler]);
+        if (handler == TH_A || handler >= TH_AT_A_M_MINUS_1)
+            printf(" %u", op->operand);
+        if (op->handler == TH_LOOP)
+            printf(" (loop head)");
+        printf("\n");
+    }
+}
+
+typedef struct {
+    uint16_t word;
+    uint64_t count;
+} Word_Count;
+
+static int cmp_word_counts(const void *a, const void *b)
+{
+    uint64_t x = ((Word_Count*) a)->count;
+    uint64_t y = ((Word_Count*) b)->count;
+    return (x < y) - (x > y);
+}
+
+// Prints how many times each instruction was executed, most frequent first
+// A-instructions are counted together
+void emu_print_histogram(Hack_CPU *cpu)
+{
+    if (cpu->counts == NULL)
+        return;
+
+    uint64_t *by_word = calloc(HISTOGRAM_SIZE, sizeof(uint64_t));
+    uint64_t a_count = 0;
+    for (size_t pc = 0; pc < cpu->rom_size; pc++) {
+        if (cpu->rom[pc] & 0x8000)
+            by_word[cpu->rom[pc]] += cpu->counts[pc];
+        else
+            a_count += cpu->counts[pc];
+    }
+
+    Word_Count *wc = malloc((HISTOGRAM_SIZE / 2 + 1) * sizeof(Word_Count));
+    size_t n = 0;
+    if (a_count)
+        wc[n++] = (Word_Count) { .word = 0, .count = a_count };
+    for (size_t w = 0x8000; w < HISTOGRAM_SIZE; w++) {
+        if (by_word[w])
+            wc[n++] = (Word_Count) { .word = w, .count = by_word[w] };
+    }
+    qsort(wc, n, sizeof(Word_Count), cmp_word_counts);
+
+    uint64_t total = cpu->cycles ? cpu->cycles : 1;
+    char buf[32];
+    printf("instruction histogram:\n");
+    for (size_t i = 0; i < n; i++) {
+        if (wc[i].word & 0x8000)
+            format_word(wc[i].word, buf);
+        else
+            strcpy(buf, "@");
+        printf("  %-14s %12llu  %5.1f%%\n", buf,
+            (unsigned long long) wc[i].count, 100.0 * wc[i].count / total);
+    }
+
+    free(wc);
+    free(by_word);
+}
+
+// Writes the execution profile read by --layout (see layout.c)
+// Returns 0 on success, 1 on error
+int emu_write_profile(Hack_CPU *cpu, FILE *f)
+{
+    if (cpu->counts == NULL)
+        return 1;
+
+    fprintf(f, "hasm-profile 1\nsize %li\n", cpu->rom_size);
+    for (size_t pc = 0; pc < cpu->rom_size; pc++) {
+        if (cpu->counts[pc]) {
+            fprintf(f, "%li %llu %llu\n", pc,
+                (unsigned long long) cpu->counts[pc],
+                (unsigned long long) cpu->taken[pc]);
+        }
+    }
+    return ferror(f) != 0;
+}
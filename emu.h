@@ -0,0 +1,80 @@
+#ifndef EMU_H
+#define EMU_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "inst.h"
+
+#define ROM_SIZE      32768
+#define RAM_SIZE      32768
+#define SCREEN_ADDR   0x4000
+#define KBD_ADDR      0x6000
+#define SCREEN_ROWS   256
+#define ROW_WORDS     32 // 512 pixels, one per bit, least significant first
+#define OP_A          0x80
+#define OP_HALT       0x81
+
+// Why emu_run stopped
+enum EMU_STATUS {
+    EMU_HALTED, // reached an '@X', '0;JMP' loop at X
+    EMU_CYCLE_LIMIT,
+    EMU_OUT_OF_ROM, // pc ran past the last instruction
+    EMU_STOPPED, // reached the address given to emu_run_until
+};
+
+enum EMU_ENGINE {
+    ENGINE_THREADED = 0,
+    ENGINE_SWITCH,
+    ENGINE_NAIVE,
+    ENGINE_JIT,
+};
+
+// Pre-decoded instruction
+typedef struct {
+    uint8_t op; // 7-bit comp code (a-bit included), or OP_A, OP_HALT
+    uint8_t dest;
+    uint8_t jump;
+    uint16_t value; // value loaded by A-instructions
+} Decoded;
+
+// Threaded code instruction: handler index and its operand
+typedef struct {
+    uint8_t handler;
+    uint8_t inner; // handler a loop head runs after the loop's bulk run
+    uint16_t operand;
+} Threaded_Op;
+
+typedef struct {
+    uint16_t ram[RAM_SIZE];
+    uint16_t a;
+    uint16_t d;
+    uint16_t pc;
+    uint64_t cycles;
+    uint16_t *rom;
+    size_t rom_size;
+    Decoded *code;
+    Threaded_Op *ops; // built by the threaded engine on first run
+    void **targets; // handler address of each op, built with 'ops'
+    struct Loop_Idiom **loops; // loop at each head, built with 'ops'
+    struct Jit *jit; // built by the JIT engine on first run
+    FILE *perf_map; // the JIT lists its blocks here for perf, if not NULL
+    Str_Int_Pair *labels; // names of ROM addresses in 'perf_map'
+    size_t label_count;
+    enum EMU_ENGINE engine;
+    uint64_t *counts; // executions per ROM address, NULL if not counted
+    uint64_t *taken; // taken jumps per ROM address, counted with 'counts'
+    struct Profiler *profiler; // follows calls while counting, if not NULL
+    uint32_t *dirty_rows; // bit per screen row, set on stores, if not NULL
+} Hack_CPU;
+
+Hack_CPU *emu_new(uint16_t *rom, size_t rom_size, int count_instructions);
+void emu_free(Hack_CPU *cpu);
+enum EMU_STATUS emu_run(Hack_CPU *cpu, uint64_t max_cycles);
+enum EMU_STATUS emu_run_until(Hack_CPU *cpu, uint16_t stop,
+    uint64_t max_cycles);
+void emu_print_histogram(Hack_CPU *cpu);
+void emu_print_ops(Hack_CPU *cpu);
+int emu_write_profile(Hack_CPU *cpu, FILE *f);
+
+#endif // EMU_H
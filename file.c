@@ -21,6 +21,7 @@ char* load_file(char* file_path, size_t* size)
     struct stat st;
     if (fstat(fd, &st) == -1) {
         printf("fstat failed\n");
+        close(fd);
         return 0;
     }
 
@@ -34,10 +35,12 @@ char* load_file(char* file_path, size_t* size)
     size_t bytes_read = read(fd, buf, READ_BUF_SIZE);
     if (bytes_read == 0) {
         printf("File %s empty\n", file_path);
+        close(fd);
         return 0;
     }
     if (bytes_read < 0) {
         printf("Couldn't read %s\n", file_path);
+        close(fd);
         return 0;
     }
 
@@ -52,6 +55,7 @@ char* load_file(char* file_path, size_t* size)
         bytes_read = read(fd, buf, READ_BUF_SIZE);
     } while(bytes_read > 0);
     file_string[file_size] = '\0';
+    close(fd);
 
     return file_string;
 }
@@ -65,14 +69,19 @@ int write_file(char *buf, char *path, size_t size)
         return 1;
     }
 
-    fwrite(buf, 1, size, fp);
+    size_t written = fwrite(buf, 1, size, fp);
 
     int err = ferror(fp);
-    if (err) {
+    if (err || written != size) {
         printf("I/O error %i when writing to file '%s'\n", err, path);
+        fclose(fp);
         return 1;
     }
 
-    fclose(fp);
+    // Buffered data is only flushed here, so a full disk shows up now
+    if (fclose(fp) != 0) {
+        printf("I/O error when closing file '%s'\n", path);
+        return 1;
+    }
     return 0;
 }
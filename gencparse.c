@@ -0,0 +1,244 @@
+/*
+ gencparse - generates cparse.h, the tables of the C-instruction parser
+
+ Usage: gencparse > cparse.h
+
+ Every valid C-instruction, written without blanks and in upper case, goes
+ into a trie built from the code tables in inst.c. The trie is minimized
+ into a DFA over character classes.
+
+ Each state carries the values the parser picks up on the way:
+     dest    taken when '=' is read in this state
+     comp    taken when ';' is read, or at the end if no ';' was read
+     jump    taken at the end
+ Since dest and comp are picked up by the parser rather than remembered by
+ the states, everything after '=' and after ';' is shared by all paths.
+
+ Blanks are skipped everywhere except inside jump mnemonics. 'a', 'm' and
+ 'd' are read as 'A', 'M' and 'D'.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inst.h"
+
+#define MAX_NODES                          65536
+#define MAX_INST_SIZE                      16
+#define CLASS_CHARS                        "AMD01-+!&|=;JGTEQLNP"
+#define CLASS_COUNT                        (2 + sizeof(CLASS_CHARS) - 1)
+#define CLASS_OTHER                        0
+#define CLASS_BLANK                        1
+#define NONE                               -1
+
+typedef struct {
+    int next[CLASS_COUNT];
+    int accept;
+    int dest; // NONE if '=' can't follow
+    int comp; // NONE if ';' or the end can't follow
+    int jump; // NONE if not accepting
+    int in_jump; // inside a jump mnemonic, where blanks aren't allowed
+} Node;
+
+Node nodes[MAX_NODES];
+int node_count = 0;
+
+int class_of(char c)
+{
+    char *p = strchr(CLASS_CHARS, c);
+    return (c != '\0' && p) ? 2 + (p - CLASS_CHARS) : CLASS_OTHER;
+}
+
+int new_node(void)
+{
+    if (node_count >= MAX_NODES) {
+        fprintf(stderr, "gencparse: too many trie nodes\n");
+        exit(1);
+    }
+    Node *n = nodes + node_count;
+    memset(n, 0, sizeof(Node));
+    n->dest = NONE;
+    n->comp = NONE;
+    n->jump = NONE;
+    return node_count++;
+}
+
+void set_value(int *field, int value, char *inst)
+{
+    if (*field != NONE && *field != value) {
+        fprintf(stderr, "gencparse: '%s' is ambiguous\n", inst);
+        exit(1);
+    }
+    *field = value;
+}
+
+// Adds 'inst' to the trie. 'jump_start' is the index of its jump mnemonic
+void add(char *inst, int dest, int comp, int jump, int jump_start)
+{
+    int n = 1;
+    int has_semicolon = strchr(inst, ';') != NULL;
+    for (int i = 0; inst[i]; i++) {
+        if (inst[i] == '=')
+            set_value(&nodes[n].dest, dest, inst);
+        if (inst[i] == ';')
+            set_value(&nodes[n].comp, comp, inst);
+
+        int c = class_of(inst[i]);
+        if (nodes[n].next[c] == 0) {
+            int m = new_node();
+            nodes[n].next[c] = m;
+        }
+        n = nodes[n].next[c];
+        if (jump_start >= 0 && i >= jump_start && inst[i + 1] != '\0')
+            nodes[n].in_jump = 1;
+    }
+
+    nodes[n].accept = 1;
+    set_value(&nodes[n].jump, jump, inst);
+    if (!has_semicolon)
+        set_value(&nodes[n].comp, comp, inst);
+}
+
+// Adds every spelling of 'dest=' followed by each tail
+void add_tails(char *prefix, int dest)
+{
+    char inst[MAX_INST_SIZE];
+    int len = strlen(prefix);
+    for (size_t c = 1; c < comp_code_count; c++) {
+        char *comp = comp_codes[c].str;
+        snprintf(inst, sizeof(inst), "%s%s", prefix, comp);
+        add(inst, dest, comp_codes[c].code, JUMP_NULL, -1);
+        for (size_t j = 1; j < jump_code_count; j++) {
+            snprintf(inst, sizeof(inst), "%s%s;%s", prefix, comp,
+                jump_codes[j].str);
+            add(inst, dest, comp_codes[c].code, jump_codes[j].code,
+                len + strlen(comp) + 1);
+        }
+    }
+    for (size_t j = 1; j < jump_code_count; j++) {
+        snprintf(inst, sizeof(inst), "%s;%s", prefix, jump_codes[j].str);
+        add(inst, dest, COMP_NULL, jump_codes[j].code, len + 1);
+        snprintf(inst, sizeof(inst), "%s%s", prefix, jump_codes[j].str);
+        add(inst, dest, COMP_NULL, jump_codes[j].code, len);
+    }
+}
+
+// Adds 'letters' in every order as a dest
+void add_dest_orders(char *letters, int len, int k, int dest)
+{
+    if (k == len) {
+        char prefix[MAX_INST_SIZE];
+        snprintf(prefix, sizeof(prefix), "%s=", letters);
+        add_tails(prefix, dest);
+        return;
+    }
+    for (int i = k; i < len; i++) {
+        char t = letters[k];
+        letters[k] = letters[i];
+        letters[i] = t;
+        add_dest_orders(letters, len, k + 1, dest);
+        letters[i] = letters[k];
+        letters[k] = t;
+    }
+}
+
+// Returns 1 if states 'a' and 'b' behave the same. Children must already
+// be replaced by their representatives
+int same_state(Node *a, Node *b)
+{
+    return a->accept == b->accept && a->dest == b->dest &&
+        a->comp == b->comp && a->jump == b->jump &&
+        a->in_jump == b->in_jump &&
+        memcmp(a->next, b->next, sizeof(a->next)) == 0;
+}
+
+int main(void)
+{
+    // Node 0 is the reject state, node 1 the start
+    new_node();
+    new_node();
+
+    add_tails("", DEST_NULL);
+    add_tails("=", DEST_NULL);
+    for (size_t d = 1; d < dest_code_count; d++) {
+        char letters[MAX_INST_SIZE];
+        snprintf(letters, sizeof(letters), "%s", dest_codes[d].str);
+        add_dest_orders(letters, strlen(letters), 0, dest_codes[d].code);
+    }
+
+    // Children are created after their parents, so walking backwards
+    // visits them first. 'rep' maps a node to its state
+    int *rep = malloc(node_count * sizeof(int));
+    int *states = malloc(node_count * sizeof(int));
+    int state_count = 0;
+    for (int n = node_count - 1; n >= 0; n--) {
+        for (size_t c = 0; c < CLASS_COUNT; c++)
+            nodes[n].next[c] = rep[nodes[n].next[c]];
+        if (n == 0) {
+            rep[n] = 0;
+            continue;
+        }
+
+        int s = 0;
+        for (; s < state_count; s++) {
+            if (same_state(nodes + states[s], nodes + n))
+                break;
+        }
+        if (s == state_count)
+            states[state_count++] = n;
+        rep[n] = s + 1;
+    }
+
+    // State 0 rejects. The rest are numbered by 'states' + 1
+    int total = state_count + 1;
+    char *type = total <= 256 ? "uint8_t" : "uint16_t";
+    printf("// Generated by gencparse from the code tables in inst.c\n");
+    printf("#ifndef CPARSE_H\n#define CPARSE_H\n\n#include <stdint.h>\n\n");
+    printf("#define CPARSE_REJECT 0\n");
+    printf("#define CPARSE_START %i\n", rep[1]);
+    printf("#define CPARSE_CLASS_EQ %i\n", class_of('='));
+    printf("#define CPARSE_CLASS_SEMICOLON %i\n\n", class_of(';'));
+
+    printf("static const uint8_t cparse_class[256] = {");
+    for (int ch = 0; ch < 256; ch++) {
+        int c = class_of(ch);
+        if (ch == ' ' || ch == '\t')
+            c = CLASS_BLANK;
+        else if (ch == 'a' || ch == 'm' || ch == 'd')
+            c = class_of(ch - 'a' + 'A');
+        printf("%s%i,", ch % 16 ? " " : "\n    ", c);
+    }
+    printf("\n};\n\n");
+
+    printf("static const %s cparse_next[%i][%i] = {\n", type, total,
+        (int) CLASS_COUNT);
+    for (int s = 0; s < total; s++) {
+        Node *n = s ? nodes + states[s - 1] : nodes;
+        printf("    {");
+        for (size_t c = 0; c < CLASS_COUNT; c++) {
+            int next = n->next[c];
+            if (c == CLASS_BLANK && s != 0 && !n->in_jump)
+                next = s;
+            printf("%s%i", c ? ", " : "", next);
+        }
+        printf("},\n");
+    }
+    printf("};\n\n");
+
+    char *names[] = { "accept", "dest", "comp", "jump" };
+    for (int f = 0; f < 4; f++) {
+        printf("static const uint8_t cparse_%s[%i] = {", names[f], total);
+        for (int s = 0; s < total; s++) {
+            Node *n = s ? nodes + states[s - 1] : nodes;
+            int v = f == 0 ? n->accept : f == 1 ? n->dest :
+                f == 2 ? n->comp : n->jump;
+            printf("%s%i,", s % 16 ? " " : "\n    ", v == NONE ? 0 : v);
+        }
+        printf("\n};\n\n");
+    }
+
+    printf("#endif // CPARSE_H\n");
+    free(rep);
+    free(states);
+    return 0;
+}
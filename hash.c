@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+#define HASH_MIN_CAPACITY 16
+
+// FNV-1a
+static uint32_t hash_str(char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; s++) {
+        h ^= (unsigned char) *s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Returns the slot holding 'key', or the empty slot where it would go
+static Str_Int_Pair *find_slot(Str_Int_Pair *entries, size_t capacity,
+    char *key)
+{
+    size_t i = hash_str(key) & (capacity - 1);
+    while (entries[i].p0 != NULL && strcmp(entries[i].p0, key) != 0)
+        i = (i + 1) & (capacity - 1);
+    return entries + i;
+}
+
+// Sizes the map so 'expected_count' keys fit without growing
+void hash_init(Hash_Map *map, size_t expected_count)
+{
+    size_t capacity = HASH_MIN_CAPACITY;
+    while (capacity < expected_count * 2)
+        capacity *= 2;
+    map->entries = calloc(capacity, sizeof(Str_Int_Pair));
+    map->capacity = capacity;
+    map->count = 0;
+}
+
+void hash_free(Hash_Map *map)
+{
+    for (size_t i = 0; i < map->capacity; i++)
+        free(map->entries[i].p0);
+    free(map->entries);
+    map->entries = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+// Returns pair if found. Returns NULL otherwise
+Str_Int_Pair *hash_get(Hash_Map *map, char *key)
+{
+    Str_Int_Pair *p = find_slot(map->entries, map->capacity, key);
+    return p->p0 ? p : NULL;
+}
+
+// Inserts 'key' or updates its value. Keeps the load factor under 1/2
+// Returns the pair
+Str_Int_Pair *hash_put(Hash_Map *map, char *key, int value)
+{
+    Str_Int_Pair *p = find_slot(map->entries, map->capacity, key);
+    if (p->p0) {
+        p->p1 = value;
+        return p;
+    }
+
+    if ((map->count + 1) * 2 > map->capacity) {
+        size_t capacity = map->capacity * 2;
+        Str_Int_Pair *entries = calloc(capacity, sizeof(Str_Int_Pair));
+        for (size_t i = 0; i < map->capacity; i++) {
+            Str_Int_Pair *e = map->entries + i;
+            if (e->p0)
+                *find_slot(entries, capacity, e->p0) = *e;
+        }
+        free(map->entries);
+        map->entries = entries;
+        map->capacity = capacity;
+        p = find_slot(entries, capacity, key);
+    }
+
+    p->p0 = malloc(strlen(key) + 1);
+    strcpy(p->p0, key);
+    p->p1 = value;
+    map->count++;
+    return p;
+}
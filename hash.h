@@ -0,0 +1,19 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include "inst.h"
+
+// String -> int map with open addressing. Keys are copied
+typedef struct {
+    Str_Int_Pair *entries; // p0 is NULL for empty slots
+    size_t capacity; // power of two
+    size_t count;
+} Hash_Map;
+
+void hash_init(Hash_Map *map, size_t expected_count);
+void hash_free(Hash_Map *map);
+Str_Int_Pair *hash_get(Hash_Map *map, char *key);
+Str_Int_Pair *hash_put(Hash_Map *map, char *key, int value);
+
+#endif // HASH_H
@@ -1,30 +1,119 @@
 /*
  hasm - hack (virtual computer) assembler
 
- Usage: hasm infile [-o outfile]
+ Usage: hasm [-O] [--dce] [--dataflow[=stats]] [--icf] [--outline[=n]]
+             [--layout profile] [--pack] [--emit=c|asm] [--map file]
+             [--run [emulator options]] infile [-o outfile]
+        hasm [options] file.vm... [-o outfile]
+        hasm [-O] [--icf] -c infile [-o outfile]
+        hasm --link objfile... [--emit=c] [--run [emulator options]]
+             [-o outfile]
+        hasm -d [--map file] infile.hack [-o outfile]
  Assembles `infile` and creates an ASCII-encoded hack binary `infile.hack`.
+ `infile` can be VM code if its name ends with `.vm`. Several .vm files
+ make up one program, each with its own static variables, named after the
+ first file.
 
  Options:
      -o outfile      specify output file
+     -O              run peephole optimizer
+     --dce           remove unreachable code and unreferenced labels
+     --dataflow      remove loads of values A and D already hold and fold
+                     computations on known values. With =stats, print the
+                     instructions and estimated cycles saved
+     --icf           merge identical code ending in a jump
+     --outline[=n]   replace repeated code with calls to one copy, when
+                     each call saves at least n words (default 4)
+     --layout file   reorder basic blocks by a --profile
+     --pack          let variables that are never live at the same time
+                     share RAM
+     --emit=c        write a C program that runs the code (`infile.c`)
+     --emit=asm      write the code as .asm before resolving symbols
+     --map file      write the address of each label to `file`
+     -d              disassemble an ASCII or binary .hack into
+                     `infile.dis.asm`, with the labels of a --map file
+     -c              write a relocatable object (`infile.o`)
+     --link          link objects instead of assembling
+     --batch         assemble each infile to its own `.hack`, overlapping
+                     file reads and writes with assembly
+     --io=backend    I/O for --batch: uring (default), threads or sync
+     --run           run assembled program in the emulator
+
+ Emulator options:
+     --max-cycles n  stop after n cycles
+     --set addr=val  set RAM[addr] before running
+     --dump addr[:n] print n words of RAM after running
+     --hist          print instruction histogram
+     --profile file  write per-instruction and taken jump counts
+     --flat-profile  print cycles spent under each label
+     --folded-stacks file
+                     write cycles per VM call stack, for flame graphs
+     --engine name   naive, switch, threaded (default) or jit (x86-64 Linux)
+     --perf-map[=file]
+                     list JIT-compiled code by label for perf, in
+                     /tmp/perf-<pid>.map unless a file is given
+     --ops           print the threaded instruction stream
+     --lockstep file run an instance for each line of `file`, which holds
+                     its addr=val RAM settings, side by side in vector lanes
+     --lanes n       instances run side by side by --lockstep (1 to 16)
+     --save-snapshot file
+                     run until the address of --snapshot-at and save the
+                     machine state there to `file`
+     --snapshot-at label
+                     label or ROM address --save-snapshot stops at
+     --snapshot file resume from a saved state instead of starting anew
+     --screen name   share SCREEN and KBD with a viewer as the POSIX shared
+                     memory object `name`, marking the rows written each frame
+     --ppm-frames prefix
+                     write the screen of each frame that changed to
+                     `prefix`000042.ppm
+     --frame-cycles n
+                     cycles per frame of --screen and --ppm-frames
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "batch.h"
+#include "cparse.h"
+#include "dataflow.h"
+#include "disasm.h"
 #include "file.h"
+#include "hash.h"
+#include "emitc.h"
+#include "emu.h"
+#include "inst.h"
+#include "jit.h"
+#include "lanes.h"
+#include "layout.h"
+#include "link.h"
+#include "opt.h"
+#include "outline.h"
+#include "pack.h"
+#include "prof.h"
+#include "screen.h"
+#include "snapshot.h"
+#include "vm.h"
 
 #define MIN_ARGC                           2
-#define MAX_ARGC                           4
 #define ERR_TEXT_SIZE                      200
 #define FILE_PATH_SIZE                     200
 #define SYMBOL_TABLE_INITIAL_SIZE          100
-#define MAX_COMP_TOKEN_COUNT               3
 #define LOG_PARSER_OUTPUT                  0
 #define LOG_GENERATOR_OUTPUT               0
 #define INST_ARRAY_STARTING_CAPACITY       1024
 #define INST_ARRAY_CAPACITY_GROWTH_RATE    1024
-#define SYMBOL_PAIRS_SIZE                  4096
+#define SYMBOL_PAIRS_SIZE                  0x8000
+#define PREDEFINED_SYMBOL_COUNT            23
+#define MAX_RAM_ARGS                       16
+#define DEFAULT_FRAME_CYCLES               100000
+#define MAX_A_VALUE                        0x7FFF
+#define VARIABLE_BASE                      16
+#define VARIABLE_LIMIT                     0x4000 // SCREEN
+#define MAX_EXPR_VALUE                     0x7FFFFFFFL
 
 // Blankspace is ' ' or '\t'
 int is_blank(char c)
@@ -192,20 +281,6 @@ size_t find_next_any_index(char *str, size_t i, char *c)
     return find_next_any(str + i, c) - str;
 }
 
-// Find first char 'c' between 'start' and 'end' (both inclusive)
-// and return pointer to it.
-// Return NULL if not found
-char *strchr_range(char *start, char *end, char c)
-{
-    while (start <= end) {
-        if (*start == c)
-            return start;
-        start++;
-    }
-
-    return NULL;
-}
-
 // Print string from 'start' and 'end' inclusive
 void print_str_range(char *start, char* end)
 {
@@ -251,8 +326,11 @@ int str_replace_last(char *str, char *sub, char *rep)
         return 1;
     }
 
-    while (*rep)
-        str[index++] = *rep++;
+    size_t sub_len = strlen(sub);
+    size_t rep_len = strlen(rep);
+    char *tail = str + index + sub_len;
+    memmove(str + index + rep_len, tail, strlen(tail) + 1);
+    memcpy(str + index, rep, rep_len);
 
     return 0;
 }
@@ -268,25 +346,389 @@ size_t copy_str_no_nullterm(char *dest, char *src)
     return dest - dest_start;
 }
 
-// Sets input_file, output_file, and error_text
+// RAM address with a value (--set) or a word count (--dump)
+typedef struct {
+    unsigned int addr;
+    int n;
+} Ram_Arg;
+
+// Command line options
+typedef struct {
+    char input_file[FILE_PATH_SIZE];
+    char output_file[FILE_PATH_SIZE];
+    int output_given; // -o
+    int optimize; // -O
+    int dce; // --dce
+    int dataflow; // --dataflow
+    int dataflow_stats; // --dataflow=stats
+    int icf; // --icf
+    size_t outline; // --outline minimum saving, 0 if not given
+    int pack; // --pack
+    char layout_file[FILE_PATH_SIZE]; // --layout, empty if not given
+    int emit_c; // --emit=c
+    int emit_asm; // --emit=asm
+    char map_file[FILE_PATH_SIZE]; // --map, empty if not given
+    int disassemble; // -d
+    int vm_input; // input_file ends with .vm
+    int compile; // -c
+    int link; // --link
+    int batch; // --batch
+    enum BATCH_IO io; // --io
+    char **input_files; // all input files
+    size_t input_count;
+    int run; // --run
+    int histogram; // --hist
+    char profile_file[FILE_PATH_SIZE]; // --profile, empty if not given
+    int flat_profile; // --flat-profile
+    char folded_file[FILE_PATH_SIZE]; // --folded-stacks, empty if not given
+    int print_ops; // --ops
+    enum EMU_ENGINE engine; // --engine
+    char perf_map_file[FILE_PATH_SIZE]; // --perf-map, empty if not given
+    char lockstep_file[FILE_PATH_SIZE]; // --lockstep, empty if not given
+    size_t lanes; // --lanes
+    char snapshot_file[FILE_PATH_SIZE]; // --snapshot, empty if not given
+    char save_snapshot_file[FILE_PATH_SIZE]; // --save-snapshot, or empty
+    char snapshot_at[FILE_PATH_SIZE]; // --snapshot-at, empty if not given
+    char screen_name[FILE_PATH_SIZE]; // --screen, empty if not given
+    char ppm_prefix[FILE_PATH_SIZE]; // --ppm-frames, empty if not given
+    uint64_t frame_cycles; // --frame-cycles
+    unsigned long long max_cycles; // --max-cycles
+    Ram_Arg sets[MAX_RAM_ARGS]; // --set
+    size_t set_count;
+    Ram_Arg dumps[MAX_RAM_ARGS]; // --dump
+    size_t dump_count;
+} Options;
+
+// Parses 'ADDR<sep>N' into 'arg'. 'N' defaults to 'default_n' if missing
 // Returns 0 on success, 1 on error
-int parse_arguments(int argc, char* argv[],
-    char *input_file, char *output_file, char *error_text)
+int parse_ram_arg(char *str, char sep, int default_n, Ram_Arg *arg)
 {
-    if (argc > MAX_ARGC) {
-        strcpy(error_text, "error: too many arguments");
+    char *end;
+    long addr = strtol(str, &end, 0);
+    if (end == str || addr < 0 || addr >= RAM_SIZE)
         return 1;
+    arg->addr = addr;
+    arg->n = default_n;
+
+    if (*end == '\0')
+        return default_n < 0;
+    if (*end != sep)
+        return 1;
+
+    str = end + 1;
+    long n = strtol(str, &end, 0);
+    if (end == str || *end != '\0' || n < -32768 || n > 65535)
+        return 1;
+    arg->n = n;
+    return 0;
+}
+
+// Returns whether 'path' names a .vm file
+int is_vm_file(char *path)
+{
+    size_t len = strlen(path);
+    return len > 3 && strcmp(path + len - 3, ".vm") == 0;
+}
+
+// Sets input_file, vm_input and, unless -o was given, the default
+// output_file of 'opts'
+void set_input_file(Options *opts, char *input_file)
+{
+    if (input_file != opts->input_file)
+        snprintf(opts->input_file, FILE_PATH_SIZE, "%s", input_file);
+
+    opts->vm_input = !opts->link && !opts->disassemble &&
+        is_vm_file(input_file);
+
+    if (!opts->output_given) {
+        char *output_file = opts->output_file;
+        char *ext = opts->compile ? ".o" : opts->emit_c ? ".c" :
+            opts->emit_asm ? ".asm" : opts->disassemble ? ".dis.asm" :
+            ".hack";
+        char *input_ext = opts->link ? ".o" : opts->vm_input ? ".vm" :
+            opts->disassemble ? ".hack" : ".asm";
+        snprintf(output_file, FILE_PATH_SIZE, "%s", input_file);
+        int err = str_replace_last(output_file, input_ext, ext);
+        if (err != 0) { // input_file doesn't end with .asm
+            strncat(output_file, ext,
+                FILE_PATH_SIZE - strlen(output_file));
+        }
     }
+}
 
+// Sets opts and error_text
+// Returns 0 on success, 1 on error
+int parse_arguments(int argc, char* argv[], Options *opts, char *error_text)
+{
     if (argc < MIN_ARGC) {
         strcpy(error_text, "error: input file not given");
         return 1;
     }
 
+    char *input_file = opts->input_file;
+    char *output_file = opts->output_file;
     *input_file = 0;
     *output_file = 0;
+    opts->output_given = 0;
+    opts->optimize = 0;
+    opts->dce = 0;
+    opts->dataflow = 0;
+    opts->dataflow_stats = 0;
+    opts->icf = 0;
+    opts->outline = 0;
+    opts->pack = 0;
+    *opts->layout_file = 0;
+    opts->emit_c = 0;
+    opts->emit_asm = 0;
+    *opts->map_file = 0;
+    opts->disassemble = 0;
+    opts->compile = 0;
+    opts->link = 0;
+    opts->batch = 0;
+    opts->io = IO_URING;
+    opts->input_files = malloc(argc * sizeof(char*));
+    opts->input_count = 0;
+    opts->run = 0;
+    opts->histogram = 0;
+    *opts->profile_file = 0;
+    opts->flat_profile = 0;
+    *opts->folded_file = 0;
+    opts->print_ops = 0;
+    opts->engine = ENGINE_THREADED;
+    *opts->perf_map_file = 0;
+    *opts->lockstep_file = 0;
+    opts->lanes = LANE_COUNT;
+    *opts->snapshot_file = 0;
+    *opts->save_snapshot_file = 0;
+    *opts->snapshot_at = 0;
+    *opts->screen_name = 0;
+    *opts->ppm_prefix = 0;
+    opts->frame_cycles = DEFAULT_FRAME_CYCLES;
+    opts->max_cycles = 0;
+    opts->set_count = 0;
+    opts->dump_count = 0;
 
     for (int i = 1; i < argc; i++) {
+        // Handle -O switch
+        if (strcmp(argv[i], "-O") == 0) {
+            opts->optimize = 1;
+            continue;
+        }
+
+        // Handle --dce switch
+        if (strcmp(argv[i], "--dce") == 0) {
+            opts->dce = 1;
+            continue;
+        }
+
+        // Handle --dataflow and --dataflow=stats
+        if (strcmp(argv[i], "--dataflow") == 0 ||
+            strcmp(argv[i], "--dataflow=stats") == 0) {
+            opts->dataflow = 1;
+            opts->dataflow_stats = argv[i][10] == '=';
+            continue;
+        }
+
+        // Handle --icf switch
+        if (strcmp(argv[i], "--icf") == 0) {
+            opts->icf = 1;
+            continue;
+        }
+
+        // Handle --outline and --outline=n
+        if (strcmp(argv[i], "--outline") == 0) {
+            opts->outline = OUTLINE_MIN_SAVING;
+            continue;
+        }
+        if (strncmp(argv[i], "--outline=", 10) == 0) {
+            char *end;
+            long n = strtol(argv[i] + 10, &end, 10);
+            if (*end != '\0' || end == argv[i] + 10 || n < 1) {
+                snprintf(error_text, ERR_TEXT_SIZE,
+                    "error: --outline needs a positive number, got '%s'",
+                    argv[i] + 10);
+                return 1;
+            }
+            opts->outline = n;
+            continue;
+        }
+
+        // Handle --pack switch
+        if (strcmp(argv[i], "--pack") == 0) {
+            opts->pack = 1;
+            continue;
+        }
+
+        // Handle -c, -d and --link switches
+        if (strcmp(argv[i], "-c") == 0) {
+            opts->compile = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-d") == 0) {
+            opts->disassemble = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--link") == 0) {
+            opts->link = 1;
+            continue;
+        }
+
+        // Handle --batch and --io=backend
+        if (strcmp(argv[i], "--batch") == 0) {
+            opts->batch = 1;
+            continue;
+        }
+        if (strncmp(argv[i], "--io=", 5) == 0) {
+            if (strcmp(argv[i] + 5, "uring") == 0) {
+                opts->io = IO_URING;
+            } else if (strcmp(argv[i] + 5, "threads") == 0) {
+                opts->io = IO_THREADS;
+            } else if (strcmp(argv[i] + 5, "sync") == 0) {
+                opts->io = IO_SYNC;
+            } else {
+                snprintf(error_text, ERR_TEXT_SIZE,
+                    "error: unknown I/O backend '%s'", argv[i] + 5);
+                return 1;
+            }
+            continue;
+        }
+
+        // Handle --emit=format
+        if (strncmp(argv[i], "--emit=", 7) == 0) {
+            opts->emit_c = 0;
+            opts->emit_asm = 0;
+            if (strcmp(argv[i] + 7, "c") == 0) {
+                opts->emit_c = 1;
+            } else if (strcmp(argv[i] + 7, "asm") == 0) {
+                opts->emit_asm = 1;
+            } else if (strcmp(argv[i] + 7, "hack") == 0) {
+            } else {
+                snprintf(error_text, ERR_TEXT_SIZE,
+                    "error: unknown output format '%s'", argv[i] + 7);
+                return 1;
+            }
+            continue;
+        }
+
+        // Handle emulator switches
+        if (strcmp(argv[i], "--run") == 0) {
+            opts->run = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--hist") == 0) {
+            opts->histogram = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--flat-profile") == 0) {
+            opts->flat_profile = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--ops") == 0) {
+            opts->print_ops = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--perf-map") == 0) {
+            snprintf(opts->perf_map_file, FILE_PATH_SIZE, "/tmp/perf-%i.map",
+                (int) getpid());
+            continue;
+        }
+        if (strncmp(argv[i], "--perf-map=", 11) == 0) {
+            snprintf(opts->perf_map_file, FILE_PATH_SIZE, "%s", argv[i] + 11);
+            continue;
+        }
+        if (strcmp(argv[i], "--snapshot") == 0 ||
+            strcmp(argv[i], "--save-snapshot") == 0 ||
+            strcmp(argv[i], "--snapshot-at") == 0) {
+            if (i + 1 >= argc) {
+                snprintf(error_text, ERR_TEXT_SIZE,
+                    "error: expected value after '%s'", argv[i]);
+                return 1;
+            }
+            char *dst = strcmp(argv[i], "--snapshot") == 0 ?
+                opts->snapshot_file : strcmp(argv[i], "--snapshot-at") == 0 ?
+                opts->snapshot_at : opts->save_snapshot_file;
+            snprintf(dst, FILE_PATH_SIZE, "%s", argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "--max-cycles") == 0 ||
+            strcmp(argv[i], "--set") == 0 ||
+            strcmp(argv[i], "--dump") == 0 ||
+            strcmp(argv[i], "--engine") == 0 ||
+            strcmp(argv[i], "--profile") == 0 ||
+            strcmp(argv[i], "--folded-stacks") == 0 ||
+            strcmp(argv[i], "--layout") == 0 ||
+            strcmp(argv[i], "--lockstep") == 0 ||
+            strcmp(argv[i], "--lanes") == 0 ||
+            strcmp(argv[i], "--map") == 0 ||
+            strcmp(argv[i], "--screen") == 0 ||
+            strcmp(argv[i], "--ppm-frames") == 0 ||
+            strcmp(argv[i], "--frame-cycles") == 0) {
+            if (i + 1 >= argc) {
+                snprintf(error_text, ERR_TEXT_SIZE,
+                    "error: expected value after '%s'", argv[i]);
+                return 1;
+            }
+
+            int bad = 0;
+            char *value = argv[i + 1];
+            char *opt = argv[i];
+            if (strcmp(opt, "--max-cycles") == 0) {
+                char *end;
+                opts->max_cycles = strtoull(value, &end, 0);
+                bad = end == value || *end != '\0';
+            } else if (strcmp(opt, "--engine") == 0) {
+                if (strcmp(value, "naive") == 0)
+                    opts->engine = ENGINE_NAIVE;
+                else if (strcmp(value, "switch") == 0)
+                    opts->engine = ENGINE_SWITCH;
+                else if (strcmp(value, "threaded") == 0)
+                    opts->engine = ENGINE_THREADED;
+                else if (strcmp(value, "jit") == 0 && JIT_SUPPORTED)
+                    opts->engine = ENGINE_JIT;
+                else
+                    bad = 1;
+            } else if (strcmp(opt, "--ppm-frames") == 0) {
+                snprintf(opts->ppm_prefix, FILE_PATH_SIZE, "%s", value);
+            } else if (strcmp(opt, "--profile") == 0) {
+                snprintf(opts->profile_file, FILE_PATH_SIZE, "%s", value);
+            } else if (strcmp(opt, "--frame-cycles") == 0) {
+                char *end;
+                opts->frame_cycles = strtoull(value, &end, 0);
+                bad = end == value || *end != '\0' || opts->frame_cycles == 0;
+            } else if (strcmp(opt, "--folded-stacks") == 0) {
+                snprintf(opts->folded_file, FILE_PATH_SIZE, "%s", value);
+            } else if (strcmp(opt, "--layout") == 0) {
+                snprintf(opts->layout_file, FILE_PATH_SIZE, "%s", value);
+            } else if (strcmp(opt, "--map") == 0) {
+                snprintf(opts->map_file, FILE_PATH_SIZE, "%s", value);
+            } else if (strcmp(opt, "--lockstep") == 0) {
+                snprintf(opts->lockstep_file, FILE_PATH_SIZE, "%s", value);
+            } else if (strcmp(opt, "--lanes") == 0) {
+                char *end;
+                long n = strtol(value, &end, 10);
+                bad = end == value || *end != '\0' || n < 1 ||
+                    n > LANE_COUNT;
+                opts->lanes = n;
+            } else if (strcmp(opt, "--screen") == 0) {
+                snprintf(opts->screen_name, FILE_PATH_SIZE, "%s", value);
+            } else if (strcmp(opt, "--set") == 0) {
+                bad = opts->set_count >= MAX_RAM_ARGS || parse_ram_arg(value,
+                    '=', -1, opts->sets + opts->set_count++);
+            } else if (strcmp(opt, "--dump") == 0) {
+                bad = opts->dump_count >= MAX_RAM_ARGS || parse_ram_arg(value,
+                    ':', 1, opts->dumps + opts->dump_count++);
+            }
+
+            if (bad) {
+                snprintf(error_text, ERR_TEXT_SIZE,
+                    "error: invalid value '%s' for '%s'", value, argv[i]);
+                return 1;
+            }
+            i++;
+            continue;
+        }
+
         // Handle -o switch
         if (strindex(argv[i], "-o") > -1) {
             // Exit if multiple output files given
@@ -309,15 +751,13 @@ int parse_arguments(int argc, char* argv[],
                 strcpy(error_text, "error: expected output file after '-o'");
                 return 1;
             }
-            strncpy(output_file, argv[i + 1], FILE_PATH_SIZE);
+            snprintf(output_file, FILE_PATH_SIZE, "%s", argv[i + 1]);
+            opts->output_given = 1;
             i++;
         } else { // Argument is input_file
-            // Exit if multiple input files given
-            if (*input_file != 0) {
-                strcpy(error_text, "error: too many input files");
-                return 1;
-            }
-            strncpy(input_file, argv[i], FILE_PATH_SIZE);
+            opts->input_files[opts->input_count++] = argv[i];
+            if (*input_file == 0)
+                snprintf(input_file, FILE_PATH_SIZE, "%s", argv[i]);
         }
     }
 
@@ -326,67 +766,119 @@ int parse_arguments(int argc, char* argv[],
         return 1;
     }
 
-    if (*output_file == 0) {
-        strncpy(output_file, input_file, FILE_PATH_SIZE);
-        int err = str_replace_last(output_file, ".asm", ".hack");
-        if (err != 0) { // input_file doesn't end with .asm
-            strncat(output_file, ".hack",
-                FILE_PATH_SIZE - strlen(output_file));
-        }
+    // Exit if multiple input files given without --link or --batch,
+    // unless they are all VM code
+    int all_vm = !opts->disassemble;
+    for (size_t i = 0; i < opts->input_count; i++)
+        all_vm &= is_vm_file(opts->input_files[i]);
+    if (opts->input_count > 1 && !opts->link && !opts->batch && !all_vm) {
+        strcpy(error_text, "error: too many input files");
+        return 1;
     }
 
-    return 0;
-}
-
-// String, but defined by a range in memory (inclusive)
-// Doesn't have to be null-terminated
-typedef struct {
-    char *start; // inclusive
-    char *end; // inclusive
-} Slice;
-
-// TODO move this out
-// Copies Slice string into a malloced null-terminated string
-// Returns pointer to new string
-// NOTE: Only use for debugging & logging!
-char *slice_to_str(Slice *slice)
-{
-    size_t slice_len = slice->end - slice->start + 1;
-    char *str = malloc(sizeof(char) * (slice_len + 1));
-    memcpy(str, slice->start, sizeof(char) * slice_len);
-    str[slice_len] = '\0';
-    return str;
-}
-
-// TODO move this out
-// Return 0 if string and slice are equal. Return 1 otherwise
-char cmp_str_slice(char *str, Slice *slice)
-{
-    char *slice_p = slice->start;
-    while (*str && slice_p <= slice->end) {
-        if (*str != *slice_p)
-            return 1;
-        slice_p++;
-        str++;
+    if (opts->disassemble && (opts->compile || opts->link || opts->batch ||
+        opts->run || opts->emit_c || opts->emit_asm || opts->optimize ||
+        opts->dce || opts->dataflow || opts->icf || opts->outline ||
+        opts->pack || *opts->layout_file)) {
+        strcpy(error_text, "error: -d only takes -o and --map");
+        return 1;
+    }
+    if (*opts->map_file && !opts->disassemble && (opts->compile ||
+        opts->link || opts->batch || opts->emit_asm)) {
+        strcpy(error_text, "error: --map can't be used with -c, --link, "
+            "--batch or --emit=asm");
+        return 1;
+    }
+    if (opts->compile && (opts->link || opts->dce || opts->emit_c ||
+        opts->run)) {
+        strcpy(error_text,
+            "error: -c can't be used with --link, --dce, --emit or --run");
+        return 1;
+    }
+    if (opts->emit_asm && (opts->link || opts->run)) {
+        strcpy(error_text,
+            "error: --emit=asm can't be used with --link or --run");
+        return 1;
+    }
+    if (opts->link && (opts->optimize || opts->dce || opts->icf)) {
+        strcpy(error_text,
+            "error: -O, --dce and --icf apply to -c, not --link");
+        return 1;
+    }
+    if (opts->dataflow && (opts->link || opts->compile)) {
+        strcpy(error_text,
+            "error: --dataflow can't be used with -c or --link");
+        return 1;
+    }
+    if (opts->outline && (opts->link || opts->compile)) {
+        strcpy(error_text, "error: --outline can't be used with -c or --link");
+        return 1;
+    }
+    if (opts->pack && (opts->link || opts->compile)) {
+        strcpy(error_text, "error: --pack can't be used with -c or --link");
+        return 1;
+    }
+    if (*opts->layout_file && (opts->link || opts->compile || opts->batch)) {
+        strcpy(error_text,
+            "error: --layout can't be used with -c, --link or --batch");
+        return 1;
+    }
+    if (*opts->profile_file && !opts->run) {
+        strcpy(error_text, "error: --profile needs --run");
+        return 1;
+    }
+    if ((opts->flat_profile || *opts->folded_file) && !opts->run) {
+        strcpy(error_text,
+            "error: --flat-profile and --folded-stacks need --run");
+        return 1;
+    }
+    if (*opts->perf_map_file && (!opts->run || opts->engine != ENGINE_JIT)) {
+        strcpy(error_text, "error: --perf-map needs --run and --engine jit");
+        return 1;
+    }
+    if (*opts->lockstep_file && (!opts->run || opts->histogram ||
+        *opts->profile_file || opts->flat_profile || *opts->folded_file ||
+        opts->print_ops || *opts->perf_map_file)) {
+        strcpy(error_text, "error: --lockstep needs --run, and can't be used "
+            "with --hist, the profiles, --ops or --perf-map");
+        return 1;
+    }
+    if ((*opts->snapshot_file || *opts->save_snapshot_file) && !opts->run) {
+        strcpy(error_text, "error: --snapshot and --save-snapshot need --run");
+        return 1;
+    }
+    if (!*opts->save_snapshot_file != !*opts->snapshot_at) {
+        strcpy(error_text,
+            "error: --save-snapshot and --snapshot-at go together");
+        return 1;
+    }
+    if (*opts->save_snapshot_file && *opts->lockstep_file) {
+        strcpy(error_text,
+            "error: --save-snapshot can't be used with --lockstep");
+        return 1;
+    }
+    if ((*opts->screen_name || *opts->ppm_prefix) && (!opts->run ||
+        *opts->lockstep_file || *opts->save_snapshot_file)) {
+        strcpy(error_text, "error: --screen and --ppm-frames need --run, and "
+            "can't be used with --lockstep or --save-snapshot");
+        return 1;
+    }
+    if (opts->batch && (opts->output_given || opts->link || opts->compile ||
+        opts->emit_c || opts->emit_asm || opts->run)) {
+        strcpy(error_text, "error: --batch can't be used with -o, --link, "
+            "-c, --emit or --run");
+        return 1;
     }
 
-    if (*str == '\0' && slice_p == slice->end + 1)
-        return 0;
-
-    return 1;
+    set_input_file(opts, input_file);
+    return 0;
 }
 
-// TODO move this out
 void print_slice(Slice *slice)
 {
     print_str_range(slice->start, slice->end);
 }
 
-typedef struct {
-    char *p0;
-    int p1;
-}  Str_Int_Pair;
-
 // Slow (but simple) associative array
 Str_Int_Pair symbol_pairs[SYMBOL_PAIRS_SIZE] = {
     { "SP",     0 },
@@ -414,7 +906,13 @@ Str_Int_Pair symbol_pairs[SYMBOL_PAIRS_SIZE] = {
     { "KBD",    0x6000 },
 };
 // Index of last element + 1 in symbol_pairs array
-size_t symbol_pairs_i = 23;
+size_t symbol_pairs_i = PREDEFINED_SYMBOL_COUNT;
+
+// Variables in the order they appear in the source, before optimization,
+// and the RAM slot from VARIABLE_BASE up each gets (--pack shares slots)
+char *variable_order[SYMBOL_PAIRS_SIZE];
+size_t variable_slot[SYMBOL_PAIRS_SIZE];
+size_t variable_count = 0;
 
 // Returns pointer to pair if found. Returns NULL otherwise
 Str_Int_Pair *find_pair_by_str(Str_Int_Pair a[], size_t len, char *str)
@@ -443,331 +941,293 @@ int log_pair(Str_Int_Pair *p)
     return printf("{ \"%s\", %i }", p->p0, p->p1);
 }
 
-// Subinstruction can be 'comp', 'dest', 'jump'...
-typedef struct {
-    char *str;
-    size_t code;
-    char *bin;
-} Subinst_Code;
-
-// TODO use hash table instead of this jandaba
-/*const Subinst_Code comp_codes[] = {
-    { "0",   "0101010" },
-    { "1",   "0111111" },
-    { "-1",  "0111010" },
-    { "D",   "0001100" },
-    { "A",   "0110000" }, { "M",   "" },
-    { "D+A", "0000010" },
-    { "D|A", "0010101" }, { "D|M", "1010101" },
-};*/
-
-// Comp syntax definition
-enum COMP {
-    COMP_NULL = 0,
-    COMP_0,
-    COMP_1,
-    COMP_MINUS_1,
-    COMP_D,
-    COMP_A,          COMP_M,
-    COMP_NOT_D,
-    COMP_NOT_A,      COMP_NOT_M,
-    COMP_MINUS_D,
-    COMP_MINUS_A,    COMP_MINUS_M,
-    COMP_D_PLUS_1,
-    COMP_A_PLUS_1,   COMP_M_PLUS_1,
-    COMP_D_MINUS_1,
-    COMP_A_MINUS_1,  COMP_M_MINUS_1,
-    COMP_D_PLUS_A,   COMP_D_PLUS_M,
-    COMP_A_PLUS_D,   COMP_M_PLUS_D,
-    COMP_D_MINUS_A,  COMP_D_MINUS_M,
-    COMP_A_MINUS_D,  COMP_M_MINUS_D,
-    COMP_D_AND_A,    COMP_D_AND_M,
-    COMP_D_OR_A,     COMP_D_OR_M,
-    COMP_A_AND_D,    COMP_M_AND_D,
-    COMP_A_OR_D,     COMP_M_OR_D,
-    COMP_PARSE_ERROR,
-};
+// Returns the value of digit 'c' in base 2, 10 or 16. Returns -1 if 'c'
+// isn't a digit
+int digit_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
 
-// Comp translation codes
-const Subinst_Code comp_codes[] = {
-    { "",    COMP_NULL,      "0101010" },
-    { "0",   COMP_0,         "0101010" },
-    { "1",   COMP_1,         "0111111" },
-    { "-1",  COMP_MINUS_1,   "0111010" },
-    { "D",   COMP_D,         "0001100" },
-    { "A",   COMP_A,         "0110000" }, { "M",   COMP_M,         "1110000" },
-    { "!D",  COMP_NOT_D,     "0001101" },
-    { "!A",  COMP_NOT_A,     "0110001" }, { "!M",  COMP_NOT_M,     "1110001" },
-    { "-D",  COMP_MINUS_D,   "0001111" },
-    { "-A",  COMP_MINUS_A,   "0110011" }, { "-M",  COMP_MINUS_M,   "1110011" },
-    { "D+1", COMP_D_PLUS_1,  "0011111" },
-    { "A+1", COMP_A_PLUS_1,  "0110111" }, { "M+1", COMP_M_PLUS_1,  "1110111" },
-    { "D-1", COMP_D_MINUS_1, "0001110" },
-    { "A-1", COMP_A_MINUS_1, "0110010" }, { "M-1", COMP_M_MINUS_1, "1110010" },
-    { "D+A", COMP_D_PLUS_A,  "0000010" }, { "D+M", COMP_D_PLUS_M,  "1000010" },
-    { "A+D", COMP_A_PLUS_D,  "0000010" }, { "M+D", COMP_M_PLUS_D,  "1000010" },
-    { "D-A", COMP_D_MINUS_A, "0010011" }, { "D-M", COMP_D_MINUS_M, "1010011" },
-    { "A-D", COMP_A_MINUS_D, "0000111" }, { "M-D", COMP_M_MINUS_D, "1000111" },
-    { "D&A", COMP_D_AND_A,   "0000000" }, { "D&M", COMP_D_AND_M,   "1000000" },
-    { "D|A", COMP_D_OR_A,    "0010101" }, { "D|M", COMP_D_OR_M,    "1010101" },
-    { "A&D", COMP_A_AND_D,   "0000000" }, { "M&D", COMP_M_AND_D,   "1000000" },
-    { "A|D", COMP_A_OR_D,    "0010101" }, { "M|D", COMP_M_OR_D,    "1010101" },
-};
-const size_t comp_code_count = sizeof(comp_codes) / sizeof(Subinst_Code);
-
-// Dest syntax definition
-enum DEST {
-    DEST_NULL = 0x00, // 0b000
-    DEST_M    = 0x01, // 0b001
-    DEST_D    = 0x02, // 0b010
-    DEST_MD   = 0x03, // 0b011
-    DEST_A    = 0x04, // 0b100
-    DEST_AM   = 0x05, // 0b101
-    DEST_AD   = 0x06, // 0b110
-    DEST_AMD  = 0x07, // 0b111
-    DEST_PARSE_ERROR,
-};
+// Prints 'message' with the literal starting at 'start'
+void literal_error(char *message, char *start, char *end)
+{
+    char *p = start;
+    while (p <= end && is_valid_symbol_tail(*p))
+        p++;
+    printf("%s '%.*s'", message, (int) (p - start), start);
+}
 
-// Dest translation codes
-const Subinst_Code dest_codes[] = {
-    { "",    DEST_NULL, "000" },
-    { "M",   DEST_M,    "001" },
-    { "D",   DEST_D,    "010" },
-    { "MD",  DEST_MD,   "011" },
-    { "A",   DEST_A,    "100" },
-    { "AM",  DEST_AM,   "101" },
-    { "AD",  DEST_AD,   "110" },
-    { "AMD", DEST_AMD,  "111" },
-};
-const size_t dest_code_count = sizeof(dest_codes) / sizeof(Subinst_Code);
-
-// Jump syntax definitions
-enum JUMP {
-    JUMP_NULL = 0,
-    JGT, JEQ, JGE,
-    JLT, JNE, JLE,
-    JMP,
-    JUMP_PARSE_ERROR,
-};
+// Parses a decimal, '0x' hexadecimal or '0b' binary literal at '*buf' and
+// moves '*buf' past it. Stops as soon as the value leaves the 15-bit range
+// of A-instructions, so long literals can't overflow
+// Returns 0 on success, 1 on error
+int parse_literal(char **buf, char *end, long *value)
+{
+    char *p = *buf;
+    int base = 10;
+    if (p + 1 <= end && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    } else if (p + 1 <= end && p[0] == '0' && (p[1] == 'b' || p[1] == 'B')) {
+        base = 2;
+        p += 2;
+    }
 
-// Jump translation codes
-const Subinst_Code jump_codes[] = {
-    { "",    JUMP_NULL, "000" },
-    { "JGT", JGT,       "001" },
-    { "JEQ", JEQ,       "010" },
-    { "JGE", JGE,       "011" },
-    { "JLT", JLT,       "100" },
-    { "JNE", JNE,       "101" },
-    { "JLE", JLE,       "110" },
-    { "JMP", JMP,       "111" },
-};
-const size_t jump_code_count = sizeof(jump_codes) / sizeof(Subinst_Code);
+    char *digits = p;
+    long n = 0;
+    for (; p <= end; p++) {
+        int d = (base == 10) ? *p - '0' : digit_value(*p);
+        if (d < 0 || d >= base)
+            break;
+        n = n * base + d;
+        if (n > MAX_A_VALUE) {
+            literal_error("Number", *buf, end);
+            printf(" out of range (0 to %i)\n", MAX_A_VALUE);
+            return 1;
+        }
+    }
 
-enum INST_TYPE { A_INST, C_INST };
+    // Literals can't run into letters or digits of another base
+    if (p == digits || (p <= end && is_valid_symbol_tail(*p))) {
+        literal_error("Invalid number", *buf, end);
+        printf("\n");
+        return 1;
+    }
 
-typedef struct {
-    enum INST_TYPE type;
-    void *inst;
-} Instruction;
+    *buf = p;
+    *value = n;
+    return 0;
+}
 
+// Constant expression folded down to 'symbol' + 'offset'
+// 'symbol' is NULL if the expression is a plain number
 typedef struct {
     Slice *symbol;
-    unsigned int value;
-    int eval; // true if .value is correct (or was evaluated)
-} A_Instruction;
-
-typedef struct {
-    enum DEST dest;
-    enum COMP comp;
-    enum JUMP jump;
-} C_Instruction;
+    long offset;
+} Expr;
 
-void free_instruction(Instruction *i)
+char *skip_blank(char *buf, char *end)
 {
-    if (i->type == A_INST) {
-        A_Instruction* a = (A_Instruction*) i->inst;
-        if (a->symbol)
-            free(a->symbol);
-    }
-    free(i->inst);
+    while (buf <= end && is_blank(*buf))
+        buf++;
+    return buf;
 }
 
-// Returns a^b
-// 'b' must be non-negative (given the return type of the function)
-int power(int a, int b)
+// Turns a predefined symbol (SP, SCREEN...) in 'e' into part of its offset
+// Returns 1 if 'e' still has a symbol, 0 otherwise
+int fold_predefined(Expr *e)
 {
-    if (a == 0)
+    if (e->symbol == NULL)
         return 0;
-
-    int ans = 1;
-    while (b-- > 0)
-        ans *= a;
-
-    return ans;
+    Str_Int_Pair *p = find_pair_by_slice(symbol_pairs,
+        PREDEFINED_SYMBOL_COUNT, e->symbol);
+    if (p == NULL)
+        return 1;
+    e->offset += p->p1;
+    free(e->symbol);
+    e->symbol = NULL;
+    return 0;
 }
 
-// Returns true if the number satisfies the following
-// reg expression: ^-?[0-9]+$
-// Returns false otherwise
-int is_valid_value(char *buf, char *end)
+// Keeps intermediate values small enough that the next operation can't
+// overflow. Frees the symbol of 'e' if it does
+// Returns 1 if 'e' is out of range, 0 otherwise
+int expr_overflows(Expr *e)
 {
-    // Swallow leading minus, if present
-    if (*buf == '-') {
-        buf++;
-    }
-
-    if (buf > end)
+    if (e->offset >= -MAX_EXPR_VALUE && e->offset <= MAX_EXPR_VALUE)
         return 0;
-
-    for (; buf <= end; buf++) {
-        if (!is_number(*buf)) {
-            return 0;
-        }
-    }
-
+    printf("Expression out of range\n");
+    free(e->symbol);
     return 1;
 }
 
-// Parses and returns first int from 'buf' to 'end' inclusive.
-// NOTE: The given range MUST ONLY contain digits or a leading minus,
-//  otherwise, undefined behavior
-int parse_next_int(char *buf, char *end)
-{
-    int num = 0;
-    int negative = 0;
+int parse_expr(char **buf, char *end, Expr *e);
 
-    // Check if negative
-    if (*buf == '-') {
-        negative = 1;
-        buf++;
-    }
+// Parses a number, symbol or '(expr)' at '*buf' and moves '*buf' past it
+// Returns 0 on success, 1 on error
+int parse_expr_primary(char **buf, char *end, Expr *e)
+{
+    char *p = skip_blank(*buf, end);
+    *e = (Expr) { .symbol = NULL, .offset = 0 };
+    if (p > end)
+        return 1;
 
-    // Skip leading zeros
-    if (*buf == '0') {
-        while (*(buf + 1) == '0') {
-            buf++;
+    if (*p == '(') {
+        p++;
+        if (parse_expr(&p, end, e))
+            return 1;
+        p = skip_blank(p, end);
+        if (p > end || *p != ')') {
+            free(e->symbol);
+            printf("Missing ')' in expression\n");
+            return 1;
         }
+        *buf = p + 1;
+        return 0;
     }
 
-    // Build num up backwards
-    char *p = end;
-    size_t rpos = 0; // Position of current digit from right
-    while (p >= buf) {
-        int n = *p - '0';
-        num += n * power(10, rpos);
-        p--;
-        rpos++;
+    char *start = p;
+    if (is_number(*p)) {
+        if (parse_literal(&p, end, &e->offset))
+            return 1;
+    } else if (is_valid_symbol_head(*p)) {
+        while (p <= end && is_valid_symbol_tail(*p))
+            p++;
+        e->symbol = malloc(sizeof(Slice));
+        *e->symbol = (Slice) { .start = start, .end = p - 1 };
+    } else {
+        return 1;
     }
+    *buf = p;
+    return 0;
+}
 
-    if (negative)
-        return -num;
+// Parses '-' unary or a primary
+// Returns 0 on success, 1 on error
+int parse_expr_unary(char **buf, char *end, Expr *e)
+{
+    char *p = skip_blank(*buf, end);
+    if (p > end || *p != '-')
+        return parse_expr_primary(buf, end, e);
 
-    return num;
+    p++;
+    if (parse_expr_unary(&p, end, e))
+        return 1;
+    if (fold_predefined(e)) {
+        printf("Can't negate a symbol\n");
+        free(e->symbol);
+        return 1;
+    }
+    e->offset = -e->offset;
+    *buf = p;
+    return 0;
 }
 
-// Converts 15-bit int to binary (ascii) string. Returns its pointer
-// TODO don't use malloc and write to passed char *str.
-char *int15_to_bin_str(unsigned int n)
+// Parses unaries joined by '*' and '/'
+// Returns 0 on success, 1 on error
+int parse_expr_term(char **buf, char *end, Expr *e)
 {
-    char *str = malloc(sizeof(char) * 16);
-    str[15] = '\0';
-    int i = 14;
-    while (n > 0 && i >= 0) {
-        int rem = n % 2;
-        str[i] = '0' + rem;
-        n /= 2;
-        i--;
-    }
+    if (parse_expr_unary(buf, end, e))
+        return 1;
 
-    // Pad with zeros
-    while (i >= 0) {
-        str[i] = '0';
-        i--;
-    }
+    for (;;) {
+        char *p = skip_blank(*buf, end);
+        if (p > end || (*p != '*' && *p != '/'))
+            return 0;
+        char op = *p++;
 
-    return str;
+        Expr r;
+        if (parse_expr_unary(&p, end, &r)) {
+            free(e->symbol);
+            return 1;
+        }
+        if (fold_predefined(e) | fold_predefined(&r)) {
+            printf("Can't %s a symbol\n", op == '*' ? "multiply" : "divide");
+            free(e->symbol);
+            free(r.symbol);
+            return 1;
+        }
+        if (op == '/' && r.offset == 0) {
+            printf("Division by zero\n");
+            return 1;
+        }
+        e->offset = (op == '*') ? e->offset * r.offset : e->offset / r.offset;
+        if (expr_overflows(e))
+            return 1;
+        *buf = p;
+    }
 }
 
-// Parses from 'buf' to 'end' inclusive
-// Returns first symbol found as malloced Slice
-// Returns NULL on parse error
-Slice *parse_next_symbol(char *buf, char *end)
+// Parses terms joined by '+' and '-'. The result can have at most one
+// symbol, which can't be subtracted
+// Returns 0 on success, 1 on error
+int parse_expr(char **buf, char *end, Expr *e)
 {
-    // Check head (first char)
-    if (!is_valid_symbol_head(buf[0])) {
-        return NULL;
-    }
+    if (parse_expr_term(buf, end, e))
+        return 1;
 
-    size_t i = 1; // Continue checking from second char
-    for (; buf + i <= end; i++) {
-        if (is_valid_symbol_tail(buf[i]))
-            continue;
-        /* The if below enables the use of the following case in asm:
-                @MYVARIABLE       // declare my var\n
-                 ^---+----^^--+--^^-----------+---^
-                     |        |               |
-                  symbol   blankspace      comment
-
-           Here, 'buf' points to 'M' and 'end' points to
-           the space before the first '/' */
-        if (buf[i] == ' ' || buf[i] == '\t') {
-            /* If symbol is followed by anything but whtiespace, exit.
-               Ex: '@MYVAR    ASD' should give fatal error.
-                     ^          ^
-                    buf        end
-            */
-            size_t j = i;
-            for (; buf + j <= end; j++) {
-                if (buf[j] == ' ' || buf[j] == '\t')
-                    continue;
-                return NULL;
-            }
+    for (;;) {
+        char *p = skip_blank(*buf, end);
+        if (p > end || (*p != '+' && *p != '-'))
+            return 0;
+        char op = *p++;
+
+        Expr r;
+        if (parse_expr_term(&p, end, &r)) {
+            free(e->symbol);
+            return 1;
         }
-        return NULL;
+        if (op == '-' && fold_predefined(&r)) {
+            printf("Can't subtract a symbol\n");
+            free(e->symbol);
+            free(r.symbol);
+            return 1;
+        }
+        if (e->symbol && r.symbol &&
+            fold_predefined(e) & fold_predefined(&r)) {
+            printf("Can't add two symbols\n");
+            free(e->symbol);
+            free(r.symbol);
+            return 1;
+        }
+        if (e->symbol == NULL)
+            e->symbol = r.symbol;
+        e->offset += (op == '+') ? r.offset : -r.offset;
+        if (expr_overflows(e))
+            return 1;
+        *buf = p;
     }
-
-    Slice *symbol = malloc(sizeof(Slice));
-    symbol->start = buf;
-    symbol->end = buf + i - 1;
-    return symbol;
 }
 
-
 // Parses A-instruction from 'buf' to 'end' inclusive
+// The operand is a constant expression like '@LABEL+3' or '@SCREEN+32*5'
+// with numbers, symbols, parentheses and '+', '-', '*', '/'. It's folded
+// down to a number or to a symbol plus an offset that's added after the
+// symbol is resolved
 // Returns NULL on parse error
 A_Instruction *parse_a_instruction(char *buf, char *end)
 {
     A_Instruction tmp = {
         .symbol = NULL,
+        .offset = 0,
         .value = 0,
         .eval = 0,
     };
 
     buf++; // Stand on char after '@'
 
-    // Skip blankspace
-    while (*buf == ' ' || *buf == '\t')
-        buf++;
+    Expr e;
+    if (parse_expr(&buf, end, &e))
+        return NULL;
 
-    if (is_number(*buf) || *buf == '-') {
-        // Values can start with [\-0-9]
-        // Check for parse errors
-        if (is_valid_value(buf, end)) {
-            tmp.value = parse_next_int(buf, end);
-            tmp.eval = 1;
-        } else {
+    // Anything but blankspace after the expression is an error
+    if (skip_blank(buf, end) <= end) {
+        free(e.symbol);
+        return NULL;
+    }
+
+    if (e.symbol) {
+        if (e.offset < -0xFFFF || e.offset > 0xFFFF) {
+            printf("Offset %li out of range\n", e.offset);
+            free(e.symbol);
             return NULL;
         }
-    } else if (is_alpha(*buf) || *buf == '_' || *buf == '.' ||
-        *buf == '%' || *buf == ':') {
-        // Symbols can start with [a-zA-Z_.%:]
-        tmp.symbol = parse_next_symbol(buf, end);
-        // Check if parse error
-        if (tmp.symbol == NULL)
-            return NULL;
+        tmp.symbol = e.symbol;
+        tmp.offset = e.offset;
     } else {
-        // Parse error
-        return NULL;
+        if (e.offset < 0 || e.offset > MAX_A_VALUE) {
+            printf("Value %li out of range (0 to %i)\n", e.offset,
+                MAX_A_VALUE);
+            return NULL;
+        }
+        tmp.value = e.offset;
+        tmp.eval = 1;
     }
 
     A_Instruction *inst = malloc(sizeof(A_Instruction));
@@ -775,181 +1235,48 @@ A_Instruction *parse_a_instruction(char *buf, char *end)
     return inst;
 }
 
-// Parses dest in C-instruction between 'buf' and 'end'
-// Returns DEST_PARSE_ERROR if parse error encountered
-// TODO don't allow multiple occurrences of a,m, or d. Ex: 'AAA', 'MDD'...
-enum DEST parse_c_dest(char *buf, char *end)
-{
-    enum DEST dest = DEST_NULL;
-    for (; buf <= end; buf++) {
-        // A
-        if (*buf == 'a' || *buf == 'A') {
-            dest |= DEST_A;
-            continue;
-        }
-
-        // M
-        if (*buf == 'm' || *buf == 'M') {
-            dest |= DEST_M;
-            continue;
-        }
-
-        // D
-        if (*buf == 'd' || *buf == 'D') {
-            dest |= DEST_D;
-            continue;
-        }
-
-        // Skip whitespace
-        if (*buf == ' ' || *buf == '\t')
-            continue;
-
-        // Invalid token
-        return DEST_PARSE_ERROR;
-    }
-    return dest;
-}
-
-// Parses comp in C-instruction from 'buf' to 'end' inclusive
-// Returns COMP_PARSE_ERROR if parse error encountered
-enum COMP parse_c_comp(char *buf, char *end)
-{
-    // Gather tokens and push them upcased into comp_str
-    char comp_str[MAX_COMP_TOKEN_COUNT + 1];
-    size_t i = 0; // index for comp_str
-    for (; buf <= end; buf++) {
-        switch (*buf) {
-        // Skip whitespace
-        case ' ':
-        case '\t':
-            break;
-        // Valid tokens
-        case 'A':
-        case 'a':
-        case 'M':
-        case 'm':
-        case 'D':
-        case 'd':
-        case '0':
-        case '1':
-        case '+':
-        case '-':
-        case '!':
-        case '&':
-        case '|':
-            if (i >= MAX_COMP_TOKEN_COUNT) {
-                printf("Too many tokens in comp section\n");
-                return COMP_PARSE_ERROR;
-            }
-            comp_str[i] = toupper(*buf);
-            i++;
-            break;
-        // Everything else is invalid
-        default:
-            printf("Invalid token '%c' in comp\n", *buf);
-            return COMP_PARSE_ERROR;
-        }
-    }
-
-    // No tokens
-    if (i == 0) {
-        return COMP_NULL;
-    }
-
-    // Terminate comp_str
-    comp_str[i] = '\0';
-
-    // Compare comp_str to comp_codes table
-    for (size_t j = 0; j < comp_code_count; j++) {
-        if (strcmp(comp_codes[j].str, comp_str) == 0) {
-            return comp_codes[j].code;
-        }
-    }
-
-    return COMP_NULL;
-}
-
-// Parses jump in C-instruction between 'buf' and 'end
-// Returns JUMP_PARSE_ERROR if parse error encountered
-enum JUMP parse_c_jump(char *buf, char *end)
-{
-    if (buf == end)
-        return JUMP_NULL;
-
-    for (size_t i = 0; i < jump_code_count; i++) {
-        if (strstr_range(buf, end, jump_codes[i].str) != NULL) {
-            return jump_codes[i].code;
-        }
-    }
-
-    return JUMP_PARSE_ERROR;
-}
-
-// Parses C-instruction from 'buf' to 'end' inclusive
+// Parses C-instruction from 'buf' to 'end' inclusive in a single pass over
+// the tables in cparse.h, which gencparse builds from the code tables
 // Returns NULL on fatal parse error
 // Examples of instructions allowed: 'JMP', '0;JMP', ';JMP', '=JMP',
 //    '=;JMP', 'D', 'AM=0;JEQ', 'comp', 'jump', '=comp'
-// TODO make parse_c_subinst functions return Subinstruction structs
 C_Instruction *parse_c_instruction(char *buf, char* end)
 {
     C_Instruction tmp = {
         .dest = DEST_NULL,
         .comp = COMP_NULL,
         .jump = JUMP_NULL,
-    };
-
-    // Dest
-    char *dest_start = buf;
-    char *eq = strchr_range(buf, end, '=');
-    if (eq == NULL) {
-        // Dest is empty
-        tmp.dest = DEST_NULL;
-        buf = dest_start; // comp starts parsing from i
-    } else {
-        tmp.dest = parse_c_dest(dest_start, eq - 1);
-        buf = eq + 1; // stand on char after '='
-    }
-
-    // Skip blankspace between 'dest=' and 'comp'
-    while (*buf == ' ' || *buf == '\t')
-        buf++;
-
-    // Comp
-    char *comp_start = buf;
-    char *semicolon = strchr_range(comp_start, end, ';');
-    char *comp_end;
-    if (semicolon == NULL) {
-        // No ';' found, parse to end of line
-        comp_end = end;
-    } else {
-        comp_end = semicolon - 1;
-        buf = semicolon + 1; // stand on char after ';'
-    }
-
-    tmp.comp = parse_c_comp(comp_start, comp_end);
+    };
 
-    // Skip blankspace between 'comp;' and 'jump'
-    while (*buf == ' ' || *buf == '\t')
-        buf++;
+    unsigned int state = CPARSE_START;
+    int has_jump = 0; // ';' was read
+    for (char *p = buf; p <= end; p++) {
+        unsigned int c = cparse_class[(unsigned char) *p];
+        if (c == CPARSE_CLASS_EQ) {
+            tmp.dest = cparse_dest[state];
+        } else if (c == CPARSE_CLASS_SEMICOLON) {
+            tmp.comp = cparse_comp[state];
+            has_jump = 1;
+        }
 
-    // Jump
-    // If 'comp' and 'jump' overlap
-    if (comp_end == end) {
-        // Comp takes perendence over jump so if they overlap and
-        // comp parses ok, then we don't have a jump
-        if (tmp.comp != COMP_NULL && tmp.comp != COMP_PARSE_ERROR) {
-            tmp.jump = JUMP_NULL;
-        } else {
-            tmp.jump = parse_c_jump(buf, end);
+        state = cparse_next[state][c];
+        if (state == CPARSE_REJECT) {
+            printf("Unexpected '%c' in C-instruction '", *p);
+            print_str_range(buf, end);
+            printf("'\n");
+            return NULL;
         }
-    } else {
-        tmp.jump = parse_c_jump(buf, end);
     }
 
-    // Exit if parse error
-    if (tmp.jump == JUMP_PARSE_ERROR) {
+    if (!cparse_accept[state]) {
+        printf("Incomplete C-instruction '");
+        print_str_range(buf, end);
+        printf("'\n");
         return NULL;
     }
+    if (!has_jump)
+        tmp.comp = cparse_comp[state];
+    tmp.jump = cparse_jump[state];
 
     C_Instruction *inst = malloc(sizeof(C_Instruction));
     memcpy(inst, &tmp, sizeof(C_Instruction));
@@ -969,6 +1296,8 @@ void log_a_inst(A_Instruction *inst)
         printf("NULL");
     }
     printf("\n");
+    // Offset
+    printf("\t.offset = %i\n", inst->offset);
     // Value
     printf("\t.value = %i\n", inst->value);
     // Evaluated
@@ -1002,30 +1331,304 @@ void log_inst(Instruction *inst)
         printf("log_inst: invalid INST_TYPE %i\n", inst->type);
 }
 
-int main(int argc, char* argv[])
+// What "<status> after <n> cycles" says for each EMU_STATUS
+char *status_str[] = {
+    [EMU_HALTED] = "halted",
+    [EMU_CYCLE_LIMIT] = "cycle limit reached",
+    [EMU_OUT_OF_ROM] = "ran past end of ROM",
+    [EMU_STOPPED] = "stopped",
+};
+
+// Restores 'cpu' from the --snapshot file, if given, and sets 'max_cycles'
+// to the cycles left of --max-cycles, which counts the cycles before the
+// snapshot too
+// Returns 0 on success, 1 on error
+int resume_snapshot(Hack_CPU *cpu, Options *opts, uint64_t *max_cycles)
 {
-    char input_file_path[FILE_PATH_SIZE];
-    char output_file_path[FILE_PATH_SIZE];
-    char error_text[ERR_TEXT_SIZE];
+    *max_cycles = opts->max_cycles;
+    if (!*opts->snapshot_file)
+        return 0;
+    if (snapshot_load(cpu, opts->snapshot_file))
+        return 1;
+    if (opts->max_cycles && cpu->cycles >= opts->max_cycles) {
+        printf("error: '%s' was taken after %llu cycles, past --max-cycles\n",
+            opts->snapshot_file, (unsigned long long) cpu->cycles);
+        return 1;
+    }
+    if (opts->max_cycles)
+        *max_cycles -= cpu->cycles;
+    return 0;
+}
 
-    // Parse arguments
-    int err = parse_arguments(argc, argv, input_file_path, output_file_path,
-        error_text);
-    if (err == 1) {
-        printf("%s\n", error_text);
+// Returns the ROM address of label 'name', or of 'name' as a number
+// Returns -1 if there's no such address
+long find_rom_address(char *name, Str_Int_Pair *labels, size_t label_count,
+    size_t count)
+{
+    for (size_t i = 0; i < label_count; i++) {
+        if (strcmp(labels[i].p0, name) == 0)
+            return labels[i].p1;
+    }
+    char *end;
+    long addr = strtol(name, &end, 0);
+    if (end == name || *end != '\0' || addr < 0 || (size_t) addr > count)
+        return -1;
+    return addr;
+}
+
+// Runs an instance of the program for each line of the --lockstep file,
+// after setting the addr=val pairs on its line and the --set ones
+// Returns 0 on success, 1 on error
+int run_lockstep(uint16_t *words, size_t count, Options *opts)
+{
+    char *buf = load_file(opts->lockstep_file, NULL);
+    if (buf == NULL)
+        return 1;
+
+    // Instances are the lines that aren't blank
+    size_t line_count = 1;
+    for (char *c = buf; *c; c++)
+        line_count += *c == '\n';
+    char **lines = malloc(line_count * sizeof(char*));
+    size_t *line_numbers = malloc(line_count * sizeof(size_t));
+    size_t instance_count = 0;
+    char *line = buf;
+    for (size_t n = 1; line != NULL; n++) {
+        char *next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+        if (line[strspn(line, " \t\r")] != '\0') {
+            lines[instance_count] = line;
+            line_numbers[instance_count++] = n;
+        }
+        line = next;
+    }
+
+    Hack_CPU *cpu = emu_new(words, count, 0);
+    uint64_t max_cycles;
+    if (resume_snapshot(cpu, opts, &max_cycles)) {
+        emu_free(cpu);
+        free(line_numbers);
+        free(lines);
+        free(buf);
+        return 1;
+    }
+    Lane_Batch *batch = malloc(sizeof(Lane_Batch));
+    int err = 0;
+    for (size_t first = 0; first < instance_count && !err;
+        first += opts->lanes) {
+        memset(batch, 0, sizeof(Lane_Batch));
+        batch->count = instance_count - first < opts->lanes ?
+            instance_count - first : opts->lanes;
+
+        for (size_t l = 0; l < batch->count && !err; l++) {
+            for (size_t addr = 0; addr < RAM_SIZE; addr++)
+                batch->ram[addr][l] = cpu->ram[addr];
+            batch->a[l] = cpu->a;
+            batch->d[l] = cpu->d;
+            batch->pc[l] = cpu->pc;
+            for (size_t i = 0; i < opts->set_count; i++)
+                batch->ram[opts->sets[i].addr][l] = opts->sets[i].n;
+
+            char *save;
+            for (char *tok = strtok_r(lines[first + l], " \t\r", &save);
+                tok != NULL; tok = strtok_r(NULL, " \t\r", &save)) {
+                Ram_Arg set;
+                if (parse_ram_arg(tok, '=', -1, &set)) {
+                    printf("Error at line %li of '%s': invalid value '%s'\n",
+                        line_numbers[first + l], opts->lockstep_file, tok);
+                    err = 1;
+                    break;
+                }
+                batch->ram[set.addr][l] = set.n;
+            }
+        }
+        if (err)
+            break;
+
+        lanes_run(batch, cpu->code, count, max_cycles);
+
+        for (size_t l = 0; l < batch->count; l++) {
+            printf("instance %li: %s after %llu cycles\n", first + l,
+                status_str[batch->status[l]],
+                (unsigned long long) (cpu->cycles + batch->cycles[l]));
+            for (size_t i = 0; i < opts->dump_count; i++) {
+                Ram_Arg *dump = opts->dumps + i;
+                for (unsigned int a = dump->addr;
+                    a < dump->addr + dump->n && a < RAM_SIZE; a++) {
+                    printf("RAM[%u] = %i\n", a, (int16_t) batch->ram[a][l]);
+                }
+            }
+        }
+    }
+
+    free(batch);
+    emu_free(cpu);
+    free(line_numbers);
+    free(lines);
+    free(buf);
+    return err;
+}
+
+// Runs 'words' in the emulator as set up by --set and prints the result,
+// the RAM ranges given with --dump, the histogram if --hist was given and
+// the cycles under each of 'labels' (ROM addresses) if --flat-profile was.
+// Also writes the execution profile if --profile was given, the cycles of
+// each call stack if --folded-stacks was and lists compiled code by
+// 'labels' if --perf-map was
+// With --ops only the threaded instruction stream is printed
+// Returns 0 on success, 1 on error
+int run_program(uint16_t *words, size_t count, Str_Int_Pair *labels,
+    size_t label_count, Options *opts)
+{
+    if (count > ROM_SIZE) {
+        printf("Program doesn't fit in ROM (%li instructions)\n", count);
+        return 1;
+    }
+    if (*opts->lockstep_file)
+        return run_lockstep(words, count, opts);
+
+    Hack_CPU *cpu = emu_new(words, count, opts->histogram ||
+        *opts->profile_file || opts->flat_profile || *opts->folded_file);
+    cpu->engine = opts->engine;
+    cpu->labels = labels;
+    cpu->label_count = label_count;
+    if (opts->print_ops) {
+        emu_print_ops(cpu);
+        emu_free(cpu);
+        return 0;
+    }
+
+    uint64_t max_cycles;
+    long stop = 0;
+    if (*opts->snapshot_at) {
+        stop = find_rom_address(opts->snapshot_at, labels, label_count,
+            count);
+        if (stop < 0)
+            printf("error: no label '%s' to take a snapshot at\n",
+                opts->snapshot_at);
+    }
+    if (stop < 0 || resume_snapshot(cpu, opts, &max_cycles)) {
+        emu_free(cpu);
         return 1;
     }
 
-    // Completely read file into a buffer
-    size_t input_file_size;
-    char *input_buf = load_file(input_file_path, &input_file_size);
+    if (*opts->perf_map_file) {
+        cpu->perf_map = fopen(opts->perf_map_file, "w");
+        if (cpu->perf_map == NULL) {
+            printf("Error when writing to '%s'\n", opts->perf_map_file);
+            emu_free(cpu);
+            return 1;
+        }
+    }
+    if (opts->flat_profile || *opts->folded_file)
+        cpu->profiler = prof_new(labels, label_count, count);
+
+    for (size_t i = 0; i < opts->set_count; i++)
+        cpu->ram[opts->sets[i].addr] = opts->sets[i].n;
+
+    int err = 0;
+    if (*opts->save_snapshot_file) {
+        enum EMU_STATUS status = emu_run_until(cpu, stop, max_cycles);
+        if (status == EMU_STOPPED) {
+            err = snapshot_save(cpu, opts->save_snapshot_file);
+            printf("snapshot at '%s' after %llu cycles\n", opts->snapshot_at,
+                (unsigned long long) cpu->cycles);
+        } else {
+            printf("%s after %llu cycles\n", status_str[status],
+                (unsigned long long) cpu->cycles);
+            printf("error: '%s' wasn't reached\n", opts->snapshot_at);
+            err = 1;
+        }
+    } else if (*opts->screen_name || *opts->ppm_prefix) {
+        Screen *screen = screen_new(cpu, opts->screen_name, opts->ppm_prefix);
+        enum EMU_STATUS status = EMU_CYCLE_LIMIT;
+        err = screen == NULL ||
+            screen_run(screen, max_cycles, opts->frame_cycles, &status);
+        printf("%s after %llu cycles\n", status_str[status],
+            (unsigned long long) cpu->cycles);
+        screen_free(screen);
+    } else {
+        enum EMU_STATUS status = emu_run(cpu, max_cycles);
+        printf("%s after %llu cycles\n", status_str[status],
+            (unsigned long long) cpu->cycles);
+    }
+
+    for (size_t i = 0; i < opts->dump_count; i++) {
+        Ram_Arg *dump = opts->dumps + i;
+        for (unsigned int a = dump->addr;
+            a < dump->addr + dump->n && a < RAM_SIZE; a++) {
+            printf("RAM[%u] = %i\n", a, (int16_t) cpu->ram[a]);
+        }
+    }
+
+    if (opts->histogram)
+        emu_print_histogram(cpu);
+    if (opts->flat_profile)
+        prof_print_flat(cpu->profiler, cpu->counts, cpu->cycles);
+
+    if (*opts->profile_file) {
+        FILE *f = fopen(opts->profile_file, "w");
+        int bad = f == NULL || emu_write_profile(cpu, f);
+        if (f != NULL)
+            bad |= fclose(f) != 0;
+        if (bad) {
+            printf("Error when writing to '%s'\n", opts->profile_file);
+            err = 1;
+        }
+    }
+
+    if (*opts->folded_file) {
+        FILE *f = fopen(opts->folded_file, "w");
+        int bad = f == NULL || prof_write_folded(cpu->profiler, f, cpu->cycles);
+        if (f != NULL)
+            bad |= fclose(f) != 0;
+        if (bad) {
+            printf("Error when writing to '%s'\n", opts->folded_file);
+            err = 1;
+        }
+    }
+
+    if (cpu->perf_map != NULL)
+        fclose(cpu->perf_map);
+    prof_free(cpu->profiler);
+    emu_free(cpu);
+    return err;
+}
+
+void free_instructions(Instruction *instructions, size_t inst_count)
+{
+    for (size_t i = 0; i < inst_count; i++)
+        free_instruction(instructions + i);
+    free(instructions);
+}
+
+void free_input_bufs(char **input_bufs, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        free(input_bufs[i]);
+    free(input_bufs);
+}
+
+// Returns the index after the end of the line at 'i'. Stops at the
+// terminating '\0' if the last line has no newline
+size_t skip_line(char *buf, size_t i)
+{
+    i = find_next_any_index(buf, i, "\r\n");
+    return buf[i] == '\0' ? i : i + 1;
+}
 
+// Parses .asm code into an instruction array and populates the symbol table
+// with labels
+// Returns 0 on success, 1 on error
+int parse_asm(char *input_buf, Instruction **instructions_out,
+    size_t *inst_count_out)
+{
     // Initialize instruction array
     size_t instructions_capacity = INST_ARRAY_STARTING_CAPACITY;
     Instruction *instructions = malloc(instructions_capacity *
         sizeof(Instruction));
 
-    // Parse code into instruction array and populate symbol table with labels
     size_t inst_count = 0;
     size_t src_line_count = 0; // for pointing out errors
     for (size_t i = 0; input_buf[i] != '\0';) {
@@ -1045,7 +1648,7 @@ int main(int argc, char* argv[])
         // Handle comment
         if (input_buf[i] == '/' && input_buf[i+1] == '/') {
             // Skip rest of line
-            i = find_next_any_index(input_buf, i, "\r\n") + 1;
+            i = skip_line(input_buf, i);
             continue;
         }
 
@@ -1057,7 +1660,7 @@ int main(int argc, char* argv[])
                 i++;
 
             // Find end of line
-            char *end = find_next_any(input_buf + i, " \r\n");
+            char *end = find_next_any(input_buf + i, "\r\n");
 
             // Find comment between token and end of line
             char *comment_start = strstr_range(input_buf + i, end - 1, "//");
@@ -1072,7 +1675,7 @@ int main(int argc, char* argv[])
             // Check for error
             if (ainst == NULL) {
                 printf("Parse error at line %li\n", src_line_count + 1);
-                return 1;
+                goto error;
             }
 
             // Add parsed instruction to array
@@ -1096,7 +1699,7 @@ int main(int argc, char* argv[])
             inst_count++;
 
             // Skip rest of line
-            i = find_next_any_index(input_buf, i, "\r\n") + 1;
+            i = skip_line(input_buf, i);
             continue;
         }
 
@@ -1118,7 +1721,7 @@ int main(int argc, char* argv[])
             if (!is_valid_symbol_head(input_buf[i])) {
                 printf("Parse error at line %li\n", src_line_count + 1);
                 printf("Label names must start with a letter\n");
-                return 1;
+                goto error;
             }
 
             Slice label = { .start = input_buf + i, .end = 0 };
@@ -1136,7 +1739,7 @@ int main(int argc, char* argv[])
             if (input_buf[i] != ')') {
                 printf("Parse error at line %li\n", src_line_count + 1);
                 printf("Missing ')' for label definition\n");
-                return 1;
+                goto error;
             }
 
             // TODO allow colon after label definition
@@ -1157,7 +1760,14 @@ int main(int argc, char* argv[])
                 print_slice(&label);
                 printf("'\n");
                 free(label_str);
-                return 1;
+                goto error;
+            }
+
+            if (symbol_pairs_i >= SYMBOL_PAIRS_SIZE) {
+                printf("Error at line %li\n", src_line_count + 1);
+                printf("Too many symbols\n");
+                free(label_str);
+                goto error;
             }
 
             // Insert into symbol table TODO change to hash map
@@ -1175,54 +1785,120 @@ int main(int argc, char* argv[])
 #endif
 
             // Skip rest of line
-            i = find_next_any_index(input_buf, i, "\r\n") + 1;
+            i = skip_line(input_buf, i);
             continue;
         }
 
-        // Handle C-instruction
-        if (is_alpha(input_buf[i]) || is_number(input_buf[i]) ||
-            input_buf[i] == ';') {
-            // Find end of line
-            char *end = find_next_any(input_buf + i, "\r\n");
+        // Everything else is a C-instruction. Lines that aren't valid
+        // C-instructions are rejected by the parser
 
-            // Find comment between token and end of line
-            char *comment_start = strstr_range(input_buf + i, end - 1, "//");
-            if (comment_start != NULL) {
-                // Parse from start of line until comment start
-                end = comment_start;
-            }
+        // Find end of line
+        char *end = find_next_any(input_buf + i, "\r\n");
 
-            // Parse
-            C_Instruction *cinst = parse_c_instruction(input_buf + i, end - 1);
-            if (cinst == NULL) {
-                printf("Parse error at line %li\n", src_line_count + 1);
-                return 1;
-            }
+        // Find comment between token and end of line
+        char *comment_start = strstr_range(input_buf + i, end - 1, "//");
+        if (comment_start != NULL) {
+            // Parse from start of line until comment start
+            end = comment_start;
+        }
 
-            // Add parsed instruction to array
-            if (inst_count >= instructions_capacity) {
-                instructions_capacity += INST_ARRAY_CAPACITY_GROWTH_RATE;
-                instructions = realloc(instructions,
-                    instructions_capacity * sizeof(Instruction));
-            }
-            instructions[inst_count] = (Instruction) {
-                .type = C_INST,
-                .inst = cinst
-            };
+        // Parse
+        C_Instruction *cinst = parse_c_instruction(input_buf + i, end - 1);
+        if (cinst == NULL) {
+            printf("Parse error at line %li\n", src_line_count + 1);
+            goto error;
+        }
+
+        // Add parsed instruction to array
+        if (inst_count >= instructions_capacity) {
+            instructions_capacity += INST_ARRAY_CAPACITY_GROWTH_RATE;
+            instructions = realloc(instructions,
+                instructions_capacity * sizeof(Instruction));
+        }
+        instructions[inst_count] = (Instruction) {
+            .type = C_INST,
+            .inst = cinst
+        };
 
 #if LOG_PARSER_OUTPUT == 1
-            // Log
-            printf("%li: [%li]", src_line_count + 1, inst_count);
-            log_inst(&instructions[inst_count]);
+        // Log
+        printf("%li: [%li]", src_line_count + 1, inst_count);
+        log_inst(&instructions[inst_count]);
 #endif
 
-            inst_count++;
+        inst_count++;
 
-            // Skip rest of line
-            i = find_next_any_index(input_buf, i, "\r\n") + 1;
+        // Skip rest of line
+        i = skip_line(input_buf, i);
+    }
+
+    *instructions_out = instructions;
+    *inst_count_out = inst_count;
+    return 0;
+
+error:
+    free_instructions(instructions, inst_count);
+    return 1;
+}
+
+// Frees labels and variables so another program can be assembled
+void reset_symbol_table(void)
+{
+    for (size_t i = PREDEFINED_SYMBOL_COUNT; i < symbol_pairs_i; i++)
+        free(symbol_pairs[i].p0);
+    symbol_pairs_i = PREDEFINED_SYMBOL_COUNT;
+    for (size_t v = 0; v < variable_count; v++)
+        free(variable_order[v]);
+    variable_count = 0;
+}
+
+// Records variables in 'variable_order' in the order they first appear, so
+// that passes which remove or move code don't change their addresses.
+// Variables the passes add ('$outline.ret') come after them
+void record_variable_order(Instruction *instructions, size_t inst_count)
+{
+    Hash_Map recorded;
+    hash_init(&recorded, variable_count);
+    for (size_t v = 0; v < variable_count; v++)
+        hash_put(&recorded, variable_order[v], v);
+
+    for (size_t i = 0; i < inst_count; i++) {
+        if (instructions[i].type != A_INST)
+            continue;
+        A_Instruction *a = instructions[i].inst;
+        if (a->symbol == NULL)
+            continue;
+
+        char *name = slice_to_str(a->symbol);
+        if (hash_get(&recorded, name) || variable_count >= SYMBOL_PAIRS_SIZE ||
+            find_pair_by_str(symbol_pairs, symbol_pairs_i, name)) {
+            free(name);
             continue;
         }
+        hash_put(&recorded, name, variable_count);
+        variable_slot[variable_count] = variable_count;
+        variable_order[variable_count++] = name;
+    }
+    hash_free(&recorded);
+}
+
+// Parses .asm code, or the .vm files 'input_bufs' read from 'paths', and
+// runs the optimization passes. Populates the symbol table with labels
+// Returns 0 on success, 1 on error
+int parse_program(char **input_bufs, char **paths, size_t file_count,
+    Options *opts, Instruction **instructions_out, size_t *inst_count_out)
+{
+    Instruction *instructions;
+    size_t inst_count;
+    int err;
+    if (opts->vm_input) {
+        err = lower_vm(input_bufs, paths, file_count, &instructions,
+            &inst_count, symbol_pairs, &symbol_pairs_i, SYMBOL_PAIRS_SIZE);
+    } else {
+        err = parse_asm(input_bufs[0], &instructions, &inst_count);
     }
+    if (err)
+        return 1;
 
 #if LOG_PARSER_OUTPUT == 1
     // Dump symbol table before evals
@@ -1235,17 +1911,124 @@ int main(int argc, char* argv[])
     printf("}\n");
 #endif
 
-    // Allocate memory for output buffer
-    // 16 bytes for the instruction code on each line
-    // 1 byte for newline on each line
-    // 1 byte at the end for null terminator
-    size_t output_buf_size = sizeof(char) * 17 * inst_count + 1;
-    char *output_buf = malloc(output_buf_size);
-    char *output_buf_p = output_buf;
+    // Optimize before symbols are resolved, so labels can be moved
+    if (opts->dce || opts->dataflow || opts->optimize || opts->icf ||
+        opts->outline || *opts->layout_file || opts->pack)
+        record_variable_order(instructions, inst_count);
+    if (opts->dce) {
+        size_t label_count = symbol_pairs_i - PREDEFINED_SYMBOL_COUNT;
+        eliminate_dead_code(instructions, &inst_count,
+            symbol_pairs + PREDEFINED_SYMBOL_COUNT, &label_count);
+        symbol_pairs_i = PREDEFINED_SYMBOL_COUNT + label_count;
+    }
+    if (opts->dataflow) {
+        Dataflow_Stats stats;
+        propagate_constants(instructions, &inst_count,
+            symbol_pairs + PREDEFINED_SYMBOL_COUNT,
+            symbol_pairs_i - PREDEFINED_SYMBOL_COUNT, &stats);
+        if (opts->dataflow_stats) {
+            printf("dataflow: %li instructions removed (%li loads, "
+                "%li stores), %li computations and %li jumps folded, "
+                "%llu cycles saved (estimated)\n", stats.removed,
+                stats.loads, stats.stores, stats.folded, stats.jumps,
+                (unsigned long long) stats.cycles);
+        }
+    }
+    if (opts->optimize) {
+        peephole_optimize(instructions, &inst_count,
+            symbol_pairs + PREDEFINED_SYMBOL_COUNT,
+            symbol_pairs_i - PREDEFINED_SYMBOL_COUNT);
+    }
+    if (opts->icf) {
+        fold_identical_code(instructions, &inst_count,
+            symbol_pairs + PREDEFINED_SYMBOL_COUNT,
+            symbol_pairs_i - PREDEFINED_SYMBOL_COUNT);
+    }
+    if (opts->outline) {
+        Outline_Stats stats;
+        size_t label_count = symbol_pairs_i - PREDEFINED_SYMBOL_COUNT;
+        outline_code(&instructions, &inst_count,
+            symbol_pairs + PREDEFINED_SYMBOL_COUNT, &label_count,
+            SYMBOL_PAIRS_SIZE - PREDEFINED_SYMBOL_COUNT, opts->outline,
+            &stats);
+        symbol_pairs_i = PREDEFINED_SYMBOL_COUNT + label_count;
+        printf("outline: %li sequences from %li copies, %li words saved\n",
+            stats.sequences, stats.copies, stats.saved);
+    }
+    if (*opts->layout_file) {
+        Profile profile;
+        Layout_Stats stats;
+        size_t label_count = symbol_pairs_i - PREDEFINED_SYMBOL_COUNT;
+        err = load_profile(opts->layout_file, &profile) ||
+            layout_blocks(&instructions, &inst_count,
+                symbol_pairs + PREDEFINED_SYMBOL_COUNT, &label_count,
+                SYMBOL_PAIRS_SIZE - PREDEFINED_SYMBOL_COUNT, &profile,
+                &stats);
+        symbol_pairs_i = PREDEFINED_SYMBOL_COUNT + label_count;
+        free_profile(&profile);
+        if (err) {
+            free_instructions(instructions, inst_count);
+            return 1;
+        }
+        printf("layout: %li blocks moved, %li jumps removed, %li inverted, "
+            "%li added, %lli cycles saved on the profile\n", stats.moved,
+            stats.removed, stats.inverted, stats.added,
+            (long long) stats.saved);
+    }
+    if (opts->pack) {
+        // Passes may have added variables ('$outline.ret')
+        size_t slot_count;
+        record_variable_order(instructions, inst_count);
+        if (!pack_variables(instructions, inst_count,
+            symbol_pairs + PREDEFINED_SYMBOL_COUNT,
+            symbol_pairs_i - PREDEFINED_SYMBOL_COUNT, variable_order,
+            variable_count, variable_slot, &slot_count)) {
+            printf("pack: %li variables in %li slots\n", variable_count,
+                slot_count);
+        }
+    }
+
+    *instructions_out = instructions;
+    *inst_count_out = inst_count;
+    return 0;
+}
+
+// Fills in symbol values and encodes the instructions. With 'pack' it is
+// an error for variables to reach SCREEN, without it they run on into it
+// as they always have
+// Returns the words on success. Returns NULL on error
+uint16_t *encode_program(Instruction *instructions, size_t inst_count,
+    int pack)
+{
+    // Variables recorded before the optimization passes come first, in
+    // their slots
+    size_t mem = VARIABLE_BASE;
+    for (size_t v = 0; v < variable_count; v++) {
+        if (symbol_pairs_i >= SYMBOL_PAIRS_SIZE) {
+            printf("Too many variables: '%s' doesn't fit in the symbol "
+                "table\n", variable_order[v]);
+            for (; v < variable_count; v++)
+                free(variable_order[v]);
+            variable_count = 0;
+            return NULL;
+        }
+        size_t addr = VARIABLE_BASE + variable_slot[v];
+        symbol_pairs[symbol_pairs_i++] = (Str_Int_Pair) {
+            .p0 = variable_order[v],
+            .p1 = addr,
+        };
+        if (addr >= mem)
+            mem = addr + 1;
+    }
+    variable_count = 0;
+    if (pack && mem > VARIABLE_LIMIT) {
+        printf("Too many variables: %li words needed from %i, past SCREEN\n",
+            mem - VARIABLE_BASE, VARIABLE_BASE);
+        return NULL;
+    }
 
     // First pass
     // Fill in symbol values and set each a_inst.eval to true
-    size_t mem = 16;
     for (size_t i = 0; i < inst_count; i++) {
         if (instructions[i].type == C_INST)
             continue;
@@ -1261,28 +2044,49 @@ int main(int argc, char* argv[])
             printf("FATAL ERROR: unevaluated A_Instruction symbol "
                 "can't be NULL\n");
             printf("Check instruction %li\n", i);
-            return 1;
+            return NULL;
         }
 
         // Scan symbol table TODO use hash func here (when we have hash map)
         Str_Int_Pair *pair = find_pair_by_slice(symbol_pairs, symbol_pairs_i,
             a_inst->symbol);
         // Symbol found in table, evaluate it
+        long value;
         if (pair != NULL) {
-            a_inst->value = pair->p1;
+            value = pair->p1;
         } else {
             // Symbol not found in table
             // Insert symbol into table and assign unused static memory address
             // TODO change to hash map
+            if ((pack && mem >= VARIABLE_LIMIT) ||
+                symbol_pairs_i >= SYMBOL_PAIRS_SIZE) {
+                printf("Too many variables: '");
+                print_slice(a_inst->symbol);
+                if (symbol_pairs_i >= SYMBOL_PAIRS_SIZE)
+                    printf("' doesn't fit in the symbol table\n");
+                else
+                    printf("' would go at %li, in SCREEN\n", mem);
+                return NULL;
+            }
             char *symbol_str = slice_to_str(a_inst->symbol);
             symbol_pairs[symbol_pairs_i++] = (Str_Int_Pair) {
                 .p0 = symbol_str,
                 .p1 = mem, // Assign unused static memory address
             };
-            a_inst->value = mem;
+            value = mem;
             mem++;
         }
 
+        // Fold the offset of '@SYMBOL+n'
+        value += a_inst->offset;
+        if (value < 0 || value > MAX_A_VALUE) {
+            printf("Value of '");
+            print_slice(a_inst->symbol);
+            printf("%+i' out of range (%li)\n", a_inst->offset, value);
+            return NULL;
+        }
+        a_inst->value = value;
+
         // Mark as evaluated
         a_inst->eval = 1;
     }
@@ -1299,53 +2103,266 @@ int main(int argc, char* argv[])
 #endif
 
     // Generate code
+    uint16_t *words = malloc((inst_count + 1) * sizeof(uint16_t));
     for (size_t i = 0; i < inst_count; i++) {
 #if LOG_PARSER_OUTPUT == 1
         printf("[%li]: ", i);
         log_inst(&instructions[i]);
 #endif
-        switch (instructions[i].type) {
-        case A_INST: {
-            *output_buf_p++ = '0';
-            A_Instruction *inst = (A_Instruction*) (instructions[i].inst);
-            char *bin = int15_to_bin_str(inst->value);
-            output_buf_p += copy_str_no_nullterm(output_buf_p, bin);
-            free(bin);
-            *output_buf_p++ = '\n';
-            break;
+        if (instructions[i].type != A_INST && instructions[i].type != C_INST) {
+            printf("Invalid INST_TYPE in instruction %li\n", i);
+            free(words);
+            return NULL;
         }
-        case C_INST: {
-            output_buf_p += copy_str_no_nullterm(output_buf_p, "111");
-            C_Instruction *inst = (C_Instruction*) (instructions[i].inst);
-            output_buf_p += copy_str_no_nullterm(
-                output_buf_p, comp_codes[inst->comp].bin);
-            output_buf_p += copy_str_no_nullterm(
-                output_buf_p, dest_codes[inst->dest].bin);
-            output_buf_p += copy_str_no_nullterm(
-                output_buf_p, jump_codes[inst->jump].bin);
-
-            *output_buf_p++ = '\n';
-            break;
+        words[i] = encode_instruction(instructions + i);
+    }
+
+    return words;
+}
+
+// Returns 'words' as an ASCII-encoded hack binary and sets 'size'
+char *format_hack(uint16_t *words, size_t count, size_t *size)
+{
+    // 16 bytes for the instruction code on each line
+    // 1 byte for newline on each line
+    size_t output_buf_size = sizeof(char) * 17 * count;
+    char *output_buf = malloc(output_buf_size + 1);
+    char *output_buf_p = output_buf;
+    for (size_t i = 0; i < count; i++) {
+        word_to_bin_str(words[i], output_buf_p);
+        output_buf_p += 16;
+        *output_buf_p++ = '\n';
+    }
+    *size = output_buf_size;
+    return output_buf;
+}
+
+// Runs 'words' and/or writes them in the output format. 'labels' name
+// ROM addresses for --perf-map
+// Returns 0 on success, 1 on error
+int output_program(uint16_t *words, size_t count, Str_Int_Pair *labels,
+    size_t label_count, Options *opts)
+{
+    // Run generated code
+    if (opts->run) {
+        if (run_program(words, count, labels, label_count, opts))
+            return 1;
+    }
+
+    // Write C translation
+    int err = 0;
+    if (opts->emit_c && (!opts->run || opts->output_given)) {
+        FILE *f = fopen(opts->output_file, "w");
+        err = f == NULL || emit_c(f, words, count, opts->input_file);
+        // Buffered output may only fail to reach the disk on fclose
+        if (f != NULL)
+            err |= fclose(f) != 0;
+        if (err)
+            printf("Error when writing to '%s'\n", opts->output_file);
+    }
+
+    // Write file
+    if (!opts->emit_c && (!opts->run || opts->output_given)) {
+        size_t output_buf_size;
+        char *output_buf = format_hack(words, count, &output_buf_size);
+        err = write_file(output_buf, opts->output_file, output_buf_size);
+        if (err)
+            printf("Error when writing to '%s'\n", opts->output_file);
+        free(output_buf);
+    }
+
+    return err;
+}
+
+// Assembles one --batch input. 'ctx' points to the command line options
+// Returns the .hack text and sets 'output_path' and 'size'. Returns NULL on
+// error
+char *assemble_batch_file(char *input_buf, char *path, char *output_path,
+    size_t *size, void *ctx)
+{
+    Options opts = *(Options*) ctx;
+    set_input_file(&opts, path);
+    snprintf(output_path, BATCH_PATH_SIZE, "%s", opts.output_file);
+
+    reset_symbol_table();
+    Instruction *instructions;
+    size_t inst_count;
+    if (parse_program(&input_buf, &path, 1, &opts, &instructions,
+        &inst_count)) {
+        printf("Error in '%s'\n", path);
+        return NULL;
+    }
+
+    uint16_t *words = encode_program(instructions, inst_count, opts.pack);
+    free_instructions(instructions, inst_count);
+    if (words == NULL) {
+        printf("Error in '%s'\n", path);
+        return NULL;
+    }
+
+    char *output_buf = format_hack(words, inst_count, size);
+    free(words);
+    return output_buf;
+}
+
+// Disassembles the .hack input_file into output_file, with the labels of
+// the --map file if given (-d)
+// Returns 0 on success, 1 on error
+int disassemble_program(Options *opts)
+{
+    size_t size;
+    char *buf = load_file(opts->input_file, &size);
+    if (buf == NULL)
+        return 1;
+    size_t count;
+    uint16_t *words = read_hack(buf, size, opts->input_file, &count);
+    free(buf);
+    if (words == NULL)
+        return 1;
+
+    Str_Int_Pair *labels = NULL;
+    size_t label_count = 0;
+    if (*opts->map_file) {
+        labels = read_symbol_map(opts->map_file, &label_count);
+        if (labels == NULL) {
+            free(words);
+            return 1;
         }
-        default:
-            printf("Invalid INST_TYPE in instruction %li\n", i);
+    }
+
+    int err = 0;
+    FILE *f = fopen(opts->output_file, "w");
+    err = f == NULL || write_disassembly(f, words, count, labels,
+        label_count);
+    if (f != NULL)
+        err |= fclose(f) != 0;
+    if (err)
+        printf("Error when writing to '%s'\n", opts->output_file);
+
+    free_symbol_map(labels, label_count);
+    free(words);
+    return err;
+}
+
+int main(int argc, char* argv[])
+{
+    Options opts;
+    char error_text[ERR_TEXT_SIZE];
+
+    // Parse arguments
+    int err = parse_arguments(argc, argv, &opts, error_text);
+    if (err == 1) {
+        printf("%s\n", error_text);
+        return 1;
+    }
+
+    if (opts.disassemble) {
+        err = disassemble_program(&opts);
+        free(opts.input_files);
+        return err;
+    }
+
+    // Link objects
+    if (opts.link) {
+        size_t count;
+        uint16_t *words = link_objects(opts.input_files, opts.input_count,
+            &count);
+        if (words == NULL)
+            return 1;
+        err = output_program(words, count, NULL, 0, &opts);
+        free(words);
+        return err;
+    }
+
+    // Assemble every input file, overlapping file I/O with assembly
+    if (opts.batch) {
+        Batch_Stats stats;
+        err = run_batch(opts.input_files, opts.input_count, opts.io,
+            assemble_batch_file, &opts, &stats);
+        printf("%li files (%li failed) in %.3f s, %.0f files/s (%s)\n",
+            stats.files, stats.failed, stats.seconds,
+            stats.seconds > 0 ? stats.files / stats.seconds : 0.0,
+            batch_io_name(stats.io));
+        free(opts.input_files);
+        return err;
+    }
+
+    // Completely read files into buffers
+    char **input_bufs = malloc(opts.input_count * sizeof(char*));
+    for (size_t i = 0; i < opts.input_count; i++) {
+        input_bufs[i] = load_file(opts.input_files[i], NULL);
+        if (input_bufs[i] == NULL)
             return 1;
+    }
+
+    // Parse code into instruction array and populate symbol table with labels
+    Instruction *instructions;
+    size_t inst_count;
+    if (parse_program(input_bufs, opts.input_files, opts.input_count, &opts,
+        &instructions, &inst_count))
+        return 1;
+
+    // Write code as .asm instead of resolving
+    if (opts.emit_asm) {
+        FILE *f = fopen(opts.output_file, "w");
+        int bad = f == NULL || write_asm(f, instructions, inst_count,
+            symbol_pairs + PREDEFINED_SYMBOL_COUNT,
+            symbol_pairs_i - PREDEFINED_SYMBOL_COUNT);
+        if (f != NULL)
+            bad |= fclose(f) != 0;
+        if (bad) {
+            printf("Error when writing to '%s'\n", opts.output_file);
+            err = 1;
+        }
+
+        free_input_bufs(input_bufs, opts.input_count);
+        free_instructions(instructions, inst_count);
+        return err;
+    }
+
+    // Write labels and symbol references for --link instead of resolving
+    if (opts.compile) {
+        FILE *f = fopen(opts.output_file, "w");
+        int bad = f == NULL || write_object(f, instructions, inst_count,
+            symbol_pairs, PREDEFINED_SYMBOL_COUNT,
+            symbol_pairs + PREDEFINED_SYMBOL_COUNT,
+            symbol_pairs_i - PREDEFINED_SYMBOL_COUNT);
+        if (f != NULL)
+            bad |= fclose(f) != 0;
+        if (bad) {
+            printf("Error when writing to '%s'\n", opts.output_file);
+            err = 1;
         }
+
+        free_input_bufs(input_bufs, opts.input_count);
+        free_instructions(instructions, inst_count);
+        return err;
     }
 
-    *output_buf_p++ = '\0';
+    // Labels come before the variables encoding adds to the symbol table
+    size_t label_count = symbol_pairs_i - PREDEFINED_SYMBOL_COUNT;
+    uint16_t *words = encode_program(instructions, inst_count, opts.pack);
+    if (words == NULL)
+        return 1;
 
-    // Write file (size - 1 to exclude null terminator)
-    int error = write_file(output_buf, output_file_path, output_buf_size - 1);
-    if (error) {
-        printf("Error when writing to '%s'\n", output_file_path);
+    if (*opts.map_file) {
+        FILE *f = fopen(opts.map_file, "w");
+        int bad = f == NULL || write_symbol_map(f,
+            symbol_pairs + PREDEFINED_SYMBOL_COUNT, label_count);
+        if (f != NULL)
+            bad |= fclose(f) != 0;
+        if (bad) {
+            printf("Error when writing to '%s'\n", opts.map_file);
+            err = 1;
+        }
     }
+    err |= output_program(words, inst_count,
+        symbol_pairs + PREDEFINED_SYMBOL_COUNT, label_count, &opts);
 
     // Free all memory
-    free(input_buf);
-    for (size_t i = 0; i < inst_count; i++)
-        free_instruction(instructions + i);
-    free(instructions);
-    free(output_buf);
-    return 0;
+    free_input_bufs(input_bufs, opts.input_count);
+    free_instructions(instructions, inst_count);
+    free(words);
+    free(opts.input_files);
+    return err;
 }
@@ -0,0 +1,587 @@
+#include <stdlib.h>
+#include <string.h>
+#include "idiom.h"
+
+/*
+ Loop idioms, run in bulk by the threaded engine.
+
+ Fill.asm and Rect.asm spend their cycles in loops like
+
+     (LOOP)
+         @address
+         A=M
+         M=-1        // store through a pointer
+         @address
+         D=M
+         @32
+         D=D+A
+         @address
+         M=D         // step it by a constant
+         @counter
+         MD=M-1
+         @LOOP
+         D;JGT       // until a counter runs out
+
+ A loop here is a straight run of instructions from its head to a jump
+ back to it, which only conditional jumps leave. Its variables are the
+ cells at constant addresses and the registers it reads before writing
+ them. One iteration is run on values that are linear forms of the
+ variables, c + k0 * v0 + k1 * v1 + ... (mod 2^16), which Hack's
+ additions, negations and moves keep linear. The loop is kept if every
+ variable ends the iteration stepped by a constant, the values it
+ leaves are linear, its exits and pointers depend only on the variables
+ and it does at most one load and one store through a pointer (A not
+ constant). The value stored may also depend on the value loaded.
+
+ On reaching a kept loop's head, the forms tell how many iterations
+ run before one would leave the loop, touch a variable's cell through a
+ pointer, or pass the cycle limit. Those run at once: as a fill when
+ every one stores the same value to the next address, as a memmove for
+ copies whose regions don't overlap in a way that changes the result,
+ and as a loop of just the loads and stores otherwise. Then the cells
+ and registers are set as the last of them leaves them. The iteration
+ that leaves the loop runs as usual, so exits and the cycle limit land
+ exactly where they would without this.
+*/
+
+#define MAX_LOOP_LENGTH                    64
+#define MAX_LOOP_VARS                      8
+#define MAX_LOOP_CELLS                     16
+#define MAX_LOOP_EXITS                     4
+#define MAX_BULK_ITERATIONS                0x10000
+#define NO_HIT                             UINT64_MAX
+
+// Locations of variables other than RAM cells
+#define LOC_A                              0x8000
+#define LOC_D                              0x8001
+#define LOC_LOAD                           0x8002 // loaded through a pointer
+
+// c + k[0] * v0 + k[1] * v1 + ... (mod 2^16), if 'linear'
+typedef struct {
+    int linear;
+    uint16_t c;
+    uint16_t k[MAX_LOOP_VARS];
+} Form;
+
+typedef struct {
+    uint16_t loc; // RAM address, LOC_A, LOC_D or LOC_LOAD
+    uint16_t step; // added by each iteration
+} Var;
+
+// Value an iteration leaves in a cell or register
+typedef struct {
+    uint16_t loc;
+    Form form;
+} Output;
+
+typedef struct {
+    Form form; // of the ALU output the jump tests
+    uint8_t jump;
+    uint8_t leave_if; // whether the loop is left when the jump is taken
+} Exit;
+
+struct Loop_Idiom {
+    uint16_t length; // instructions, so cycles, per iteration
+    Var vars[MAX_LOOP_VARS];
+    size_t var_count;
+    Output outputs[MAX_LOOP_CELLS + 2]; // cells written, A and D
+    size_t output_count;
+    uint16_t cells[MAX_LOOP_CELLS]; // constant addresses accessed
+    size_t cell_count;
+    Exit exits[MAX_LOOP_EXITS];
+    size_t exit_count;
+    int load; // whether there's a load through a pointer
+    int store; // whether there's a store through a pointer
+    int load_first; // whether the load comes before the store
+    Form load_addr;
+    Form store_addr;
+    Form store_value;
+};
+
+// One iteration being run on forms
+typedef struct {
+    Loop_Idiom *loop;
+    Form a;
+    Form d;
+    int a_set; // whether A was written, otherwise it's a variable
+    int d_set;
+    int bad; // the loop can't be kept
+} Sym;
+
+static Form constant(uint16_t c)
+{
+    Form f;
+    memset(&f, 0, sizeof(f));
+    f.linear = 1;
+    f.c = c;
+    return f;
+}
+
+static int is_constant(Form *f)
+{
+    if (!f->linear)
+        return 0;
+    for (size_t i = 0; i < MAX_LOOP_VARS; i++) {
+        if (f->k[i])
+            return 0;
+    }
+    return 1;
+}
+
+static Form add(Form x, Form y)
+{
+    x.linear = x.linear && y.linear;
+    x.c += y.c;
+    for (size_t i = 0; i < MAX_LOOP_VARS; i++)
+        x.k[i] += y.k[i];
+    return x;
+}
+
+// ~x, which is -x - 1
+static Form complement(Form x)
+{
+    x.c = -x.c - 1;
+    for (size_t i = 0; i < MAX_LOOP_VARS; i++)
+        x.k[i] = -x.k[i];
+    return x;
+}
+
+// Runs comp code 'op' on forms, as alu() does on values. Adding keeps
+// forms linear, and so does AND with a constant 0 or -1
+static Form alu_form(uint8_t op, Form x, Form y)
+{
+    if (op & 0x20) x = constant(0);
+    if (op & 0x10) x = complement(x);
+    if (op & 0x08) y = constant(0);
+    if (op & 0x04) y = complement(y);
+
+    Form out;
+    if (op & 0x02)
+        out = add(x, y);
+    else if (is_constant(&x) && is_constant(&y))
+        out = constant(x.c & y.c);
+    else if ((is_constant(&x) && x.c == 0) || (is_constant(&y) && y.c == 0))
+        out = constant(0);
+    else if (is_constant(&x) && x.c == 0xFFFF)
+        out = y;
+    else if (is_constant(&y) && y.c == 0xFFFF)
+        out = x;
+    else {
+        out = constant(0);
+        out.linear = 0;
+    }
+
+    if (op & 0x01) out = complement(out);
+    return out;
+}
+
+// Returns the form of variable 'loc', adding it if it's new
+static Form var_form(Sym *s, uint16_t loc)
+{
+    Loop_Idiom *loop = s->loop;
+    size_t i = 0;
+    while (i < loop->var_count && loop->vars[i].loc != loc)
+        i++;
+    if (i == MAX_LOOP_VARS) {
+        s->bad = 1;
+        return constant(0);
+    }
+    if (i == loop->var_count)
+        loop->vars[loop->var_count++] = (Var) { .loc = loc };
+    Form f = constant(0);
+    f.k[i] = 1;
+    return f;
+}
+
+static void add_cell(Sym *s, uint16_t addr)
+{
+    Loop_Idiom *loop = s->loop;
+    for (size_t i = 0; i < loop->cell_count; i++) {
+        if (loop->cells[i] == addr)
+            return;
+    }
+    if (loop->cell_count == MAX_LOOP_CELLS)
+        s->bad = 1;
+    else
+        loop->cells[loop->cell_count++] = addr;
+}
+
+static Output *find_output(Loop_Idiom *loop, uint16_t loc)
+{
+    for (size_t i = 0; i < loop->output_count; i++) {
+        if (loop->outputs[i].loc == loc)
+            return loop->outputs + i;
+    }
+    return NULL;
+}
+
+// Whether 'f' depends on the value loaded through a pointer
+static int uses_load(Loop_Idiom *loop, Form *f)
+{
+    for (size_t i = 0; i < loop->var_count; i++) {
+        if (loop->vars[i].loc == LOC_LOAD && f->k[i])
+            return 1;
+    }
+    return 0;
+}
+
+// Whether 'f' is a linear form of the variables alone
+static int depends_on_vars(Loop_Idiom *loop, Form *f)
+{
+    return f->linear && !uses_load(loop, f);
+}
+
+static Form load(Sym *s, Form addr)
+{
+    Loop_Idiom *loop = s->loop;
+    if (is_constant(&addr)) {
+        uint16_t cell = addr.c & 0x7FFF;
+        add_cell(s, cell);
+        Output *o = find_output(loop, cell);
+        return o ? o->form : var_form(s, cell);
+    }
+    if (loop->load || !depends_on_vars(loop, &addr)) {
+        s->bad = 1;
+        return constant(0);
+    }
+    loop->load = 1;
+    loop->load_first = !loop->store;
+    loop->load_addr = addr;
+    return var_form(s, LOC_LOAD);
+}
+
+static void store(Sym *s, Form addr, Form value)
+{
+    Loop_Idiom *loop = s->loop;
+    if (!value.linear) {
+        s->bad = 1;
+    } else if (is_constant(&addr)) {
+        uint16_t cell = addr.c & 0x7FFF;
+        add_cell(s, cell);
+        Output *o = find_output(loop, cell);
+        if (o == NULL && loop->output_count == MAX_LOOP_CELLS)
+            s->bad = 1;
+        else if (o == NULL)
+            loop->outputs[loop->output_count++] = (Output) { cell, value };
+        else
+            o->form = value;
+    } else if (loop->store || !depends_on_vars(loop, &addr)) {
+        s->bad = 1;
+    } else {
+        loop->store = 1;
+        loop->store_addr = addr;
+        loop->store_value = value;
+    }
+}
+
+static void add_exit(Sym *s, Form out, uint8_t jump, int leave_if)
+{
+    Loop_Idiom *loop = s->loop;
+    if (loop->exit_count == MAX_LOOP_EXITS || !depends_on_vars(loop, &out)) {
+        s->bad = 1;
+        return;
+    }
+    loop->exits[loop->exit_count++] = (Exit) {
+        .form = out,
+        .jump = jump,
+        .leave_if = leave_if,
+    };
+}
+
+// Form a location is left with after an iteration
+static Form end_form(Sym *s, uint16_t loc, size_t var)
+{
+    if (loc == LOC_A && s->a_set)
+        return s->a;
+    if (loc == LOC_D && s->d_set)
+        return s->d;
+    Output *o = loc < LOC_A ? find_output(s->loop, loc) : NULL;
+    if (o != NULL)
+        return o->form;
+    Form f = constant(0);
+    f.k[var] = 1;
+    return f;
+}
+
+// Runs the instructions from 'head' to 'end', which jumps back to 'head',
+// on forms
+// Returns the loop, or NULL if it can't be kept
+static Loop_Idiom *analyze(Decoded *code, size_t head, size_t end)
+{
+    Loop_Idiom *loop = calloc(1, sizeof(Loop_Idiom));
+    Sym s = { .loop = loop };
+    loop->length = end - head + 1;
+
+    for (size_t pc = head; pc <= end && !s.bad; pc++) {
+        Decoded *in = code + pc;
+        if (in->op == OP_HALT) {
+            s.bad = 1;
+            break;
+        }
+        if (in->op == OP_A) {
+            s.a = constant(in->value);
+            s.a_set = 1;
+            continue;
+        }
+
+        // Only read the registers used, so that they aren't made variables
+        int uses_x = !(in->op & 0x20);
+        int uses_y = !(in->op & 0x08);
+        int reads_m = uses_y && (in->op & 0x40);
+        int uses_a = (uses_y && !(in->op & 0x40)) || reads_m ||
+            (in->dest & 1) || in->jump;
+        Form a = !uses_a ? constant(0) : s.a_set ? s.a : var_form(&s, LOC_A);
+        Form x = !uses_x ? constant(0) : s.d_set ? s.d : var_form(&s, LOC_D);
+        Form m = reads_m ? load(&s, a) : constant(0);
+        Form out = alu_form(in->op, x, (in->op & 0x40) ? m : a);
+
+        // M is addressed by A before this instruction writes it
+        if (in->dest & 1)
+            store(&s, a, out);
+        if (in->dest & 4) {
+            s.a = out;
+            s.a_set = 1;
+        }
+        if (in->dest & 2) {
+            s.d = out;
+            s.d_set = 1;
+        }
+
+        if (in->jump) {
+            size_t target = a.c & 0x7FFF;
+            if (!is_constant(&a))
+                s.bad = 1;
+            else if (pc == end && target != head)
+                s.bad = 1;
+            else if (pc == end && in->jump != 7)
+                add_exit(&s, out, in->jump, 0);
+            else if (pc < end && (in->jump == 7 ||
+                (target >= head && target <= end)))
+                s.bad = 1;
+            else if (pc < end)
+                add_exit(&s, out, in->jump, 1);
+        }
+    }
+
+    // Every variable must step by a constant
+    for (size_t i = 0; i < loop->var_count && !s.bad; i++) {
+        if (loop->vars[i].loc == LOC_LOAD)
+            continue;
+        Form f = end_form(&s, loop->vars[i].loc, i);
+        Form v = constant(0);
+        v.k[i] = 1;
+        v.c = f.c;
+        if (!f.linear || memcmp(f.k, v.k, sizeof(v.k)) != 0)
+            s.bad = 1;
+        loop->vars[i].step = f.c;
+    }
+
+    // Registers left as forms are set after running in bulk
+    if (s.a_set)
+        loop->outputs[loop->output_count++] = (Output) { LOC_A, s.a };
+    if (s.d_set)
+        loop->outputs[loop->output_count++] = (Output) { LOC_D, s.d };
+    for (size_t i = 0; i < loop->output_count; i++) {
+        if (!loop->outputs[i].form.linear)
+            s.bad = 1;
+    }
+
+    if (s.bad) {
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+// Finds the loops the threaded engine can run in bulk
+// Returns the loop starting at each ROM address, or NULL there
+Loop_Idiom **idiom_find_loops(Decoded *code, size_t rom_size)
+{
+    Loop_Idiom **loops = calloc(rom_size + 1, sizeof(Loop_Idiom*));
+    for (size_t end = 1; end < rom_size; end++) {
+        // '@head', 'X;JMP'-like jump back to an earlier instruction
+        Decoded *in = code + end;
+        Decoded *at = code + end - 1;
+        if (in->op >= OP_A || !in->jump || at->op != OP_A ||
+            at->value > end || end - at->value >= MAX_LOOP_LENGTH ||
+            loops[at->value] != NULL)
+            continue;
+        loops[at->value] = analyze(code, at->value, end);
+    }
+    return loops;
+}
+
+void idiom_free_loops(Loop_Idiom **loops, size_t rom_size)
+{
+    if (loops == NULL)
+        return;
+    for (size_t i = 0; i <= rom_size; i++)
+        free(loops[i]);
+    free(loops);
+}
+
+static uint16_t eval(Form *f, uint16_t *v, size_t var_count)
+{
+    uint16_t x = f->c;
+    for (size_t i = 0; i < var_count; i++)
+        x += (uint32_t) f->k[i] * v[i];
+    return x;
+}
+
+// What each iteration adds to 'f', not counting the loaded value
+static uint16_t step_of(Loop_Idiom *loop, Form *f)
+{
+    uint16_t x = 0;
+    for (size_t i = 0; i < loop->var_count; i++)
+        x += (uint32_t) f->k[i] * loop->vars[i].step;
+    return x;
+}
+
+static int jump_taken(uint8_t jump, uint16_t out)
+{
+    int16_t v = (int16_t) out;
+    return (jump & 4 && v < 0) || (jump & 2 && v == 0) || (jump & 1 && v > 0);
+}
+
+// Returns the first iteration a pointer starting at 'p' and adding 'step'
+// each iteration addresses cell 'cell' in, or NO_HIT if it never does
+static uint64_t first_hit(uint16_t p, uint16_t step, uint16_t cell)
+{
+    // Addresses are 15 bits: solve p + k * step = cell (mod 2^15)
+    uint32_t delta = (cell - p) & 0x7FFF;
+    step &= 0x7FFF;
+    if (step == 0)
+        return delta == 0 ? 0 : NO_HIT;
+    int shift = __builtin_ctz(step);
+    if (delta & ((1u << shift) - 1))
+        return NO_HIT;
+    uint32_t mask = (0x8000u >> shift) - 1;
+    uint32_t odd = step >> shift;
+    // Inverse of 'odd' mod 2^16 by Newton's method, each step doubling
+    // the bits that are right
+    uint32_t inv = odd;
+    for (int i = 0; i < 4; i++)
+        inv *= 2 - odd * inv;
+    return ((delta >> shift) * inv) & mask;
+}
+
+// Runs the whole iterations of 'loop', which starts at the CPU's pc, that
+// come before one leaves it and end by cycle 'end'
+void idiom_run(Loop_Idiom *loop, Hack_CPU *cpu, uint64_t end)
+{
+    uint16_t *ram = cpu->ram;
+    uint64_t n = (end - cpu->cycles) / loop->length;
+    if (n > MAX_BULK_ITERATIONS)
+        n = MAX_BULK_ITERATIONS;
+
+    size_t var_count = loop->var_count;
+    uint16_t v[MAX_LOOP_VARS];
+    for (size_t i = 0; i < var_count; i++) {
+        uint16_t loc = loop->vars[i].loc;
+        v[i] = loc == LOC_A ? cpu->a : loc == LOC_D ? cpu->d :
+            loc == LOC_LOAD ? 0 : ram[loc];
+    }
+
+    // Stop before the first iteration that leaves
+    for (size_t i = 0; i < loop->exit_count && n > 0; i++) {
+        Exit *e = loop->exits + i;
+        uint16_t x = eval(&e->form, v, var_count);
+        uint16_t step = step_of(loop, &e->form);
+        if (step == 0) {
+            if (jump_taken(e->jump, x) == e->leave_if)
+                n = 0;
+            continue;
+        }
+        for (uint64_t k = 0; k < n; k++, x += step) {
+            if (jump_taken(e->jump, x) == e->leave_if) {
+                n = k;
+                break;
+            }
+        }
+    }
+
+    // and before the first that loads or stores a variable's cell through
+    // a pointer
+    uint16_t load_p = 0, load_step = 0, store_p = 0, store_step = 0;
+    if (loop->load) {
+        load_p = eval(&loop->load_addr, v, var_count);
+        load_step = step_of(loop, &loop->load_addr);
+    }
+    if (loop->store) {
+        store_p = eval(&loop->store_addr, v, var_count);
+        store_step = step_of(loop, &loop->store_addr);
+    }
+    for (size_t i = 0; i < loop->cell_count; i++) {
+        uint64_t k = loop->load ?
+            first_hit(load_p, load_step, loop->cells[i]) : NO_HIT;
+        if (k < n)
+            n = k;
+        k = loop->store ?
+            first_hit(store_p, store_step, loop->cells[i]) : NO_HIT;
+        if (k < n)
+            n = k;
+    }
+    if (n == 0)
+        return;
+
+    // Value stored: 'value' + k * 'value_step' + 'load_k' * loaded value
+    uint16_t value = 0, value_step = 0, load_k = 0;
+    for (size_t i = 0; i < var_count; i++) {
+        if (loop->vars[i].loc == LOC_LOAD)
+            load_k = loop->store_value.k[i];
+    }
+    if (loop->store) {
+        value = eval(&loop->store_value, v, var_count);
+        value_step = step_of(loop, &loop->store_value);
+    }
+
+    uint16_t loaded = 0;
+    int copy = loop->load && loop->store && loop->load_first &&
+        load_k == 1 && value == 0 && value_step == 0 && load_step == 1 &&
+        store_step == 1;
+    if (loop->store && !loop->load && value_step == 0 && store_step == 1 &&
+        store_p + n <= RAM_SIZE) {
+        uint16_t *p = ram + store_p;
+        for (uint64_t k = 0; k < n; k++)
+            p[k] = value;
+    } else if (copy && load_p + n <= RAM_SIZE && store_p + n <= RAM_SIZE &&
+        (store_p <= load_p || store_p >= load_p + n)) {
+        // Copying up to lower addresses reads each word before it's
+        // written, as the loop would
+        loaded = ram[load_p + n - 1];
+        memmove(ram + store_p, ram + load_p, n * sizeof(uint16_t));
+    } else if (loop->load || loop->store) {
+        for (uint64_t k = 0; k < n; k++) {
+            uint16_t at = store_p + k * store_step;
+            if (loop->load && loop->load_first)
+                loaded = ram[(uint16_t) (load_p + k * load_step) & 0x7FFF];
+            if (loop->store) {
+                ram[at & 0x7FFF] = value + k * value_step +
+                    (uint32_t) load_k * loaded;
+            }
+            if (loop->load && !loop->load_first)
+                loaded = ram[(uint16_t) (load_p + k * load_step) & 0x7FFF];
+        }
+    }
+
+    // Leave cells and registers as the last iteration does
+    for (size_t i = 0; i < var_count; i++) {
+        if (loop->vars[i].loc == LOC_LOAD)
+            v[i] = loaded;
+        else
+            v[i] += (n - 1) * loop->vars[i].step;
+    }
+    uint16_t out[MAX_LOOP_CELLS + 2];
+    for (size_t i = 0; i < loop->output_count; i++)
+        out[i] = eval(&loop->outputs[i].form, v, var_count);
+    for (size_t i = 0; i < loop->output_count; i++) {
+        uint16_t loc = loop->outputs[i].loc;
+        if (loc == LOC_A)
+            cpu->a = out[i];
+        else if (loc == LOC_D)
+            cpu->d = out[i];
+        else
+            ram[loc] = out[i];
+    }
+    cpu->cycles += n * loop->length;
+}
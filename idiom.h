@@ -0,0 +1,14 @@
+#ifndef IDIOM_H
+#define IDIOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "emu.h"
+
+typedef struct Loop_Idiom Loop_Idiom;
+
+Loop_Idiom **idiom_find_loops(Decoded *code, size_t rom_size);
+void idiom_free_loops(Loop_Idiom **loops, size_t rom_size);
+void idiom_run(Loop_Idiom *loop, Hack_CPU *cpu, uint64_t end);
+
+#endif // IDIOM_H
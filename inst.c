@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inst.h"
+
+// TODO use hash table instead of this jandaba
+/*const Subinst_Code comp_codes[] = {
+    { "0",   "0101010" },
+    { "1",   "0111111" },
+    { "-1",  "0111010" },
+    { "D",   "0001100" },
+    { "A",   "0110000" }, { "M",   "" },
+    { "D+A", "0000010" },
+    { "D|A", "0010101" }, { "D|M", "1010101" },
+};*/
+
+// Comp translation codes
+const Subinst_Code comp_codes[] = {
+    { "",    COMP_NULL,      "0101010" },
+    { "0",   COMP_0,         "0101010" },
+    { "1",   COMP_1,         "0111111" },
+    { "-1",  COMP_MINUS_1,   "0111010" },
+    { "D",   COMP_D,         "0001100" },
+    { "A",   COMP_A,         "0110000" }, { "M",   COMP_M,         "1110000" },
+    { "!D",  COMP_NOT_D,     "0001101" },
+    { "!A",  COMP_NOT_A,     "0110001" }, { "!M",  COMP_NOT_M,     "1110001" },
+    { "-D",  COMP_MINUS_D,   "0001111" },
+    { "-A",  COMP_MINUS_A,   "0110011" }, { "-M",  COMP_MINUS_M,   "1110011" },
+    { "D+1", COMP_D_PLUS_1,  "0011111" },
+    { "A+1", COMP_A_PLUS_1,  "0110111" }, { "M+1", COMP_M_PLUS_1,  "1110111" },
+    { "D-1", COMP_D_MINUS_1, "0001110" },
+    { "A-1", COMP_A_MINUS_1, "0110010" }, { "M-1", COMP_M_MINUS_1, "1110010" },
+    { "D+A", COMP_D_PLUS_A,  "0000010" }, { "D+M", COMP_D_PLUS_M,  "1000010" },
+    { "A+D", COMP_A_PLUS_D,  "0000010" }, { "M+D", COMP_M_PLUS_D,  "1000010" },
+    { "D-A", COMP_D_MINUS_A, "0010011" }, { "D-M", COMP_D_MINUS_M, "1010011" },
+    { "A-D", COMP_A_MINUS_D, "0000111" }, { "M-D", COMP_M_MINUS_D, "1000111" },
+    { "D&A", COMP_D_AND_A,   "0000000" }, { "D&M", COMP_D_AND_M,   "1000000" },
+    { "D|A", COMP_D_OR_A,    "0010101" }, { "D|M", COMP_D_OR_M,    "1010101" },
+    { "A&D", COMP_A_AND_D,   "0000000" }, { "M&D", COMP_M_AND_D,   "1000000" },
+    { "A|D", COMP_A_OR_D,    "0010101" }, { "M|D", COMP_M_OR_D,    "1010101" },
+};
+const size_t comp_code_count = sizeof(comp_codes) / sizeof(Subinst_Code);
+
+// Dest translation codes
+const Subinst_Code dest_codes[] = {
+    { "",    DEST_NULL, "000" },
+    { "M",   DEST_M,    "001" },
+    { "D",   DEST_D,    "010" },
+    { "MD",  DEST_MD,   "011" },
+    { "A",   DEST_A,    "100" },
+    { "AM",  DEST_AM,   "101" },
+    { "AD",  DEST_AD,   "110" },
+    { "AMD", DEST_AMD,  "111" },
+};
+const size_t dest_code_count = sizeof(dest_codes) / sizeof(Subinst_Code);
+
+// Jump translation codes
+const Subinst_Code jump_codes[] = {
+    { "",    JUMP_NULL, "000" },
+    { "JGT", JGT,       "001" },
+    { "JEQ", JEQ,       "010" },
+    { "JGE", JGE,       "011" },
+    { "JLT", JLT,       "100" },
+    { "JNE", JNE,       "101" },
+    { "JLE", JLE,       "110" },
+    { "JMP", JMP,       "111" },
+};
+const size_t jump_code_count = sizeof(jump_codes) / sizeof(Subinst_Code);
+
+// Copies Slice string into a malloced null-terminated string
+// Returns pointer to new string
+// NOTE: Only use for debugging & logging!
+char *slice_to_str(Slice *slice)
+{
+    size_t slice_len = slice->end - slice->start + 1;
+    char *str = malloc(sizeof(char) * (slice_len + 1));
+    memcpy(str, slice->start, sizeof(char) * slice_len);
+    str[slice_len] = '\0';
+    return str;
+}
+
+// Return 0 if string and slice are equal. Return 1 otherwise
+char cmp_str_slice(char *str, Slice *slice)
+{
+    char *slice_p = slice->start;
+    while (*str && slice_p <= slice->end) {
+        if (*str != *slice_p)
+            return 1;
+        slice_p++;
+        str++;
+    }
+
+    if (*str == '\0' && slice_p == slice->end + 1)
+        return 0;
+
+    return 1;
+}
+
+// Return 0 if both slices hold the same string. Return 1 otherwise
+int cmp_slices(Slice *a, Slice *b)
+{
+    size_t a_len = a->end - a->start + 1;
+    size_t b_len = b->end - b->start + 1;
+    if (a_len != b_len)
+        return 1;
+
+    return memcmp(a->start, b->start, a_len) != 0;
+}
+
+// Returns 1 if 'comp' reads register 'reg' ('A', 'D' or 'M')
+// Returns 0 otherwise
+int comp_reads(enum COMP comp, char reg)
+{
+    if (comp >= COMP_PARSE_ERROR)
+        return 0;
+    return strchr(comp_codes[comp].str, reg) != NULL;
+}
+
+void free_instruction(Instruction *i)
+{
+    if (i->type == A_INST) {
+        A_Instruction* a = (A_Instruction*) i->inst;
+        if (a->symbol)
+            free(a->symbol);
+    }
+    free(i->inst);
+}
+
+// Returns a new A-instruction loading symbol 'name'. The symbol text is
+// stored right after its Slice, so free_instruction frees both
+Instruction new_a_symbol(char *name)
+{
+    size_t len = strlen(name);
+    Slice *s = malloc(sizeof(Slice) + len + 1);
+    char *text = (char*) (s + 1);
+    memcpy(text, name, len + 1);
+    *s = (Slice) { .start = text, .end = text + len - 1 };
+
+    A_Instruction *a = malloc(sizeof(A_Instruction));
+    *a = (A_Instruction) { .symbol = s, .value = 0, .eval = 0 };
+    return (Instruction) { .type = A_INST, .inst = a };
+}
+
+Instruction new_c_instruction(enum DEST dest, enum COMP comp, enum JUMP jump)
+{
+    C_Instruction *c = malloc(sizeof(C_Instruction));
+    *c = (C_Instruction) { .dest = dest, .comp = comp, .jump = jump };
+    return (Instruction) { .type = C_INST, .inst = c };
+}
+
+// Parses ascii binary string like "0101010"
+static unsigned int bin_str_to_int(char *str)
+{
+    unsigned int n = 0;
+    for (; *str; str++)
+        n = (n << 1) | (*str - '0');
+    return n;
+}
+
+// Encodes instruction into a 16-bit hack machine word
+uint16_t encode_instruction(Instruction *i)
+{
+    if (i->type == A_INST) {
+        A_Instruction *a = (A_Instruction*) i->inst;
+        return a->value & 0x7FFF;
+    }
+
+    C_Instruction *c = (C_Instruction*) i->inst;
+    return 0xE000 | bin_str_to_int(comp_codes[c->comp].bin) << 6 |
+        c->dest << 3 | c->jump;
+}
+
+// Writes 'word' as 16 ascii '0' and '1' chars into 'str' (not terminated)
+void word_to_bin_str(uint16_t word, char *str)
+{
+    for (int i = 15; i >= 0; i--) {
+        str[i] = '0' + (word & 1);
+        word >>= 1;
+    }
+}
+
+// Returns the first comp whose 7 bits (a-bit included) are 'bits'
+// Returns COMP_NULL if no mnemonic encodes to 'bits'
+static enum COMP comp_of_bits(unsigned int bits)
+{
+    for (size_t i = 1; i < comp_code_count; i++) {
+        if (bin_str_to_int(comp_codes[i].bin) == bits)
+            return comp_codes[i].code;
+    }
+    return COMP_NULL;
+}
+
+// Decodes C-instruction 'word' into 'c'
+// Returns 0 on success, 1 if its comp bits have no mnemonic
+int decode_c_instruction(uint16_t word, C_Instruction *c)
+{
+    c->comp = comp_of_bits((word >> 6) & 0x7F);
+    c->dest = (word >> 3) & 7;
+    c->jump = word & 7;
+    return c->comp == COMP_NULL;
+}
+
+// Writes assembly mnemonic of 'word' into 'buf' (Ex: '@17', 'AM=M-1;JMP')
+// 'buf' must fit at least 16 chars
+// Returns number of chars written
+int format_word(uint16_t word, char *buf)
+{
+    if (!(word & 0x8000))
+        return sprintf(buf, "@%u", word);
+
+    C_Instruction c;
+    int unknown = decode_c_instruction(word, &c);
+    int n = 0;
+    if (c.dest != DEST_NULL)
+        n += sprintf(buf + n, "%s=", dest_codes[c.dest].str);
+    if (unknown)
+        n += sprintf(buf + n, "?%02X", (word >> 6) & 0x7F);
+    else
+        n += sprintf(buf + n, "%s", comp_codes[c.comp].str);
+    if (c.jump != JUMP_NULL)
+        n += sprintf(buf + n, ";%s", jump_codes[c.jump].str);
+    return n;
+}
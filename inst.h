@@ -0,0 +1,114 @@
+#ifndef INST_H
+#define INST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// String, but defined by a range in memory (inclusive)
+// Doesn't have to be null-terminated
+typedef struct {
+    char *start; // inclusive
+    char *end; // inclusive
+} Slice;
+
+typedef struct {
+    char *p0;
+    int p1;
+}  Str_Int_Pair;
+
+// Subinstruction can be 'comp', 'dest', 'jump'...
+typedef struct {
+    char *str;
+    size_t code;
+    char *bin;
+} Subinst_Code;
+
+// Comp syntax definition
+enum COMP {
+    COMP_NULL = 0,
+    COMP_0,
+    COMP_1,
+    COMP_MINUS_1,
+    COMP_D,
+    COMP_A,          COMP_M,
+    COMP_NOT_D,
+    COMP_NOT_A,      COMP_NOT_M,
+    COMP_MINUS_D,
+    COMP_MINUS_A,    COMP_MINUS_M,
+    COMP_D_PLUS_1,
+    COMP_A_PLUS_1,   COMP_M_PLUS_1,
+    COMP_D_MINUS_1,
+    COMP_A_MINUS_1,  COMP_M_MINUS_1,
+    COMP_D_PLUS_A,   COMP_D_PLUS_M,
+    COMP_A_PLUS_D,   COMP_M_PLUS_D,
+    COMP_D_MINUS_A,  COMP_D_MINUS_M,
+    COMP_A_MINUS_D,  COMP_M_MINUS_D,
+    COMP_D_AND_A,    COMP_D_AND_M,
+    COMP_D_OR_A,     COMP_D_OR_M,
+    COMP_A_AND_D,    COMP_M_AND_D,
+    COMP_A_OR_D,     COMP_M_OR_D,
+    COMP_PARSE_ERROR,
+};
+
+// Dest syntax definition
+enum DEST {
+    DEST_NULL = 0x00, // 0b000
+    DEST_M    = 0x01, // 0b001
+    DEST_D    = 0x02, // 0b010
+    DEST_MD   = 0x03, // 0b011
+    DEST_A    = 0x04, // 0b100
+    DEST_AM   = 0x05, // 0b101
+    DEST_AD   = 0x06, // 0b110
+    DEST_AMD  = 0x07, // 0b111
+    DEST_PARSE_ERROR,
+};
+
+// Jump syntax definitions
+enum JUMP {
+    JUMP_NULL = 0,
+    JGT, JEQ, JGE,
+    JLT, JNE, JLE,
+    JMP,
+    JUMP_PARSE_ERROR,
+};
+
+extern const Subinst_Code comp_codes[];
+extern const size_t comp_code_count;
+extern const Subinst_Code dest_codes[];
+extern const size_t dest_code_count;
+extern const Subinst_Code jump_codes[];
+extern const size_t jump_code_count;
+
+enum INST_TYPE { A_INST, C_INST };
+
+typedef struct {
+    enum INST_TYPE type;
+    void *inst;
+} Instruction;
+
+typedef struct {
+    Slice *symbol;
+    int offset; // added to the value of 'symbol' ('@LABEL+3')
+    unsigned int value;
+    int eval; // true if .value is correct (or was evaluated)
+} A_Instruction;
+
+typedef struct {
+    enum DEST dest;
+    enum COMP comp;
+    enum JUMP jump;
+} C_Instruction;
+
+char *slice_to_str(Slice *slice);
+char cmp_str_slice(char *str, Slice *slice);
+int cmp_slices(Slice *a, Slice *b);
+int comp_reads(enum COMP comp, char reg);
+void free_instruction(Instruction *i);
+Instruction new_a_symbol(char *name);
+Instruction new_c_instruction(enum DEST dest, enum COMP comp, enum JUMP jump);
+uint16_t encode_instruction(Instruction *i);
+void word_to_bin_str(uint16_t word, char *str);
+int decode_c_instruction(uint16_t word, C_Instruction *c);
+int format_word(uint16_t word, char *buf);
+
+#endif // INST_H
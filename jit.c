@@ -0,0 +1,480 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu.h"
+#include "jit.h"
+
+/*
+ JIT compiler from hack ROM words to x86-64 (--engine jit).
+
+ A block is compiled the first time it is entered: the instructions from
+ its ROM address up to and including the first jump, stopped early before
+ a halt, at the end of ROM or after MAX_BLOCK_LENGTH. Blocks end by putting
+ the next ROM address in esi and jumping through 'table', which holds the
+ native code for every ROM address. Addresses that aren't compiled yet,
+ past the ROM or at a halt lead to the exit stub, which returns to jit_run
+ to compile the block or stop. So computed jumps ('@R14', 'A=M', '0;JMP')
+ cost the same as any other jump.
+
+ Registers in compiled code:
+     rbx    RAM            r12d   A
+     rbp    table          r13d   D
+     r14    cycles         r15    cycle limit
+     esi    ROM address of the block being entered
+     eax    ALU out        ecx    A before the instruction, masked
+     edx    M, or A for comp codes without a mnemonic
+
+ A block checks on entry that all its cycles fit under the limit, and
+ exits if not, leaving the last few cycles to the switch engine. Results
+ are the same as the other engines', cycle for cycle.
+
+ Code goes into an mmap'd area that is writable while compiling and
+ executable while running, and is emptied when full. If a perf map is
+ given, each block is listed in it, named after the label at or before
+ its address, so 'perf report' shows where in the hack program time goes.
+*/
+
+#if JIT_SUPPORTED
+
+#include <sys/mman.h>
+
+#define CODE_SIZE                          (16 << 20)
+#define MAX_BLOCK_LENGTH                   64
+#define MAX_INSTRUCTION_SIZE               64
+#define MAX_BLOCK_OVERHEAD                 64
+
+// Registers, numbered as in x86 encodings
+enum REG { EAX = 0, ECX = 1, EDX = 2, ESI = 6, R12 = 12, R13 = 13 };
+
+// Opcodes of the 'op r/m32, r32' forms
+enum OPCODE { ADD = 0x01, OR = 0x09, AND = 0x21, SUB = 0x29, XOR = 0x31,
+    MOV = 0x89 };
+
+// Opcode extensions of 0xF7
+enum UNARY { NOT = 2, NEG = 3 };
+
+// Displacement of a Jit_State field, for rdi-relative moves
+#define OFFSET(field)                      ((int) offsetof(Jit_State, field))
+
+// State passed between jit_run and compiled code
+typedef struct {
+    uint16_t *ram;
+    void **table;
+    uint64_t cycles;
+    uint64_t end;
+    uint32_t a;
+    uint32_t d;
+    uint32_t pc;
+} Jit_State;
+
+struct Jit {
+    uint8_t *code; // mmap'd area
+    size_t used;
+    size_t stub_size; // enter and exit stubs at the start of 'code'
+    int writable;
+    void (*enter)(Jit_State *s);
+    uint8_t *exit;
+    void **table; // native code of each ROM address, ROM_SIZE + 1 entries
+    uint16_t *length; // instructions in the block at each address, 0 if none
+};
+
+// Jump conditions (hack jump bits) as jcc rel8 opcodes after 'test ax, ax'
+static const uint8_t jcc[8] = {
+    [1] = 0x7F, // JGT jg
+    [2] = 0x74, // JEQ je
+    [3] = 0x7D, // JGE jge
+    [4] = 0x7C, // JLT jl
+    [5] = 0x75, // JNE jne
+    [6] = 0x7E, // JLE jle
+};
+
+// Emits 'n' bytes
+static uint8_t *emit(uint8_t *p, int n, ...)
+{
+    va_list args;
+    va_start(args, n);
+    for (int i = 0; i < n; i++)
+        *p++ = (uint8_t) va_arg(args, int);
+    va_end(args);
+    return p;
+}
+
+static uint8_t *emit32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+// op dst, src
+static uint8_t *emit_rr(uint8_t *p, enum OPCODE op, enum REG dst,
+    enum REG src)
+{
+    uint8_t rex = 0x40 | (src & 8 ? 4 : 0) | (dst & 8 ? 1 : 0);
+    if (rex != 0x40)
+        *p++ = rex;
+    return emit(p, 2, op, 0xC0 | (src & 7) << 3 | (dst & 7));
+}
+
+// not r, neg r
+static uint8_t *emit_unary(uint8_t *p, enum UNARY ext, enum REG r)
+{
+    if (r & 8)
+        *p++ = 0x41;
+    return emit(p, 2, 0xF7, 0xC0 | ext << 3 | (r & 7));
+}
+
+// mov r, v
+static uint8_t *emit_mov_imm(uint8_t *p, enum REG r, uint32_t v)
+{
+    if (r & 8)
+        *p++ = 0x41;
+    *p++ = 0xB8 | (r & 7);
+    return emit32(p, v);
+}
+
+// jmp [rbp + rsi*8], to the block at ROM address esi
+static uint8_t *emit_dispatch(uint8_t *p)
+{
+    return emit(p, 4, 0xFF, 0x64, 0xF5, 0x00);
+}
+
+// Emits code leaving comp code 'op' in eax, not yet cut to 16 bits
+// With the a-bit set, M is read from the address in ecx
+static uint8_t *emit_comp(uint8_t *p, uint8_t op)
+{
+    enum REG y = R12;
+    if (op & 0x40) {
+        p = emit(p, 4, 0x0F, 0xB7, 0x14, 0x4B); // movzx edx, [rbx + rcx*2]
+        y = EDX;
+    }
+
+    switch (op & 0x3F) {
+    case 0x2A:                                        // 0
+        return emit_rr(p, XOR, EAX, EAX);
+    case 0x3F:                                        // 1
+        return emit_mov_imm(p, EAX, 1);
+    case 0x3A:                                        // -1
+        return emit_mov_imm(p, EAX, 0xFFFF);
+    case 0x0C:                                        // D
+        return emit_rr(p, MOV, EAX, R13);
+    case 0x30:                                        // A, M
+        return emit_rr(p, MOV, EAX, y);
+    case 0x0D:                                        // !D
+        p = emit_rr(p, MOV, EAX, R13);
+        return emit_unary(p, NOT, EAX);
+    case 0x31:                                        // !A, !M
+        p = emit_rr(p, MOV, EAX, y);
+        return emit_unary(p, NOT, EAX);
+    case 0x0F:                                        // -D
+        p = emit_rr(p, MOV, EAX, R13);
+        return emit_unary(p, NEG, EAX);
+    case 0x33:                                        // -A, -M
+        p = emit_rr(p, MOV, EAX, y);
+        return emit_unary(p, NEG, EAX);
+    case 0x1F:                                        // D+1
+        p = emit_rr(p, MOV, EAX, R13);
+        return emit(p, 3, 0x83, 0xC0, 1);
+    case 0x37:                                        // A+1, M+1
+        p = emit_rr(p, MOV, EAX, y);
+        return emit(p, 3, 0x83, 0xC0, 1);
+    case 0x0E:                                        // D-1
+        p = emit_rr(p, MOV, EAX, R13);
+        return emit(p, 3, 0x83, 0xE8, 1);
+    case 0x32:                                        // A-1, M-1
+        p = emit_rr(p, MOV, EAX, y);
+        return emit(p, 3, 0x83, 0xE8, 1);
+    case 0x02:                                        // D+A, D+M
+        p = emit_rr(p, MOV, EAX, R13);
+        return emit_rr(p, ADD, EAX, y);
+    case 0x13:                                        // D-A, D-M
+        p = emit_rr(p, MOV, EAX, R13);
+        return emit_rr(p, SUB, EAX, y);
+    case 0x07:                                        // A-D, M-D
+        p = emit_rr(p, MOV, EAX, y);
+        return emit_rr(p, SUB, EAX, R13);
+    case 0x00:                                        // D&A, D&M
+        p = emit_rr(p, MOV, EAX, R13);
+        return emit_rr(p, AND, EAX, y);
+    case 0x15:                                        // D|A, D|M
+        p = emit_rr(p, MOV, EAX, R13);
+        return emit_rr(p, OR, EAX, y);
+    default:
+        // The ALU, for codes without a mnemonic
+        p = emit_rr(p, MOV, EAX, R13);
+        if (y != EDX)
+            p = emit_rr(p, MOV, EDX, y);
+        if (op & 0x20) p = emit_rr(p, XOR, EAX, EAX);   // zx
+        if (op & 0x10) p = emit_unary(p, NOT, EAX);     // nx
+        if (op & 0x08) p = emit_rr(p, XOR, EDX, EDX);   // zy
+        if (op & 0x04) p = emit_unary(p, NOT, EDX);     // ny
+        p = emit_rr(p, (op & 0x02) ? ADD : AND, EAX, EDX); // f
+        if (op & 0x01) p = emit_unary(p, NOT, EAX);     // no
+        return p;
+    }
+}
+
+// Emits instruction 'in', leaving its jump to the end of the block
+static uint8_t *emit_instruction(uint8_t *p, Decoded *in)
+{
+    if (in->op == OP_A)
+        return emit_mov_imm(p, R12, in->value);
+
+    // M and jumps are addressed by A before this instruction writes it
+    if (in->op & 0x40 || in->dest & 1 || in->jump) {
+        p = emit_rr(p, MOV, ECX, R12);
+        p = emit32(emit(p, 2, 0x81, 0xE1), 0x7FFF);   // and ecx, 0x7FFF
+    }
+
+    p = emit_comp(p, in->op);
+    p = emit(p, 3, 0x0F, 0xB7, 0xC0);                 // movzx eax, ax
+    if (in->dest & 1)
+        p = emit(p, 4, 0x66, 0x89, 0x04, 0x4B);      // mov [rbx + rcx*2], ax
+    if (in->dest & 4)
+        p = emit_rr(p, MOV, R12, EAX);
+    if (in->dest & 2)
+        p = emit_rr(p, MOV, R13, EAX);
+    return p;
+}
+
+// Emits 'enter', which loads the registers from a Jit_State and jumps to
+// the block at its pc
+static uint8_t *emit_enter(uint8_t *p)
+{
+    // push rbx, rbp, r12, r13, r14, r15, rdi
+    p = emit(p, 11, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41,
+        0x57, 0x57);
+    p = emit(p, 4, 0x48, 0x8B, 0x5F, OFFSET(ram));
+    p = emit(p, 4, 0x48, 0x8B, 0x6F, OFFSET(table));
+    p = emit(p, 4, 0x4C, 0x8B, 0x77, OFFSET(cycles));
+    p = emit(p, 4, 0x4C, 0x8B, 0x7F, OFFSET(end));
+    p = emit(p, 4, 0x44, 0x8B, 0x67, OFFSET(a));
+    p = emit(p, 4, 0x44, 0x8B, 0x6F, OFFSET(d));
+    p = emit(p, 3, 0x8B, 0x77, OFFSET(pc));
+    return emit_dispatch(p);
+}
+
+// Emits the exit stub, which saves the registers back to the Jit_State
+// and returns from 'enter'
+static uint8_t *emit_exit(uint8_t *p)
+{
+    p = emit(p, 1, 0x5F);                             // pop rdi
+    p = emit(p, 4, 0x4C, 0x89, 0x77, OFFSET(cycles));
+    p = emit(p, 4, 0x44, 0x89, 0x67, OFFSET(a));
+    p = emit(p, 4, 0x44, 0x89, 0x6F, OFFSET(d));
+    p = emit(p, 3, 0x89, 0x77, OFFSET(pc));
+    // pop r15, r14, r13, r12, rbp, rbx
+    p = emit(p, 10, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D,
+        0x5B);
+    return emit(p, 1, 0xC3);                          // ret
+}
+
+// Makes the code area writable or executable
+// Returns 0 on success, 1 on error
+static int set_writable(Jit *jit, int writable)
+{
+    if (jit->writable == writable)
+        return 0;
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+    if (mprotect(jit->code, CODE_SIZE, prot))
+        return 1;
+    jit->writable = writable;
+    return 0;
+}
+
+// Drops all compiled blocks
+static void flush(Jit *jit)
+{
+    jit->used = jit->stub_size;
+    for (size_t i = 0; i <= ROM_SIZE; i++)
+        jit->table[i] = jit->exit;
+    memset(jit->length, 0, (ROM_SIZE + 1) * sizeof(uint16_t));
+}
+
+// Lists 'size' bytes of code at 'start' in the perf map as 'hack:NAME',
+// where NAME is the label at or before ROM address 'pc' plus the offset
+static void write_perf_map(Hack_CPU *cpu, uint8_t *start, size_t size,
+    size_t pc)
+{
+    Str_Int_Pair *label = NULL;
+    for (size_t i = 0; i < cpu->label_count; i++) {
+        Str_Int_Pair *l = cpu->labels + i;
+        if ((size_t) l->p1 <= pc && (label == NULL || l->p1 > label->p1))
+            label = l;
+    }
+
+    fprintf(cpu->perf_map, "%" PRIxPTR " %zx hack:", (uintptr_t) start, size);
+    if (label == NULL)
+        fprintf(cpu->perf_map, "%zu\n", pc);
+    else if ((size_t) label->p1 == pc)
+        fprintf(cpu->perf_map, "%s\n", label->p0);
+    else
+        fprintf(cpu->perf_map, "%s+%zu\n", label->p0, pc - label->p1);
+}
+
+// Compiles the block at 'pc', which is in ROM and not a halt
+// Returns 0 on success, 1 if the code area can't be written
+static int compile_block(Jit *jit, Hack_CPU *cpu, size_t pc)
+{
+    Decoded *code = cpu->code;
+    size_t n = 0;
+    while (pc + n < cpu->rom_size && code[pc + n].op != OP_HALT &&
+        n < MAX_BLOCK_LENGTH) {
+        Decoded *in = code + pc + n++;
+        if (in->op != OP_A && in->jump)
+            break;
+    }
+
+    if (jit->used + n * MAX_INSTRUCTION_SIZE + MAX_BLOCK_OVERHEAD > CODE_SIZE)
+        flush(jit);
+    if (set_writable(jit, 1))
+        return 1;
+
+    uint8_t *start = jit->code + jit->used;
+    uint8_t *p = start;
+
+    // Exit if the cycles of the block don't fit under the limit
+    p = emit(p, 6, 0x4C, 0x89, 0xF8, 0x4C, 0x29, 0xF0); // mov rax, r15
+                                                        // sub rax, r14
+    p = emit32(emit(p, 2, 0x48, 0x3D), n);            // cmp rax, n
+    p = emit(p, 2, 0x0F, 0x82);                       // jb exit
+    p = emit32(p, (uint32_t) (jit->exit - (p + 4)));
+    p = emit32(emit(p, 3, 0x49, 0x81, 0xC6), n);      // add r14, n
+
+    for (size_t i = 0; i < n; i++)
+        p = emit_instruction(p, code + pc + i);
+
+    Decoded *last = code + pc + n - 1;
+    uint8_t jump = last->op == OP_A ? 0 : last->jump;
+    if (jump == 7) {
+        p = emit(p, 2, 0x89, 0xCE);                   // mov esi, ecx
+        p = emit_dispatch(p);
+    } else {
+        // Not taken goes to the next address. The 9 bytes skipped are
+        // 'mov esi, next' and the dispatch
+        if (jump)
+            p = emit(p, 5, 0x66, 0x85, 0xC0, jcc[jump], 9); // test ax, ax
+        p = emit_mov_imm(p, ESI, pc + n);               // mov esi, next
+        p = emit_dispatch(p);
+        if (jump) {
+            p = emit(p, 2, 0x89, 0xCE);               // mov esi, ecx
+            p = emit_dispatch(p);
+        }
+    }
+
+    jit->used += p - start;
+    jit->table[pc] = start;
+    jit->length[pc] = n;
+    if (cpu->perf_map)
+        write_perf_map(cpu, start, p - start, pc);
+    return 0;
+}
+
+// Creates a JIT with no blocks compiled
+// Returns NULL if executable memory can't be mapped
+Jit *jit_new(Hack_CPU *cpu)
+{
+    uint8_t *code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return NULL;
+
+    Jit *jit = calloc(1, sizeof(Jit));
+    jit->code = code;
+    jit->writable = 1;
+    jit->table = malloc((ROM_SIZE + 1) * sizeof(void*));
+    jit->length = malloc((ROM_SIZE + 1) * sizeof(uint16_t));
+
+    // ISO C has no cast from data to function pointers
+    uint8_t *p = emit_enter(code);
+    memcpy(&jit->enter, &code, sizeof(code));
+    jit->exit = p;
+    p = emit_exit(p);
+    jit->stub_size = p - code;
+    flush(jit);
+
+    if (cpu->perf_map) {
+        fprintf(cpu->perf_map, "%" PRIxPTR " %zx hack:enter\n",
+            (uintptr_t) code, (size_t) (jit->exit - code));
+        fprintf(cpu->perf_map, "%" PRIxPTR " %zx hack:exit\n",
+            (uintptr_t) jit->exit, (size_t) (p - jit->exit));
+    }
+    return jit;
+}
+
+void jit_free(Jit *jit)
+{
+    if (jit == NULL)
+        return;
+    munmap(jit->code, CODE_SIZE);
+    free(jit->table);
+    free(jit->length);
+    free(jit);
+}
+
+// Runs compiled code until the program halts, leaves ROM or 'end' cycles
+// have run, compiling blocks as they are reached
+// Returns EMU_CYCLE_LIMIT with 'cpu->cycles' short of 'end' when the next
+// block doesn't fit under it, for the caller to finish
+enum EMU_STATUS jit_run(Jit *jit, Hack_CPU *cpu, uint64_t end)
+{
+    Jit_State s = {
+        .ram = cpu->ram,
+        .table = jit->table,
+        .cycles = cpu->cycles,
+        .end = end,
+        .a = cpu->a,
+        .d = cpu->d,
+        .pc = cpu->pc,
+    };
+    enum EMU_STATUS status = EMU_CYCLE_LIMIT;
+
+    while (s.cycles < end) {
+        if (s.pc >= cpu->rom_size) {
+            status = EMU_OUT_OF_ROM;
+            break;
+        }
+        if (cpu->code[s.pc].op == OP_HALT) {
+            status = EMU_HALTED;
+            break;
+        }
+        if (jit->length[s.pc] == 0 && compile_block(jit, cpu, s.pc))
+            break;
+        if (end - s.cycles < jit->length[s.pc] || set_writable(jit, 0))
+            break;
+        jit->enter(&s);
+    }
+
+    cpu->a = s.a;
+    cpu->d = s.d;
+    cpu->pc = s.pc;
+    cpu->cycles = s.cycles;
+    return status;
+}
+
+#else
+
+Jit *jit_new(Hack_CPU *cpu)
+{
+    (void) cpu;
+    return NULL;
+}
+
+void jit_free(Jit *jit)
+{
+    (void) jit;
+}
+
+enum EMU_STATUS jit_run(Jit *jit, Hack_CPU *cpu, uint64_t end)
+{
+    (void) jit;
+    (void) cpu;
+    (void) end;
+    return EMU_CYCLE_LIMIT;
+}
+
+#endif
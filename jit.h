@@ -0,0 +1,19 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+#include "emu.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+typedef struct Jit Jit;
+
+Jit *jit_new(Hack_CPU *cpu);
+void jit_free(Jit *jit);
+enum EMU_STATUS jit_run(Jit *jit, Hack_CPU *cpu, uint64_t end);
+
+#endif // JIT_H
@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <string.h>
+#include "emu.h"
+#include "lanes.h"
+
+/*
+ Lockstep execution of many instances of one program (--lockstep).
+
+ The instances of a Lane_Batch are lanes of vectors holding A, D and pc,
+ 16 bit words side by side, so one vector operation runs an instruction
+ for every lane. Each step runs the instruction at the lowest pc of any
+ lane, masked to the lanes that are at it. Lanes that took a different
+ branch wait, and are picked up again when the others reach their pc, so
+ lanes that went separate ways through an if or a loop join after it.
+ While every lane is at the same pc, as long as no jump splits them,
+ there's nothing to look for and the step counts once for all of them.
+
+ RAM is laid out with each word of all lanes together. When all lanes
+ running a step address the same word, as they do for '@SP', 'AM=M+1'
+ and the stack while they agree, M is one vector load or store. Otherwise
+ each lane's word is read and written by itself.
+
+ The loop is written with GCC vector types and compiled once for AVX2 and
+ once for the baseline (SSE2 on x86-64, scalar elsewhere), picked at load
+ time by what the CPU has. Results are the same as running each instance
+ on its own in the other engines, cycles included.
+*/
+
+#if defined(__x86_64__) && defined(__linux__)
+#define LANES_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define LANES_TARGETS
+#endif
+
+// pc of lanes that are done or not in use, above any ROM address
+#define PARKED                             0xFFFF
+
+typedef uint16_t Lanes __attribute__((vector_size(2 * LANE_COUNT)));
+typedef int16_t Signed_Lanes __attribute__((vector_size(2 * LANE_COUNT)));
+
+// x where 'mask' is set, y elsewhere
+#define BLEND(mask, x, y) (((mask) & (x)) | (~(mask) & (y)))
+
+// 1 if any lane of 'v' isn't 0
+#define ANY(v) (memcmp(&(v), &zero, sizeof(Lanes)) != 0)
+
+// Runs the lanes of 'b' until each halts, leaves ROM or has run
+// 'max_cycles' cycles (no limit if 0)
+LANES_TARGETS
+void lanes_run(Lane_Batch *b, Decoded *code, size_t rom_size,
+    uint64_t max_cycles)
+{
+    const Lanes zero = { 0 };
+    Lanes a, d, pc, active = zero;
+    memcpy(&a, b->a, sizeof(a));
+    memcpy(&d, b->d, sizeof(d));
+    memcpy(&pc, b->pc, sizeof(pc));
+    for (size_t l = 0; l < LANE_COUNT; l++) {
+        if (l < b->count)
+            active[l] = 0xFFFF;
+        else
+            pc[l] = PARKED;
+    }
+
+    // Cycles of lane l are 'full' + 'partial[l]'. Steps that all active
+    // lanes run are counted once
+    uint64_t limit = max_cycles ? max_cycles : UINT64_MAX;
+    uint64_t full = 0;
+    uint64_t partial[LANE_COUNT] = { 0 };
+    uint64_t most_partial = 0;
+
+    // Set while all active lanes are at 'at'. Otherwise the lanes at the
+    // lowest pc are looked for before each step
+    int together = 0;
+    uint16_t at = PARKED;
+    size_t first = 0;
+
+// Ends the lanes in 'mask' with 'st'
+#define FINISH(mask, st)                                                 \
+    for (size_t l = 0; l < LANE_COUNT; l++) {                            \
+        if (!(mask)[l])                                                  \
+            continue;                                                    \
+        b->status[l] = (st);                                             \
+        b->a[l] = a[l];                                                  \
+        b->d[l] = d[l];                                                  \
+        b->pc[l] = pc[l];                                                \
+        b->cycles[l] = full + partial[l];                                \
+        active[l] = 0;                                                   \
+        pc[l] = PARKED;                                                  \
+    }                                                                    \
+    together = 0;
+
+    for (;;) {
+        Lanes mask = active;
+        if (!together) {
+            at = PARKED;
+            for (size_t l = 0; l < LANE_COUNT; l++) {
+                if (pc[l] < at) {
+                    at = pc[l];
+                    first = l;
+                }
+            }
+            if (at == PARKED)
+                break;
+            mask = (Lanes) (pc == zero + at);
+            together = memcmp(&mask, &active, sizeof(mask)) == 0;
+        }
+
+        if (at >= rom_size) {
+            FINISH(mask, EMU_OUT_OF_ROM);
+            continue;
+        }
+        Decoded *in = code + at;
+        if (in->op == OP_HALT) {
+            FINISH(mask, EMU_HALTED);
+            continue;
+        }
+
+        if (together) {
+            full++;
+        } else {
+            for (size_t l = 0; l < LANE_COUNT; l++) {
+                if (mask[l] && ++partial[l] > most_partial)
+                    most_partial = partial[l];
+            }
+        }
+
+        if (in->op == OP_A) {
+            a = BLEND(mask, zero + in->value, a);
+            pc = BLEND(mask, zero + (uint16_t) (at + 1), pc);
+            at++;
+        } else {
+            // M is addressed by A before this instruction writes it
+            Lanes addr = a & 0x7FFF;
+            uint16_t *row = b->ram[addr[first]];
+            Lanes apart = mask & (Lanes) (addr != zero + addr[first]);
+            int uniform = !ANY(apart);
+
+            Lanes m = zero;
+            if (in->op & 0x40) {
+                if (uniform) {
+                    memcpy(&m, row, sizeof(m));
+                } else {
+                    for (size_t l = 0; l < LANE_COUNT; l++)
+                        m[l] = b->ram[addr[l]][l];
+                }
+            }
+
+            Lanes y = (in->op & 0x40) ? m : a;
+            Lanes out;
+            switch (in->op & 0x3F) {
+            case 0x2A: out = zero;              break; // 0
+            case 0x3F: out = zero + 1;          break; // 1
+            case 0x3A: out = zero + 0xFFFF;     break; // -1
+            case 0x0C: out = d;                 break; // D
+            case 0x30: out = y;                 break; // A, M
+            case 0x0D: out = ~d;                break; // !D
+            case 0x31: out = ~y;                break; // !A, !M
+            case 0x0F: out = zero - d;          break; // -D
+            case 0x33: out = zero - y;          break; // -A, -M
+            case 0x1F: out = d + 1;             break; // D+1
+            case 0x37: out = y + 1;             break; // A+1, M+1
+            case 0x0E: out = d - 1;             break; // D-1
+            case 0x32: out = y - 1;             break; // A-1, M-1
+            case 0x02: out = d + y;             break; // D+A, D+M
+            case 0x13: out = d - y;             break; // D-A, D-M
+            case 0x07: out = y - d;             break; // A-D, M-D
+            case 0x00: out = d & y;             break; // D&A, D&M
+            case 0x15: out = d | y;             break; // D|A, D|M
+            default: {
+                // The ALU, for codes without a mnemonic
+                Lanes x = d;
+                if (in->op & 0x20) x = zero;    // zx
+                if (in->op & 0x10) x = ~x;      // nx
+                if (in->op & 0x08) y = zero;    // zy
+                if (in->op & 0x04) y = ~y;      // ny
+                out = (in->op & 0x02) ? x + y : x & y; // f
+                if (in->op & 0x01) out = ~out;  // no
+            }
+            }
+
+            if (in->dest & 1) {
+                if (uniform) {
+                    Lanes words;
+                    memcpy(&words, row, sizeof(words));
+                    words = BLEND(mask, out, words);
+                    memcpy(row, &words, sizeof(words));
+                } else {
+                    for (size_t l = 0; l < LANE_COUNT; l++) {
+                        if (mask[l])
+                            b->ram[addr[l]][l] = out[l];
+                    }
+                }
+            }
+            if (in->dest & 4)
+                a = BLEND(mask, out, a);
+            if (in->dest & 2)
+                d = BLEND(mask, out, d);
+
+            Lanes next = BLEND(mask, zero + (uint16_t) (at + 1), pc);
+            if (in->jump) {
+                Signed_Lanes v = (Signed_Lanes) out;
+                Signed_Lanes none = { 0 };
+                Lanes taken = zero;
+                if (in->jump & 4) taken |= (Lanes) (v < none);
+                if (in->jump & 2) taken |= (Lanes) (v == none);
+                if (in->jump & 1) taken |= (Lanes) (v > none);
+                next = BLEND(mask & taken, addr, next);
+                if (together) {
+                    Lanes split = active & (Lanes) (next != zero + next[first]);
+                    together = !ANY(split);
+                }
+            }
+            pc = next;
+            at = pc[first];
+        }
+
+        // Lanes whose cycles ran out
+        if (full + most_partial >= limit) {
+            Lanes done = zero;
+            for (size_t l = 0; l < LANE_COUNT; l++) {
+                if (mask[l] && full + partial[l] >= limit)
+                    done[l] = 0xFFFF;
+            }
+            FINISH(done, EMU_CYCLE_LIMIT);
+        }
+    }
+#undef FINISH
+}
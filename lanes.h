@@ -0,0 +1,24 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "emu.h"
+
+#define LANE_COUNT    16
+
+// Instances of one program, run side by side by lanes_run
+typedef struct {
+    uint16_t ram[RAM_SIZE][LANE_COUNT]; // each word of every lane together
+    uint16_t a[LANE_COUNT];
+    uint16_t d[LANE_COUNT];
+    uint16_t pc[LANE_COUNT];
+    uint64_t cycles[LANE_COUNT];
+    enum EMU_STATUS status[LANE_COUNT];
+    size_t count; // lanes in use, from the first
+} Lane_Batch;
+
+void lanes_run(Lane_Batch *b, Decoded *code, size_t rom_size,
+    uint64_t max_cycles);
+
+#endif // LANES_H
@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cfg.h"
+#include "file.h"
+#include "layout.h"
+#include "opt.h"
+
+/*
+ Profile-guided basic block layout (--layout).
+
+ A profile is a text file written by '--run --profile':
+     hasm-profile 1
+     size <n>
+     <address> <executions> <taken>     one line per executed instruction
+ 'taken' counts how often the jump at that address was taken.
+
+ Blocks are chained greedily, heaviest edge first (Pettis-Hansen). An edge
+ can become a fall-through when
+     - it already is one
+     - it's an '@L', '0;JMP' at the end of the block. The pair is dropped
+     - it's a conditional '@L', 'comp;jump'. The condition is inverted and
+       jumps to the old fall-through instead
+ A fall-through that isn't kept gets an '@L', '0;JMP' appended. Every
+ rewrite changes what A holds when the target is entered, so it's only done
+ for targets that set A before reading it. Labels and numeric jump
+ targets are re-resolved afterwards.
+
+ Every instruction costs one cycle, taken jump or not, so the layout saves
+ two cycles per execution of a removed pair and costs two per execution of
+ an added one. It's only applied if that comes out ahead on the profile.
+*/
+
+#define PROFILE_MAGIC                      "hasm-profile 1"
+#define LAYOUT_LABEL_SIZE                  32
+#define ROM_LIMIT                          0x8000
+
+enum EDGE { EDGE_NONE = 0, EDGE_FALL, EDGE_JUMP, EDGE_INVERT };
+
+typedef struct {
+    size_t from;
+    size_t to;
+    uint64_t weight;
+    int pinned; // fall-through that can't be replaced by a jump
+    enum EDGE kind;
+} Edge;
+
+// Returns 0 on success, 1 on error
+int load_profile(char *path, Profile *profile)
+{
+    *profile = (Profile) { .size = 0 };
+    char *buf = load_file(path, NULL);
+    if (buf == NULL)
+        return 1;
+
+    char *p = buf;
+    int n = 0;
+    long size;
+    if (strncmp(p, PROFILE_MAGIC "\n", sizeof(PROFILE_MAGIC)) != 0 ||
+        sscanf(p += sizeof(PROFILE_MAGIC), "size %li\n%n", &size, &n) != 1 ||
+        size < 0 || size > ROM_LIMIT)
+        goto error;
+    p += n;
+
+    profile->size = size;
+    profile->counts = calloc(size + 1, sizeof(uint64_t));
+    profile->taken = calloc(size + 1, sizeof(uint64_t));
+    while (*p) {
+        long addr;
+        unsigned long long count, taken;
+        if (sscanf(p, "%li %llu %llu\n%n", &addr, &count, &taken, &n) != 3 ||
+            addr < 0 || addr >= size || taken > count)
+            goto error;
+        profile->counts[addr] = count;
+        profile->taken[addr] = taken;
+        p += n;
+    }
+
+    free(buf);
+    return 0;
+
+error:
+    printf("Malformed profile '%s'\n", path);
+    free_profile(profile);
+    free(buf);
+    return 1;
+}
+
+void free_profile(Profile *profile)
+{
+    free(profile->counts);
+    free(profile->taken);
+    profile->counts = NULL;
+    profile->taken = NULL;
+}
+
+// Returns 1 if the code at the start of 'b' may depend on the value of A it
+// is entered with. Unknown if 'b' ends first, so that counts as a read
+static int reads_a_on_entry(Instruction *inst, Basic_Block *b)
+{
+    for (size_t i = b->start; i < b->end; i++) {
+        if (inst[i].type == A_INST)
+            return 0;
+        C_Instruction *c = inst[i].inst;
+        if (comp_reads(c->comp, 'A') || comp_reads(c->comp, 'M') ||
+            c->dest & DEST_M || c->jump != JUMP_NULL)
+            return 1;
+        if (c->dest & DEST_A)
+            return 0;
+    }
+    return 1;
+}
+
+// Heaviest first. Pinned fall-throughs go before everything, and on equal
+// weights removing a jump beats keeping a fall-through
+static int cmp_edges(const void *a, const void *b)
+{
+    const Edge *x = a;
+    const Edge *y = b;
+    if (x->pinned != y->pinned)
+        return y->pinned - x->pinned;
+    if (x->weight != y->weight)
+        return x->weight < y->weight ? 1 : -1;
+    if ((x->kind == EDGE_FALL) != (y->kind == EDGE_FALL))
+        return x->kind == EDGE_FALL ? 1 : -1;
+    return x->from < y->from ? -1 : x->from > y->from;
+}
+
+// Returns the name of a label pointing at instruction 'index', adding one
+// if there is none. Returns NULL if the label table is full
+static char *label_at(size_t index, Str_Int_Pair *labels, size_t *label_count,
+    size_t label_capacity)
+{
+    for (size_t i = 0; i < *label_count; i++) {
+        if ((size_t) labels[i].p1 == index)
+            return labels[i].p0;
+    }
+
+    if (*label_count >= label_capacity)
+        return NULL;
+    char name[LAYOUT_LABEL_SIZE];
+    snprintf(name, sizeof(name), "$layout.%li", index);
+    char *str = malloc(strlen(name) + 1);
+    strcpy(str, name);
+    labels[(*label_count)++] = (Str_Int_Pair) { .p0 = str, .p1 = index };
+    return str;
+}
+
+// Returns the instruction block 'b' falls through to, which is the end of
+// the program if it runs off the end of ROM. Returns -1 if it can't fall
+static long fall_target(Instruction *inst, CFG *cfg, size_t b)
+{
+    Basic_Block *block = cfg->blocks + b;
+    if (block->fall != NO_BLOCK)
+        return cfg->blocks[block->fall].start;
+    C_Instruction *c = inst[block->end - 1].type == C_INST ?
+        inst[block->end - 1].inst : NULL;
+    if (c && c->jump == JMP)
+        return -1;
+    return block->end;
+}
+
+// Inverse of a conditional jump
+static enum JUMP invert_jump(enum JUMP jump)
+{
+    switch (jump) {
+    case JGT: return JLE;
+    case JEQ: return JNE;
+    case JGE: return JLT;
+    case JLT: return JGE;
+    case JNE: return JEQ;
+    case JLE: return JGT;
+    default: return jump;
+    }
+}
+
+// Finds the edges of block 'b' that can become fall-throughs
+// Returns number of edges written to 'edges'
+static size_t block_edges(Instruction *inst, CFG *cfg, size_t b,
+    uint64_t *counts, uint64_t *taken, Edge *edges)
+{
+    Basic_Block *block = cfg->blocks + b;
+    size_t last = block->end - 1;
+    C_Instruction *c = inst[last].type == C_INST ? inst[last].inst : NULL;
+    uint64_t runs = counts[last];
+    uint64_t jumps = (c && c->jump != JUMP_NULL) ? taken[last] : 0;
+    size_t n = 0;
+
+    if (block->fall != NO_BLOCK) {
+        edges[n++] = (Edge) {
+            .from = b,
+            .to = block->fall,
+            .weight = runs - jumps,
+            .pinned = reads_a_on_entry(inst, cfg->blocks + block->fall),
+            .kind = EDGE_FALL,
+        };
+    }
+
+    // The jump must load its target right before it, so that rewriting or
+    // dropping the '@L' can't change anything else
+    if (block->jump == NO_BLOCK || block->jump == block->fall ||
+        last == block->start || inst[last - 1].type != A_INST ||
+        reads_a_on_entry(inst, cfg->blocks + block->jump))
+        return n;
+
+    if (c->jump == JMP) {
+        if (c->dest == DEST_NULL) {
+            edges[n++] = (Edge) {
+                .from = b, .to = block->jump, .weight = jumps,
+                .kind = EDGE_JUMP,
+            };
+        }
+    } else if (block->fall != NO_BLOCK && !edges[0].pinned &&
+        !comp_reads(c->comp, 'A') && !comp_reads(c->comp, 'M') &&
+        !(c->dest & DEST_M)) {
+        edges[n++] = (Edge) {
+            .from = b, .to = block->jump, .weight = jumps,
+            .kind = EDGE_INVERT,
+        };
+    }
+    return n;
+}
+
+// Reorders basic blocks so the edges taken most often in 'profile' fall
+// through. 'profile' must come from the same program
+// Returns 0 on success, 1 on error
+int layout_blocks(Instruction **inst_ptr, size_t *count, Str_Int_Pair *labels,
+    size_t *label_count, size_t label_capacity, Profile *profile,
+    Layout_Stats *stats)
+{
+    Instruction *inst = *inst_ptr;
+    size_t n = *count;
+    *stats = (Layout_Stats) { .moved = 0 };
+    if (profile->size != n) {
+        printf("Profile is for %li instructions, the program has %li\n",
+            profile->size, n);
+        return 1;
+    }
+
+    CFG cfg;
+    if (build_cfg(&cfg, inst, n, labels, *label_count)) {
+        printf("warning: --layout skipped, computed jumps to numeric "
+            "addresses or label offsets\n");
+        free_cfg(&cfg);
+        return 0;
+    }
+    size_t bc = cfg.block_count;
+
+    Edge *edges = malloc((2 * bc + 1) * sizeof(Edge));
+    size_t edge_count = 0;
+    for (size_t b = 0; b < bc; b++) {
+        edge_count += block_edges(inst, &cfg, b, profile->counts,
+            profile->taken, edges + edge_count);
+    }
+    qsort(edges, edge_count, sizeof(Edge), cmp_edges);
+
+    // Chain blocks. 'chain' is the first block of the chain a block is in
+    size_t *succ = malloc((bc + 1) * sizeof(size_t));
+    size_t *pred = malloc((bc + 1) * sizeof(size_t));
+    size_t *chain = malloc((bc + 1) * sizeof(size_t));
+    enum EDGE *kind = calloc(bc + 1, sizeof(enum EDGE));
+    for (size_t b = 0; b < bc; b++) {
+        succ[b] = pred[b] = NO_BLOCK;
+        chain[b] = b;
+    }
+    for (size_t i = 0; i < edge_count; i++) {
+        Edge *e = edges + i;
+        if (succ[e->from] != NO_BLOCK || pred[e->to] != NO_BLOCK ||
+            chain[e->from] == chain[e->to] || e->to == 0)
+            continue;
+        succ[e->from] = e->to;
+        pred[e->to] = e->from;
+        kind[e->from] = e->kind;
+        for (size_t b = e->to; b != NO_BLOCK; b = succ[b])
+            chain[b] = chain[e->from];
+    }
+
+    // The entry chain goes first, the rest stay in source order
+    size_t *order = malloc((bc + 1) * sizeof(size_t));
+    size_t placed = 0;
+    for (size_t h = 0; h < bc; h++) {
+        if (pred[h] != NO_BLOCK)
+            continue;
+        for (size_t b = h; b != NO_BLOCK; b = succ[b])
+            order[placed++] = b;
+    }
+
+    // Find the fall-throughs that need a jump now and count what the
+    // layout saves before committing to it
+    long *jump_to = malloc((bc + 1) * sizeof(long));
+    int64_t saved = 0;
+    for (size_t p = 0; p < bc; p++) {
+        size_t b = order[p];
+        Basic_Block *block = cfg.blocks + b;
+        long f = fall_target(inst, &cfg, b);
+        size_t next_start = (p + 1 < bc) ? cfg.blocks[order[p + 1]].start : n;
+        uint64_t runs = profile->counts[block->end - 1];
+        uint64_t jumps = profile->taken[block->end - 1];
+
+        jump_to[b] = -1;
+        if (kind[b] == EDGE_JUMP) {
+            saved += 2 * jumps;
+            stats->removed++;
+        } else if (kind[b] == EDGE_INVERT) {
+            jump_to[b] = f;
+            stats->inverted++;
+        } else if (f != -1 && (size_t) f != next_start) {
+            jump_to[b] = f;
+            saved -= 2 * (runs - jumps);
+            stats->added++;
+        }
+        if (p > 0 && b != order[p - 1] + 1)
+            stats->moved++;
+    }
+    stats->saved = saved;
+
+    int err = 0;
+    if (saved <= 0) {
+        *stats = (Layout_Stats) { .moved = 0 };
+        goto done;
+    }
+
+    // Labels for the targets of inverted and added jumps
+    char **target = calloc(bc + 1, sizeof(char*));
+    for (size_t b = 0; b < bc; b++) {
+        if (jump_to[b] == -1)
+            continue;
+        target[b] = label_at(jump_to[b], labels, label_count, label_capacity);
+        if (target[b] == NULL) {
+            printf("Too many labels\n");
+            free(target);
+            err = 1;
+            goto done;
+        }
+    }
+
+    // Where each block ends up
+    size_t *new_start = malloc((bc + 1) * sizeof(size_t));
+    size_t m = 0;
+    for (size_t p = 0; p < bc; p++) {
+        size_t b = order[p];
+        Basic_Block *block = cfg.blocks + b;
+        new_start[b] = m;
+        m += block->end - block->start;
+        if (kind[b] == EDGE_JUMP)
+            m -= 2;
+        else if (kind[b] != EDGE_INVERT && target[b])
+            m += 2;
+    }
+
+    // Labels and numeric jump targets always point at block starts or at
+    // the end
+    for (size_t i = 0; i < *label_count; i++) {
+        size_t t = labels[i].p1;
+        if (t <= n)
+            labels[i].p1 = (t < n) ? new_start[cfg.block_of[t]] : m;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!cfg.is_code_ref[i])
+            continue;
+        A_Instruction *a = inst[i].inst;
+        if (a->value <= n)
+            a->value = (a->value < n) ? new_start[cfg.block_of[a->value]] : m;
+    }
+
+    // Copy the blocks over. Dropped instructions are freed
+    Instruction *out = malloc((m + 1) * sizeof(Instruction));
+    size_t k = 0;
+    for (size_t p = 0; p < bc; p++) {
+        size_t b = order[p];
+        Basic_Block *block = cfg.blocks + b;
+        size_t end = block->end;
+        if (kind[b] == EDGE_JUMP) {
+            free_instruction(inst + end - 2);
+            free_instruction(inst + end - 1);
+            end -= 2;
+        } else if (kind[b] == EDGE_INVERT) {
+            C_Instruction *c = inst[end - 1].inst;
+            c->jump = invert_jump(c->jump);
+            free_instruction(inst + end - 2);
+            inst[end - 2] = new_a_symbol(target[b]);
+        }
+
+        for (size_t i = block->start; i < end; i++)
+            out[k++] = inst[i];
+        if (kind[b] != EDGE_INVERT && target[b]) {
+            out[k++] = new_a_symbol(target[b]);
+            out[k++] = new_c_instruction(DEST_NULL, COMP_0, JMP);
+        }
+    }
+
+    free(target);
+    free(new_start);
+    free(inst);
+    *inst_ptr = out;
+    *count = m;
+
+done:
+    free(jump_to);
+    free(order);
+    free(kind);
+    free(chain);
+    free(pred);
+    free(succ);
+    free(edges);
+    free_cfg(&cfg);
+    return err;
+}
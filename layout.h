@@ -0,0 +1,28 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdint.h>
+#include "inst.h"
+
+// Execution profile written by '--run --profile'
+typedef struct {
+    size_t size; // instructions in the profiled program
+    uint64_t *counts; // executions of each instruction
+    uint64_t *taken; // times the jump at each instruction was taken
+} Profile;
+
+typedef struct {
+    size_t moved; // blocks no longer after their source order predecessor
+    size_t removed; // '@L', '0;JMP' pairs removed
+    size_t inverted; // conditional jumps inverted
+    size_t added; // '@L', '0;JMP' pairs added to keep fall-throughs
+    int64_t saved; // cycles saved on the profiled run
+} Layout_Stats;
+
+int load_profile(char *path, Profile *profile);
+void free_profile(Profile *profile);
+int layout_blocks(Instruction **inst, size_t *count, Str_Int_Pair *labels,
+    size_t *label_count, size_t label_capacity, Profile *profile,
+    Layout_Stats *stats);
+
+#endif // LAYOUT_H
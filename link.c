@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "file.h"
+#include "hash.h"
+#include "link.h"
+#include "opt.h"
+
+/*
+ Relocatable objects (-c) and the linker (--link).
+
+ An object is a text file:
+     hasm-object 2
+     words <n>
+     <n words in hex, one per line>
+     export <name> <address>          labels the module defines
+     import <name>                    symbols it uses without defining
+     reloc <index> <label> <offset>   A-instruction loading a label of its
+                                      own module, plus <offset>
+     extern <index> <name> <offset>   A-instruction loading an import
+ Label addresses are relative to the start of the module. The words of
+ reloc and extern instructions are 0 until linked, and those lines are in
+ instruction order.
+
+ The linker places modules one after another. A module's own labels come
+ first for its references, so labels like (LOOP) may be defined by every
+ module. Imports resolve through a hash table to the label of the one
+ module exporting it, or get RAM slots from 16 up, in order of first use,
+ if no module does. Resolved values must fit an A-instruction. Linking a
+ single object gives the same words as assembling its source directly.
+*/
+
+#define OBJECT_MAGIC                       "hasm-object 2"
+#define OBJECT_NAME_SIZE                   256
+#define VARIABLE_BASE                      16
+#define ROM_LIMIT                          0x8000
+#define MAX_A_VALUE                        0x7FFF
+#define MAX_OFFSET                         0xFFFF
+
+// A-instruction that needs its value filled in by the linker
+typedef struct {
+    size_t index;
+    char *symbol;
+    int local; // whether 'symbol' is a label of the same module
+    int offset;
+} Link_Ref;
+
+typedef struct {
+    char *path;
+    uint16_t *words;
+    size_t count;
+    size_t base;
+    Str_Int_Pair *labels;
+    size_t label_count;
+    Hash_Map label_map; // 'labels' by name
+    Link_Ref *refs;
+    size_t ref_count;
+} Object;
+
+// Writes 'inst' as an object. 'labels' are module-relative
+// Returns 0 on success, 1 on error
+int write_object(FILE *f, Instruction *inst, size_t count,
+    Str_Int_Pair *predefined, size_t predefined_count,
+    Str_Int_Pair *labels, size_t label_count)
+{
+    fprintf(f, "%s\nwords %li\n", OBJECT_MAGIC, count);
+    for (size_t i = 0; i < count; i++) {
+        long w = 0;
+        if (inst[i].type == C_INST) {
+            w = encode_instruction(inst + i);
+        } else {
+            A_Instruction *a = inst[i].inst;
+            int v = a->symbol ? find_label_index(predefined,
+                predefined_count, a->symbol) : (int) a->value;
+            if (v != -1)
+                w = v + a->offset;
+            if (w < 0 || w > MAX_A_VALUE) {
+                char *name = slice_to_str(a->symbol);
+                printf("Value of '%s%+i' out of range (%li)\n", name,
+                    a->offset, w);
+                free(name);
+                return 1;
+            }
+        }
+        fprintf(f, "%04lx\n", w);
+    }
+
+    for (size_t i = 0; i < label_count; i++)
+        fprintf(f, "export %s %i\n", labels[i].p0, labels[i].p1);
+
+    // Each import once, in order of first use
+    Hash_Map imports;
+    hash_init(&imports, count);
+    for (size_t i = 0; i < count; i++) {
+        if (inst[i].type != A_INST)
+            continue;
+        A_Instruction *a = inst[i].inst;
+        if (a->symbol == NULL ||
+            find_label_index(predefined, predefined_count, a->symbol) != -1 ||
+            find_label_index(labels, label_count, a->symbol) != -1)
+            continue;
+        char *name = slice_to_str(a->symbol);
+        if (hash_get(&imports, name) == NULL) {
+            hash_put(&imports, name, 0);
+            fprintf(f, "import %s\n", name);
+        }
+        free(name);
+    }
+    hash_free(&imports);
+
+    for (size_t i = 0; i < count; i++) {
+        if (inst[i].type != A_INST)
+            continue;
+        A_Instruction *a = inst[i].inst;
+        if (a->symbol == NULL ||
+            find_label_index(predefined, predefined_count, a->symbol) != -1)
+            continue;
+        char *name = slice_to_str(a->symbol);
+        int local = find_label_index(labels, label_count, a->symbol) != -1;
+        fprintf(f, "%s %li %s %i\n", local ? "reloc" : "extern", i, name,
+            a->offset);
+        free(name);
+    }
+
+    return ferror(f) ? 1 : 0;
+}
+
+static char *copy_str(char *s)
+{
+    char *copy = malloc(strlen(s) + 1);
+    strcpy(copy, s);
+    return copy;
+}
+
+static void free_object(Object *obj)
+{
+    for (size_t i = 0; i < obj->label_count; i++)
+        free(obj->labels[i].p0);
+    for (size_t i = 0; i < obj->ref_count; i++)
+        free(obj->refs[i].symbol);
+    free(obj->words);
+    free(obj->labels);
+    free(obj->refs);
+    if (obj->label_map.entries != NULL)
+        hash_free(&obj->label_map);
+}
+
+// Returns 0 on success, 1 on error
+static int read_object(Object *obj, char *path)
+{
+    *obj = (Object) { .path = path };
+    char *buf = load_file(path, NULL);
+    if (buf == NULL)
+        return 1;
+
+    char name[OBJECT_NAME_SIZE];
+    Hash_Map imports = { 0 };
+    char *p = buf;
+    int n = 0;
+    long count, index, value;
+    if (strncmp(p, OBJECT_MAGIC "\n", sizeof(OBJECT_MAGIC)) != 0 ||
+        sscanf(p += sizeof(OBJECT_MAGIC), "words %li\n%n", &count, &n) != 1 ||
+        count < 0 || count > ROM_LIMIT)
+        goto error;
+    p += n;
+
+    obj->count = count;
+    obj->words = malloc((count + 1) * sizeof(uint16_t));
+    for (long i = 0; i < count; i++) {
+        char *end;
+        value = strtol(p, &end, 16);
+        if (end == p || *end != '\n' || value < 0 || value > 0xFFFF)
+            goto error;
+        obj->words[i] = value;
+        p = end + 1;
+    }
+
+    // At most one reference per instruction
+    size_t label_capacity = 16;
+    obj->labels = malloc(label_capacity * sizeof(Str_Int_Pair));
+    obj->refs = malloc((count + 1) * sizeof(Link_Ref));
+    hash_init(&obj->label_map, label_capacity);
+    hash_init(&imports, 16);
+    char kind[8];
+    int offset;
+    while (*p) {
+        if (sscanf(p, "export %255s %li\n%n", name, &value, &n) == 2 &&
+            value >= 0 && value <= count) {
+            if (hash_get(&obj->label_map, name) != NULL) {
+                printf("Duplicate label '%s' in '%s'\n", name, path);
+                goto error_checked;
+            }
+            if (obj->label_count >= label_capacity) {
+                label_capacity *= 2;
+                obj->labels = realloc(obj->labels,
+                    label_capacity * sizeof(Str_Int_Pair));
+            }
+            obj->labels[obj->label_count++] = (Str_Int_Pair) {
+                .p0 = copy_str(name),
+                .p1 = value,
+            };
+            hash_put(&obj->label_map, name, value);
+        } else if (sscanf(p, "import %255s\n%n", name, &n) == 1) {
+            hash_put(&imports, name, 0);
+        } else if (sscanf(p, "%7s %li %255s %i\n%n", kind, &index, name,
+            &offset, &n) == 4 && index >= 0 && index < count &&
+            obj->ref_count < (size_t) count &&
+            offset >= -MAX_OFFSET && offset <= MAX_OFFSET &&
+            (strcmp(kind, "reloc") == 0 ?
+                hash_get(&obj->label_map, name) != NULL :
+                strcmp(kind, "extern") == 0 &&
+                hash_get(&imports, name) != NULL)) {
+            obj->refs[obj->ref_count++] = (Link_Ref) {
+                .index = index,
+                .symbol = copy_str(name),
+                .local = kind[0] == 'r',
+                .offset = offset,
+            };
+        } else {
+            goto error;
+        }
+        p += n;
+    }
+
+    hash_free(&imports);
+    free(buf);
+    return 0;
+
+error:
+    printf("Malformed object file '%s'\n", path);
+error_checked:
+    if (imports.entries != NULL)
+        hash_free(&imports);
+    free_object(obj);
+    free(buf);
+    return 1;
+}
+
+// Links the objects at 'paths' in order into one program
+// Returns the words and sets 'count' on success. Returns NULL on error
+uint16_t *link_objects(char **paths, size_t path_count, size_t *count)
+{
+    Object *objs = calloc(path_count, sizeof(Object));
+    uint16_t *words = NULL;
+    Hash_Map exports, variables;
+    size_t total = 0;
+    size_t label_total = 0;
+    size_t loaded = 0;
+
+    for (; loaded < path_count; loaded++) {
+        Object *obj = objs + loaded;
+        if (read_object(obj, paths[loaded]))
+            goto done;
+        obj->base = total;
+        total += obj->count;
+        label_total += obj->label_count;
+    }
+    if (total > ROM_LIMIT) {
+        printf("Linked program doesn't fit in ROM (%li instructions)\n",
+            total);
+        goto done;
+    }
+
+    // Module exporting each label, -1 if more than one does
+    hash_init(&exports, label_total);
+    for (size_t i = 0; i < path_count; i++) {
+        Object *obj = objs + i;
+        for (size_t j = 0; j < obj->label_count; j++) {
+            Str_Int_Pair *e = hash_get(&exports, obj->labels[j].p0);
+            if (e != NULL)
+                e->p1 = -1;
+            else
+                hash_put(&exports, obj->labels[j].p0, i);
+        }
+    }
+
+    // Place modules and fill in references
+    hash_init(&variables, 16);
+    words = malloc((total + 1) * sizeof(uint16_t));
+    int mem = VARIABLE_BASE;
+    for (size_t i = 0; i < path_count; i++) {
+        Object *obj = objs + i;
+        uint16_t *w = words + obj->base;
+        memcpy(w, obj->words, obj->count * sizeof(uint16_t));
+        for (size_t j = 0; j < obj->ref_count; j++) {
+            Link_Ref *ref = obj->refs + j;
+            Object *owner = ref->local ? obj : NULL;
+            Str_Int_Pair *e = ref->local ? NULL :
+                hash_get(&exports, ref->symbol);
+            if (e != NULL && e->p1 == -1) {
+                printf("'%s' used by '%s' is a label of more than one "
+                    "module:", ref->symbol, obj->path);
+                for (size_t k = 0; k < path_count; k++) {
+                    if (hash_get(&objs[k].label_map, ref->symbol) != NULL)
+                        printf(" '%s'", objs[k].path);
+                }
+                printf("\n");
+                goto link_error;
+            }
+            if (e != NULL)
+                owner = objs + e->p1;
+
+            long value;
+            if (owner != NULL) {
+                value = owner->base +
+                    hash_get(&owner->label_map, ref->symbol)->p1;
+            } else {
+                Str_Int_Pair *v = hash_get(&variables, ref->symbol);
+                if (v == NULL)
+                    v = hash_put(&variables, ref->symbol, mem++);
+                value = v->p1;
+            }
+            value += ref->offset;
+            if (value < 0 || value > MAX_A_VALUE) {
+                printf("Value of '%s%+i' in '%s' out of range (%li)\n",
+                    ref->symbol, ref->offset, obj->path, value);
+                goto link_error;
+            }
+            w[ref->index] = value;
+        }
+    }
+    *count = total;
+    hash_free(&variables);
+    hash_free(&exports);
+    goto done;
+
+link_error:
+    free(words);
+    words = NULL;
+    hash_free(&variables);
+    hash_free(&exports);
+
+done:
+    for (size_t i = 0; i < loaded; i++)
+        free_object(objs + i);
+    free(objs);
+    return words;
+}
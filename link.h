@@ -0,0 +1,13 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "inst.h"
+
+int write_object(FILE *f, Instruction *inst, size_t count,
+    Str_Int_Pair *predefined, size_t predefined_count,
+    Str_Int_Pair *labels, size_t label_count);
+uint16_t *link_objects(char **paths, size_t path_count, size_t *count);
+
+#endif // LINK_H
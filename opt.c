@@ -0,0 +1,739 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opt.h"
+#include "cfg.h"
+#include "rules.h"
+
+/*
+ Optimization passes over the parsed instruction array.
+
+ All passes run after labels are collected and before symbols are resolved,
+ so A-instructions still carry their symbols. Deleting an instruction moves
+ every label pointing to it onto the next kept instruction.
+
+ Numeric A-instructions are treated as ROM addresses only when they are the
+ source of a jump (Ex: '@95' followed by '0;JMP'). All other numbers are
+ data, so code addresses that travel through memory must be labels.
+*/
+
+// Returns index of instruction the label 'symbol' points to
+// Returns -1 if 'symbol' isn't a label
+int find_label_index(Str_Int_Pair *labels, size_t label_count, Slice *symbol)
+{
+    for (size_t i = 0; i < label_count; i++) {
+        if (cmp_str_slice(labels[i].p0, symbol) == 0)
+            return labels[i].p1;
+    }
+    return -1;
+}
+
+// Returns 1 if 'a' and 'b' load the same operand into A
+int same_operand(A_Instruction *a, A_Instruction *b)
+{
+    if (a->symbol && b->symbol)
+        return cmp_slices(a->symbol, b->symbol) == 0 &&
+            a->offset == b->offset;
+    if (!a->symbol && !b->symbol)
+        return a->value == b->value;
+    return 0;
+}
+
+// Returns index of the A-instruction that sets A for the jump at 'j'
+// Walks back over C-instructions that don't write A
+// Returns -1 if A isn't set by an A-instruction on the fall-through path
+long find_jump_source(Instruction *inst, size_t count, char *is_target,
+    size_t j)
+{
+    for (size_t k = j; k-- > 0;) {
+        // Control can enter between 'k' and 'j' with another value in A
+        if (is_target[k + 1])
+            return -1;
+        if (inst[k].type == A_INST)
+            return k;
+        C_Instruction *c = inst[k].inst;
+        if (c->dest & DEST_A || c->jump == JMP)
+            return -1;
+    }
+    return -1;
+}
+
+// Marks label targets and numeric jump targets in 'is_target' and numeric
+// jump sources in 'is_code_ref' (both zeroed arrays of 'count' + 1)
+// Returns 1 if addresses can be safely renumbered, 0 otherwise
+int can_renumber(Instruction *inst, size_t count, Str_Int_Pair *labels,
+    size_t label_count, char *is_target, char *is_code_ref)
+{
+    // Addresses relative to a label ('@LOOP+2') don't follow moved code
+    for (size_t i = 0; i < count; i++) {
+        if (inst[i].type != A_INST)
+            continue;
+        A_Instruction *a = inst[i].inst;
+        if (a->symbol && a->offset != 0 &&
+            find_label_index(labels, label_count, a->symbol) != -1)
+            return 0;
+    }
+
+    for (size_t i = 0; i < label_count; i++) {
+        if ((size_t) labels[i].p1 <= count)
+            is_target[labels[i].p1] = 1;
+    }
+
+    int has_computed_jumps = 0;
+    char *is_jump_source = calloc(count + 1, sizeof(char));
+    for (size_t j = 0; j < count; j++) {
+        if (inst[j].type != C_INST)
+            continue;
+        C_Instruction *c = inst[j].inst;
+        if (c->jump == JUMP_NULL)
+            continue;
+
+        long s = find_jump_source(inst, count, is_target, j);
+        if (s == -1) {
+            has_computed_jumps = 1;
+            continue;
+        }
+
+        A_Instruction *a = inst[s].inst;
+        is_jump_source[s] = 1;
+        if (a->symbol == NULL) {
+            is_code_ref[s] = 1;
+            if (a->value <= count)
+                is_target[a->value] = 1;
+        } else if (find_label_index(labels, label_count, a->symbol) == -1) {
+            // Jump through a variable
+            has_computed_jumps = 1;
+        }
+    }
+
+    // Labels loaded as data are how return addresses get pushed. Computed
+    // jumps without any of those return to numeric addresses, which can't
+    // be told apart from constants
+    int has_address_taken_labels = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (inst[i].type != A_INST || is_jump_source[i])
+            continue;
+        A_Instruction *a = inst[i].inst;
+        if (a->symbol &&
+            find_label_index(labels, label_count, a->symbol) != -1) {
+            has_address_taken_labels = 1;
+            break;
+        }
+    }
+
+    free(is_jump_source);
+    return !has_computed_jumps || has_address_taken_labels;
+}
+
+// Drops instructions marked in 'dead' and re-resolves label addresses and
+// numeric jump targets marked in 'is_code_ref'
+// Returns new instruction count
+size_t remove_instructions(Instruction *inst, size_t count, char *dead,
+    char *is_code_ref, Str_Int_Pair *labels, size_t label_count)
+{
+    // new_index[i] is where instruction 'i' (or the next kept one) ends up
+    size_t *new_index = malloc((count + 1) * sizeof(size_t));
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        new_index[i] = kept;
+        if (!dead[i])
+            kept++;
+    }
+    new_index[count] = kept;
+
+    for (size_t i = 0; i < label_count; i++) {
+        if ((size_t) labels[i].p1 <= count)
+            labels[i].p1 = new_index[labels[i].p1];
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (dead[i] || !is_code_ref[i])
+            continue;
+        A_Instruction *a = inst[i].inst;
+        if (a->value <= count)
+            a->value = new_index[a->value];
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (dead[i]) {
+            free_instruction(inst + i);
+            continue;
+        }
+        is_code_ref[n] = is_code_ref[i];
+        inst[n++] = inst[i];
+    }
+
+    free(new_index);
+    return n;
+}
+
+// State shared by the peephole patterns
+typedef struct {
+    Instruction *inst;
+    size_t count;
+    char *dead;
+    char *is_target;
+    Str_Int_Pair *labels;
+    size_t label_count;
+} Peephole;
+
+static size_t next_live(Peephole *p, size_t i)
+{
+    for (i++; i < p->count && p->dead[i]; i++)
+        ;
+    return i;
+}
+
+static void kill(Peephole *p, size_t i)
+{
+    p->dead[i] = 1;
+    // Labels of a removed instruction move to the next one
+    if (p->is_target[i])
+        p->is_target[next_live(p, i)] = 1;
+}
+
+// Returns 1 if the value in A is overwritten before being read on the
+// fall-through path starting at 'i'
+static int a_dead_from(Peephole *p, size_t i)
+{
+    for (; i < p->count; i = next_live(p, i)) {
+        if (p->dead[i])
+            continue;
+        if (p->inst[i].type == A_INST)
+            return 1;
+        C_Instruction *c = p->inst[i].inst;
+        // Jumps go to A and stores go to M, which is addressed by A
+        if (comp_reads(c->comp, 'A') || comp_reads(c->comp, 'M') ||
+            c->jump != JUMP_NULL || c->dest & DEST_M)
+            return 0;
+        if (c->dest & DEST_A)
+            return 1;
+    }
+    return 1;
+}
+
+// Returns 1 if the value in D is overwritten before being read on the
+// fall-through path starting at 'i'
+static int d_dead_from(Peephole *p, size_t i)
+{
+    for (; i < p->count; i = next_live(p, i)) {
+        if (p->dead[i] || p->inst[i].type == A_INST)
+            continue;
+        C_Instruction *c = p->inst[i].inst;
+        // Jump targets may read D, so assume they do
+        if (comp_reads(c->comp, 'D') || c->jump != JUMP_NULL)
+            return 0;
+        if (c->dest & DEST_D)
+            return 1;
+    }
+    return 0;
+}
+
+// Returns instruction index 'a' jumps to, skipping removed instructions
+// Returns -1 if 'a' isn't a known jump target
+static long jump_target(Peephole *p, A_Instruction *a)
+{
+    long t = (a->symbol == NULL) ? (long) a->value :
+        find_label_index(p->labels, p->label_count, a->symbol);
+    if (t < 0 || (size_t) t > p->count)
+        return -1;
+    if ((size_t) t < p->count && p->dead[t])
+        t = next_live(p, t);
+    return t;
+}
+
+// '@X' whose value is never read
+static int remove_dead_a_loads(Peephole *p)
+{
+    int changed = 0;
+    for (size_t i = 0; i < p->count; i++) {
+        if (p->dead[i] || p->inst[i].type != A_INST)
+            continue;
+        if (a_dead_from(p, next_live(p, i))) {
+            kill(p, i);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// '@X' when A already holds X. Ex: '@SP', 'M=M+1', '@SP'
+static int remove_redundant_a_loads(Peephole *p)
+{
+    int changed = 0;
+    long last = -1; // A-instruction that set the current value of A
+    for (size_t i = 0; i < p->count; i++) {
+        if (p->dead[i])
+            continue;
+        if (p->is_target[i])
+            last = -1;
+
+        if (p->inst[i].type == A_INST) {
+            if (last != -1 &&
+                same_operand(p->inst[last].inst, p->inst[i].inst)) {
+                kill(p, i);
+                changed = 1;
+            } else {
+                last = i;
+            }
+            continue;
+        }
+
+        C_Instruction *c = p->inst[i].inst;
+        if (c->dest & DEST_A || c->jump == JMP)
+            last = -1;
+    }
+    return changed;
+}
+
+// C-instructions without effect: no destination, self copies ('D=D'),
+// registers overwritten before being read and stores to M overwritten by
+// the next instruction
+static int remove_dead_stores(Peephole *p)
+{
+    int changed = 0;
+    for (size_t i = 0; i < p->count; i++) {
+        if (p->dead[i] || p->inst[i].type != C_INST)
+            continue;
+        C_Instruction *c = p->inst[i].inst;
+        if (c->jump != JUMP_NULL)
+            continue;
+
+        size_t j = next_live(p, i);
+        int dead = 0;
+        if ((c->dest == DEST_A && c->comp == COMP_A) ||
+            (c->dest == DEST_D && c->comp == COMP_D) ||
+            (c->dest == DEST_M && c->comp == COMP_M)) {
+            dead = 1;
+        } else if (c->dest == DEST_M) {
+            if (j < p->count && !p->is_target[j] &&
+                p->inst[j].type == C_INST) {
+                C_Instruction *next = p->inst[j].inst;
+                dead = next->dest & DEST_M && !comp_reads(next->comp, 'M');
+            }
+        } else if (!(c->dest & DEST_M)) {
+            dead = (!(c->dest & DEST_A) || a_dead_from(p, j)) &&
+                (!(c->dest & DEST_D) || d_dead_from(p, j));
+        }
+
+        if (dead) {
+            kill(p, i);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// '@L', 'D;JGT' when 'L' is the instruction right after the jump
+static int remove_trivial_jumps(Peephole *p)
+{
+    int changed = 0;
+    for (size_t i = 0; i < p->count; i++) {
+        if (p->dead[i] || p->inst[i].type != A_INST)
+            continue;
+        size_t j = next_live(p, i);
+        if (j >= p->count || p->is_target[j] || p->inst[j].type != C_INST)
+            continue;
+        C_Instruction *c = p->inst[j].inst;
+        if (c->jump == JUMP_NULL || c->dest != DEST_NULL)
+            continue;
+
+        size_t k = next_live(p, j);
+        if (jump_target(p, p->inst[i].inst) != (long) k ||
+            !a_dead_from(p, k))
+            continue;
+
+        kill(p, i);
+        kill(p, j);
+        changed = 1;
+    }
+    return changed;
+}
+
+// Runs of C-instructions that superopt found a shorter equivalent for in
+// rules.h. Ex: 'D=A', 'D=D-1' becomes 'D=A-1'
+static int apply_rewrite_rules(Peephole *p)
+{
+    int changed = 0;
+    for (size_t i = 0; i < p->count; i++) {
+        if (p->dead[i])
+            continue;
+
+        // Labels may only point to the start of a run
+        size_t run[MAX_RULE_LENGTH];
+        uint16_t words[MAX_RULE_LENGTH];
+        size_t n = 0;
+        for (size_t j = i; j < p->count && n < MAX_RULE_LENGTH;
+            j = next_live(p, j)) {
+            if (p->inst[j].type != C_INST || (n > 0 && p->is_target[j]))
+                break;
+            C_Instruction *c = p->inst[j].inst;
+            if (c->jump != JUMP_NULL)
+                break;
+            run[n] = j;
+            words[n++] = encode_instruction(p->inst + j);
+        }
+
+        for (size_t r = 0; r < rewrite_rule_count; r++) {
+            const Rewrite_Rule *rule = rewrite_rules + r;
+            if (rule->length > n || memcmp(rule->pattern, words,
+                rule->length * sizeof(uint16_t)) != 0)
+                continue;
+            for (size_t k = 0; k < rule->length; k++) {
+                if (k < rule->replacement_length)
+                    decode_c_instruction(rule->replacement[k],
+                        p->inst[run[k]].inst);
+                else
+                    kill(p, run[k]);
+            }
+            changed = 1;
+            break;
+        }
+    }
+    return changed;
+}
+
+// Removes redundant A-loads, dead stores and jumps to the next instruction
+// from 'inst', shortens runs of C-instructions by the rules in rules.h and
+// re-resolves label addresses
+// Returns number of instructions removed
+size_t peephole_optimize(Instruction *inst, size_t *count,
+    Str_Int_Pair *labels, size_t label_count)
+{
+    Peephole p = {
+        .inst = inst,
+        .count = *count,
+        .dead = calloc(*count + 1, sizeof(char)),
+        .is_target = calloc(*count + 1, sizeof(char)),
+        .labels = labels,
+        .label_count = label_count,
+    };
+    char *is_code_ref = calloc(*count + 1, sizeof(char));
+
+    if (!can_renumber(inst, *count, labels, label_count, p.is_target,
+        is_code_ref)) {
+        printf("warning: -O skipped, computed jumps to numeric addresses "
+            "or label offsets\n");
+        free(p.dead);
+        free(p.is_target);
+        free(is_code_ref);
+        return 0;
+    }
+
+    int changed;
+    do {
+        changed = remove_redundant_a_loads(&p);
+        changed |= remove_trivial_jumps(&p);
+        changed |= remove_dead_stores(&p);
+        changed |= remove_dead_a_loads(&p);
+        changed |= apply_rewrite_rules(&p);
+    } while (changed);
+
+    size_t old_count = *count;
+    *count = remove_instructions(inst, *count, p.dead, is_code_ref, labels,
+        label_count);
+
+    free(p.dead);
+    free(p.is_target);
+    free(is_code_ref);
+    return old_count - *count;
+}
+
+// Removes labels no A-instruction refers to from 'labels'
+// Returns number of labels removed
+static size_t remove_unreferenced_labels(Instruction *inst, size_t count,
+    Str_Int_Pair *labels, size_t *label_count)
+{
+    char *referenced = calloc(*label_count + 1, sizeof(char));
+    for (size_t i = 0; i < count; i++) {
+        if (inst[i].type != A_INST)
+            continue;
+        A_Instruction *a = inst[i].inst;
+        if (a->symbol == NULL)
+            continue;
+        for (size_t j = 0; j < *label_count; j++) {
+            if (cmp_str_slice(labels[j].p0, a->symbol) == 0) {
+                referenced[j] = 1;
+                break;
+            }
+        }
+    }
+
+    size_t n = 0;
+    for (size_t j = 0; j < *label_count; j++) {
+        if (referenced[j])
+            labels[n++] = labels[j];
+        else
+            free(labels[j].p0);
+    }
+
+    size_t removed = *label_count - n;
+    *label_count = n;
+    free(referenced);
+    return removed;
+}
+
+// Removes basic blocks unreachable from the first instruction and labels
+// that are no longer referenced, then re-resolves label addresses
+// Labels loaded as data (return addresses, function pointers) by reachable
+// code count as reachable, since computed jumps may go there
+// Returns number of instructions removed
+size_t eliminate_dead_code(Instruction *inst, size_t *count,
+    Str_Int_Pair *labels, size_t *label_count)
+{
+    CFG cfg;
+    if (build_cfg(&cfg, inst, *count, labels, *label_count)) {
+        printf("warning: --dce skipped, computed jumps to numeric "
+            "addresses or label offsets\n");
+        free_cfg(&cfg);
+        return 0;
+    }
+
+    char *reachable = calloc(cfg.block_count + 1, sizeof(char));
+    size_t *stack = malloc((cfg.block_count + 1) * sizeof(size_t));
+    size_t top = 0;
+    if (cfg.block_count > 0) {
+        reachable[0] = 1;
+        stack[top++] = 0;
+    }
+
+    while (top > 0) {
+        Basic_Block *b = cfg.blocks + stack[--top];
+        size_t next[2] = { b->fall, b->jump };
+        for (int k = 0; k < 2; k++) {
+            if (next[k] != NO_BLOCK && !reachable[next[k]]) {
+                reachable[next[k]] = 1;
+                stack[top++] = next[k];
+            }
+        }
+
+        for (size_t i = b->start; i < b->end; i++) {
+            if (!cfg.escapes[i])
+                continue;
+            A_Instruction *a = inst[i].inst;
+            size_t t = find_label_index(labels, *label_count, a->symbol);
+            if (t < *count && !reachable[cfg.block_of[t]]) {
+                reachable[cfg.block_of[t]] = 1;
+                stack[top++] = cfg.block_of[t];
+            }
+        }
+    }
+
+    char *dead = calloc(*count + 1, sizeof(char));
+    for (size_t i = 0; i < *count; i++)
+        dead[i] = !reachable[cfg.block_of[i]];
+
+    size_t old_count = *count;
+    *count = remove_instructions(inst, *count, dead, cfg.is_code_ref, labels,
+        *label_count);
+    remove_unreferenced_labels(inst, *count, labels, label_count);
+
+    free(dead);
+    free(stack);
+    free(reachable);
+    free_cfg(&cfg);
+    return old_count - *count;
+}
+
+// Code from a label up to the first unconditional jump, entered only
+// through labels since the instruction before it is a jump too
+typedef struct {
+    size_t start;
+    size_t end; // the jump, inclusive
+    uint64_t hash;
+} Region;
+
+static int compare_regions(const void *x, const void *y)
+{
+    const Region *a = x;
+    const Region *b = y;
+    if (a->hash != b->hash)
+        return a->hash < b->hash ? -1 : 1;
+    return a->start < b->start ? -1 : 1;
+}
+
+static uint64_t hash_word(uint64_t h, uint64_t word)
+{
+    for (int i = 0; i < 8; i++) {
+        h ^= (word >> (i * 8)) & 0xFF;
+        h *= 0x100000001B3;
+    }
+    return h;
+}
+
+// Hashes region 'r'. 'target' holds the instruction each label reference
+// points to, or -1. Jumps inside the region hash by their distance from
+// its start, so copies with their own local labels hash the same
+static uint64_t hash_region(Instruction *inst, long *target, Region *r)
+{
+    uint64_t h = 0xCBF29CE484222325;
+    for (size_t i = r->start; i <= r->end; i++) {
+        if (inst[i].type == C_INST) {
+            h = hash_word(h, encode_instruction(inst + i));
+            continue;
+        }
+        A_Instruction *a = inst[i].inst;
+        long t = target[i];
+        if (t >= (long) r->start && t <= (long) r->end) {
+            h = hash_word(h, 0x10000 + t - r->start);
+        } else if (t != -1) {
+            h = hash_word(h, 0x20000 + t);
+        } else if (a->symbol) {
+            for (char *c = a->symbol->start; c <= a->symbol->end; c++)
+                h = hash_word(h, *c);
+            h = hash_word(h, 0x30000 + a->offset);
+        } else {
+            h = hash_word(h, a->value);
+        }
+    }
+    return h;
+}
+
+// Returns 1 if regions 'x' and 'y' run the same code
+static int same_region(Instruction *inst, long *target, Region *x, Region *y)
+{
+    if (x->end - x->start != y->end - y->start)
+        return 0;
+    for (size_t k = 0; k <= x->end - x->start; k++) {
+        Instruction *a = inst + x->start + k;
+        Instruction *b = inst + y->start + k;
+        if (a->type != b->type)
+            return 0;
+        if (a->type == C_INST) {
+            if (encode_instruction(a) != encode_instruction(b))
+                return 0;
+            continue;
+        }
+
+        long ta = target[x->start + k];
+        long tb = target[y->start + k];
+        int a_inside = ta >= (long) x->start && ta <= (long) x->end;
+        int b_inside = tb >= (long) y->start && tb <= (long) y->end;
+        if (a_inside || b_inside) {
+            if (!a_inside || !b_inside ||
+                ta - (long) x->start != tb - (long) y->start)
+                return 0;
+        } else if (ta != -1 || tb != -1) {
+            if (ta != tb)
+                return 0;
+        } else if (!same_operand(a->inst, b->inst)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Removes the copies of each region found in 'inst' and points their labels
+// to the first one
+// Returns number of instructions removed
+static size_t fold_regions(Instruction *inst, size_t *count,
+    Str_Int_Pair *labels, size_t label_count, char *is_target,
+    char *is_code_ref)
+{
+    long *target = malloc((*count + 1) * sizeof(long));
+    char *is_numeric_target = calloc(*count + 1, sizeof(char));
+    for (size_t i = 0; i < *count; i++) {
+        target[i] = -1;
+        if (inst[i].type != A_INST)
+            continue;
+        A_Instruction *a = inst[i].inst;
+        if (a->symbol)
+            target[i] = find_label_index(labels, label_count, a->symbol);
+        else if (is_code_ref[i] && a->value <= *count)
+            is_numeric_target[a->value] = 1;
+    }
+
+    // Numeric jump targets can't be moved to another copy, so regions
+    // holding one are left alone
+    Region *regions = malloc((*count + 1) * sizeof(Region));
+    size_t region_count = 0;
+    for (size_t s = 1; s < *count; s++) {
+        Instruction *prev = inst + s - 1;
+        if (!is_target[s] || prev->type != C_INST ||
+            ((C_Instruction*) prev->inst)->jump != JMP)
+            continue;
+
+        size_t e = s;
+        int numeric = 0;
+        for (; e < *count; e++) {
+            numeric |= is_numeric_target[e];
+            if (inst[e].type == C_INST &&
+                ((C_Instruction*) inst[e].inst)->jump == JMP)
+                break;
+        }
+        if (e == *count || numeric)
+            continue;
+
+        Region *r = regions + region_count++;
+        r->start = s;
+        r->end = e;
+        r->hash = hash_region(inst, target, r);
+        s = e;
+    }
+    qsort(regions, region_count, sizeof(Region), compare_regions);
+
+    // 'copy_of' maps each instruction of a removed region to the same
+    // instruction in the kept one
+    char *dead = calloc(*count + 1, sizeof(char));
+    size_t *copy_of = malloc((*count + 1) * sizeof(size_t));
+    for (size_t i = 0; i < region_count; i++) {
+        Region *r = regions + i;
+        for (size_t j = i; j-- > 0 && regions[j].hash == r->hash;) {
+            Region *kept = regions + j;
+            if (dead[kept->start] || !same_region(inst, target, kept, r))
+                continue;
+            for (size_t k = r->start; k <= r->end; k++) {
+                dead[k] = 1;
+                copy_of[k] = kept->start + (k - r->start);
+            }
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < label_count; i++) {
+        size_t p = labels[i].p1;
+        if (p < *count && dead[p])
+            labels[i].p1 = copy_of[p];
+    }
+
+    size_t old_count = *count;
+    *count = remove_instructions(inst, *count, dead, is_code_ref, labels,
+        label_count);
+
+    free(copy_of);
+    free(dead);
+    free(regions);
+    free(is_numeric_target);
+    free(target);
+    return old_count - *count;
+}
+
+// Merges identical regions of code that end in an unconditional jump, like
+// the comparison and return sequences the VM translator writes for each
+// use, and points labels of the removed copies to the kept one. Repeats
+// until no copies are left, since merging makes more regions identical
+// Returns number of instructions removed
+size_t fold_identical_code(Instruction *inst, size_t *count,
+    Str_Int_Pair *labels, size_t label_count)
+{
+    size_t old_count = *count;
+    size_t removed;
+    do {
+        char *is_target = calloc(*count + 1, sizeof(char));
+        char *is_code_ref = calloc(*count + 1, sizeof(char));
+        if (!can_renumber(inst, *count, labels, label_count, is_target,
+            is_code_ref)) {
+            printf("warning: --icf skipped, computed jumps to numeric "
+                "addresses or label offsets\n");
+            free(is_target);
+            free(is_code_ref);
+            break;
+        }
+        removed = fold_regions(inst, count, labels, label_count, is_target,
+            is_code_ref);
+        free(is_target);
+        free(is_code_ref);
+    } while (removed > 0);
+    return old_count - *count;
+}
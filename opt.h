@@ -0,0 +1,21 @@
+#ifndef OPT_H
+#define OPT_H
+
+#include "inst.h"
+
+int find_label_index(Str_Int_Pair *labels, size_t label_count, Slice *symbol);
+int same_operand(A_Instruction *a, A_Instruction *b);
+long find_jump_source(Instruction *inst, size_t count, char *is_target,
+    size_t j);
+int can_renumber(Instruction *inst, size_t count, Str_Int_Pair *labels,
+    size_t label_count, char *is_target, char *is_code_ref);
+size_t remove_instructions(Instruction *inst, size_t count, char *dead,
+    char *is_code_ref, Str_Int_Pair *labels, size_t label_count);
+size_t peephole_optimize(Instruction *inst, size_t *count,
+    Str_Int_Pair *labels, size_t label_count);
+size_t eliminate_dead_code(Instruction *inst, size_t *count,
+    Str_Int_Pair *labels, size_t *label_count);
+size_t fold_identical_code(Instruction *inst, size_t *count,
+    Str_Int_Pair *labels, size_t label_count);
+
+#endif // OPT_H
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opt.h"
+#include "outline.h"
+
+/*
+ Outlining of repeated code (--outline).
+
+ An instruction sequence found in several places is kept once, after the
+ program, and each copy becomes a call to it:
+         @$outline.3.1      return address
+         D=A
+         @$outline.ret
+         M=D
+         @$outline.3        shared copy
+         0;JMP
+     ($outline.3.1)
+ and the shared copy ends with a return:
+         @$outline.ret
+         A=M
+         0;JMP
+
+ A sequence can be outlined when
+     - it has no jumps and no labels except at its start
+     - it starts with an A-instruction, so A isn't read on entry
+     - it writes D before reading it, since calls overwrite D
+     - an A-instruction follows it, since returns overwrite A
+ Shared copies don't call each other, so one return address is enough.
+ Programs that don't end with a jump would run into the shared copies, so
+ theirs go before the program instead, behind a jump over them.
+
+ A call and its return take 9 cycles more than the copy they replace. So
+ that these cycles buy enough ROM, a sequence is only outlined when every
+ copy is at least 'min_saving' words longer than its call, and when the
+ calls save more words than the return adds. Longer sequences go first.
+*/
+
+#define MAX_OUTLINE_LENGTH                 64
+#define CALL_SIZE                          6
+#define RETURN_SIZE                        3
+#define SKIP_SIZE                          2
+#define OUTLINE_LABEL_SIZE                 32
+#define RETURN_VARIABLE                    "$outline.ret"
+
+typedef struct {
+    size_t start;
+    uint64_t hash;
+} Window;
+
+static int compare_windows(const void *x, const void *y)
+{
+    const Window *a = x;
+    const Window *b = y;
+    if (a->hash != b->hash)
+        return a->hash < b->hash ? -1 : 1;
+    return a->start < b->start ? -1 : 1;
+}
+
+static uint64_t inst_key(Instruction *i)
+{
+    if (i->type == C_INST)
+        return encode_instruction(i) | (1ull << 32);
+    A_Instruction *a = i->inst;
+    if (a->symbol == NULL)
+        return a->value | (2ull << 32);
+    uint64_t h = 0xCBF29CE484222325;
+    for (char *c = a->symbol->start; c <= a->symbol->end; c++) {
+        h ^= (unsigned char) *c;
+        h *= 0x100000001B3;
+    }
+    return h ^ (uint32_t) a->offset;
+}
+
+static int same_inst(Instruction *x, Instruction *y)
+{
+    if (x->type != y->type)
+        return 0;
+    if (x->type == C_INST)
+        return encode_instruction(x) == encode_instruction(y);
+    A_Instruction *a = x->inst;
+    A_Instruction *b = y->inst;
+    if (a->symbol && b->symbol)
+        return cmp_slices(a->symbol, b->symbol) == 0 &&
+            a->offset == b->offset;
+    if (!a->symbol && !b->symbol)
+        return a->value == b->value;
+    return 0;
+}
+
+static char *new_label(Str_Int_Pair *labels, size_t *label_count,
+    size_t index, char *name)
+{
+    char *str = malloc(strlen(name) + 1);
+    strcpy(str, name);
+    labels[(*label_count)++] = (Str_Int_Pair) { .p0 = str, .p1 = index };
+    return str;
+}
+
+// Moves the first copy of each sequence to 'out' + 'k', followed by a return
+// Returns the new 'k'
+static size_t emit_shared_copies(Instruction *out, size_t k,
+    Instruction *inst, size_t *seq_start, size_t *seq_length,
+    size_t seq_count, Str_Int_Pair *labels, size_t *label_count)
+{
+    char name[OUTLINE_LABEL_SIZE];
+    for (size_t s = 0; s < seq_count; s++) {
+        snprintf(name, sizeof(name), "$outline.%zu", s);
+        new_label(labels, label_count, k, name);
+        for (size_t j = 0; j < seq_length[s]; j++)
+            out[k++] = inst[seq_start[s] + j];
+        out[k++] = new_a_symbol(RETURN_VARIABLE);
+        out[k++] = new_c_instruction(DEST_A, COMP_M, JUMP_NULL);
+        out[k++] = new_c_instruction(DEST_NULL, COMP_0, JMP);
+    }
+    return k;
+}
+
+// Replaces repeated instruction sequences with calls to a shared copy.
+// Adds labels for the shared copies and return addresses
+void outline_code(Instruction **inst_ptr, size_t *count, Str_Int_Pair *labels,
+    size_t *label_count, size_t label_capacity, size_t min_saving,
+    Outline_Stats *stats)
+{
+    Instruction *inst = *inst_ptr;
+    size_t n = *count;
+    *stats = (Outline_Stats) { 0 };
+
+    char *is_target = calloc(n + 1, sizeof(char));
+    char *is_code_ref = calloc(n + 1, sizeof(char));
+    if (!can_renumber(inst, n, labels, *label_count, is_target,
+        is_code_ref)) {
+        printf("warning: --outline skipped, computed jumps to numeric "
+            "addresses or label offsets\n");
+        free(is_target);
+        free(is_code_ref);
+        return;
+    }
+
+    C_Instruction *last = (n > 0 && inst[n - 1].type == C_INST) ?
+        inst[n - 1].inst : NULL;
+    int in_front = last == NULL || last->jump != JMP;
+
+    // 'straight[i]' is how many instructions from 'i' on have no jumps and
+    // no labels after the first. 'd_read[i]' is 1 if the first instruction
+    // from 'i' on that uses D reads it, and 'd_use[i]' is that instruction
+    size_t *straight = malloc((n + 1) * sizeof(size_t));
+    size_t *d_use = malloc((n + 1) * sizeof(size_t));
+    char *d_read = malloc(n + 1);
+    uint64_t *key = malloc((n + 1) * sizeof(uint64_t));
+    straight[n] = 0;
+    d_use[n] = n;
+    d_read[n] = 1;
+    for (size_t i = n; i-- > 0;) {
+        key[i] = inst_key(inst + i);
+        straight[i] = 1 + (is_target[i + 1] ? 0 : straight[i + 1]);
+        d_use[i] = d_use[i + 1];
+        d_read[i] = d_read[i + 1];
+        if (inst[i].type != C_INST)
+            continue;
+        C_Instruction *c = inst[i].inst;
+        if (c->jump != JUMP_NULL)
+            straight[i] = 0;
+        if (comp_reads(c->comp, 'D') || c->dest & DEST_D) {
+            d_use[i] = i;
+            d_read[i] = comp_reads(c->comp, 'D');
+        }
+    }
+
+    // 'site[i]' is 1 + the sequence a call at 'i' goes to, 0 if none
+    size_t *site = calloc(n + 1, sizeof(size_t));
+    char *taken = calloc(n + 1, sizeof(char));
+    size_t *seq_start = malloc((n + 1) * sizeof(size_t));
+    size_t *seq_length = malloc((n + 1) * sizeof(size_t));
+    size_t seq_count = 0;
+    size_t new_labels = 0;
+    size_t saved = 0;
+    Window *windows = malloc((n + 1) * sizeof(Window));
+    char *grouped = malloc(n + 1);
+    size_t *copies = malloc((n + 1) * sizeof(size_t));
+
+    for (size_t len = MAX_OUTLINE_LENGTH; len >= CALL_SIZE + min_saving &&
+        len > CALL_SIZE; len--) {
+        size_t wc = 0;
+        for (size_t i = 0; i + len < n; i++) {
+            if (straight[i] < len || inst[i].type != A_INST ||
+                inst[i + len].type != A_INST || d_use[i] >= i + len ||
+                d_read[i])
+                continue;
+            uint64_t h = len;
+            for (size_t k = i; k < i + len; k++)
+                h = h * 0x100000001B3 + key[k];
+            windows[wc++] = (Window) { .start = i, .hash = h };
+        }
+        qsort(windows, wc, sizeof(Window), compare_windows);
+        memset(grouped, 0, wc);
+
+        for (size_t w = 0; w < wc; w++) {
+            if (grouped[w])
+                continue;
+
+            // Copies of the sequence at 'w' that don't overlap
+            size_t rep = windows[w].start;
+            size_t copy_count = 0;
+            size_t next_free = 0;
+            for (size_t v = w; v < wc && windows[v].hash == windows[w].hash;
+                v++) {
+                size_t s = windows[v].start;
+                int same = !grouped[v];
+                for (size_t k = 0; same && k < len; k++)
+                    same = same_inst(inst + rep + k, inst + s + k);
+                if (!same)
+                    continue;
+                grouped[v] = 1;
+
+                int available = s >= next_free;
+                for (size_t k = s; available && k < s + len; k++)
+                    available = !taken[k];
+                if (available) {
+                    copies[copy_count++] = s;
+                    next_free = s + len;
+                }
+            }
+
+            // One label per call and shared copy, and '$outline.start'
+            if (copy_count < 2 ||
+                copy_count * (len - CALL_SIZE) <= len + RETURN_SIZE ||
+                *label_count + new_labels + copy_count + 2 > label_capacity)
+                continue;
+
+            for (size_t c = 0; c < copy_count; c++) {
+                site[copies[c]] = seq_count + 1;
+                memset(taken + copies[c], 1, len);
+            }
+            seq_start[seq_count] = copies[0];
+            seq_length[seq_count++] = len;
+            new_labels += copy_count + 1;
+            saved += copy_count * (len - CALL_SIZE) - len - RETURN_SIZE;
+            stats->copies += copy_count;
+        }
+    }
+
+    if (seq_count == 0 || (in_front && saved <= SKIP_SIZE)) {
+        stats->copies = 0;
+        goto done;
+    }
+
+    size_t shared_size = 0;
+    for (size_t s = 0; s < seq_count; s++)
+        shared_size += seq_length[s] + RETURN_SIZE;
+
+    // Where each instruction ends up. Labels and numeric jump targets are
+    // never inside a copy
+    size_t *new_index = malloc((n + 1) * sizeof(size_t));
+    size_t m = in_front ? SKIP_SIZE + shared_size : 0;
+    for (size_t i = 0; i < n;) {
+        new_index[i] = m;
+        if (site[i]) {
+            size_t len = seq_length[site[i] - 1];
+            for (size_t k = i; k < i + len; k++)
+                new_index[k] = m;
+            m += CALL_SIZE;
+            i += len;
+        } else {
+            m++;
+            i++;
+        }
+    }
+    new_index[n] = m;
+    if (!in_front)
+        m += shared_size;
+
+    for (size_t i = 0; i < *label_count; i++) {
+        if ((size_t) labels[i].p1 <= n)
+            labels[i].p1 = new_index[labels[i].p1];
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!is_code_ref[i])
+            continue;
+        A_Instruction *a = inst[i].inst;
+        if (a->value <= n)
+            a->value = new_index[a->value];
+    }
+
+    // Calls replace the copies, except for the first copy of each sequence
+    // which is moved to the shared copies
+    Instruction *out = malloc((m + 1) * sizeof(Instruction));
+    size_t *calls = calloc(seq_count, sizeof(size_t));
+    char name[OUTLINE_LABEL_SIZE];
+    size_t k = 0;
+    if (in_front) {
+        snprintf(name, sizeof(name), "$outline.start");
+        new_label(labels, label_count, SKIP_SIZE + shared_size, name);
+        out[k++] = new_a_symbol(name);
+        out[k++] = new_c_instruction(DEST_NULL, COMP_0, JMP);
+        k = emit_shared_copies(out, k, inst, seq_start, seq_length,
+            seq_count, labels, label_count);
+    }
+    for (size_t i = 0; i < n;) {
+        if (!site[i]) {
+            out[k++] = inst[i++];
+            continue;
+        }
+        size_t s = site[i] - 1;
+        snprintf(name, sizeof(name), "$outline.%zu.%zu", s, ++calls[s]);
+        out[k++] = new_a_symbol(name);
+        new_label(labels, label_count, k + CALL_SIZE - 1, name);
+        out[k++] = new_c_instruction(DEST_D, COMP_A, JUMP_NULL);
+        out[k++] = new_a_symbol(RETURN_VARIABLE);
+        out[k++] = new_c_instruction(DEST_M, COMP_D, JUMP_NULL);
+        snprintf(name, sizeof(name), "$outline.%zu", s);
+        out[k++] = new_a_symbol(name);
+        out[k++] = new_c_instruction(DEST_NULL, COMP_0, JMP);
+
+        if (i != seq_start[s]) {
+            for (size_t j = i; j < i + seq_length[s]; j++)
+                free_instruction(inst + j);
+        }
+        i += seq_length[s];
+    }
+
+    if (!in_front) {
+        k = emit_shared_copies(out, k, inst, seq_start, seq_length,
+            seq_count, labels, label_count);
+    }
+
+    stats->sequences = seq_count;
+    stats->saved = saved - (in_front ? SKIP_SIZE : 0);
+    free(calls);
+    free(new_index);
+    free(inst);
+    *inst_ptr = out;
+    *count = m;
+
+done:
+    free(copies);
+    free(grouped);
+    free(windows);
+    free(seq_length);
+    free(seq_start);
+    free(taken);
+    free(site);
+    free(key);
+    free(d_read);
+    free(d_use);
+    free(straight);
+    free(is_code_ref);
+    free(is_target);
+}
@@ -0,0 +1,19 @@
+#ifndef OUTLINE_H
+#define OUTLINE_H
+
+#include <stddef.h>
+#include "inst.h"
+
+#define OUTLINE_MIN_SAVING                 4
+
+typedef struct {
+    size_t sequences; // shared copies added
+    size_t copies; // copies replaced by calls
+    size_t saved; // words saved
+} Outline_Stats;
+
+void outline_code(Instruction **inst, size_t *count, Str_Int_Pair *labels,
+    size_t *label_count, size_t label_capacity, size_t min_saving,
+    Outline_Stats *stats);
+
+#endif // OUTLINE_H
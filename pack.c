@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cfg.h"
+#include "hash.h"
+#include "opt.h"
+#include "pack.h"
+
+/*
+ Packing of variables into shared RAM slots (--pack).
+
+ A variable is used by the instructions that read or write M while A holds
+ the address its '@x' loaded. Liveness is found backward over the basic
+ blocks, where computed jumps (returns) may go to any label loaded as data.
+ Two variables interfere when one is written while the other is live, and
+ variables that don't interfere can share a slot. Slots are handed out
+ greedily in the order variables first appear, lowest free slot first.
+
+ A variable gets a slot of its own when its address is used for anything
+ but M: read as a value ('@x', 'D=A'), jumped to, or still in A at a label
+ where other paths come in. Packing is skipped when a variable is used
+ with an offset ('@arr+2'), since that reaches the slots after it.
+*/
+
+#define NO_VARIABLE                        ((size_t) -1)
+#define WORD_BITS                          64
+
+typedef struct {
+    size_t words; // uint64_t per set
+    uint64_t *bits;
+} Sets;
+
+static void new_sets(Sets *s, size_t set_count, size_t size)
+{
+    s->words = (size + WORD_BITS - 1) / WORD_BITS;
+    s->bits = calloc(set_count * s->words + 1, sizeof(uint64_t));
+}
+
+static uint64_t *set_at(Sets *s, size_t i)
+{
+    return s->bits + i * s->words;
+}
+
+static int has(uint64_t *set, size_t v)
+{
+    return (set[v / WORD_BITS] >> (v % WORD_BITS)) & 1;
+}
+
+static void add(uint64_t *set, size_t v)
+{
+    set[v / WORD_BITS] |= (uint64_t) 1 << (v % WORD_BITS);
+}
+
+static void remove_from(uint64_t *set, size_t v)
+{
+    set[v / WORD_BITS] &= ~((uint64_t) 1 << (v % WORD_BITS));
+}
+
+static int intersects(uint64_t *x, uint64_t *y, size_t words)
+{
+    for (size_t w = 0; w < words; w++) {
+        if (x[w] & y[w])
+            return 1;
+    }
+    return 0;
+}
+
+// Returns index of 'symbol' in 'variables', NO_VARIABLE if it isn't one
+static size_t find_variable(Hash_Map *variables, Slice *symbol)
+{
+    char *name = slice_to_str(symbol);
+    Str_Int_Pair *p = hash_get(variables, name);
+    free(name);
+    return p ? (size_t) p->p1 : NO_VARIABLE;
+}
+
+// Fills 'used[i]' with the variable instruction 'i' reads or writes through
+// M and marks variables whose addresses are used otherwise in 'own_slot'
+// Returns 1 if a variable is used with an offset, 0 otherwise
+static int find_uses(Instruction *inst, size_t count, char *is_target,
+    Hash_Map *variables, size_t *used, char *own_slot)
+{
+    size_t current = NO_VARIABLE; // variable whose address is in A
+    int crossed = 0; // a label came after the '@x' that loaded it
+    for (size_t i = 0; i < count; i++) {
+        used[i] = NO_VARIABLE;
+        if (is_target[i])
+            crossed = 1;
+
+        if (inst[i].type == A_INST) {
+            A_Instruction *a = inst[i].inst;
+            current = a->symbol ? find_variable(variables, a->symbol) :
+                NO_VARIABLE;
+            crossed = 0;
+            if (current != NO_VARIABLE && a->offset != 0)
+                return 1;
+            continue;
+        }
+
+        C_Instruction *c = inst[i].inst;
+        if (current == NO_VARIABLE)
+            continue;
+        int reads_m = comp_reads(c->comp, 'M');
+        int writes_m = c->dest & DEST_M;
+        if (comp_reads(c->comp, 'A') || c->jump != JUMP_NULL ||
+            (crossed && (reads_m || writes_m)))
+            own_slot[current] = 1;
+        else if (reads_m || writes_m)
+            used[i] = current;
+        if (c->dest & DEST_A || c->jump != JUMP_NULL)
+            current = NO_VARIABLE;
+    }
+    return 0;
+}
+
+// Sets 'live' to the union of what is live into the successors of 'b'
+static void live_out(CFG *cfg, size_t b, Sets *live_in, size_t *entries,
+    size_t entry_count, uint64_t *live)
+{
+    Basic_Block *block = cfg->blocks + b;
+    memset(live, 0, live_in->words * sizeof(uint64_t));
+    size_t next[2] = { block->fall, block->jump };
+    for (int k = 0; k < 2; k++) {
+        if (next[k] == NO_BLOCK)
+            continue;
+        for (size_t w = 0; w < live_in->words; w++)
+            live[w] |= set_at(live_in, next[k])[w];
+    }
+    for (size_t e = 0; block->computed && e < entry_count; e++) {
+        for (size_t w = 0; w < live_in->words; w++)
+            live[w] |= set_at(live_in, entries[e])[w];
+    }
+}
+
+// Marks in 'interferes' the variables written while others are live
+static void find_interference(CFG *cfg, Instruction *inst, size_t *used,
+    size_t variable_count, size_t *entries, size_t entry_count,
+    Sets *interferes)
+{
+    size_t n = cfg->block_count;
+    Sets use, def, live_in;
+    new_sets(&use, n, variable_count);
+    new_sets(&def, n, variable_count);
+    new_sets(&live_in, n, variable_count);
+    uint64_t *live = calloc(use.words + 1, sizeof(uint64_t));
+
+    // Reads before writes, and writes, of each block
+    for (size_t b = 0; b < n; b++) {
+        Basic_Block *block = cfg->blocks + b;
+        for (size_t i = block->start; i < block->end; i++) {
+            size_t v = used[i];
+            if (v == NO_VARIABLE)
+                continue;
+            C_Instruction *c = inst[i].inst;
+            if (comp_reads(c->comp, 'M') && !has(set_at(&def, b), v))
+                add(set_at(&use, b), v);
+            if (c->dest & DEST_M)
+                add(set_at(&def, b), v);
+        }
+    }
+
+    // live_in = use | (live_out & ~def), with live_out the union of the
+    // successors' live_in. Later blocks first, since liveness flows back
+    int changed;
+    do {
+        changed = 0;
+        for (size_t b = n; b-- > 0;) {
+            live_out(cfg, b, &live_in, entries, entry_count, live);
+            uint64_t *in = set_at(&live_in, b);
+            for (size_t w = 0; w < use.words; w++) {
+                uint64_t x = set_at(&use, b)[w] |
+                    (live[w] & ~set_at(&def, b)[w]);
+                if (x != in[w]) {
+                    in[w] = x;
+                    changed = 1;
+                }
+            }
+        }
+    } while (changed);
+
+    // Walk each block back from its live_out
+    for (size_t b = 0; b < n; b++) {
+        Basic_Block *block = cfg->blocks + b;
+        live_out(cfg, b, &live_in, entries, entry_count, live);
+        for (size_t i = block->end; i-- > block->start;) {
+            size_t v = used[i];
+            if (v == NO_VARIABLE)
+                continue;
+            C_Instruction *c = inst[i].inst;
+            if (c->dest & DEST_M) {
+                for (size_t w = 0; w < use.words; w++) {
+                    for (size_t u = w * WORD_BITS; live[w] &&
+                        u < (w + 1) * WORD_BITS; u++) {
+                        if (u != v && has(live, u)) {
+                            add(set_at(interferes, u), v);
+                            add(set_at(interferes, v), u);
+                        }
+                    }
+                }
+                remove_from(live, v);
+            }
+            if (comp_reads(c->comp, 'M'))
+                add(live, v);
+        }
+    }
+
+    free(live);
+    free(live_in.bits);
+    free(def.bits);
+    free(use.bits);
+}
+
+// Gives each of 'variables' a slot in 'slot_of', where variables that are
+// never live at the same time may share one, and sets 'slot_count'
+// Returns 0 on success
+// Returns 1 if packing was skipped, leaving 'slot_of' as it was
+int pack_variables(Instruction *inst, size_t count, Str_Int_Pair *labels,
+    size_t label_count, char **variables, size_t variable_count,
+    size_t *slot_of, size_t *slot_count)
+{
+    CFG cfg;
+    if (build_cfg(&cfg, inst, count, labels, label_count)) {
+        printf("warning: --pack skipped, computed jumps to numeric "
+            "addresses or label offsets\n");
+        free_cfg(&cfg);
+        return 1;
+    }
+
+    Hash_Map index;
+    hash_init(&index, variable_count);
+    for (size_t v = 0; v < variable_count; v++)
+        hash_put(&index, variables[v], v);
+
+    size_t *used = malloc((count + 1) * sizeof(size_t));
+    char *own_slot = calloc(variable_count + 1, sizeof(char));
+    int offsets = find_uses(inst, count, cfg.is_target, &index, used,
+        own_slot);
+    hash_free(&index);
+    if (offsets) {
+        printf("warning: --pack skipped, variables used with offsets\n");
+        free(own_slot);
+        free(used);
+        free_cfg(&cfg);
+        return 1;
+    }
+
+    // Blocks computed jumps may go to
+    size_t *entries = malloc((cfg.block_count + 1) * sizeof(size_t));
+    char *is_entry = calloc(cfg.block_count + 1, sizeof(char));
+    size_t entry_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!cfg.escapes[i])
+            continue;
+        A_Instruction *a = inst[i].inst;
+        size_t t = find_label_index(labels, label_count, a->symbol);
+        if (t < count && !is_entry[cfg.block_of[t]]) {
+            is_entry[cfg.block_of[t]] = 1;
+            entries[entry_count++] = cfg.block_of[t];
+        }
+    }
+
+    Sets interferes, members;
+    new_sets(&interferes, variable_count, variable_count);
+    new_sets(&members, variable_count, variable_count);
+    find_interference(&cfg, inst, used, variable_count, entries,
+        entry_count, &interferes);
+
+    // Each variable goes to the lowest slot none of whose variables it
+    // interferes with. Variables with a slot of their own open a new one
+    // and take no one else
+    char *taken = calloc(variable_count + 1, sizeof(char));
+    *slot_count = 0;
+    for (size_t v = 0; v < variable_count; v++) {
+        size_t s = own_slot[v] ? *slot_count : 0;
+        while (s < *slot_count && (taken[s] || intersects(
+            set_at(&members, s), set_at(&interferes, v), members.words)))
+            s++;
+        if (s == *slot_count)
+            (*slot_count)++;
+        slot_of[v] = s;
+        add(set_at(&members, s), v);
+        taken[s] = own_slot[v];
+    }
+
+    free(taken);
+    free(members.bits);
+    free(interferes.bits);
+    free(is_entry);
+    free(entries);
+    free(own_slot);
+    free(used);
+    free_cfg(&cfg);
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include "inst.h"
+
+int pack_variables(Instruction *inst, size_t count, Str_Int_Pair *labels,
+    size_t label_count, char **variables, size_t variable_count,
+    size_t *slot_of, size_t *slot_count);
+
+#endif // PACK_H
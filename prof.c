@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prof.h"
+
+/*
+ Cycle profiler by label (--flat-profile, --folded-stacks).
+
+ Each ROM address belongs to the function label at or before it. When
+ the program came from VM code, functions are the labels with a '.' and
+ no '$' ('Main.fact'), and the others ('Main.fact$REC', 'END_EQ') count
+ towards the function before them. Otherwise every label is a function.
+ Code before the first function is '(top)'.
+
+ The flat profile adds up the executions of each address by function.
+
+ Folded stacks follow VM calls while the program runs. Return addresses
+ are labeled '<function>$ret.<n>' by the VM front end and 'RET_ADDRESS_*'
+ by the nand2tetris translator. A taken jump followed by a return address
+ is a call, of the first function start jumped to from there on, as the
+ call may go through shared code first. A jump to the return address of
+ a call on the stack returns from it and everything it called. Cycles go
+ to the calling context they ran in, one line per context
+ ('(top);Sys.init;Main.fact 1234'), which flamegraph.pl and speedscope
+ read as is.
+*/
+
+#define NO_NODE                            ((size_t) -1)
+#define STACK_INITIAL_CAPACITY             64
+#define NODES_INITIAL_CAPACITY             64
+
+// Calling context: a function called through the chain of its parents
+typedef struct {
+    size_t function; // index into 'names'
+    size_t parent;
+    size_t child; // first callee, NO_NODE if none
+    size_t sibling; // next callee of 'parent'
+    uint64_t cycles; // spent in the function itself in this context
+} Context;
+
+// Call on the stack
+typedef struct {
+    size_t node;
+    size_t ret; // return address
+} Frame;
+
+struct Profiler {
+    size_t rom_size;
+    char **names; // function names, '(top)' first
+    size_t name_count;
+    size_t *function_of; // function of each ROM address
+    char *is_start; // ROM address has a function label
+    char *is_return; // ROM address has a return address label
+    Context *nodes;
+    size_t node_count;
+    size_t node_capacity;
+    Frame *stack;
+    size_t depth;
+    size_t stack_capacity;
+    uint64_t last_cycles; // when the context on top of the stack was entered
+    size_t pending; // return address of a call yet to reach its function
+};
+
+typedef struct {
+    size_t addr;
+    size_t name;
+} Function_Start;
+
+typedef struct {
+    size_t name;
+    uint64_t cycles;
+} Function_Cycles;
+
+static int cmp_function_starts(const void *a, const void *b)
+{
+    const Function_Start *x = a;
+    const Function_Start *y = b;
+    if (x->addr != y->addr)
+        return (x->addr > y->addr) - (x->addr < y->addr);
+    return (x->name > y->name) - (x->name < y->name);
+}
+
+static int cmp_function_cycles(const void *a, const void *b)
+{
+    uint64_t x = ((Function_Cycles*) a)->cycles;
+    uint64_t y = ((Function_Cycles*) b)->cycles;
+    return (x < y) - (x > y);
+}
+
+// Returns the context 'function' called from context 'parent', adding it
+// the first time
+static size_t child_context(Profiler *prof, size_t parent, size_t function)
+{
+    if (prof->node_count == prof->node_capacity) {
+        prof->node_capacity *= 2;
+        prof->nodes = realloc(prof->nodes,
+            prof->node_capacity * sizeof(Context));
+    }
+
+    size_t *link = &prof->nodes[parent].child;
+    while (*link != NO_NODE) {
+        if (prof->nodes[*link].function == function)
+            return *link;
+        link = &prof->nodes[*link].sibling;
+    }
+    prof->nodes[prof->node_count] = (Context) {
+        .function = function,
+        .parent = parent,
+        .child = NO_NODE,
+        .sibling = NO_NODE,
+    };
+    *link = prof->node_count;
+    return prof->node_count++;
+}
+
+// Gives the cycles run since the last call or return to the context on
+// top of the stack
+static void charge(Profiler *prof, uint64_t cycles)
+{
+    prof->nodes[prof->stack[prof->depth - 1].node].cycles +=
+        cycles - prof->last_cycles;
+    prof->last_cycles = cycles;
+}
+
+// Returns 1 if 'label' names a function, 0 otherwise. 'from_vm' is set
+// when any label has a '.', as VM function names do
+static int is_function(char *label, int from_vm)
+{
+    return strchr(label, '$') == NULL &&
+        (!from_vm || strchr(label, '.') != NULL);
+}
+
+static int is_return_address(char *label)
+{
+    return strstr(label, "$ret.") != NULL ||
+        strncmp(label, "RET_ADDRESS", 11) == 0;
+}
+
+// Creates a profiler for a ROM of 'rom_size' words named by 'labels'
+Profiler *prof_new(Str_Int_Pair *labels, size_t label_count,
+    size_t rom_size)
+{
+    Profiler *prof = calloc(1, sizeof(Profiler));
+    prof->rom_size = rom_size;
+    prof->names = malloc((label_count + 1) * sizeof(char*));
+    prof->function_of = calloc(rom_size + 1, sizeof(size_t));
+    prof->is_start = calloc(rom_size + 1, sizeof(char));
+    prof->is_return = calloc(rom_size + 1, sizeof(char));
+    prof->names[prof->name_count++] = "(top)";
+    prof->pending = NO_NODE;
+
+    int from_vm = 0;
+    for (size_t i = 0; i < label_count; i++)
+        from_vm |= strchr(labels[i].p0, '.') != NULL;
+
+    // Functions in address order, each running up to the next
+    Function_Start *starts = malloc((label_count + 1) *
+        sizeof(Function_Start));
+    size_t start_count = 0;
+    for (size_t i = 0; i < label_count; i++) {
+        size_t addr = labels[i].p1;
+        if (addr >= rom_size)
+            continue;
+        if (is_return_address(labels[i].p0))
+            prof->is_return[addr] = 1;
+        if (!is_function(labels[i].p0, from_vm))
+            continue;
+        prof->is_start[addr] = 1;
+        starts[start_count++] = (Function_Start) {
+            .addr = addr,
+            .name = prof->name_count,
+        };
+        prof->names[prof->name_count++] = labels[i].p0;
+    }
+    qsort(starts, start_count, sizeof(Function_Start), cmp_function_starts);
+    for (size_t s = 0; s < start_count; s++) {
+        size_t end = s + 1 < start_count ? starts[s + 1].addr : rom_size;
+        for (size_t pc = starts[s].addr; pc < end; pc++)
+            prof->function_of[pc] = starts[s].name;
+    }
+    free(starts);
+
+    prof->node_capacity = NODES_INITIAL_CAPACITY;
+    prof->nodes = malloc(prof->node_capacity * sizeof(Context));
+    prof->nodes[prof->node_count++] = (Context) {
+        .function = 0,
+        .parent = NO_NODE,
+        .child = NO_NODE,
+        .sibling = NO_NODE,
+    };
+    prof->stack_capacity = STACK_INITIAL_CAPACITY;
+    prof->stack = malloc(prof->stack_capacity * sizeof(Frame));
+    prof->stack[prof->depth++] = (Frame) { .node = 0, .ret = NO_NODE };
+    return prof;
+}
+
+void prof_free(Profiler *prof)
+{
+    if (prof == NULL)
+        return;
+    free(prof->names);
+    free(prof->function_of);
+    free(prof->is_start);
+    free(prof->is_return);
+    free(prof->nodes);
+    free(prof->stack);
+    free(prof);
+}
+
+// Follows calls and returns, given a jump taken from 'from' to 'to' that
+// brought the cycle count to 'cycles'
+void prof_jump(Profiler *prof, size_t from, size_t to, uint64_t cycles)
+{
+    if (to >= prof->rom_size)
+        return;
+
+    if (from + 1 < prof->rom_size && prof->is_return[from + 1])
+        prof->pending = from + 1;
+
+    // Return to the caller of the innermost call with this return address.
+    // A call may go to a function starting at a return address, of a call
+    // that never returns
+    if (prof->is_return[to] &&
+        (prof->pending == NO_NODE || !prof->is_start[to])) {
+        for (size_t k = prof->depth; k-- > 1;) {
+            if (prof->stack[k].ret == to) {
+                charge(prof, cycles);
+                prof->depth = k;
+                prof->pending = NO_NODE;
+                return;
+            }
+        }
+    }
+    if (prof->pending == NO_NODE || !prof->is_start[to])
+        return;
+
+    // The call reached its function
+    charge(prof, cycles);
+    if (prof->depth == prof->stack_capacity) {
+        prof->stack_capacity *= 2;
+        prof->stack = realloc(prof->stack,
+            prof->stack_capacity * sizeof(Frame));
+    }
+    size_t node = child_context(prof, prof->stack[prof->depth - 1].node,
+        prof->function_of[to]);
+    prof->stack[prof->depth++] = (Frame) {
+        .node = node,
+        .ret = prof->pending,
+    };
+    prof->pending = NO_NODE;
+}
+
+// Prints the cycles spent in each function, most first, given how many
+// times each ROM address ran in 'counts' and 'cycles' in total
+void prof_print_flat(Profiler *prof, uint64_t *counts, uint64_t cycles)
+{
+    Function_Cycles *fc = malloc(prof->name_count * sizeof(Function_Cycles));
+    for (size_t n = 0; n < prof->name_count; n++)
+        fc[n] = (Function_Cycles) { .name = n };
+    for (size_t pc = 0; pc < prof->rom_size; pc++)
+        fc[prof->function_of[pc]].cycles += counts[pc];
+    qsort(fc, prof->name_count, sizeof(Function_Cycles), cmp_function_cycles);
+
+    uint64_t total = cycles ? cycles : 1;
+    printf("cycles by label:\n");
+    for (size_t n = 0; n < prof->name_count && fc[n].cycles; n++) {
+        printf("  %-24s %12llu  %5.1f%%\n", prof->names[fc[n].name],
+            (unsigned long long) fc[n].cycles, 100.0 * fc[n].cycles / total);
+    }
+    free(fc);
+}
+
+// Writes the cycles of each calling context up to 'cycles', one
+// 'caller;callee;... cycles' line per context that ran
+// Returns 0 on success, 1 on error
+int prof_write_folded(Profiler *prof, FILE *f, uint64_t cycles)
+{
+    charge(prof, cycles);
+    size_t *path = malloc((prof->node_count + 1) * sizeof(size_t));
+    for (size_t i = 0; i < prof->node_count; i++) {
+        if (prof->nodes[i].cycles == 0)
+            continue;
+        size_t n = 0;
+        for (size_t k = i; k != NO_NODE; k = prof->nodes[k].parent)
+            path[n++] = k;
+        while (n-- > 0) {
+            fprintf(f, "%s%c", prof->names[prof->nodes[path[n]].function],
+                n ? ';' : ' ');
+        }
+        fprintf(f, "%llu\n", (unsigned long long) prof->nodes[i].cycles);
+    }
+    free(path);
+    return ferror(f) != 0;
+}
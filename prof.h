@@ -0,0 +1,18 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "inst.h"
+
+typedef struct Profiler Profiler;
+
+Profiler *prof_new(Str_Int_Pair *labels, size_t label_count,
+    size_t rom_size);
+void prof_free(Profiler *prof);
+void prof_jump(Profiler *prof, size_t from, size_t to, uint64_t cycles);
+void prof_print_flat(Profiler *prof, uint64_t *counts, uint64_t cycles);
+int prof_write_folded(Profiler *prof, FILE *f, uint64_t cycles);
+
+#endif // PROF_H
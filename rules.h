@@ -0,0 +1,29 @@
+// Generated by superopt from the programs in the Makefile's 'rules' target
+#ifndef RULES_H
+#define RULES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_RULE_LENGTH 3
+
+// 'pattern' leaves A, D and RAM as 'replacement' does
+typedef struct {
+    uint8_t length;
+    uint16_t pattern[MAX_RULE_LENGTH];
+    uint8_t replacement_length;
+    uint16_t replacement[MAX_RULE_LENGTH];
+} Rewrite_Rule;
+
+static const Rewrite_Rule rewrite_rules[] = {
+    // D=A, D=D-1 -> D=A-1 (seen 32 times)
+    { 2, { 0xEC10, 0xE390 }, 1, { 0xEC90 } },
+    // M=D&M, D=M -> MD=D&M (seen 2 times)
+    { 2, { 0xF008, 0xFC10 }, 1, { 0xF018 } },
+    // M=M-D, D=M -> MD=M-D (seen 2 times)
+    { 2, { 0xF1C8, 0xFC10 }, 1, { 0xF1D8 } },
+};
+
+static const size_t rewrite_rule_count = 3;
+
+#endif // RULES_H
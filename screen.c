@@ -0,0 +1,234 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "screen.h"
+
+/*
+ Screen export (--screen, --ppm-frames).
+
+ The program runs --frame-cycles cycles at a time, on the switch engine,
+ which sets a bit for each screen row it stores to. Each frame then
+ passes the rows written during it to a viewer and to the PPM writer, so
+ neither converts the rows that didn't change.
+
+ --screen creates a POSIX shared memory object: a Screen_Header page,
+ then SCREEN and the page KBD is on. The SCREEN and KBD part is mapped
+ over the CPU's own RAM, which emu_new places on a page, so the emulator
+ reads and writes it in place and a viewer sees stores without any copy.
+ A viewer maps the whole object, and on each new 'frame' takes the dirty
+ bits with an atomic exchange, redraws those rows and writes key codes
+ to KBD for the program to read.
+
+ --ppm-frames writes the screen of each frame that changed to
+ '<prefix>000042.ppm', numbered by frame, keeping the pixels between
+ frames and converting only the dirty rows.
+*/
+
+#define PPM_PATH_SIZE                      4096
+#define PIXEL_BYTES                        3
+#define PPM_ROW_SIZE                       (ROW_WORDS * 16 * PIXEL_BYTES)
+
+struct Screen {
+    Hack_CPU *cpu;
+    uint32_t dirty[SCREEN_ROWS / 32]; // rows stored to during this frame
+    uint64_t frame;
+    char *shm_name; // NULL without --screen
+    Screen_Header *header;
+    size_t page_size;
+    char *ppm_prefix; // NULL without --ppm-frames
+    uint8_t *pixels; // RGB of the last frame written
+};
+
+// RGB of the 8 pixels of each byte, least significant bit first
+static uint8_t byte_pixels[256][8 * PIXEL_BYTES];
+static int byte_pixels_ready = 0;
+
+static void build_byte_pixels(void)
+{
+    for (size_t b = 0; b < 256; b++) {
+        for (size_t bit = 0; bit < 8; bit++) {
+            uint8_t v = (b >> bit & 1) ? 0 : 255;
+            memset(byte_pixels[b] + bit * PIXEL_BYTES, v, PIXEL_BYTES);
+        }
+    }
+    byte_pixels_ready = 1;
+}
+
+// Maps SCREEN and KBD of the CPU to the shared memory object 'name'
+// Returns 0 on success, 1 on error
+static int map_shared(Screen *s, char *name)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t screen_size = (KBD_ADDR - SCREEN_ADDR) * sizeof(uint16_t);
+    size_t shared_size = screen_size + page;
+    uint16_t *at = s->cpu->ram + SCREEN_ADDR;
+    if ((uintptr_t) at % page != 0 ||
+        KBD_ADDR * sizeof(uint16_t) + page > sizeof(s->cpu->ram)) {
+        printf("error: --screen doesn't work with %zu byte pages\n", page);
+        return 1;
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        printf("Couldn't create shared memory '%s'\n", name);
+        return 1;
+    }
+    if (ftruncate(fd, page + shared_size) == -1) {
+        printf("Couldn't create shared memory '%s'\n", name);
+        close(fd);
+        shm_unlink(name);
+        return 1;
+    }
+
+    // Keep what's on the screen, for runs resumed from a snapshot
+    uint16_t *old = malloc(shared_size);
+    memcpy(old, at, shared_size);
+    s->header = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void *screen = mmap(at, shared_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED, fd, page);
+    close(fd);
+    if (s->header == MAP_FAILED || screen == MAP_FAILED) {
+        printf("Couldn't map shared memory '%s'\n", name);
+        if (s->header != MAP_FAILED)
+            munmap(s->header, page);
+        s->header = NULL;
+        shm_unlink(name);
+        free(old);
+        return 1;
+    }
+    memcpy(at, old, shared_size);
+    free(old);
+
+    Screen_Header *h = s->header;
+    memcpy(h->magic, SCREEN_SHM_MAGIC, sizeof(h->magic));
+    h->version = SCREEN_SHM_VERSION;
+    h->screen_offset = page;
+    h->cycles = s->cpu->cycles;
+    memset(h->dirty, 0xFF, sizeof(h->dirty));
+    __atomic_store_n(&h->running, 1, __ATOMIC_RELEASE);
+    s->shm_name = name;
+    s->page_size = page;
+    return 0;
+}
+
+// Starts tracking the screen rows 'cpu' stores to, exporting them to the
+// shared memory object 'shm_name' and as PPM files starting with
+// 'ppm_prefix', unless they are empty
+// Returns NULL on error
+Screen *screen_new(Hack_CPU *cpu, char *shm_name, char *ppm_prefix)
+{
+    Screen *s = calloc(1, sizeof(Screen));
+    s->cpu = cpu;
+    if (*shm_name && map_shared(s, shm_name)) {
+        free(s);
+        return NULL;
+    }
+    if (*ppm_prefix) {
+        if (!byte_pixels_ready)
+            build_byte_pixels();
+        s->ppm_prefix = ppm_prefix;
+        s->pixels = malloc(SCREEN_ROWS * PPM_ROW_SIZE);
+    }
+
+    // The first frame has every row
+    memset(s->dirty, 0xFF, sizeof(s->dirty));
+    cpu->dirty_rows = s->dirty;
+    return s;
+}
+
+// Stops tracking and removes the shared memory object. The CPU keeps
+// using its mapping until it's freed
+void screen_free(Screen *s)
+{
+    if (s == NULL)
+        return;
+    s->cpu->dirty_rows = NULL;
+    if (s->header != NULL) {
+        __atomic_store_n(&s->header->running, 0, __ATOMIC_RELEASE);
+        munmap(s->header, s->page_size);
+        shm_unlink(s->shm_name);
+    }
+    free(s->pixels);
+    free(s);
+}
+
+// Writes the screen to the PPM file of this frame, converting the dirty
+// rows
+// Returns 0 on success, 1 on error
+static int write_ppm(Screen *s)
+{
+    uint16_t *screen = s->cpu->ram + SCREEN_ADDR;
+    for (size_t row = 0; row < SCREEN_ROWS; row++) {
+        if (!(s->dirty[row / 32] >> (row % 32) & 1))
+            continue;
+        uint8_t *p = s->pixels + row * PPM_ROW_SIZE;
+        for (size_t w = 0; w < ROW_WORDS; w++) {
+            uint16_t word = screen[row * ROW_WORDS + w];
+            memcpy(p, byte_pixels[word & 0xFF], 8 * PIXEL_BYTES);
+            memcpy(p + 8 * PIXEL_BYTES, byte_pixels[word >> 8],
+                8 * PIXEL_BYTES);
+            p += 16 * PIXEL_BYTES;
+        }
+    }
+
+    char path[PPM_PATH_SIZE];
+    snprintf(path, PPM_PATH_SIZE, "%s%06llu.ppm", s->ppm_prefix,
+        (unsigned long long) s->frame);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        printf("Error when writing to '%s'\n", path);
+        return 1;
+    }
+    fprintf(f, "P6\n%i %i\n255\n", ROW_WORDS * 16, SCREEN_ROWS);
+    int err = fwrite(s->pixels, PPM_ROW_SIZE, SCREEN_ROWS, f) != SCREEN_ROWS;
+    err |= fclose(f) != 0;
+    if (err)
+        printf("Error when writing to '%s'\n", path);
+    return err;
+}
+
+// Passes the rows written during this frame on and starts the next
+// Returns 0 on success, 1 on error
+static int end_frame(Screen *s)
+{
+    uint32_t any = 0;
+    for (size_t i = 0; i < SCREEN_ROWS / 32; i++)
+        any |= s->dirty[i];
+
+    int err = 0;
+    if (s->header != NULL) {
+        Screen_Header *h = s->header;
+        for (size_t i = 0; i < SCREEN_ROWS / 32; i++) {
+            if (s->dirty[i])
+                __atomic_fetch_or(h->dirty + i, s->dirty[i], __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&h->cycles, s->cpu->cycles, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->frame, s->frame + 1, __ATOMIC_RELEASE);
+    }
+    if (s->ppm_prefix != NULL && any)
+        err = write_ppm(s);
+
+    memset(s->dirty, 0, sizeof(s->dirty));
+    s->frame++;
+    return err;
+}
+
+// Runs for at most 'max_cycles' cycles (no limit if 0), 'frame_cycles' at
+// a time, ending a frame after each. Sets 'status' to why it stopped
+// Returns 0 on success, 1 if a frame couldn't be written
+int screen_run(Screen *s, uint64_t max_cycles, uint64_t frame_cycles,
+    enum EMU_STATUS *status)
+{
+    Hack_CPU *cpu = s->cpu;
+    uint64_t end = max_cycles ? cpu->cycles + max_cycles : UINT64_MAX;
+    do {
+        uint64_t left = end - cpu->cycles;
+        *status = emu_run(cpu, left < frame_cycles ? left : frame_cycles);
+        if (end_frame(s))
+            return 1;
+    } while (*status == EMU_CYCLE_LIMIT && cpu->cycles < end);
+    return 0;
+}
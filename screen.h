@@ -0,0 +1,31 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stdint.h>
+#include "emu.h"
+
+#define SCREEN_SHM_MAGIC                   "hackscrn"
+#define SCREEN_SHM_VERSION                 1
+
+// First page of the --screen shared memory object. SCREEN follows at
+// 'screen_offset' bytes, with KBD right after it
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t screen_offset;
+    uint32_t running; // 0 once the emulator is done
+    uint32_t unused;
+    uint64_t frame; // bumped after the rows of a frame are marked
+    uint64_t cycles; // run by the end of the last frame
+    uint32_t dirty[SCREEN_ROWS / 32]; // rows written since a viewer took
+                                      // their bits
+} Screen_Header;
+
+typedef struct Screen Screen;
+
+Screen *screen_new(Hack_CPU *cpu, char *shm_name, char *ppm_prefix);
+void screen_free(Screen *s);
+int screen_run(Screen *s, uint64_t max_cycles, uint64_t frame_cycles,
+    enum EMU_STATUS *status);
+
+#endif // SCREEN_H
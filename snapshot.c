@@ -0,0 +1,116 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+/*
+ Emulator snapshots (--save-snapshot, --snapshot).
+
+ A snapshot is the machine state at some point of a run: A, D, pc, the
+ cycles run so far and all of RAM, behind a header naming the program by
+ its size and a hash of its words. The file is the Snapshot struct as it
+ is in memory, so it's only read back on machines of the same byte order.
+
+ Loading maps the file read-only and copies it into the CPU. RAM is part
+ of Hack_CPU, where every engine expects it, so it isn't used from the
+ mapping in place, and restoring is one 64 KB copy.
+*/
+
+#define SNAPSHOT_MAGIC                     "hacksnap"
+#define SNAPSHOT_VERSION                   1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t rom_size;
+    uint64_t rom_hash;
+    uint64_t cycles;
+    uint16_t a;
+    uint16_t d;
+    uint16_t pc;
+    uint16_t unused;
+    uint16_t ram[RAM_SIZE];
+} Snapshot;
+
+// FNV-1a over the bytes of the ROM words
+static uint64_t rom_hash(Hack_CPU *cpu)
+{
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < cpu->rom_size; i++) {
+        h = (h ^ (cpu->rom[i] & 0xFF)) * 0x100000001B3ULL;
+        h = (h ^ (cpu->rom[i] >> 8)) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+// Writes the state of 'cpu' to 'path'
+// Returns 0 on success, 1 on error
+int snapshot_save(Hack_CPU *cpu, char *path)
+{
+    static Snapshot s;
+    memcpy(s.magic, SNAPSHOT_MAGIC, sizeof(s.magic));
+    s.version = SNAPSHOT_VERSION;
+    s.rom_size = cpu->rom_size;
+    s.rom_hash = rom_hash(cpu);
+    s.cycles = cpu->cycles;
+    s.a = cpu->a;
+    s.d = cpu->d;
+    s.pc = cpu->pc;
+    memcpy(s.ram, cpu->ram, sizeof(s.ram));
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        printf("Error when writing to '%s'\n", path);
+        return 1;
+    }
+    int err = fwrite(&s, sizeof(s), 1, f) != 1;
+    err |= fclose(f) != 0;
+    if (err)
+        printf("Error when writing to '%s'\n", path);
+    return err;
+}
+
+// Restores 'cpu' to the state in the snapshot at 'path', which must be of
+// the same program
+// Returns 0 on success, 1 on error
+int snapshot_load(Hack_CPU *cpu, char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("Couldn't open %s\n", path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size != sizeof(Snapshot)) {
+        printf("'%s' isn't a snapshot\n", path);
+        close(fd);
+        return 1;
+    }
+    Snapshot *s = mmap(NULL, sizeof(Snapshot), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        printf("Couldn't read %s\n", path);
+        return 1;
+    }
+
+    int err = 0;
+    if (memcmp(s->magic, SNAPSHOT_MAGIC, sizeof(s->magic)) != 0 ||
+        s->version != SNAPSHOT_VERSION) {
+        printf("'%s' isn't a snapshot\n", path);
+        err = 1;
+    } else if (s->rom_size != cpu->rom_size || s->rom_hash != rom_hash(cpu)) {
+        printf("'%s' is a snapshot of another program\n", path);
+        err = 1;
+    } else {
+        memcpy(cpu->ram, s->ram, sizeof(cpu->ram));
+        cpu->a = s->a;
+        cpu->d = s->d;
+        cpu->pc = s->pc;
+        cpu->cycles = s->cycles;
+    }
+    munmap(s, sizeof(Snapshot));
+    return err;
+}
@@ -0,0 +1,9 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "emu.h"
+
+int snapshot_save(Hack_CPU *cpu, char *path);
+int snapshot_load(Hack_CPU *cpu, char *path);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,448 @@
+/*
+ superopt - finds shorter equivalents of C-instruction runs in hack programs
+
+ Usage: superopt file.hack... > rules.h
+
+ Every run of 2 or 3 C-instructions without jumps found in the given
+ programs is compared against all shorter sequences of C-instructions. The
+ first sequence that leaves A, D and RAM the same becomes a rewrite rule,
+ which 'hasm -O' applies to the programs it assembles.
+
+ Two sequences are taken to be equivalent when they agree on a fixed set of
+ start states: edge values of A and D, RAM holding values related to their
+ addresses (so that pointers alias) and random states. Rules are checked
+ against another 65536 random states before being written out.
+
+ Sequences longer than 3 aren't searched, since the number of candidates
+ grows by 196 with each instruction.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inst.h"
+
+#define MAX_WINDOW                         3
+#define MAX_WINDOWS                        65536
+#define MAX_ALPHABET                       256
+#define RANDOM_STARTS                      2048
+#define CHECK_STARTS                       65536
+#define LINE_SIZE                          64
+
+// How RAM cells not written by a sequence are filled
+enum RAM_FILL {
+    FILL_HASH, // pseudo-random value of the address
+    FILL_ADDR, // address + k
+    FILL_CONST, // k
+};
+
+typedef struct {
+    uint16_t a;
+    uint16_t d;
+    enum RAM_FILL fill;
+    uint16_t k;
+} Start;
+
+typedef struct {
+    uint16_t a;
+    uint16_t d;
+    size_t write_count;
+    uint16_t addr[MAX_WINDOW];
+    uint16_t value[MAX_WINDOW];
+} State;
+
+typedef struct {
+    size_t length;
+    uint16_t words[MAX_WINDOW];
+    size_t seen; // times found in the programs
+    size_t replacement_length; // MAX_WINDOW + 1 if none was found
+    uint16_t replacement[MAX_WINDOW];
+} Window;
+
+Window windows[MAX_WINDOWS];
+size_t window_count = 0;
+
+uint16_t alphabet[MAX_ALPHABET];
+size_t alphabet_size = 0;
+
+Start *starts;
+size_t start_count = 0;
+State *expected; // state left by the window being searched, per start
+
+uint32_t rng = 0x2545F491;
+
+uint32_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+uint16_t hash16(uint16_t addr, uint16_t k)
+{
+    uint32_t h = (addr ^ (k << 16)) * 0x9E3779B1u;
+    return h >> 16;
+}
+
+// Computes comp code 'op' the way the hack ALU does. 'y' is A or M,
+// depending on the a-bit
+uint16_t alu(unsigned int op, uint16_t x, uint16_t y)
+{
+    if (op & 0x20) x = 0;      // zx
+    if (op & 0x10) x = ~x;     // nx
+    if (op & 0x08) y = 0;      // zy
+    if (op & 0x04) y = ~y;     // ny
+    uint16_t out = (op & 0x02) ? x + y : x & y; // f
+    if (op & 0x01) out = ~out; // no
+    return out;
+}
+
+uint16_t ram_read(State *s, Start *start, uint16_t addr)
+{
+    for (size_t i = s->write_count; i > 0; i--) {
+        if (s->addr[i - 1] == addr)
+            return s->value[i - 1];
+    }
+    switch (start->fill) {
+    case FILL_HASH:  return hash16(addr, start->k);
+    case FILL_ADDR:  return addr + start->k;
+    case FILL_CONST: return start->k;
+    }
+    return 0;
+}
+
+void run(uint16_t *code, size_t length, Start *start, State *s)
+{
+    s->a = start->a;
+    s->d = start->d;
+    s->write_count = 0;
+    for (size_t i = 0; i < length; i++) {
+        uint16_t w = code[i];
+        unsigned int op = (w >> 6) & 0x7F;
+        uint16_t addr = s->a & 0x7FFF;
+        uint16_t y = (op & 0x40) ? ram_read(s, start, addr) : s->a;
+        uint16_t out = alu(op, s->d, y);
+        // M is addressed by A before this instruction writes it
+        if (w & 0x08) {
+            s->addr[s->write_count] = addr;
+            s->value[s->write_count++] = out;
+        }
+        if (w & 0x20)
+            s->a = out;
+        if (w & 0x10)
+            s->d = out;
+    }
+}
+
+int same_state(State *x, State *y, Start *start)
+{
+    if (x->a != y->a || x->d != y->d)
+        return 0;
+    for (size_t i = 0; i < x->write_count; i++) {
+        if (ram_read(x, start, x->addr[i]) != ram_read(y, start, x->addr[i]))
+            return 0;
+    }
+    for (size_t i = 0; i < y->write_count; i++) {
+        if (ram_read(x, start, y->addr[i]) != ram_read(y, start, y->addr[i]))
+            return 0;
+    }
+    return 1;
+}
+
+// Returns 1 if 'code' leaves the states in 'expected' on every start
+int matches(uint16_t *code, size_t length)
+{
+    State s;
+    for (size_t i = 0; i < start_count; i++) {
+        run(code, length, starts + i, &s);
+        if (!same_state(&s, expected + i, starts + i))
+            return 0;
+    }
+    return 1;
+}
+
+// Returns 1 if 'a' and 'b' agree on CHECK_STARTS random starts
+int check(uint16_t *a, size_t a_length, uint16_t *b, size_t b_length)
+{
+    for (size_t i = 0; i < CHECK_STARTS; i++) {
+        Start start = {
+            .a = next_random(),
+            .d = next_random(),
+            .fill = next_random() % 3,
+            .k = next_random(),
+        };
+        if (start.fill == FILL_ADDR)
+            start.k = (next_random() % 7) - 3;
+        State x, y;
+        run(a, a_length, &start, &x);
+        run(b, b_length, &start, &y);
+        if (!same_state(&x, &y, &start))
+            return 0;
+    }
+    return 1;
+}
+
+// Looks for a sequence shorter than 'limit' equivalent to 'w'
+// Returns 1 if one was found
+int search(Window *w, size_t limit)
+{
+    for (size_t i = 0; i < start_count; i++)
+        run(w->words, w->length, starts + i, expected + i);
+
+    uint16_t code[MAX_WINDOW];
+    for (size_t length = 0; length < limit; length++) {
+        size_t total = 1;
+        for (size_t i = 0; i < length; i++)
+            total *= alphabet_size;
+
+        for (size_t n = 0; n < total; n++) {
+            size_t rest = n;
+            for (size_t i = 0; i < length; i++) {
+                code[i] = alphabet[rest % alphabet_size];
+                rest /= alphabet_size;
+            }
+            if (!matches(code, length) ||
+                !check(w->words, w->length, code, length))
+                continue;
+            w->replacement_length = length;
+            memcpy(w->replacement, code, length * sizeof(uint16_t));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void make_alphabet(void)
+{
+    // Comps with more than one mnemonic ('D+A', 'A+D') are taken once
+    for (size_t c = 1; c < comp_code_count; c++) {
+        C_Instruction ci = { DEST_M, comp_codes[c].code, JUMP_NULL };
+        Instruction inst = { C_INST, &ci };
+        uint16_t word = encode_instruction(&inst) & ~0x38;
+        int seen = 0;
+        for (size_t i = 0; i < alphabet_size; i++)
+            seen |= (alphabet[i] & ~0x38) == word;
+        if (seen)
+            continue;
+        for (size_t d = 1; d < dest_code_count; d++)
+            alphabet[alphabet_size++] = word | dest_codes[d].code << 3;
+    }
+}
+
+void make_starts(void)
+{
+    uint16_t edges[] = {
+        0, 1, 2, 0x4000, 0x7FFF, 0x8000, 0xFFFE, 0xFFFF
+    };
+    size_t edge_count = sizeof(edges) / sizeof(uint16_t);
+    starts = malloc((edge_count * edge_count * (edge_count + 4) +
+        RANDOM_STARTS) * sizeof(Start));
+
+    for (size_t a = 0; a < edge_count; a++) {
+        for (size_t d = 0; d < edge_count; d++) {
+            Start s = { edges[a], edges[d], FILL_HASH, 0 };
+            starts[start_count++] = s;
+            for (int k = -1; k <= 1; k++) {
+                s.fill = FILL_ADDR;
+                s.k = k;
+                starts[start_count++] = s;
+            }
+            for (size_t k = 0; k < edge_count; k++) {
+                s.fill = FILL_CONST;
+                s.k = edges[k];
+                starts[start_count++] = s;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < RANDOM_STARTS; i++) {
+        Start s = {
+            .a = next_random(),
+            .d = next_random(),
+            .fill = next_random() % 3,
+            .k = next_random(),
+        };
+        if (s.fill == FILL_ADDR)
+            s.k = (next_random() % 7) - 3;
+        // Small addresses, like the ones of predefined symbols
+        if (i % 2)
+            s.a %= 32;
+        starts[start_count++] = s;
+    }
+    expected = malloc(start_count * sizeof(State));
+}
+
+void add_window(uint16_t *words, size_t length)
+{
+    for (size_t i = 0; i < window_count; i++) {
+        if (windows[i].length == length &&
+            memcmp(windows[i].words, words, length * sizeof(uint16_t)) == 0) {
+            windows[i].seen++;
+            return;
+        }
+    }
+    if (window_count >= MAX_WINDOWS) {
+        fprintf(stderr, "superopt: too many windows\n");
+        exit(1);
+    }
+    Window *w = windows + window_count++;
+    w->length = length;
+    memcpy(w->words, words, length * sizeof(uint16_t));
+    w->seen = 1;
+    w->replacement_length = MAX_WINDOW + 1;
+}
+
+// Adds the windows of every run of C-instructions without jumps in 'path'.
+// Instructions without a destination are left to the peephole optimizer
+int read_hack(char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "superopt: can't open '%s'\n", path);
+        return 1;
+    }
+
+    char line[LINE_SIZE];
+    uint16_t run_words[MAX_WINDOW];
+    size_t run_length = 0;
+    while (fgets(line, sizeof(line), f)) {
+        uint16_t w = 0;
+        int n = 0;
+        for (; line[n] == '0' || line[n] == '1'; n++)
+            w = (w << 1) | (line[n] - '0');
+        if (n != 16) {
+            fprintf(stderr, "superopt: '%s' isn't a hack program\n", path);
+            fclose(f);
+            return 1;
+        }
+
+        C_Instruction c;
+        if (!(w & 0x8000) || decode_c_instruction(w, &c) ||
+            c.jump != JUMP_NULL || c.dest == DEST_NULL) {
+            run_length = 0;
+            continue;
+        }
+
+        if (run_length == MAX_WINDOW) {
+            memmove(run_words, run_words + 1,
+                (MAX_WINDOW - 1) * sizeof(uint16_t));
+            run_length--;
+        }
+        run_words[run_length++] = w;
+        for (size_t length = 2; length <= run_length; length++)
+            add_window(run_words + run_length - length, length);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+Window *find_window(uint16_t *words, size_t length)
+{
+    for (size_t i = 0; i < window_count; i++) {
+        if (windows[i].length == length &&
+            memcmp(windows[i].words, words, length * sizeof(uint16_t)) == 0)
+            return windows + i;
+    }
+    return NULL;
+}
+
+// Longest patterns first, so that they're tried before their prefixes
+int compare_rules(const void *x, const void *y)
+{
+    const Window *a = x;
+    const Window *b = y;
+    if (a->length != b->length)
+        return a->length < b->length ? 1 : -1;
+    if (a->seen != b->seen)
+        return a->seen < b->seen ? 1 : -1;
+    return memcmp(a->words, b->words, sizeof(a->words));
+}
+
+void print_words(uint16_t *words, size_t length)
+{
+    char buf[LINE_SIZE];
+    if (length == 0)
+        printf("(nothing)");
+    for (size_t i = 0; i < length; i++) {
+        format_word(words[i], buf);
+        printf("%s%s", i ? ", " : "", buf);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: superopt file.hack... > rules.h\n");
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (read_hack(argv[i]))
+            return 1;
+    }
+
+    make_alphabet();
+    make_starts();
+
+    // Pairs first. A run of 3 only gets a rule if it does better than the
+    // rules of the pairs in it
+    size_t rule_count = 0;
+    for (size_t length = 2; length <= MAX_WINDOW; length++) {
+        for (size_t i = 0; i < window_count; i++) {
+            Window *w = windows + i;
+            if (w->length != length)
+                continue;
+            size_t limit = length;
+            for (size_t k = 0; length > 2 && k + 2 <= length; k++) {
+                Window *pair = find_window(w->words + k, 2);
+                if (pair && pair->replacement_length < 2)
+                    limit = length - 1;
+            }
+            rule_count += search(w, limit);
+        }
+    }
+
+    qsort(windows, window_count, sizeof(Window), compare_rules);
+
+    printf("// Generated by superopt from the programs in the Makefile's "
+        "'rules' target\n");
+    printf("#ifndef RULES_H\n#define RULES_H\n\n#include <stddef.h>\n#include <stdint.h>\n\n");
+    printf("#define MAX_RULE_LENGTH %i\n\n", MAX_WINDOW);
+    printf("// 'pattern' leaves A, D and RAM as 'replacement' does\n");
+    printf("typedef struct {\n");
+    printf("    uint8_t length;\n");
+    printf("    uint16_t pattern[MAX_RULE_LENGTH];\n");
+    printf("    uint8_t replacement_length;\n");
+    printf("    uint16_t replacement[MAX_RULE_LENGTH];\n");
+    printf("} Rewrite_Rule;\n\n");
+
+    printf("static const Rewrite_Rule rewrite_rules[] = {\n");
+    for (size_t i = 0; i < window_count; i++) {
+        Window *w = windows + i;
+        if (w->replacement_length > MAX_WINDOW)
+            continue;
+        printf("    // ");
+        print_words(w->words, w->length);
+        printf(" -> ");
+        print_words(w->replacement, w->replacement_length);
+        printf(" (seen %zu times)\n", w->seen);
+
+        printf("    { %zu, {", w->length);
+        for (size_t k = 0; k < w->length; k++)
+            printf("%s0x%04X", k ? ", " : " ", w->words[k]);
+        printf(" }, %zu, {", w->replacement_length);
+        for (size_t k = 0; k < w->replacement_length; k++)
+            printf("%s0x%04X", k ? ", " : " ", w->replacement[k]);
+        printf("%s} },\n", w->replacement_length ? " " : " 0 ");
+    }
+    if (rule_count == 0)
+        printf("    { 0, { 0 }, 0, { 0 } },\n");
+    printf("};\n\n");
+    printf("static const size_t rewrite_rule_count = %zu;\n\n", rule_count);
+    printf("#endif // RULES_H\n");
+
+    free(starts);
+    free(expected);
+    return 0;
+}
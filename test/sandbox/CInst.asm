@@ -0,0 +1,15 @@
+// C-instruction forms accepted by the parser
+
+    AM=M-1
+    D = D + M ; JGT
+    md=!a
+    d|m;JNE
+    MAD=D&A
+    0 ;  JMP   // comment
+    JGT
+    ;JEQ
+    =JGE
+    =;JLT
+    =D+1
+    -1
+    DM=-1;JLE
@@ -0,0 +1,45 @@
+// Constant propagation over A and D (--dataflow)
+
+    @SP
+    M=0
+(START)             // only entered from above, so A still holds SP
+    @SP
+    M=M+1
+    @0
+    D=A             // D=0, and @0 is no longer read
+    @R1
+    M=D
+    D=D+1           // D=1
+    @R2
+    M=D
+    D=1             // D already holds 1
+    @R3
+    M=D+1
+    @R0
+    D=M
+    @POS
+    D;JGT
+    @R4
+    M=-1
+    D=0
+    @JOIN
+    0;JMP
+(POS)
+    @R4
+    M=1
+    D=0
+(JOIN)              // D is 0 on both paths
+    @R5
+    M=D             // M=0
+    D=D-1           // D=-1
+    @DONE
+    D;JLT           // always taken
+    @R6
+    M=1
+(DONE)
+    D=0
+    @END
+    D;JNE           // never taken, removed with its A-instruction
+(END)
+    @END
+    0;JMP
@@ -0,0 +1,38 @@
+// Dead code and unreferenced label elimination
+
+   @R0
+   D=M
+   @POSITIVE
+   D;JGT
+   @RET_0           // return address loaded as data, so RET_0 is kept
+   D=A
+   @R15
+   M=D
+   @DOUBLE
+   0;JMP
+(RET_0)
+(UNUSED_LABEL)
+   @END
+   0;JMP
+   @R1              // unreachable, follows an unconditional jump
+   M=0
+(POSITIVE)
+   @R1
+   M=D
+   @END
+   0;JMP
+(NEVER_CALLED)      // nothing refers to this function
+   @R2
+   M=0
+   @R15
+   A=M
+   0;JMP
+(DOUBLE)
+   @R0
+   M=M+D
+   @R15
+   A=M
+   0;JMP
+(END)
+   @END
+   0;JMP
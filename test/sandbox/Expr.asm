@@ -0,0 +1,23 @@
+// Constant expressions in A-instructions
+
+    @LOOP+1          // address of the second LOOP instruction
+    D=A
+    @SCREEN+32*5     // row 5 of the screen
+    M=D
+    @(2+3)*4
+    D=A
+    @ R1 + 1 
+    M=D
+    @KBD-1
+    D=A
+    @arr+2
+    M=D
+    @arr
+    M=-1
+    @100/7-(1)
+    D=A
+    @x
+    M=D
+(LOOP)
+    @LOOP
+    0;JMP
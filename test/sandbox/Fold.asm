@@ -0,0 +1,56 @@
+// Identical code folding
+
+   @R0
+   D=M
+   @GT_1
+   D;JGT
+   @R1
+   M=0
+   @NEXT_1
+   0;JMP
+(GT_1)            // kept
+   @R1
+   M=-1
+   @NEXT_2
+   0;JMP
+(NEXT_1)          // differs from NEXT_2 in 'R2'
+   @R0
+   D=M
+   @GT_2
+   D;JGT
+   @R2
+   M=0
+   @NEXT_2
+   0;JMP
+(GT_2)            // same as GT_1, removed
+   @R1
+   M=-1
+   @NEXT_2
+   0;JMP
+(NEXT_2)
+   @R1
+   D=M
+   @WAIT_1
+   0;JMP
+(WAIT_1)          // loop to its own label, kept
+   @R3
+   M=M+1
+   D=M
+   @WAIT_1
+   D;JLT
+   @END
+   0;JMP
+(WAIT_2)          // same as WAIT_1, removed
+   @R3
+   M=M+1
+   D=M
+   @WAIT_2
+   D;JLT
+   @END
+   0;JMP
+(END)             // jumps to WAIT_2, which is now WAIT_1
+   @WAIT_2
+   D;JLT
+(HALT)
+   @HALT
+   0;JMP
@@ -0,0 +1,183 @@
+// Loops the threaded engine runs in bulk (see idiom.c), R0 iterations
+// each. The engines must leave the same RAM after any cycle
+
+    // RAM[1000..] = -1
+    @1000
+    D=A
+    @p
+    M=D
+    @R0
+    D=M
+    @n
+    M=D
+    @FILL_END
+    D;JLE
+(FILL)
+    @p
+    A=M
+    M=-1
+    @p
+    M=M+1
+    @n
+    MD=M-1
+    @FILL
+    D;JGT
+(FILL_END)
+
+    // RAM[2000 + 3 * i] = i
+    @2000
+    D=A
+    @p
+    M=D
+    @i
+    M=0
+(STRIDE)
+    @i
+    D=M
+    @R0
+    D=D-M
+    @STRIDE_END
+    D;JGE
+    @i
+    D=M
+    @p
+    A=M
+    M=D
+    @3
+    D=A
+    @p
+    M=D+M
+    @i
+    M=M+1
+    @STRIDE
+    0;JMP
+(STRIDE_END)
+
+    // RAM[3000..] = R0 + 2, R0 + 1, ..., counted down in D
+    @3000
+    D=A
+    @p
+    M=D
+    @R0
+    D=M
+    @2
+    D=D+A
+(COUNT)
+    @p
+    A=M
+    M=D
+    @p
+    M=M+1
+    D=D-1
+    @COUNT
+    D;JGT
+
+    // RAM[s + 1] = RAM[s] going up from 3000, which repeats RAM[3000]
+    @3000
+    D=A
+    @s
+    M=D
+    @R0
+    D=M
+    @n
+    M=D
+    @FORWARD_END
+    D;JLE
+(FORWARD)
+    @s
+    A=M
+    D=M
+    @s
+    AM=M+1
+    M=D
+    @n
+    MD=M-1
+    @FORWARD
+    D;JGT
+(FORWARD_END)
+
+    // RAM[s + 1] = RAM[s] going down from 3000 + R0, which moves it up
+    @R0
+    D=M
+    @3000
+    D=D+A
+    @s
+    M=D
+    @R0
+    D=M
+    @n
+    M=D
+    @BACKWARD_END
+    D;JLE
+(BACKWARD)
+    @s
+    A=M
+    D=M
+    A=A+1
+    M=D
+    @s
+    M=M-1
+    @n
+    MD=M-1
+    @BACKWARD
+    D;JGT
+(BACKWARD_END)
+
+    // RAM[4000..] = RAM[2000..]
+    @2000
+    D=A
+    @s
+    M=D
+    @4000
+    D=A
+    @d
+    M=D
+    @R0
+    D=M
+    @n
+    M=D
+    @COPY_END
+    D;JLE
+(COPY)
+    @s
+    A=M
+    D=M
+    @d
+    A=M
+    M=D
+    @s
+    M=M+1
+    @d
+    M=M+1
+    @n
+    MD=M-1
+    @COPY
+    D;JGT
+(COPY_END)
+
+    // RAM[5..] = -1, which reaches p and n after a few iterations
+    @5
+    D=A
+    @p
+    M=D
+    @R0
+    D=M
+    @n
+    M=D
+    @OVER_END
+    D;JLE
+(OVER)
+    @p
+    A=M
+    M=-1
+    @p
+    M=M+1
+    @n
+    MD=M-1
+    @OVER
+    D;JGT
+(OVER_END)
+
+(END)
+    @END
+    0;JMP
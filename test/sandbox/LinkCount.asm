@@ -0,0 +1,29 @@
+// Counts R0 down in a (LOOP) of its own, then R1 = 2 * count with DOUBLE
+// from LinkDouble.asm, which has a (LOOP) and an (END) too
+
+    @R0
+    D=M
+    @n
+    M=D
+(LOOP)
+    @n
+    D=M
+    @DONE
+    D;JLE
+    @n
+    M=M-1
+    @count
+    M=M+1
+    @LOOP
+    0;JMP
+(DONE)
+    @RET
+    D=A
+    @return
+    M=D
+    @DOUBLE
+    0;JMP
+(RET)
+(END)
+    @END
+    0;JMP
@@ -0,0 +1,22 @@
+// R1 = 2 * count, then jumps to the address in return
+
+(DOUBLE)
+    @R1
+    M=0
+    @2
+    D=A
+    @i
+    M=D
+(LOOP)
+    @count
+    D=M
+    @R1
+    M=D+M
+    @i
+    MD=M-1
+    @LOOP
+    D;JGT
+(END)
+    @return
+    A=M
+    0;JMP
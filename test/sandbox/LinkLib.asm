@@ -0,0 +1,12 @@
+// sum = R0 + R1, then jumps to the address in return
+
+(ADD)
+    @R0
+    D=M
+    @R1
+    D=D+M
+    @sum
+    M=D
+    @return
+    A=M
+    0;JMP
@@ -0,0 +1,16 @@
+// Adds R0 and R1 with ADD from LinkLib.asm and stores the sum in R2
+
+    @RET
+    D=A
+    @return
+    M=D
+    @ADD
+    0;JMP
+(RET)
+    @sum
+    D=M
+    @R2
+    M=D
+(END)
+    @END
+    0;JMP
@@ -0,0 +1,4 @@
+// 32768 doesn't fit in an A-instruction
+
+    @32768
+    D=A
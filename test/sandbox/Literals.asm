@@ -0,0 +1,15 @@
+// Number literals
+
+    @0x7FFF
+    D=A
+    @0b101
+    D=D+A
+    @0X1f
+    D=D-A
+    @00042
+    M=D
+    @32767
+    @0
+(END)
+    @END
+    0;JMP
@@ -0,0 +1,51 @@
+// Outlining: the three copies of 'R2 = R0 + R1' and the counter updates
+// after it become calls to one copy
+
+   @R0
+   D=M
+   @R1
+   D=D+M
+   @R2
+   M=D
+   @R3
+   M=M+1
+   @R4
+   M=D
+   @R5
+   M=-1
+   @R6
+   M=M+1
+   @SKIP
+   D;JGT
+   @R0
+   D=M
+   @R1
+   D=D+M
+   @R2
+   M=D
+   @R3
+   M=M+1
+   @R4
+   M=D
+   @R5
+   M=-1
+(SKIP)
+   @R7
+   M=M+1
+   @R0
+   D=M
+   @R1
+   D=D+M
+   @R2
+   M=D
+   @R3
+   M=M+1
+   @R4
+   M=D
+   @R5
+   M=-1
+   @R3
+   D=M
+(END)
+   @END
+   0;JMP
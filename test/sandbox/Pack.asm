@@ -0,0 +1,47 @@
+// Variables that are never live at the same time share RAM (--pack)
+
+    @R0
+    D=M
+    @a
+    M=D
+    @R1
+    D=M
+    @b
+    M=D
+    @a
+    D=M
+    @b
+    D=D+M
+    @R2
+    M=D             // a and b are dead from here
+    @R0
+    D=M
+    @c              // takes the slot of a
+    M=D
+    @d              // takes the slot of b
+    M=0
+(LOOP)
+    @c
+    D=M
+    @DONE
+    D;JLE
+    @R1
+    D=M
+    @d
+    M=M+D
+    @c
+    M=M-1
+    @LOOP
+    0;JMP
+(DONE)
+    @d
+    D=M
+    @R3
+    M=D
+    @ptr            // its address is stored, so it gets a slot of its own
+    D=A
+    @R4
+    M=D
+(END)
+    @END
+    0;JMP
@@ -0,0 +1,28 @@
+// Peephole optimizer patterns
+
+   @SP
+   M=M+1
+   @SP          // redundant, A already holds SP
+   A=M-1
+   M=D
+   @R13         // dead, overwritten by next load
+   @R14
+   D=M
+   D=A          // dead, overwritten before read
+   D=M
+   M=0          // dead, overwritten by next store
+   M=D
+   D=D          // no effect
+   @NEXT        // jump to next instruction
+   D;JGT
+(NEXT)
+   @R15
+   M=D
+   D=A          // with the next one, becomes 'D=A-1' (rules.h)
+   D=D-1
+   M=D
+(LOOP)
+   @R15         // kept, LOOP is entered with A holding LOOP
+   M=M+1
+   @LOOP
+   0;JMP
@@ -9,7 +9,10 @@ local fmt = string.format
 local HASM_PATH = arg[1] or "../hasm"
 local TEST_DIR = arg[2] or "sandbox"
 
-local function make_hasm_command(in_file, out_file)
+local function make_hasm_command(in_file, out_file, flags)
+   if flags then
+      return fmt("%s %s %s -o %s", HASM_PATH, flags, in_file, out_file)
+   end
    return fmt("%s %s -o %s", HASM_PATH, in_file, out_file)
 end
 
@@ -27,22 +30,31 @@ local function read_file_fully(filename)
    return content
 end
 
--- rm all generated .hack files
+-- rm all generated .hack files, objects, translations, their binaries and
+-- profiles
 local function clean()
    local files = list_files_in_dir(TEST_DIR)
    for filename in string.gmatch(files, "(.-)\n") do
-      if string.find(filename, "[^cmp].hack") then
+      if string.find(filename, "[^cmp].hack") or
+         string.find(filename, "%.o$") or
+         string.find(filename, "%.vm%.asm$") or
+         string.find(filename, "%.c$") or
+         string.find(filename, "%.native$") or
+         string.find(filename, "%.prof$") then
          os.execute(fmt("rm %s", filename))
       end
    end
 end
 
-local function test_files(filenames)
+-- 'flags' are passed to hasm and outputs are compared against
+-- '<filename><variant>.cmp.hack'
+local function test_files(filenames, flags, variant)
+   variant = variant or ""
    for i, filename in ipairs(filenames) do
       local asm = fmt("%s/%s.asm", TEST_DIR, filename)
-      local hack = fmt("%s/%s.hack", TEST_DIR, filename)
-      local cmp = fmt("%s/%s.cmp.hack", TEST_DIR, filename)
-      local command = make_hasm_command(asm, hack)
+      local hack = fmt("%s/%s%s.hack", TEST_DIR, filename, variant)
+      local cmp = fmt("%s/%s%s.cmp.hack", TEST_DIR, filename, variant)
+      local command = make_hasm_command(asm, hack, flags)
 
       group(fmt("%s", command))
 
@@ -69,6 +81,236 @@ local function test_files(filenames)
    end
 end
 
+local function run_hasm(args)
+   local f = io.popen(fmt("%s %s", HASM_PATH, args))
+   local output = f:read("*a")
+   f:close()
+   return output
+end
+
+-- Runs 'filename' in the emulator and compares its output to 'expected'
+local function test_run(filename, flags, expected)
+   local args = fmt("--run %s %s/%s.asm", flags, TEST_DIR, filename)
+   group(fmt("%s %s", HASM_PATH, args))
+   expect(run_hasm(args)).to_be(expected)
+end
+
+-- Checks that each of 'opt_flags' leaves the emulator output unchanged
+local function test_run_equivalence(filename, flags, opt_flags)
+   local args = fmt("--run %s %s/%s.asm", flags, TEST_DIR, filename)
+   local expected = run_hasm(args)
+   for i, opt in ipairs(opt_flags) do
+      group(fmt("%s %s %s", HASM_PATH, opt, args))
+      expect(run_hasm(fmt("%s %s", opt, args))).to_be(expected)
+   end
+end
+
+-- Splits emulator output into its status, cycle count and RAM dumps
+local function split_run(output)
+   local status, cycles, ram = output:match("^(.-) after (%d+) cycles\n(.*)$")
+   return status, tonumber(cycles), ram
+end
+
+-- Runs 'filename' optimized with each of 'opt_flags' and checks that it
+-- leaves RAM as the original does in no more cycles
+local function test_opt_equivalence(filename, flags, opt_flags)
+   local args = fmt("--run %s %s/%s.asm", flags, TEST_DIR, filename)
+   local status, cycles, ram = split_run(run_hasm(args))
+   for i, opt in ipairs(opt_flags) do
+      group(fmt("%s %s %s", HASM_PATH, opt, args))
+      local o_status, o_cycles, o_ram =
+         split_run(run_hasm(fmt("%s %s", opt, args)))
+      expect(o_status).to_be(status)
+      expect(o_ram).to_be(ram)
+      expect(o_cycles <= cycles).to_be(true)
+   end
+end
+
+-- Runs 'filename' with --lockstep, one instance for each of 'instances',
+-- lists of --set values, and checks that each gives what running it alone
+-- does
+local function test_lockstep(filename, flags, instances)
+   local lines, expected = {}, {}
+   for i, sets in ipairs(instances) do
+      lines[i] = table.concat(sets, " ")
+      local args = ""
+      for _, set in ipairs(sets) do
+         args = fmt("%s --set %s", args, set)
+      end
+      expected[i] = fmt("instance %i: %s", i - 1, run_hasm(fmt(
+         "--run %s %s %s/%s.asm", flags, args, TEST_DIR, filename)))
+   end
+
+   local lockstep_file = fmt("%s/%s.lockstep", TEST_DIR, filename)
+   local fh = io.open(lockstep_file, "w")
+   fh:write(table.concat(lines, "\n"), "\n")
+   fh:close()
+   local args = fmt("--run %s --lockstep %s %s/%s.asm", flags, lockstep_file,
+      TEST_DIR, filename)
+   group(fmt("%s %s", HASM_PATH, args))
+   expect(run_hasm(args)).to_be(table.concat(expected))
+   os.remove(lockstep_file)
+end
+
+-- Profiles 'filename' run with 'profile_flags', lays it out by the profile
+-- and checks that it then leaves RAM as the original does in no more cycles
+local function test_layout(filename, profile_flags, flags)
+   local src = fmt("%s/%s", TEST_DIR, filename)
+   local profile = fmt("%s/%s.prof", TEST_DIR, filename)
+   run_hasm(fmt("--run %s %s --profile %s", profile_flags, src, profile))
+
+   local args = fmt("--layout %s --run %s %s", profile, flags, src)
+   group(fmt("%s %s", HASM_PATH, args))
+   local status, cycles, ram = split_run(run_hasm(fmt("--run %s %s",
+      flags, src)))
+   local output = run_hasm(args)
+   expect(output:match("^layout: ")).not_.to_be(nil)
+   local l_status, l_cycles, l_ram = split_run(output:gsub("^[^\n]*\n", ""))
+   expect(l_status).to_be(status)
+   expect(l_ram).to_be(ram)
+   expect(l_cycles <= cycles).to_be(true)
+end
+
+-- Runs 'filename' with 'opt', a pass that prints a line of stats starting
+-- with 'pass', and checks that it then leaves RAM as the original does.
+-- Cycles may differ, like with the calls and returns of --outline
+local function test_pass(filename, flags, opt, pass)
+   local args = fmt("--run %s %s/%s", flags, TEST_DIR, filename)
+   group(fmt("%s %s %s", HASM_PATH, opt, args))
+   local status, cycles, ram = split_run(run_hasm(args))
+   local output = run_hasm(fmt("%s %s", opt, args))
+   expect(output:match("^" .. pass .. ": ")).not_.to_be(nil)
+   local o_status, o_cycles, o_ram = split_run(output:gsub("^[^\n]*\n", ""))
+   expect(o_status).to_be(status)
+   expect(o_ram).to_be(ram)
+end
+
+-- Compiles the --emit=c translation of 'filename' and checks that it
+-- prints what the emulator does
+local function test_emit_c(filename, flags)
+   local asm = fmt("%s/%s.asm", TEST_DIR, filename)
+   local c = fmt("%s/%s.c", TEST_DIR, filename)
+   local native = fmt("%s/%s.native", TEST_DIR, filename)
+   local command = fmt("%s --emit=c %s -o %s && cc -std=c99 -O1 %s -o %s",
+      HASM_PATH, asm, c, c, native)
+
+   group(command)
+   expect(os.execute(command)).to_be(0)
+
+   local f = io.popen(fmt("%s %s", native, flags))
+   local output = f:read("*a")
+   f:close()
+   expect(output).to_be(run_hasm(fmt("--run %s %s", flags, asm)))
+end
+
+-- Disassembles '<filename>' assembled with 'flags', as ASCII and binary
+-- .hack and with and without its symbol map, and checks that assembling
+-- each disassembly gives the same words back
+-- Returns the disassembly with labels
+local function test_disasm(filename, flags)
+   local base = fmt("%s/%s", TEST_DIR, filename:gsub("%.", "_"))
+   local hack = base .. ".orig.hack"
+   run_hasm(fmt("%s --map %s.map %s/%s -o %s", flags, base, TEST_DIR,
+      filename, hack))
+   local words = read_file_fully(hack)
+
+   -- Same words, most significant byte first
+   local bytes = {}
+   for line in words:gmatch("[01]+") do
+      local w = tonumber(line, 2)
+      bytes[#bytes + 1] = string.char(math.floor(w / 256), w % 256)
+   end
+   local bin = base .. ".bin"
+   local fh = io.open(bin, "wb")
+   fh:write(table.concat(bytes))
+   fh:close()
+
+   local labeled
+   for _, input in ipairs({ hack, bin }) do
+      for _, map in ipairs({ "", fmt("--map %s.map", base) }) do
+         local command = fmt("%s -d %s %s -o %s.dis.asm", HASM_PATH, map,
+            input, base)
+         group(command)
+         expect(os.execute(command)).to_be(0)
+         run_hasm(fmt("%s.dis.asm -o %s.dis.hack", base, base))
+         expect(read_file_fully(base .. ".dis.hack")).to_be(words)
+         if map ~= "" then
+            labeled = read_file_fully(base .. ".dis.asm")
+         end
+      end
+   end
+   os.remove(base .. ".map")
+   os.remove(base .. ".bin")
+   os.remove(base .. ".dis.asm")
+   return labeled
+end
+
+-- Assembles 'modules' separately with -c and links them into
+-- '<name>.hack', which is compared against '<name>.cmp.hack'
+local function test_link(modules, name)
+   local objects = {}
+   for i, module in ipairs(modules) do
+      local asm = fmt("%s/%s.asm", TEST_DIR, module)
+      objects[i] = fmt("%s/%s.o", TEST_DIR, module)
+      local command = fmt("%s -c %s -o %s", HASM_PATH, asm, objects[i])
+      group(command)
+      expect(os.execute(command)).to_be(0)
+   end
+
+   local hack = fmt("%s/%s.hack", TEST_DIR, name)
+   local command = fmt("%s --link %s -o %s", HASM_PATH,
+      table.concat(objects, " "), hack)
+   group(command)
+   expect(os.execute(command)).to_be(0)
+   expect(read_file_fully(hack)).to_be(
+      read_file_fully(fmt("%s/%s.cmp.hack", TEST_DIR, name)))
+end
+
+-- Assembles 'filename'.vm directly and through its --emit=asm
+-- translation, which must give the same words. Running the .asm, and the
+-- disassembly of the direct .hack, with 'flags' must print 'expected',
+-- worked out by hand from the VM code
+local function test_vm(filename, flags, expected)
+   local vm = fmt("%s/%s.vm", TEST_DIR, filename)
+   local asm = fmt("%s/%s.vm.asm", TEST_DIR, filename)
+   local hack = fmt("%s/%s.hack", TEST_DIR, filename)
+   local two_step_hack = fmt("%s/%s.vm.hack", TEST_DIR, filename)
+   local dis = fmt("%s/%s.vm.dis.asm", TEST_DIR, filename)
+
+   local command = make_hasm_command(vm, hack)
+   group(command)
+   expect(os.execute(command)).to_be(0)
+   run_hasm(fmt("-d %s -o %s", hack, dis))
+   expect(run_hasm(fmt("--run %s %s", flags, dis))).to_be(expected)
+   os.remove(dis)
+
+   command = fmt("%s && %s", make_hasm_command(vm, asm, "--emit=asm"),
+      make_hasm_command(asm, two_step_hack))
+   group(command)
+   expect(os.execute(command)).to_be(0)
+   expect(read_file_fully(two_step_hack)).to_be(read_file_fully(hack))
+   expect(run_hasm(fmt("--run %s %s", flags, asm))).to_be(expected)
+end
+
+-- Assembles all 'filenames' in one --batch run with the 'io' backend.
+-- Each '<filename>.hack' is compared against '<filename>.cmp.hack'
+local function test_batch(filenames, io)
+   local inputs = {}
+   for i, filename in ipairs(filenames) do
+      inputs[i] = fmt("%s/%s", TEST_DIR, filename)
+   end
+
+   local command = fmt("%s --batch --io=%s %s > /dev/null", HASM_PATH, io,
+      table.concat(inputs, " "))
+   group(command)
+   expect(os.execute(command)).to_be(0)
+   for i, filename in ipairs(filenames) do
+      local name = string.gsub(filename, "%.[^.]*$", "")
+      expect(read_file_fully(fmt("%s/%s.hack", TEST_DIR, name))).to_be(
+         read_file_fully(fmt("%s/%s.cmp.hack", TEST_DIR, name)))
+   end
+end
+
 clean()
 
 test_files({
@@ -86,4 +328,455 @@ test_files({
    "Pong",
 })
 
+-- Constant expressions in A-instructions
+test_files({
+   "Expr",
+})
+
+-- Decimal, hex and binary literals. Values must fit in 15 bits
+test_files({
+   "Literals",
+})
+group("out of range literal")
+expect(os.execute(fmt("%s %s/LiteralRange.asm -o %s/LiteralRange.hack " ..
+   "> /dev/null", HASM_PATH, TEST_DIR, TEST_DIR))).not_.to_be(0)
+
+-- Every spelling of a C-instruction the parser accepts
+test_files({
+   "CInst",
+})
+group("malformed C-instructions")
+for _, inst in ipairs({"0;JMPX", "xJMP", "0;JM P", "D+D", "AAM=D", "D;",
+   "M=D+", "D;JGT;JMP", "D=M=A", "=", "*"}) do
+   local fh = io.open(TEST_DIR .. "/BadCInst.asm", "w")
+   fh:write(inst .. "\r\n")
+   fh:close()
+   expect(os.execute(fmt("%s %s/BadCInst.asm -o %s/BadCInst.hack > /dev/null",
+      HASM_PATH, TEST_DIR, TEST_DIR))).not_.to_be(0)
+end
+os.remove(TEST_DIR .. "/BadCInst.asm")
+
+-- Peephole optimizer
+test_files({
+   "Peephole",
+   "Mult",
+   "Fill",
+}, "-O", ".O")
+
+-- Dead code elimination
+test_files({
+   "DeadCode",
+}, "--dce", ".D")
+
+-- Identical code folding
+test_files({
+   "Fold",
+}, "--icf", ".I")
+
+-- Constant propagation
+test_files({
+   "Dataflow",
+}, "--dataflow", ".F")
+group("dataflow stats")
+expect(run_hasm(fmt("--dataflow=stats %s/Dataflow.asm -o /dev/null",
+   TEST_DIR))).to_be("dataflow: 5 instructions removed (1 loads, " ..
+   "1 stores), 7 computations and 2 jumps folded, 5 cycles saved " ..
+   "(estimated)\n")
+
+-- Emulator
+test_run("Add", "--dump 0",
+   "ran past end of ROM after 6 cycles\nRAM[0] = 5\n")
+test_run("Max", "--set 0=3 --set 1=-8 --dump 2",
+   "halted after 11 cycles\nRAM[2] = 3\n")
+test_run("Mult", "--set 0=6 --set 1=-7 --dump 2",
+   "halted after 917466 cycles\nRAM[2] = -42\n")
+test_run("Expr", "--dump 2 --dump 16:3 --dump 16544",
+   "halted after 19 cycles\nRAM[2] = 20\nRAM[16] = -1\nRAM[17] = 13\n" ..
+   "RAM[18] = 24575\nRAM[16544] = 19\n")
+test_run("Fill", "--max-cycles 1000 --dump 16384:2",
+   "cycle limit reached after 1000 cycles\nRAM[16384] = 0\nRAM[16385] = 0\n")
+test_run("Fill", "--set 24576=75 --max-cycles 1000 --dump 16384:2",
+   "cycle limit reached after 1000 cycles\nRAM[16384] = -1\nRAM[16385] = -1\n")
+
+-- Optimized programs must leave RAM as the originals do
+test_opt_equivalence("Mult", "--set 0=123 --set 1=-45 --dump 0:32",
+   { "-O", "--dce", "--dce -O", "--dataflow" })
+test_opt_equivalence("Pong", "--max-cycles 20000000 --dump 16:240 " ..
+   "--dump 2048:2048 --dump 16384:8192",
+   { "-O", "--dce", "--dce -O", "--icf", "--dce -O --icf", "--dataflow",
+     "--dce --dataflow -O --icf" })
+test_opt_equivalence("Fold", "--set 0=5 --dump 0:4", { "--icf" })
+test_opt_equivalence("Dataflow", "--set 0=5 --dump 0:7",
+   { "--dataflow", "--dataflow -O" })
+test_opt_equivalence("Dataflow", "--set 0=-5 --dump 0:7",
+   { "--dataflow", "--dataflow -O" })
+
+-- All emulator engines must give the same results
+test_run_equivalence("Mult", "--set 0=123 --set 1=-45 --dump 0:32",
+   { "--engine naive", "--engine switch", "--engine threaded",
+     "--engine jit" })
+test_run_equivalence("Pong", "--max-cycles 20000001 --dump 0:240 " ..
+   "--dump 2048:2048 --dump 16384:8192",
+   { "--engine naive", "--engine switch", "--engine threaded",
+     "--engine jit" })
+-- Limits that fall inside JIT blocks
+for i, n in ipairs({ 1, 2, 999, 1000, 1001 }) do
+   test_run_equivalence("Fill", fmt("--max-cycles %i --dump 0:32 " ..
+      "--dump 16384:64", n), { "--engine jit" })
+end
+-- Loops run in bulk, with limits that fall inside them
+local idiom_dumps = "--dump 0:32 --dump 1000:40 --dump 2000:112 " ..
+   "--dump 3000:42 --dump 4000:112"
+for i, r0 in ipairs({ 0, 1, 2, 37, -5, 1000 }) do
+   test_run_equivalence("Idiom", fmt("--set 0=%i --max-cycles 5000000 %s",
+      r0, idiom_dumps), { "--engine naive", "--engine switch" })
+end
+for i, n in ipairs({ 20, 151, 400, 777, 1300, 2024, 2900 }) do
+   test_run_equivalence("Idiom", fmt("--set 0=37 --max-cycles %i %s",
+      n, idiom_dumps), { "--engine switch" })
+end
+for i, n in ipairs({ 999, 163841, 3000000 }) do
+   test_run_equivalence("Fill", fmt("--set 24576=1 --max-cycles %i " ..
+      "--dump 0:32 --dump 16384:8192", n), { "--engine switch" })
+end
+for i, r0 in ipairs({ 5, 256, 32767 }) do
+   test_run_equivalence("Rect", fmt("--set 0=%i --max-cycles 2000000 " ..
+      "--dump 0:32 --dump 16384:8192", r0), { "--engine switch" })
+end
+
+-- Lockstep instances take separate paths and must still give what they do
+-- alone, cycles included
+local mult_instances = {}
+for i = 1, 37 do
+   mult_instances[i] = { fmt("0=%i", (i * 7) % 23 - 5), fmt("1=%i", i % 11) }
+end
+test_lockstep("Mult", "--dump 0:3", mult_instances)
+test_lockstep("Mult", "--lanes 5 --max-cycles 60 --dump 0:3", mult_instances)
+test_lockstep("Max", "--dump 0:3", { { "0=3", "1=9" }, { "0=9", "1=3" },
+   { "0=-4", "1=-4" } })
+test_lockstep("Pong", "--max-cycles 300000 --dump 0:240 --dump 16384:512",
+   { { "24576=0" }, { "24576=130" }, { "24576=132" }, { "24576=140" } })
+
+group("perf map names JIT-compiled code by label")
+run_hasm(fmt("--run --engine jit --perf-map=%s/Mult.map --set 0=3 " ..
+   "--set 1=4 %s/Mult.asm", TEST_DIR, TEST_DIR))
+local perf_map = read_file_fully(TEST_DIR .. "/Mult.map")
+expect(perf_map:match("^%x+ %x+ hack:enter\n")).not_.to_be(nil)
+expect(perf_map:match("\n%x+ %x+ hack:LOOP\n")).not_.to_be(nil)
+os.remove(TEST_DIR .. "/Mult.map")
+
+-- Cycle profiles by label and by VM call stack
+group("flat profile adds up cycles by function")
+local flat = run_hasm(fmt("--run --flat-profile %s/VmTest.vm", TEST_DIR))
+expect(flat:match("\n  Math.mul +3394  +63.2%%\n")).not_.to_be(nil)
+expect(flat:match("\n  Main.fact +785 ")).not_.to_be(nil)
+expect(flat:match("\n  %(top%) +46 ")).not_.to_be(nil)
+
+group("folded stacks follow VM calls")
+run_hasm(fmt("--run --folded-stacks %s/VmTest.folded %s/VmTest.vm",
+   TEST_DIR, TEST_DIR))
+expect(read_file_fully(TEST_DIR .. "/VmTest.folded")).to_be([[
+(top) 46
+(top);Sys.init 263
+(top);Sys.init;Main.fact 177
+(top);Sys.init;Main.fact;Main.fact 177
+(top);Sys.init;Main.fact;Main.fact;Main.fact 177
+(top);Sys.init;Main.fact;Main.fact;Main.fact;Main.fact 177
+(top);Sys.init;Main.fact;Main.fact;Main.fact;Main.fact;Main.fact 77
+(top);Sys.init;Main.fact;Main.fact;Main.fact;Main.fact;Math.mul 196
+(top);Sys.init;Main.fact;Main.fact;Main.fact;Math.mul 286
+(top);Sys.init;Main.fact;Main.fact;Math.mul 646
+(top);Sys.init;Main.fact;Math.mul 2266
+(top);Sys.init;Main.sum 885
+]])
+os.remove(TEST_DIR .. "/VmTest.folded")
+
+-- Pong calls through shared code and its labels are the nand2tetris
+-- translator's. Every cycle is in some stack
+group("folded stacks of Pong")
+run_hasm(fmt("--run --max-cycles 2000000 --folded-stacks %s/Pong.folded " ..
+   "%s/Pong.asm", TEST_DIR, TEST_DIR))
+local folded = read_file_fully(TEST_DIR .. "/Pong.folded")
+local total = 0
+for n in folded:gmatch(" (%d+)\n") do
+   total = total + tonumber(n)
+end
+expect(total).to_be(2000000)
+expect(folded:match("\n%(top%);sys%.init;output%.init;" ..
+   "output%.createshiftedmap;math%.multiply;math%.abs %d+\n")).not_.to_be(nil)
+os.remove(TEST_DIR .. "/Pong.folded")
+
+-- Profile-guided layouts must leave RAM as the originals do. Profiles come
+-- from other inputs than the checked runs
+test_layout("Mult.asm", "--set 0=123 --set 1=45",
+   "--set 0=6 --set 1=-7 --dump 0:32")
+test_layout("Mult.asm", "--set 0=6 --set 1=-7",
+   "--set 0=123 --set 1=45 --dump 0:32")
+test_layout("VmTest.vm", "", "--dump 5:2 --dump 16")
+test_layout("Pong.asm", "--max-cycles 2000000", "--max-cycles 20000000 " ..
+   "--dump 16:240 --dump 2048:2048 --dump 16384:8192")
+group("layout rejects a profile of another program")
+run_hasm(fmt("--run %s/Max.asm --profile %s/Max.prof", TEST_DIR, TEST_DIR))
+expect(os.execute(fmt("%s --layout %s/Max.prof %s/Mult.asm > /dev/null",
+   HASM_PATH, TEST_DIR, TEST_DIR))).not_.to_be(0)
+
+-- Outlining
+test_files({
+   "Outline",
+}, "--outline", ".U")
+test_pass("Outline.asm", "--set 0=3 --set 1=4 --dump 0:8", "--outline",
+   "outline")
+test_pass("Outline.asm", "--set 0=-3 --set 1=1 --dump 0:8", "--outline",
+   "outline")
+-- Pong runs off its end, so its shared copies go first. Its screen is
+-- compared once it waits for a key
+test_pass("Pong.asm", "--max-cycles 300000000 --dump 16384:8192",
+   "--outline", "outline")
+group("outline minimum saving")
+expect(run_hasm(fmt("--outline=7 %s/Outline.asm -o /dev/null", TEST_DIR)))
+   .to_be("outline: 0 sequences from 0 copies, 0 words saved\n")
+expect(os.execute(fmt("%s --outline=0 %s/Outline.asm -o /dev/null > /dev/null",
+   HASM_PATH, TEST_DIR))).not_.to_be(0)
+
+-- Variable packing. Variables move, so only the rest of RAM is compared
+test_files({
+   "Pack",
+}, "--pack", ".P")
+test_pass("Pack.asm", "--set 0=6 --set 1=7 --dump 0:4", "--pack", "pack")
+test_pass("Mult.asm", "--set 0=123 --set 1=-45 --dump 0:16", "--pack", "pack")
+test_pass("Pong.asm", "--max-cycles 20000000 --dump 0:16 --dump 256:1792 " ..
+   "--dump 16384:8192", "--pack", "pack")
+test_pass("Pong.asm", "--max-cycles 20000000 --dump 2048:2048 " ..
+   "--dump 16384:8192", "--dce -O --pack", "pack")
+group("pack stats")
+expect(run_hasm(fmt("--pack %s/Pack.asm -o /dev/null", TEST_DIR)))
+   .to_be("pack: 5 variables in 3 slots\n")
+
+-- With --pack variables must not run into SCREEN. Unread ones all share
+-- one slot, ones whose address is used keep their own. Without --pack
+-- they run on into SCREEN as they always have
+group("too many variables")
+for _, inst in ipairs({ "M=0", "D=A" }) do
+   local vars = {}
+   for i = 0, 16368 do
+      vars[#vars + 1] = fmt("@v%d\r\n%s\r\n", i, inst)
+   end
+   local fh = io.open(TEST_DIR .. "/Vars.asm", "w")
+   fh:write(table.concat(vars))
+   fh:close()
+   expect(os.execute(fmt("%s %s/Vars.asm -o %s/Vars.hack > /dev/null",
+      HASM_PATH, TEST_DIR, TEST_DIR))).to_be(0)
+   local hack = read_file_fully(TEST_DIR .. "/Vars.hack")
+   expect(hack:match("(%d+)\n[01]+\n$")).to_be("0100000000000000")
+   local command = fmt("%s --pack %s/Vars.asm -o %s/Vars.hack > /dev/null",
+      HASM_PATH, TEST_DIR, TEST_DIR)
+   expect(os.execute(command) == 0).to_be(inst == "M=0")
+end
+
+-- Labels and the variables -O records before encoding share the symbol
+-- table, which must not overflow
+local lines = {}
+for i = 0, 16999 do
+   lines[#lines + 1] = fmt("(L%d)\n@v%d\n", i, i)
+end
+local fh = io.open(TEST_DIR .. "/Vars.asm", "w")
+fh:write(table.concat(lines))
+fh:close()
+for _, flags in ipairs({ "", "-O" }) do
+   expect(run_hasm(fmt("%s %s/Vars.asm -o %s/Vars.hack", flags, TEST_DIR,
+      TEST_DIR))).to_be("Too many variables: 'v15745' doesn't fit in " ..
+      "the symbol table\n")
+end
+os.remove(TEST_DIR .. "/Vars.asm")
+os.remove(TEST_DIR .. "/Vars.hack")
+
+-- Disassembly
+for _, name in ipairs({ "Add.asm", "Max.asm", "Rect.asm", "Fill.asm",
+   "Pong.asm", "PongL.asm", "Expr.asm", "CInst.asm", "Literals.asm" }) do
+   test_disasm(name, "")
+end
+test_disasm("Peephole.asm", "-O")
+test_disasm("Outline.asm", "--outline")
+group("disassembly puts labels back")
+local mult_dis = test_disasm("Mult.asm", "")
+expect(mult_dis:match("\n%(LOOP%)\n")).not_.to_be(nil)
+expect(mult_dis:match("\n    @END\n    D;JEQ\n")).not_.to_be(nil)
+local vm_dis = test_disasm("VmTest.vm", "")
+expect(vm_dis:match("\n%(Main%.fact%)\n")).not_.to_be(nil)
+expect(vm_dis:match("\n    @Math%.mul\n    0;JMP\n")).not_.to_be(nil)
+group("disassembly of a malformed .hack")
+local bad_hack = TEST_DIR .. "/Bad.hack"
+local fh = io.open(bad_hack, "w")
+fh:write("0000000000000001\n000000000000002\n")
+fh:close()
+expect(run_hasm(fmt("-d %s -o /dev/null", bad_hack))).to_be(
+   fmt("Error at line 2 of '%s': expected 16 '0' or '1' chars\n", bad_hack))
+os.remove(bad_hack)
+
+-- Linking must give what assembling the sources as one file does
+test_link({ "Pong" }, "Pong")
+test_link({ "LinkMain", "LinkLib" }, "Link")
+group("linked program runs")
+expect(run_hasm(fmt("--link %s/LinkMain.o %s/LinkLib.o --run " ..
+   "--set 0=1200 --set 1=34 --dump 2", TEST_DIR, TEST_DIR))).to_be(
+   "halted after 20 cycles\nRAM[2] = 1234\n")
+
+-- Each module may have its own (LOOP) and (END), but a module using one it
+-- doesn't define can't tell whose it means
+local function compile(name, source)
+   local asm = fmt("%s/%s.asm", TEST_DIR, name)
+   if source then
+      local fh = io.open(asm, "w")
+      fh:write(source)
+      fh:close()
+   end
+   os.execute(fmt("%s -c %s -o %s/%s.o > /dev/null", HASM_PATH, asm,
+      TEST_DIR, name))
+   if source then
+      os.remove(asm)
+   end
+   return fmt("%s/%s.o", TEST_DIR, name)
+end
+local count_o, double_o = compile("LinkCount"), compile("LinkDouble")
+group("modules with labels of the same name link")
+expect(run_hasm(fmt("--link %s %s --run --set 0=21 --dump 1", count_o,
+   double_o))).to_be("halted after 250 cycles\nRAM[1] = 42\n")
+group("bad links")
+local links = {
+   { count_o, double_o, compile("LinkLoop", "@LOOP\n0;JMP\n") },
+   { compile("LinkBelow", "(START)\n@START-1\n0;JMP\n") },
+   { compile("LinkAbove", "@v+32767\nD=A\n") },
+}
+for _, objects in ipairs(links) do
+   expect(os.execute(fmt("%s --link %s -o %s/Bad.hack > /dev/null",
+      HASM_PATH, table.concat(objects, " "), TEST_DIR))).not_.to_be(0)
+end
+
+-- VM front end
+local vm_results = "halted after 5373 cycles\nRAM[5] = 55\n" ..
+   "RAM[6] = 11\nRAM[16] = 120\n"
+test_vm("VmTest", "--dump 5:2 --dump 16", vm_results)
+group("VM program runs")
+expect(run_hasm(fmt("--run %s/VmTest.vm --dump 5:2 --dump 16", TEST_DIR)))
+   .to_be(vm_results)
+
+-- The file defining Sys.init may come anywhere, and each file has its own
+-- static 0
+group("VM program of several files runs")
+local vm_main = fmt("%s/VmMain.vm", TEST_DIR)
+local vm_lib = fmt("%s/VmLib.vm", TEST_DIR)
+for _, files in ipairs({ { vm_main, vm_lib }, { vm_lib, vm_main } }) do
+   expect(run_hasm(fmt("--run %s --dump 5:2", table.concat(files, " "))))
+      .to_be("halted after 277 cycles\nRAM[5] = 7\nRAM[6] = 42\n")
+end
+group("no bootstrap without a Sys.init function")
+expect(run_hasm(fmt("--emit=asm %s -o /dev/stdout", vm_lib))
+   :find("Bootstrap", 1, true)).to_be(nil)
+group("several inputs only for VM code")
+expect(os.execute(fmt("%s %s %s/Add.asm > /dev/null", HASM_PATH, vm_main,
+   TEST_DIR))).not_.to_be(0)
+
+-- Resuming from a snapshot must give what the full run does
+local function test_snapshot(filename, label, flags)
+   local src = fmt("%s/%s", TEST_DIR, filename)
+   local snap = fmt("%s/%s.snap", TEST_DIR, filename)
+   group(fmt("snapshot of %s at %s", filename, label))
+   expect(run_hasm(fmt("--run %s --snapshot-at %s --save-snapshot %s",
+      src, label, snap)):match("^snapshot at '" .. label .. "' after %d+ " ..
+      "cycles\n$") ~= nil).to_be(true)
+   local expected = run_hasm(fmt("--run %s %s", flags, src))
+   for _, engine in ipairs({ "naive", "switch", "threaded", "jit" }) do
+      expect(run_hasm(fmt("--run %s --engine %s --snapshot %s %s", flags,
+         engine, snap, src))).to_be(expected)
+   end
+   os.remove(snap)
+end
+
+test_snapshot("VmTest.vm", "Main.sum", "--dump 5:2 --dump 16")
+test_snapshot("Pong.asm", "ponggame.run", "--max-cycles 6000000 " ..
+   "--set 24576=130 --dump 0:240 --dump 2048:2048 --dump 16384:8192")
+
+run_hasm(fmt("--run %s/Pong.asm --snapshot-at ponggame.run " ..
+   "--save-snapshot %s/Pong.snap", TEST_DIR, TEST_DIR))
+test_lockstep("Pong", fmt("--snapshot %s/Pong.snap --max-cycles 5300000 " ..
+   "--dump 0:240 --dump 16384:512", TEST_DIR),
+   { { "24576=0" }, { "24576=130" }, { "24576=132" }, { "24576=140" } })
+os.remove(TEST_DIR .. "/Pong.snap")
+
+group("snapshot of another program")
+run_hasm(fmt("--run %s/Max.asm --snapshot-at 0 --save-snapshot %s/Max.snap",
+   TEST_DIR, TEST_DIR))
+expect(run_hasm(fmt("--run %s/Mult.asm --snapshot %s/Max.snap", TEST_DIR,
+   TEST_DIR))).to_be(fmt("'%s/Max.snap' is a snapshot of another program\n",
+   TEST_DIR))
+os.remove(TEST_DIR .. "/Max.snap")
+
+-- Screen export must not change the run
+group("--screen shares SCREEN and KBD without changing the run")
+local pong_flags = fmt("--run %s/Pong.asm --max-cycles 6000000 " ..
+   "--set 24576=130 --dump 0:240 --dump 16384:8193", TEST_DIR)
+local pong_out = run_hasm(pong_flags)
+for _, engine in ipairs({ "naive", "switch", "threaded", "jit" }) do
+   expect(run_hasm(fmt("%s --engine %s --screen /hasm-test-screen " ..
+      "--frame-cycles 300000", pong_flags, engine))).to_be(pong_out)
+end
+expect(io.open("/dev/shm/hasm-test-screen")).to_be(nil)
+
+-- The last PPM frame must show the screen as it's left in RAM, and frames
+-- without stores to it aren't written
+local function screen_ppm(out)
+   local pixels = {}
+   for word in out:gmatch("RAM%[%d+%] = (%-?%d+)") do
+      local w = tonumber(word) % 0x10000
+      for b = 0, 15 do
+         pixels[#pixels + 1] = bit.band(bit.rshift(w, b), 1) == 1 and
+            "\0\0\0" or "\255\255\255"
+      end
+   end
+   return "P6\n512 256\n255\n" .. table.concat(pixels)
+end
+
+group("--ppm-frames writes the frames that changed")
+local rect_out = run_hasm(fmt("--run %s/Rect.asm --set 0=40 " ..
+   "--ppm-frames %s/Rect. --frame-cycles 100 --dump 16384:8192", TEST_DIR,
+   TEST_DIR))
+expect(rect_out:match("^[^\n]*")).to_be("halted after 531 cycles")
+for frame = 0, 5 do
+   local ppm = fmt("%s/Rect.%06i.ppm", TEST_DIR, frame)
+   if frame == 5 then
+      expect(read_file_fully(ppm) == screen_ppm(rect_out)).to_be(true)
+   end
+   os.remove(ppm)
+end
+run_hasm(fmt("--run %s/Rect.asm --set 0=0 --ppm-frames %s/Rect. " ..
+   "--frame-cycles 2", TEST_DIR, TEST_DIR))
+expect(io.open(fmt("%s/Rect.000001.ppm", TEST_DIR))).to_be(nil)
+os.remove(fmt("%s/Rect.000000.ppm", TEST_DIR))
+
+-- C translations must leave RAM as the emulator does
+test_emit_c("Add", "--dump 0")
+test_emit_c("Mult", "--set 0=123 --set 1=-45 --dump 0:32")
+test_emit_c("Fill", "--set 24576=75 --max-cycles 1001 --dump 16384:8192")
+test_emit_c("Pong", "--max-cycles 20000001 --dump 0:240 " ..
+   "--dump 2048:2048 --dump 16384:8192")
+group("failed writes exit with an error")
+for _, flags in ipairs({ "", "--emit=c", "--emit=asm", "-c" }) do
+   expect(os.execute(fmt("%s %s %s/Mult.asm -o /dev/full > /dev/null",
+      HASM_PATH, flags, TEST_DIR))).not_.to_be(0)
+end
+for _, flags in ipairs({ "--map /dev/full -o /dev/null",
+   "--run --profile /dev/full", "--run --folded-stacks /dev/full" }) do
+   expect(os.execute(fmt("%s %s %s/Mult.asm > /dev/null", HASM_PATH, flags,
+      TEST_DIR))).not_.to_be(0)
+end
+expect(os.execute(fmt("%s -d %s/Add.cmp.hack -o /dev/full > /dev/null",
+   HASM_PATH, TEST_DIR))).not_.to_be(0)
+
+-- Batch assembly must match single-file assembly on every I/O backend
+for _, io in ipairs({ "uring", "threads", "sync" }) do
+   clean()
+   test_batch({ "Add.asm", "Max.asm", "Rect.asm", "Mult.asm", "Fill.asm",
+      "Pong.asm", "MaxL.asm", "RectL.asm", "PongL.asm", "VmTest.vm" }, io)
+end
+
 lest.print_stats()
@@ -0,0 +1,577 @@
+/*
+ testfarm - runs hasm test jobs on all cores
+
+ Usage: testfarm [-j threads] [--hasm path] manifest
+
+ Each line of `manifest` is a job, with paths relative to its directory:
+     asm SOURCE EXPECTED [FLAGS...]   assemble SOURCE with FLAGS and compare
+                                      the result with the .hack EXPECTED
+     run SOURCE [FLAGS...] = OUTPUT   run SOURCE with '--run FLAGS' and
+                                      compare what hasm prints with OUTPUT,
+                                      where '\n' is a newline
+ Blank lines and lines starting with '#' are skipped.
+
+ Jobs are dealt out in runs of consecutive lines to one thread per core
+ (or -j threads). A thread works through its own jobs from the front and,
+ when it has none left, steals from the back of another thread's, so a
+ few slow jobs (Pong) don't hold up the rest. Each job runs hasm as its
+ own process. The assembler keeps its symbol table in globals, so jobs
+ can't share one process.
+
+ Failures are printed in manifest order once all jobs are done: for asm
+ jobs, the first instruction that differs and, for plain .asm sources, the
+ line it was assembled from; for run jobs, the first line of output that
+ differs. Exits with 1 if any job failed.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_JOB_ARGS                       32
+#define MAX_THREADS                        256
+#define MESSAGE_SIZE                       512
+#define TMP_PATH_SIZE                      64
+
+extern char **environ;
+
+enum JOB_KIND {
+    JOB_ASM,
+    JOB_RUN,
+};
+
+typedef struct {
+    enum JOB_KIND kind;
+    size_t line; // in the manifest
+    char *source;
+    char *expected; // .hack path for JOB_ASM, output for JOB_RUN
+    char *args[MAX_JOB_ARGS]; // hasm flags
+    size_t arg_count;
+    int passed;
+    char message[MESSAGE_SIZE]; // why it failed
+} Job;
+
+// Jobs of one thread, the indices from 'head' to 'tail'. Its thread takes
+// from the head, others steal from the tail
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+} Deque;
+
+typedef struct {
+    Job *jobs;
+    size_t job_count;
+    Deque *deques;
+    size_t thread_count;
+    char *hasm;
+    char *tmp_dir;
+    size_t stolen; // jobs run by another thread than the one dealt them
+    pthread_mutex_t stolen_lock;
+} Farm;
+
+typedef struct {
+    Farm *farm;
+    size_t id;
+} Worker;
+
+// Reads all of 'path' into a '\0'-terminated buffer, without printing
+// anything if it can't
+// Returns NULL on error
+static char *read_whole(char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    size_t capacity = 4096;
+    size_t n = 0;
+    char *buf = malloc(capacity);
+    for (;;) {
+        n += fread(buf + n, 1, capacity - n - 1, f);
+        if (n < capacity - 1)
+            break;
+        capacity *= 2;
+        buf = realloc(buf, capacity);
+    }
+    fclose(f);
+    buf[n] = '\0';
+    *size = n;
+    return buf;
+}
+
+// Returns the line that starts at 'at', up to 'len' chars, in 'out'
+static void copy_line(char *out, size_t len, char *at)
+{
+    size_t n = strcspn(at, "\r\n");
+    if (n >= len)
+        n = len - 1;
+    memcpy(out, at, n);
+    out[n] = '\0';
+}
+
+// Returns the start of line 'index' (from 0) of 'buf', NULL if it has
+// fewer lines
+static char *nth_line(char *buf, size_t index)
+{
+    for (; index > 0; index--) {
+        buf = strchr(buf, '\n');
+        if (buf == NULL)
+            return NULL;
+        buf++;
+    }
+    return *buf ? buf : NULL;
+}
+
+// Returns the number of the .asm line that instruction 'index' was
+// assembled from, 0 if it wasn't found. Each line holds at most one
+// instruction, so this only holds when no flags change the code
+static size_t source_line_of(char *asm_path, size_t index)
+{
+    size_t size;
+    char *buf = read_whole(asm_path, &size);
+    if (buf == NULL)
+        return 0;
+
+    size_t line = 0;
+    size_t found = 0;
+    for (char *at = buf; at != NULL && *at; ) {
+        line++;
+        char *end = at + strcspn(at, "\n");
+        char *c = at + strspn(at, " \t\r");
+        int is_inst = c < end && *c != '(' && !(c[0] == '/' && c[1] == '/');
+        if (is_inst && index-- == 0) {
+            found = line;
+            break;
+        }
+        at = *end ? end + 1 : NULL;
+    }
+    free(buf);
+    return found;
+}
+
+// Runs hasm with 'argv', its output going to 'out_path'
+// Returns hasm's exit status, -1 if it didn't run or exit
+static int spawn_hasm(char **argv, char *out_path)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out_path,
+        O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0)
+        return -1;
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+// Compares assembled 'got' with 'job's expected .hack
+static void check_asm(Job *job, char *got_path)
+{
+    size_t got_size, expected_size;
+    char *got = read_whole(got_path, &got_size);
+    char *expected = read_whole(job->expected, &expected_size);
+    if (got == NULL || expected == NULL) {
+        snprintf(job->message, MESSAGE_SIZE, "couldn't read '%s'",
+            got == NULL ? got_path : job->expected);
+        free(got);
+        free(expected);
+        return;
+    }
+    if (got_size == expected_size && memcmp(got, expected, got_size) == 0) {
+        job->passed = 1;
+        free(got);
+        free(expected);
+        return;
+    }
+
+    // First differing instruction, a line of the .hack
+    size_t first = 0;
+    while (first < got_size && first < expected_size &&
+        got[first] == expected[first]) {
+        first++;
+    }
+    size_t index = 0;
+    for (size_t i = 0; i < first; i++)
+        index += got[i] == '\n';
+
+    char *got_line = nth_line(got, index);
+    char *expected_line = nth_line(expected, index);
+    char got_word[20] = "end of file";
+    char expected_word[20] = "end of file";
+    if (got_line != NULL)
+        copy_line(got_word, sizeof(got_word), got_line);
+    if (expected_line != NULL)
+        copy_line(expected_word, sizeof(expected_word), expected_line);
+    int n = snprintf(job->message, MESSAGE_SIZE,
+        "instruction %zu differs: got %s, expected %s",
+        index, got_word, expected_word);
+
+    size_t len = strlen(job->source);
+    size_t line = 0;
+    if (job->arg_count == 0 && len > 4 &&
+        strcmp(job->source + len - 4, ".asm") == 0) {
+        line = source_line_of(job->source, index);
+    }
+    if (line != 0) {
+        size_t size;
+        char *src = read_whole(job->source, &size);
+        char text[80] = "";
+        char *at = src ? nth_line(src, line - 1) : NULL;
+        if (at != NULL)
+            copy_line(text, sizeof(text), at + strspn(at, " \t"));
+        snprintf(job->message + n, MESSAGE_SIZE - n, "\n    %s:%zu: %s",
+            job->source, line, text);
+        free(src);
+    }
+    free(got);
+    free(expected);
+}
+
+// Compares what hasm printed with 'job's expected output
+static void check_run(Job *job, char *got_path)
+{
+    size_t size;
+    char *got = read_whole(got_path, &size);
+    if (got == NULL) {
+        snprintf(job->message, MESSAGE_SIZE, "couldn't read '%s'", got_path);
+        return;
+    }
+    if (strcmp(got, job->expected) == 0) {
+        job->passed = 1;
+        free(got);
+        return;
+    }
+
+    size_t line = 0;
+    char *g = got;
+    char *e = job->expected;
+    while (*g && *g == *e) {
+        if (*g == '\n')
+            line++;
+        g++;
+        e++;
+    }
+    char got_text[80] = "end of output";
+    char expected_text[80] = "end of output";
+    char *got_line = nth_line(got, line);
+    char *expected_line = nth_line(job->expected, line);
+    if (got_line != NULL)
+        copy_line(got_text, sizeof(got_text), got_line);
+    if (expected_line != NULL)
+        copy_line(expected_text, sizeof(expected_text), expected_line);
+    snprintf(job->message, MESSAGE_SIZE,
+        "output line %zu differs:\n    got      %s\n    expected %s",
+        line + 1, got_text, expected_text);
+    free(got);
+}
+
+static void run_job(Farm *farm, size_t index)
+{
+    Job *job = farm->jobs + index;
+    char out_path[TMP_PATH_SIZE];
+    char hack_path[TMP_PATH_SIZE];
+    snprintf(out_path, TMP_PATH_SIZE, "%s/%zu.out", farm->tmp_dir, index);
+    snprintf(hack_path, TMP_PATH_SIZE, "%s/%zu.hack", farm->tmp_dir, index);
+
+    char *argv[MAX_JOB_ARGS + 6];
+    size_t argc = 0;
+    argv[argc++] = farm->hasm;
+    if (job->kind == JOB_RUN)
+        argv[argc++] = "--run";
+    for (size_t i = 0; i < job->arg_count; i++)
+        argv[argc++] = job->args[i];
+    argv[argc++] = job->source;
+    if (job->kind == JOB_ASM) {
+        argv[argc++] = "-o";
+        argv[argc++] = hack_path;
+    }
+    argv[argc] = NULL;
+
+    int status = spawn_hasm(argv, out_path);
+    if (status == -1) {
+        snprintf(job->message, MESSAGE_SIZE, "couldn't run '%s'", farm->hasm);
+    } else if (job->kind == JOB_RUN) {
+        check_run(job, out_path);
+    } else if (status != 0) {
+        size_t size;
+        char *out = read_whole(out_path, &size);
+        char text[200] = "";
+        if (out != NULL)
+            copy_line(text, sizeof(text), out);
+        snprintf(job->message, MESSAGE_SIZE, "hasm exited with %i: %s",
+            status, text);
+        free(out);
+    } else {
+        check_asm(job, hack_path);
+    }
+    unlink(out_path);
+    unlink(hack_path);
+}
+
+// Takes the next job of thread 'id', or steals one from another thread's
+// deque, starting from the next thread
+// Returns 0 when there are no jobs left, 1 otherwise
+static int next_job(Farm *farm, size_t id, size_t *index)
+{
+    for (size_t k = 0; k < farm->thread_count; k++) {
+        Deque *q = farm->deques + (id + k) % farm->thread_count;
+        pthread_mutex_lock(&q->lock);
+        int found = q->head < q->tail;
+        if (found)
+            *index = k == 0 ? q->head++ : --q->tail;
+        pthread_mutex_unlock(&q->lock);
+        if (!found)
+            continue;
+        if (k != 0) {
+            pthread_mutex_lock(&farm->stolen_lock);
+            farm->stolen++;
+            pthread_mutex_unlock(&farm->stolen_lock);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static void *worker(void *arg)
+{
+    Worker *w = arg;
+    size_t index;
+    while (next_job(w->farm, w->id, &index))
+        run_job(w->farm, index);
+    return NULL;
+}
+
+// Replaces '\n' and '\\' escapes in 's'
+static void unescape(char *s)
+{
+    char *out = s;
+    for (; *s; s++) {
+        if (s[0] == '\\' && (s[1] == 'n' || s[1] == '\\')) {
+            *out++ = s[1] == 'n' ? '\n' : '\\';
+            s++;
+        } else {
+            *out++ = *s;
+        }
+    }
+    *out = '\0';
+}
+
+// Parses the jobs in 'buf', pointing into it
+// Returns 0 on success, 1 on error
+static int parse_manifest(char *buf, char *path, Job **jobs_out,
+    size_t *count_out)
+{
+    size_t capacity = 64;
+    size_t count = 0;
+    Job *jobs = malloc(capacity * sizeof(Job));
+
+    char *line = buf;
+    for (size_t n = 1; line != NULL; n++) {
+        char *next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+        line[strcspn(line, "\r")] = '\0';
+        char *c = line + strspn(line, " \t");
+        if (*c == '\0' || *c == '#') {
+            line = next;
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity *= 2;
+            jobs = realloc(jobs, capacity * sizeof(Job));
+        }
+        Job *job = jobs + count;
+        memset(job, 0, sizeof(Job));
+        job->line = n;
+
+        // Output of run jobs is the rest of the line after ' = '
+        char *output = strstr(c, " = ");
+        if (output != NULL) {
+            *output = '\0';
+            output += 3;
+        }
+
+        char *save;
+        char *kind = strtok_r(c, " \t", &save);
+        job->source = strtok_r(NULL, " \t", &save);
+        int bad = job->source == NULL;
+        if (strcmp(kind, "asm") == 0) {
+            job->kind = JOB_ASM;
+            job->expected = strtok_r(NULL, " \t", &save);
+            bad |= job->expected == NULL || output != NULL;
+        } else if (strcmp(kind, "run") == 0) {
+            job->kind = JOB_RUN;
+            job->expected = output;
+            bad |= output == NULL;
+            if (output != NULL)
+                unescape(output);
+        } else {
+            bad = 1;
+        }
+        for (char *arg = strtok_r(NULL, " \t", &save); arg != NULL && !bad;
+            arg = strtok_r(NULL, " \t", &save)) {
+            bad = job->arg_count == MAX_JOB_ARGS;
+            job->args[job->arg_count++] = arg;
+        }
+        if (bad) {
+            printf("Error at line %zu of '%s': expected 'asm SOURCE EXPECTED "
+                "[FLAGS...]' or 'run SOURCE [FLAGS...] = OUTPUT'\n", n, path);
+            free(jobs);
+            return 1;
+        }
+        count++;
+        line = next;
+    }
+
+    *jobs_out = jobs;
+    *count_out = count;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char *manifest = NULL;
+    char *hasm = "./hasm";
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--hasm") == 0) &&
+            i + 1 < argc) {
+            if (argv[i][1] == 'j') {
+                char *end;
+                threads = strtol(argv[i + 1], &end, 10);
+                if (*end != '\0' || threads < 1 || threads > MAX_THREADS) {
+                    printf("error: -j needs 1 to %i threads\n", MAX_THREADS);
+                    return 1;
+                }
+            } else {
+                hasm = argv[i + 1];
+            }
+            i++;
+        } else if (manifest == NULL && argv[i][0] != '-') {
+            manifest = argv[i];
+        } else {
+            printf("Usage: testfarm [-j threads] [--hasm path] manifest\n");
+            return 1;
+        }
+    }
+    if (manifest == NULL) {
+        printf("Usage: testfarm [-j threads] [--hasm path] manifest\n");
+        return 1;
+    }
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    // Paths in the manifest are relative to its directory
+    char hasm_path[PATH_MAX];
+    if (realpath(hasm, hasm_path) == NULL) {
+        printf("Couldn't find hasm at '%s'\n", hasm);
+        return 1;
+    }
+    size_t size;
+    char *buf = read_whole(manifest, &size);
+    if (buf == NULL) {
+        printf("Couldn't open %s\n", manifest);
+        return 1;
+    }
+    char *slash = strrchr(manifest, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        if (chdir(*manifest ? manifest : "/") != 0) {
+            printf("Couldn't enter directory '%s'\n", manifest);
+            return 1;
+        }
+        *slash = '/';
+    }
+
+    Farm farm = {
+        .hasm = hasm_path,
+        .thread_count = threads,
+    };
+    if (parse_manifest(buf, manifest, &farm.jobs, &farm.job_count)) {
+        free(buf);
+        return 1;
+    }
+    char tmp_dir[] = "/tmp/hasm-farm-XXXXXX";
+    if (mkdtemp(tmp_dir) == NULL) {
+        printf("Couldn't create a directory in /tmp\n");
+        return 1;
+    }
+    farm.tmp_dir = tmp_dir;
+    if (farm.thread_count > farm.job_count && farm.job_count > 0)
+        farm.thread_count = farm.job_count;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Deal consecutive jobs to each thread
+    pthread_mutex_init(&farm.stolen_lock, NULL);
+    farm.deques = malloc(farm.thread_count * sizeof(Deque));
+    Worker *workers = malloc(farm.thread_count * sizeof(Worker));
+    pthread_t *ids = malloc(farm.thread_count * sizeof(pthread_t));
+    for (size_t t = 0; t < farm.thread_count; t++) {
+        pthread_mutex_init(&farm.deques[t].lock, NULL);
+        farm.deques[t].head = t * farm.job_count / farm.thread_count;
+        farm.deques[t].tail = (t + 1) * farm.job_count / farm.thread_count;
+        workers[t] = (Worker) { .farm = &farm, .id = t };
+    }
+    size_t started = 0;
+    for (size_t t = 1; t < farm.thread_count; t++) {
+        if (pthread_create(ids + t, NULL, worker, workers + t))
+            break;
+        started = t;
+    }
+    // This thread is worker 0, and takes over the jobs of threads that
+    // couldn't be created by stealing them
+    worker(workers);
+    for (size_t t = 1; t <= started; t++)
+        pthread_join(ids[t], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) +
+        (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    size_t passed = 0;
+    for (size_t i = 0; i < farm.job_count; i++) {
+        Job *job = farm.jobs + i;
+        if (job->passed) {
+            passed++;
+            continue;
+        }
+        printf("FAIL %s:%zu: %s %s", manifest, job->line,
+            job->kind == JOB_ASM ? "asm" : "run", job->source);
+        for (size_t k = 0; k < job->arg_count; k++)
+            printf(" %s", job->args[k]);
+        printf("\n    %s\n", job->message);
+    }
+    printf("%zu/%zu jobs passed on %zu threads (%zu stolen) in %.2fs\n",
+        passed, farm.job_count, farm.thread_count, farm.stolen, seconds);
+
+    rmdir(tmp_dir);
+    for (size_t t = 0; t < farm.thread_count; t++)
+        pthread_mutex_destroy(&farm.deques[t].lock);
+    pthread_mutex_destroy(&farm.stolen_lock);
+    free(ids);
+    free(workers);
+    free(farm.deques);
+    free(farm.jobs);
+    free(buf);
+    return passed != farm.job_count;
+}
@@ -0,0 +1,574 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+
+/*
+ VM language front end.
+
+ Lowers .vm commands straight into Instructions and labels, the way a
+ VM translator followed by the .asm parser would, without the text in
+ between. A program may be several .vm files, lowered one after another.
+ Static variables are named '<file>.<i>', so each file has its own,
+ labels '<function>$<label>' and return addresses '<function>$ret.<n>'.
+ When a file defines 'Sys.init', the code starts with the bootstrap
+ 'SP=256', 'call Sys.init 0'.
+
+ write_asm() prints instructions and labels back as .asm (--emit=asm),
+ which assembles to the same words.
+*/
+
+#define VM_LINE_SIZE                       256
+#define VM_NAME_SIZE                       128
+#define VM_INST_STARTING_CAPACITY          1024
+#define VM_STACK_BASE                      256
+#define VM_TEMP_BASE                       5
+
+typedef struct {
+    Instruction *inst;
+    size_t count;
+    size_t capacity;
+    Str_Int_Pair *symbols;
+    size_t *symbol_count;
+    size_t symbol_capacity;
+    char *file_name; // being lowered
+    char file_base[VM_NAME_SIZE]; // prefix of static variables
+    char function[VM_NAME_SIZE]; // function being lowered
+    unsigned int next_id; // for comparison and return labels
+    size_t line;
+    int has_sys_init; // whether a 'function Sys.init' was lowered
+    int error;
+} Vm;
+
+// Segments addressed through a base pointer
+static const char *pointer_segments[] = {
+    "local", "argument", "this", "that",
+};
+static const char *pointer_segment_bases[] = { "LCL", "ARG", "THIS", "THAT" };
+
+static void add_inst(Vm *vm, enum INST_TYPE type, void *p)
+{
+    if (vm->count >= vm->capacity) {
+        vm->capacity *= 2;
+        vm->inst = realloc(vm->inst, vm->capacity * sizeof(Instruction));
+    }
+    vm->inst[vm->count++] = (Instruction) { .type = type, .inst = p };
+}
+
+// @value
+static void at_num(Vm *vm, unsigned int value)
+{
+    A_Instruction *a = malloc(sizeof(A_Instruction));
+    *a = (A_Instruction) { .symbol = NULL, .value = value, .eval = 1 };
+    add_inst(vm, A_INST, a);
+}
+
+// @symbol. The symbol text is stored right after its Slice, so
+// free_instruction frees both
+static void at_sym(Vm *vm, const char *fmt, ...)
+{
+    char name[VM_NAME_SIZE * 2];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(name, sizeof(name), fmt, args);
+    va_end(args);
+
+    size_t len = strlen(name);
+    Slice *s = malloc(sizeof(Slice) + len + 1);
+    char *text = (char*) (s + 1);
+    memcpy(text, name, len + 1);
+    s->start = text;
+    s->end = text + len - 1;
+
+    A_Instruction *a = malloc(sizeof(A_Instruction));
+    *a = (A_Instruction) { .symbol = s, .value = 0, .eval = 0 };
+    add_inst(vm, A_INST, a);
+}
+
+// dest=comp;jump
+static void c(Vm *vm, enum DEST dest, enum COMP comp, enum JUMP jump)
+{
+    C_Instruction *ci = malloc(sizeof(C_Instruction));
+    *ci = (C_Instruction) { .dest = dest, .comp = comp, .jump = jump };
+    add_inst(vm, C_INST, ci);
+}
+
+// (label) at the next instruction
+static void label(Vm *vm, const char *fmt, ...)
+{
+    char name[VM_NAME_SIZE * 2];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(name, sizeof(name), fmt, args);
+    va_end(args);
+
+    if (*vm->symbol_count >= vm->symbol_capacity) {
+        printf("Error at line %li of '%s'\n", vm->line, vm->file_name);
+        printf("Too many labels\n");
+        vm->error = 1;
+        return;
+    }
+    char *str = malloc(strlen(name) + 1);
+    strcpy(str, name);
+    vm->symbols[(*vm->symbol_count)++] = (Str_Int_Pair) {
+        .p0 = str,
+        .p1 = vm->count,
+    };
+}
+
+static int is_defined(Vm *vm, char *name)
+{
+    for (size_t i = 0; i < *vm->symbol_count; i++) {
+        if (strcmp(vm->symbols[i].p0, name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// *SP++ = D
+static void push_d(Vm *vm)
+{
+    at_sym(vm, "SP");
+    c(vm, DEST_AM, COMP_M_PLUS_1, JUMP_NULL);
+    c(vm, DEST_A, COMP_A_MINUS_1, JUMP_NULL);
+    c(vm, DEST_M, COMP_D, JUMP_NULL);
+}
+
+// D = *--SP
+static void pop_d(Vm *vm)
+{
+    at_sym(vm, "SP");
+    c(vm, DEST_AM, COMP_M_MINUS_1, JUMP_NULL);
+    c(vm, DEST_D, COMP_M, JUMP_NULL);
+}
+
+// Loads the address of fixed segment word 'segment i' into A
+// Returns 1 if 'segment' isn't temp, pointer or static
+static int at_fixed(Vm *vm, char *segment, long i)
+{
+    if (strcmp(segment, "temp") == 0 && i < 8)
+        at_num(vm, VM_TEMP_BASE + i);
+    else if (strcmp(segment, "pointer") == 0 && i < 2)
+        at_sym(vm, i == 0 ? "THIS" : "THAT");
+    else if (strcmp(segment, "static") == 0)
+        at_sym(vm, "%s.%li", vm->file_base, i);
+    else
+        return 1;
+    return 0;
+}
+
+static int find_pointer_segment(char *segment)
+{
+    for (int s = 0; s < 4; s++) {
+        if (strcmp(segment, pointer_segments[s]) == 0)
+            return s;
+    }
+    return -1;
+}
+
+// Returns 0 on success, 1 on error
+static int lower_push(Vm *vm, char *segment, long i)
+{
+    int s = find_pointer_segment(segment);
+    if (strcmp(segment, "constant") == 0) {
+        if (i > 0x7FFF)
+            return 1;
+        at_num(vm, i);
+        c(vm, DEST_D, COMP_A, JUMP_NULL);
+    } else if (s != -1) {
+        if (i == 0) {
+            at_sym(vm, "%s", pointer_segment_bases[s]);
+            c(vm, DEST_A, COMP_M, JUMP_NULL);
+        } else {
+            at_num(vm, i);
+            c(vm, DEST_D, COMP_A, JUMP_NULL);
+            at_sym(vm, "%s", pointer_segment_bases[s]);
+            c(vm, DEST_A, COMP_D_PLUS_M, JUMP_NULL);
+        }
+        c(vm, DEST_D, COMP_M, JUMP_NULL);
+    } else if (at_fixed(vm, segment, i) == 0) {
+        c(vm, DEST_D, COMP_M, JUMP_NULL);
+    } else {
+        return 1;
+    }
+    push_d(vm);
+    return 0;
+}
+
+// Returns 0 on success, 1 on error
+static int lower_pop(Vm *vm, char *segment, long i)
+{
+    int s = find_pointer_segment(segment);
+    if (s != -1 && i > 0) {
+        // R13 = base + i
+        at_num(vm, i);
+        c(vm, DEST_D, COMP_A, JUMP_NULL);
+        at_sym(vm, "%s", pointer_segment_bases[s]);
+        c(vm, DEST_D, COMP_D_PLUS_M, JUMP_NULL);
+        at_sym(vm, "R13");
+        c(vm, DEST_M, COMP_D, JUMP_NULL);
+        pop_d(vm);
+        at_sym(vm, "R13");
+        c(vm, DEST_A, COMP_M, JUMP_NULL);
+    } else if (s != -1) {
+        pop_d(vm);
+        at_sym(vm, "%s", pointer_segment_bases[s]);
+        c(vm, DEST_A, COMP_M, JUMP_NULL);
+    } else {
+        pop_d(vm);
+        if (at_fixed(vm, segment, i))
+            return 1;
+    }
+    c(vm, DEST_M, COMP_D, JUMP_NULL);
+    return 0;
+}
+
+// Returns 0 on success, 1 if 'cmd' isn't an arithmetic command
+static int lower_arithmetic(Vm *vm, char *cmd)
+{
+    static const Str_Int_Pair binary[] = {
+        { "add", COMP_D_PLUS_M },
+        { "sub", COMP_M_MINUS_D },
+        { "and", COMP_D_AND_M },
+        { "or",  COMP_D_OR_M },
+    };
+    static const Str_Int_Pair unary[] = {
+        { "neg", COMP_MINUS_M },
+        { "not", COMP_NOT_M },
+    };
+    static const Str_Int_Pair compare[] = {
+        { "eq", JEQ },
+        { "gt", JGT },
+        { "lt", JLT },
+    };
+
+    for (int k = 0; k < 4; k++) {
+        if (strcmp(cmd, binary[k].p0) == 0) {
+            pop_d(vm);
+            c(vm, DEST_A, COMP_A_MINUS_1, JUMP_NULL);
+            c(vm, DEST_M, binary[k].p1, JUMP_NULL);
+            return 0;
+        }
+    }
+    for (int k = 0; k < 2; k++) {
+        if (strcmp(cmd, unary[k].p0) == 0) {
+            at_sym(vm, "SP");
+            c(vm, DEST_A, COMP_M_MINUS_1, JUMP_NULL);
+            c(vm, DEST_M, unary[k].p1, JUMP_NULL);
+            return 0;
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        if (strcmp(cmd, compare[k].p0) == 0) {
+            // Store true, then overwrite with false if the jump isn't taken
+            unsigned int id = vm->next_id++;
+            pop_d(vm);
+            c(vm, DEST_A, COMP_A_MINUS_1, JUMP_NULL);
+            c(vm, DEST_D, COMP_M_MINUS_D, JUMP_NULL);
+            c(vm, DEST_M, COMP_MINUS_1, JUMP_NULL);
+            at_sym(vm, "%s$cmp.%u", vm->file_base, id);
+            c(vm, DEST_NULL, COMP_D, compare[k].p1);
+            at_sym(vm, "SP");
+            c(vm, DEST_A, COMP_M_MINUS_1, JUMP_NULL);
+            c(vm, DEST_M, COMP_0, JUMP_NULL);
+            label(vm, "%s$cmp.%u", vm->file_base, id);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void lower_call(Vm *vm, char *function, long arg_count)
+{
+    unsigned int id = vm->next_id++;
+    static const char *saved[] = { "LCL", "ARG", "THIS", "THAT" };
+
+    at_sym(vm, "%s$ret.%u", vm->function, id);
+    c(vm, DEST_D, COMP_A, JUMP_NULL);
+    push_d(vm);
+    for (int k = 0; k < 4; k++) {
+        at_sym(vm, "%s", saved[k]);
+        c(vm, DEST_D, COMP_M, JUMP_NULL);
+        push_d(vm);
+    }
+
+    // ARG = SP - 5 - arg_count, LCL = SP
+    at_sym(vm, "SP");
+    c(vm, DEST_D, COMP_M, JUMP_NULL);
+    at_num(vm, 5 + arg_count);
+    c(vm, DEST_D, COMP_D_MINUS_A, JUMP_NULL);
+    at_sym(vm, "ARG");
+    c(vm, DEST_M, COMP_D, JUMP_NULL);
+    at_sym(vm, "SP");
+    c(vm, DEST_D, COMP_M, JUMP_NULL);
+    at_sym(vm, "LCL");
+    c(vm, DEST_M, COMP_D, JUMP_NULL);
+
+    at_sym(vm, "%s", function);
+    c(vm, DEST_NULL, COMP_0, JMP);
+    label(vm, "%s$ret.%u", vm->function, id);
+}
+
+static void lower_return(Vm *vm)
+{
+    static const char *restored[] = { "THAT", "THIS", "ARG", "LCL" };
+
+    // R13 = frame, R14 = return address
+    at_sym(vm, "LCL");
+    c(vm, DEST_D, COMP_M, JUMP_NULL);
+    at_sym(vm, "R13");
+    c(vm, DEST_M, COMP_D, JUMP_NULL);
+    at_num(vm, 5);
+    c(vm, DEST_A, COMP_D_MINUS_A, JUMP_NULL);
+    c(vm, DEST_D, COMP_M, JUMP_NULL);
+    at_sym(vm, "R14");
+    c(vm, DEST_M, COMP_D, JUMP_NULL);
+
+    // *ARG = pop(), SP = ARG + 1
+    pop_d(vm);
+    at_sym(vm, "ARG");
+    c(vm, DEST_A, COMP_M, JUMP_NULL);
+    c(vm, DEST_M, COMP_D, JUMP_NULL);
+    at_sym(vm, "ARG");
+    c(vm, DEST_D, COMP_M_PLUS_1, JUMP_NULL);
+    at_sym(vm, "SP");
+    c(vm, DEST_M, COMP_D, JUMP_NULL);
+
+    for (int k = 0; k < 4; k++) {
+        at_sym(vm, "R13");
+        c(vm, DEST_AM, COMP_M_MINUS_1, JUMP_NULL);
+        c(vm, DEST_D, COMP_M, JUMP_NULL);
+        at_sym(vm, "%s", restored[k]);
+        c(vm, DEST_M, COMP_D, JUMP_NULL);
+    }
+
+    at_sym(vm, "R14");
+    c(vm, DEST_A, COMP_M, JUMP_NULL);
+    c(vm, DEST_NULL, COMP_0, JMP);
+}
+
+// Lowers one command. Returns 0 on success, 1 on error
+static int lower_command(Vm *vm, char *line)
+{
+    char cmd[VM_NAME_SIZE], arg1[VM_NAME_SIZE], extra;
+    long arg2 = 0;
+    int n = sscanf(line, "%127s %127s %li %c", cmd, arg1, &arg2, &extra);
+    if (n < 1)
+        return 0; // blank line
+    if (n == 4 || arg2 < 0)
+        return 1;
+
+    if (n == 1) {
+        if (strcmp(cmd, "return") == 0) {
+            lower_return(vm);
+            return 0;
+        }
+        return lower_arithmetic(vm, cmd);
+    }
+
+    if (n == 2) {
+        char name[VM_NAME_SIZE * 2];
+        snprintf(name, sizeof(name), "%s$%s", vm->function, arg1);
+        if (strcmp(cmd, "label") == 0) {
+            if (is_defined(vm, name))
+                return 1;
+            label(vm, "%s", name);
+        } else if (strcmp(cmd, "goto") == 0) {
+            at_sym(vm, "%s", name);
+            c(vm, DEST_NULL, COMP_0, JMP);
+        } else if (strcmp(cmd, "if-goto") == 0) {
+            pop_d(vm);
+            at_sym(vm, "%s", name);
+            c(vm, DEST_NULL, COMP_D, JNE);
+        } else {
+            return 1;
+        }
+        return 0;
+    }
+
+    if (strcmp(cmd, "push") == 0)
+        return lower_push(vm, arg1, arg2);
+    if (strcmp(cmd, "pop") == 0)
+        return lower_pop(vm, arg1, arg2);
+    if (strcmp(cmd, "call") == 0) {
+        lower_call(vm, arg1, arg2);
+        return 0;
+    }
+    if (strcmp(cmd, "function") == 0) {
+        if (is_defined(vm, arg1))
+            return 1;
+        vm->has_sys_init |= strcmp(arg1, "Sys.init") == 0;
+        snprintf(vm->function, VM_NAME_SIZE, "%s", arg1);
+        label(vm, "%s", arg1);
+        for (long k = 0; k < arg2; k++) {
+            at_sym(vm, "SP");
+            c(vm, DEST_AM, COMP_M_PLUS_1, JUMP_NULL);
+            c(vm, DEST_A, COMP_A_MINUS_1, JUMP_NULL);
+            c(vm, DEST_M, COMP_0, JUMP_NULL);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// Lowers the commands of one file, 'src'
+static void lower_file(Vm *vm, char *src, char *file_name)
+{
+    // Static prefix is the file name without directory and extension
+    char *base = strrchr(file_name, '/');
+    base = base ? base + 1 : file_name;
+    snprintf(vm->file_base, VM_NAME_SIZE, "%s", base);
+    char *dot = strrchr(vm->file_base, '.');
+    if (dot)
+        *dot = '\0';
+    snprintf(vm->function, VM_NAME_SIZE, "%s", vm->file_base);
+    vm->file_name = file_name;
+    vm->line = 0;
+
+    char line[VM_LINE_SIZE];
+    for (char *p = src; *p && !vm->error;) {
+        vm->line++;
+        size_t len = strcspn(p, "\r\n");
+        if (len >= VM_LINE_SIZE) {
+            printf("Error at line %li of '%s'\n", vm->line, file_name);
+            printf("Line too long\n");
+            vm->error = 1;
+            break;
+        }
+        memcpy(line, p, len);
+        line[len] = '\0';
+        char *comment = strstr(line, "//");
+        if (comment)
+            *comment = '\0';
+
+        if (lower_command(vm, line)) {
+            printf("Parse error at line %li of '%s'\n", vm->line, file_name);
+            vm->error = 1;
+            break;
+        }
+
+        p += len;
+        if (*p == '\r')
+            p++;
+        if (*p == '\n')
+            p++;
+    }
+}
+
+// Puts the bootstrap 'SP=256', 'call Sys.init 0' in front of the code,
+// moving the labels from 'first_label' on after it
+static void prepend_bootstrap(Vm *vm, size_t first_label)
+{
+    size_t label_end = *vm->symbol_count;
+    Vm boot = *vm;
+    boot.count = 0;
+    boot.capacity = VM_INST_STARTING_CAPACITY;
+    boot.inst = malloc(boot.capacity * sizeof(Instruction));
+    boot.next_id = 0;
+    snprintf(boot.function, VM_NAME_SIZE, "Bootstrap");
+    at_num(&boot, VM_STACK_BASE);
+    c(&boot, DEST_D, COMP_A, JUMP_NULL);
+    at_sym(&boot, "SP");
+    c(&boot, DEST_M, COMP_D, JUMP_NULL);
+    lower_call(&boot, "Sys.init", 0);
+
+    for (size_t i = first_label; i < label_end; i++)
+        vm->symbols[i].p1 += boot.count;
+    if (vm->count + boot.count > vm->capacity) {
+        vm->capacity = vm->count + boot.count;
+        vm->inst = realloc(vm->inst, vm->capacity * sizeof(Instruction));
+    }
+    memmove(vm->inst + boot.count, vm->inst,
+        vm->count * sizeof(Instruction));
+    memcpy(vm->inst, boot.inst, boot.count * sizeof(Instruction));
+    vm->count += boot.count;
+    vm->error |= boot.error;
+    free(boot.inst);
+}
+
+// Lowers the VM files 'srcs', named 'file_names', into one program in
+// 'inst' and adds its labels to 'symbols'
+// Returns 0 on success, 1 on error
+int lower_vm(char **srcs, char **file_names, size_t file_count,
+    Instruction **inst, size_t *count, Str_Int_Pair *symbols,
+    size_t *symbol_count, size_t symbol_capacity)
+{
+    Vm vm = {
+        .capacity = VM_INST_STARTING_CAPACITY,
+        .symbols = symbols,
+        .symbol_count = symbol_count,
+        .symbol_capacity = symbol_capacity,
+    };
+    vm.inst = malloc(vm.capacity * sizeof(Instruction));
+
+    size_t first_label = *symbol_count;
+    for (size_t i = 0; i < file_count && !vm.error; i++)
+        lower_file(&vm, srcs[i], file_names[i]);
+
+    // Only known once every file is lowered
+    if (!vm.error && vm.has_sys_init)
+        prepend_bootstrap(&vm, first_label);
+
+    if (vm.error) {
+        for (size_t i = 0; i < vm.count; i++)
+            free_instruction(vm.inst + i);
+        free(vm.inst);
+        return 1;
+    }
+    *inst = vm.inst;
+    *count = vm.count;
+    return 0;
+}
+
+// Writes 'inst' as .asm with 'labels' in front of their instructions
+// Returns 0 on success, 1 on error
+int write_asm(FILE *f, Instruction *inst, size_t count, Str_Int_Pair *labels,
+    size_t label_count)
+{
+    // Order labels by address with a counting sort
+    size_t *first = calloc(count + 2, sizeof(size_t));
+    size_t *order = malloc((label_count + 1) * sizeof(size_t));
+    for (size_t i = 0; i < label_count; i++)
+        first[labels[i].p1 + 1]++;
+    for (size_t i = 1; i <= count + 1; i++)
+        first[i] += first[i - 1];
+    for (size_t i = 0; i < label_count; i++)
+        order[first[labels[i].p1]++] = i;
+
+    size_t l = 0;
+    for (size_t i = 0; i <= count; i++) {
+        while (l < label_count && (size_t) labels[order[l]].p1 == i)
+            fprintf(f, "(%s)\n", labels[order[l++]].p0);
+        if (i == count)
+            break;
+
+        if (inst[i].type == A_INST) {
+            A_Instruction *a = inst[i].inst;
+            if (a->symbol && a->offset)
+                fprintf(f, "    @%.*s%+i\n",
+                    (int) (a->symbol->end - a->symbol->start + 1),
+                    a->symbol->start, a->offset);
+            else if (a->symbol)
+                fprintf(f, "    @%.*s\n",
+                    (int) (a->symbol->end - a->symbol->start + 1),
+                    a->symbol->start);
+            else
+                fprintf(f, "    @%u\n", a->value);
+            continue;
+        }
+
+        C_Instruction *ci = inst[i].inst;
+        fprintf(f, "    ");
+        if (ci->dest != DEST_NULL)
+            fprintf(f, "%s=", dest_codes[ci->dest].str);
+        fprintf(f, "%s", comp_codes[ci->comp].str);
+        if (ci->jump != JUMP_NULL)
+            fprintf(f, ";%s", jump_codes[ci->jump].str);
+        fprintf(f, "\n");
+    }
+
+    free(first);
+    free(order);
+    return ferror(f) ? 1 : 0;
+}
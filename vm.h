@@ -0,0 +1,13 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdio.h>
+#include "inst.h"
+
+int lower_vm(char **srcs, char **file_names, size_t file_count,
+    Instruction **inst, size_t *count, Str_Int_Pair *symbols,
+    size_t *symbol_count, size_t symbol_capacity);
+int write_asm(FILE *f, Instruction *inst, size_t count, Str_Int_Pair *labels,
+    size_t label_count);
+
+#endif // VM_H